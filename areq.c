@@ -4,6 +4,10 @@
 * @Last Modified time: 2015-12-08 22:50:54
 * @Description:
 *     ARP API function
+*     + int AreqSend(struct sockaddr *IPaddr, socklen_t sockaddrlen)
+*         [Send an ARP request to the ARP service without waiting]
+*     + int AreqRecv(int sockfd, struct sockaddr *IPaddr, struct hwaddr *HWaddr)
+*         [Read the response of a sent ARP request]
 *     + int areq(struct sockaddr *IPaddr, socklen_t sockaddrlen, struct hwaddr *HWaddr)
 *         [ARP API function]
 */
@@ -11,23 +15,23 @@
 #include "arp.h"
 
 /* --------------------------------------------------------------------------
- *  areq
+ *  AreqSend
  *
- *  ARP API function
+ *  Send an ARP request to the ARP service without waiting
  *
  *  @param  : struct sockaddr   *IPaddr         [IP address structure]
  *            socklen_t         sockaddrlen     [address structure length]
- *            struct hwaddr     *HWaddr         [Hardware address structure]
- *  @return : int               [The number of bytes read, -1 if failed]
+ *  @return : int               [connected domain socket, -1 if failed]
  *
- *  Create a domain socket to write IP address request to ARP service
- *  Wait for the response (3 seconds)
- *  Write the response to HWaddr
+ *  Create a domain socket and write IP address request to ARP service
+ *  The response becomes readable on the returned socket, so the caller can
+ *  wait for it in its own select() loop
  * --------------------------------------------------------------------------
  */
-int areq(struct sockaddr *IPaddr, socklen_t sockaddrlen, struct hwaddr *HWaddr) {
-    int sockfd, r, i;
+int AreqSend(struct sockaddr *IPaddr, socklen_t sockaddrlen) {
+    int sockfd, tmpfd;
     uchar *ipaddr = ((uchar *)IPaddr) + 4;
+    char ip[IPSTR_BUFFSIZE];
     struct sockaddr_un areqaddr, arpaddr;
 
     bzero(&areqaddr, sizeof(areqaddr));
@@ -38,20 +42,80 @@ int areq(struct sockaddr *IPaddr, socklen_t sockaddrlen, struct hwaddr *HWaddr)
     arpaddr.sun_family = AF_LOCAL;
     strcpy(arpaddr.sun_path, ARP_PATH);
 
-    sockfd = mkstemp(areqaddr.sun_path);
+    tmpfd = mkstemp(areqaddr.sun_path);
     // Call unlink so that whenever the file is closed or the program exits
     // the temporary file is deleted
     unlink(areqaddr.sun_path);
+    if (tmpfd >= 0)
+        close(tmpfd);
 
     // Create UNIX Domain Socket, Bind and Connect
     sockfd = Socket(AF_LOCAL, SOCK_STREAM, 0);
     Bind(sockfd, (SA *)&areqaddr, sizeof(areqaddr));
-    Connect(sockfd, (SA *)&arpaddr, sizeof(arpaddr));
+    if (connect(sockfd, (SA *)&arpaddr, sizeof(arpaddr)) < 0) {
+        printf("[AREQ] ARP service is not available.\n");
+        close(sockfd);
+        return -1;
+    }
 
-    printf("[AREQ] AREQ \"%s\" to local ARP service...\n", UtilIpToString(ipaddr));
+    printf("[AREQ] AREQ \"%s\" to local ARP service...\n", UtilFormatIp(ipaddr, ip));
     // Write the IP address to ARP service
     Write(sockfd, ipaddr, IP_ALEN);
 
+    return sockfd;
+}
+
+/* --------------------------------------------------------------------------
+ *  AreqRecv
+ *
+ *  Read the response of a sent ARP request
+ *
+ *  @param  : int               sockfd      [socket returned by AreqSend]
+ *            struct sockaddr   *IPaddr     [IP address structure]
+ *            struct hwaddr     *HWaddr     [Hardware address structure]
+ *  @return : int               [The number of bytes read, -1 if failed]
+ *
+ *  Write the response to HWaddr and close the socket
+ * --------------------------------------------------------------------------
+ */
+int AreqRecv(int sockfd, struct sockaddr *IPaddr, struct hwaddr *HWaddr) {
+    int r;
+    uchar *ipaddr = ((uchar *)IPaddr) + 4;
+    char ip[IPSTR_BUFFSIZE], mac[MACSTR_BUFFSIZE];
+
+    r = read(sockfd, HWaddr, sizeof(struct hwaddr));
+    close(sockfd);
+    if (r != sizeof(struct hwaddr)) {
+        printf("[AREQ] AREQ \"%s\" failed.\n", UtilFormatIp(ipaddr, ip));
+        return -1;
+    }
+
+    printf("[AREQ] AREQ \"%s\" received: <%d, %d, %d, %s>\n", UtilFormatIp(ipaddr, ip),
+        HWaddr->sll_ifindex, HWaddr->sll_hatype, HWaddr->sll_halen, UtilFormatMac(HWaddr->sll_addr, mac));
+    return r;
+}
+
+/* --------------------------------------------------------------------------
+ *  areq
+ *
+ *  ARP API function
+ *
+ *  @param  : struct sockaddr   *IPaddr         [IP address structure]
+ *            socklen_t         sockaddrlen     [address structure length]
+ *            struct hwaddr     *HWaddr         [Hardware address structure]
+ *  @return : int               [The number of bytes read, -1 if failed]
+ *
+ *  Blocking form of AreqSend() / AreqRecv()
+ *  Wait for the response (3 seconds)
+ *  Write the response to HWaddr
+ * --------------------------------------------------------------------------
+ */
+int areq(struct sockaddr *IPaddr, socklen_t sockaddrlen, struct hwaddr *HWaddr) {
+    int sockfd, r;
+
+    if ((sockfd = AreqSend(IPaddr, sockaddrlen)) < 0)
+        return -1;
+
     fd_set rset;
     FD_ZERO(&rset);
     FD_SET(sockfd, &rset);
@@ -66,13 +130,9 @@ int areq(struct sockaddr *IPaddr, socklen_t sockaddrlen, struct hwaddr *HWaddr)
     // error or timeout, return -1
     if (r <= 0) {
         printf("[AREQ] AREQ timeout.\n");
+        close(sockfd);
         return -1;
     }
 
-    r = Read(sockfd, HWaddr, sizeof(struct hwaddr));
-
-    printf("[AREQ] AREQ \"%s\" received: ", UtilIpToString(ipaddr));
-    printf("<%d, %d, %d, ", HWaddr->sll_ifindex, HWaddr->sll_hatype, HWaddr->sll_halen);
-    for (i = 0; i < 6; i++)
-        printf("%.2x%s", HWaddr->sll_addr[i], (i < 5) ? ":" : ">\n");
+    return AreqRecv(sockfd, IPaddr, HWaddr);
 }
@@ -0,0 +1,441 @@
+/*
+* @File:    areqload.c
+* @Date:    2026-10-18 22:41:16
+* @Last Modified time: 2026-10-18 23:37:02
+* @Description:
+*     AREQ load generator for the ARP service
+*     - double LoadRandom(uint64_t *state)
+*         [Uniform random number of a worker]
+*     - int LoadPickKey(load_worker *w)
+*         [Pick a cached address by the key distribution]
+*     - int LoadRequest(const uchar *ipaddr, int timeout, struct hwaddr *HWaddr)
+*         [Send one AREQ and wait for its answer]
+*     - void *LoadWorker(void *arg)
+*         [Issue requests back to back until stopped]
+*     - uint64_t LoadDaemonCpu(pid_t pid)
+*         [CPU time used by the ARP service]
+*     - void LoadWarmUp(void)
+*         [Get every cached address into the ARP cache]
+*     - void ParseKeys(int argc, char **argv)
+*         [Parse the cached addresses]
+*     - void ParseOptions(int argc, char **argv)
+*         [Parse the command line options]
+*     + int main(int argc, char **argv)
+*         [Entry function]
+*/
+
+#include "arp.h"
+#include "hist.h"
+
+#include <poll.h>
+#include <math.h>
+#include <pthread.h>
+#include <limits.h>
+
+#define LOAD_MISS_NET       0xc6120000  // misses ask 198.18.0.0/15
+#define LOAD_MISS_MASK      0x1ffff
+
+// Load generator options and shared state
+typedef struct load_config_t {
+    int     threads;                /* Concurrent clients       */
+    double  duration;               /* Seconds of load          */
+    double  hitRatio;               /* Requests for cached keys */
+    double  zipf;                   /* Key skew, 0 is uniform   */
+    int     missTimeout;            /* ms to wait for a miss    */
+    pid_t   pid;                    /* ARP service, 0 if unknown*/
+    uchar   (*keys)[IP_ALEN];       /* Cached addresses         */
+    int     keyCount;               /* Number of keys           */
+    double  *cdf;                   /* Key distribution         */
+    volatile int stop;              /* Set when time is up      */
+    uint32_t missSeq;               /* Next miss address        */
+} load_config;
+
+// One client thread
+typedef struct load_worker_t {
+    pthread_t tid;                  /* Thread                   */
+    uint64_t rng;                   /* Random state             */
+    hist    latency;                /* Answered requests, ns    */
+    uint64_t answered;              /* Answered requests        */
+    uint64_t unanswered;            /* Timed out requests       */
+    uint64_t errors;                /* Failed to reach service  */
+} load_worker;
+
+static load_config cfg;
+
+/* --------------------------------------------------------------------------
+ *  LoadRandom
+ *
+ *  Uniform random number of a worker
+ *
+ *  @param  : uint64_t  *state  [xorshift state, not 0]
+ *  @return : double    [0.0 <= r < 1.0]
+ *
+ *  Every worker has its own state, random() would serialize them on its
+ *  lock
+ * --------------------------------------------------------------------------
+ */
+static double LoadRandom(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return ((x * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* --------------------------------------------------------------------------
+ *  LoadPickKey
+ *
+ *  Pick a cached address by the key distribution
+ *
+ *  @param  : load_worker   *w  [worker]
+ *  @return : int           [key index]
+ *
+ *  Binary search of a uniform number in the cumulative distribution, key i
+ *  has weight 1 / (i + 1)^zipf
+ * --------------------------------------------------------------------------
+ */
+static int LoadPickKey(load_worker *w) {
+    double u = LoadRandom(&w->rng);
+    int lo = 0, hi = cfg.keyCount - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cfg.cdf[mid] <= u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* --------------------------------------------------------------------------
+ *  LoadRequest
+ *
+ *  Send one AREQ and wait for its answer
+ *
+ *  @param  : const uchar   *ipaddr     [IP address to resolve]
+ *            int           timeout     [ms to wait for the answer]
+ *            struct hwaddr *HWaddr     [answer]
+ *  @return : int           [0 if answered, 1 if timed out, -1 if the
+ *                           service could not be reached]
+ *
+ *  Same exchange as areq(): connect to the service, write the address and
+ *  read one struct hwaddr. The client socket is not bound to a temporary
+ *  path and nothing is printed, so the client costs as little as possible
+ * --------------------------------------------------------------------------
+ */
+static int LoadRequest(const uchar *ipaddr, int timeout, struct hwaddr *HWaddr) {
+    struct sockaddr_un arpaddr;
+    struct pollfd pfd;
+    int sockfd, r;
+
+    bzero(&arpaddr, sizeof(arpaddr));
+    arpaddr.sun_family = AF_LOCAL;
+    strcpy(arpaddr.sun_path, ARP_PATH);
+
+    if ((sockfd = socket(AF_LOCAL, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(sockfd, (SA *)&arpaddr, sizeof(arpaddr)) < 0
+        || write(sockfd, ipaddr, IP_ALEN) != IP_ALEN) {
+        close(sockfd);
+        return -1;
+    }
+
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout) <= 0) {
+        close(sockfd);
+        return 1;
+    }
+    r = read(sockfd, HWaddr, sizeof(struct hwaddr));
+    close(sockfd);
+    return (r == sizeof(struct hwaddr)) ? 0 : -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  LoadWorker
+ *
+ *  Issue requests back to back until stopped
+ *
+ *  @param  : void  *arg    [load_worker]
+ *  @return : void  *       [NULL]
+ *
+ *  A hit asks a cached address and waits up to AREQ_TIMEOUT seconds. A miss
+ *  asks a fresh address of 198.18.0.0/15 that nobody answers, the service
+ *  broadcasts an ARP REQ and drops its incomplete entry when the client
+ *  gives up after missTimeout ms
+ * --------------------------------------------------------------------------
+ */
+static void *LoadWorker(void *arg) {
+    load_worker *w = (load_worker *)arg;
+    struct hwaddr HWaddr;
+    uchar miss[IP_ALEN];
+    const uchar *ipaddr;
+    uint32_t seq;
+    uint64_t start;
+    int r, timeout;
+
+    while (!cfg.stop) {
+        if (cfg.keyCount > 0 && LoadRandom(&w->rng) < cfg.hitRatio) {
+            ipaddr = cfg.keys[LoadPickKey(w)];
+            timeout = AREQ_TIMEOUT * 1000;
+        } else {
+            seq = htonl(LOAD_MISS_NET | (__sync_fetch_and_add(&cfg.missSeq, 1) & LOAD_MISS_MASK));
+            memcpy(miss, &seq, IP_ALEN);
+            ipaddr = miss;
+            timeout = cfg.missTimeout;
+        }
+
+        start = UtilNowNs();
+        r = LoadRequest(ipaddr, timeout, &HWaddr);
+        if (r == 0) {
+            HistRecord(&w->latency, UtilNowNs() - start);
+            w->answered++;
+        } else if (r == 1) {
+            w->unanswered++;
+        } else {
+            w->errors++;
+            usleep(1000);
+        }
+    }
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  LoadDaemonCpu
+ *
+ *  CPU time used by the ARP service
+ *
+ *  @param  : pid_t     pid     [ARP service process]
+ *  @return : uint64_t  [user + system time in ns, 0 if unknown]
+ * --------------------------------------------------------------------------
+ */
+static uint64_t LoadDaemonCpu(pid_t pid) {
+    char path[64], buf[1024], *p;
+    unsigned long utime, stime;
+    FILE *fp;
+
+    if (pid == 0)
+        return 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+    p = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+
+    // the command name may contain spaces, fields restart after ')'
+    if (p == NULL || (p = strrchr(buf, ')')) == NULL)
+        return 0;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return 0;
+    return (uint64_t)(utime + stime) * 1000000000ULL / sysconf(_SC_CLK_TCK);
+}
+
+/* --------------------------------------------------------------------------
+ *  LoadWarmUp
+ *
+ *  Get every cached address into the ARP cache
+ *
+ *  @param  : void
+ *  @return : void
+ *
+ *  Keys that are not answered stay in the set, their requests will time
+ *  out like misses
+ * --------------------------------------------------------------------------
+ */
+static void LoadWarmUp(void) {
+    struct hwaddr HWaddr;
+    char ip[IPSTR_BUFFSIZE];
+    int i, r, answered = 0;
+
+    for (i = 0; i < cfg.keyCount; i++) {
+        if ((r = LoadRequest(cfg.keys[i], AREQ_TIMEOUT * 1000, &HWaddr)) < 0)
+            err_quit("[LOAD] ARP service is not available.");
+        if (r == 0)
+            answered++;
+        else
+            printf("[LOAD] %s is not answered by the ARP service.\n", UtilFormatIp(cfg.keys[i], ip));
+    }
+    printf("[LOAD] %d of %d keys cached.\n", answered, cfg.keyCount);
+}
+
+/* --------------------------------------------------------------------------
+ *  ParseKeys
+ *
+ *  Parse the cached addresses
+ *
+ *  @param  : int   argc
+ *            char  **argv  [addresses "a.b.c.d" or ranges "a.b.c.d-a.b.c.e"]
+ *  @return : void
+ *
+ *  Build the cumulative key distribution as well
+ * --------------------------------------------------------------------------
+ */
+static void ParseKeys(int argc, char **argv) {
+    uint32_t *range = Calloc(2 * argc + 1, sizeof(uint32_t));
+    struct in_addr first, last;
+    uint64_t count = 0;
+    char *dash;
+    uint32_t a;
+    double sum = 0;
+    int i;
+
+    // the ranges first, to size the keys at once
+    for (i = 0; i < argc; i++) {
+        if ((dash = strchr(argv[i], '-')) != NULL)
+            *dash = 0;
+        if (inet_pton(AF_INET, argv[i], &first) != 1)
+            err_quit("[LOAD] invalid address %s", argv[i]);
+        last = first;
+        if (dash && inet_pton(AF_INET, dash + 1, &last) != 1)
+            err_quit("[LOAD] invalid address %s", dash + 1);
+        if (ntohl(last.s_addr) < ntohl(first.s_addr))
+            err_quit("[LOAD] empty range %s", argv[i]);
+        range[2 * i] = ntohl(first.s_addr);
+        range[2 * i + 1] = ntohl(last.s_addr);
+        if ((count += (uint64_t)range[2 * i + 1] - range[2 * i] + 1) > INT_MAX / IP_ALEN)
+            err_quit("[LOAD] too many keys");
+    }
+
+    cfg.keys = Calloc(count ? count : 1, IP_ALEN);
+    for (i = 0; i < argc; i++) {
+        for (a = range[2 * i]; ; a++) {
+            first.s_addr = htonl(a);
+            memcpy(cfg.keys[cfg.keyCount++], &first, IP_ALEN);
+            if (a == range[2 * i + 1])
+                break;
+        }
+    }
+    free(range);
+
+    cfg.cdf = Calloc(cfg.keyCount ? cfg.keyCount : 1, sizeof(double));
+    for (i = 0; i < cfg.keyCount; i++)
+        cfg.cdf[i] = (sum += 1.0 / pow(i + 1, cfg.zipf));
+    for (i = 0; i < cfg.keyCount; i++)
+        cfg.cdf[i] /= sum;
+}
+
+/* --------------------------------------------------------------------------
+ *  ParseOptions
+ *
+ *  Parse the command line options
+ *
+ *  @param  : int   argc
+ *            char  **argv
+ *  @return : void
+ *
+ *    -c clients    concurrent client threads             (default 8)
+ *    -d seconds    duration of the load                  (default 10)
+ *    -h ratio      share of requests for cached keys     (default 1.0)
+ *    -z exponent   Zipf skew of the keys, 0 is uniform   (default 0)
+ *    -t ms         time a miss waits for an answer       (default 100)
+ *    -p pid        ARP service, to report its CPU time per request
+ *  followed by the cached keys, addresses or ranges of addresses
+ * --------------------------------------------------------------------------
+ */
+static void ParseOptions(int argc, char **argv) {
+    int c;
+
+    cfg.threads = 8;
+    cfg.duration = 10;
+    cfg.hitRatio = 1.0;
+    cfg.zipf = 0;
+    cfg.missTimeout = 100;
+
+    while ((c = getopt(argc, argv, "c:d:h:z:t:p:")) != -1) {
+        switch (c) {
+        case 'c':
+            cfg.threads = atoi(optarg);
+            break;
+        case 'd':
+            cfg.duration = atof(optarg);
+            break;
+        case 'h':
+            cfg.hitRatio = atof(optarg);
+            break;
+        case 'z':
+            cfg.zipf = atof(optarg);
+            break;
+        case 't':
+            cfg.missTimeout = atoi(optarg);
+            break;
+        case 'p':
+            cfg.pid = atoi(optarg);
+            break;
+        default:
+            err_quit("usage: %s [-c clients] [-d seconds] [-h ratio] [-z exponent] [-t ms] [-p pid] [address[-address] ...]", argv[0]);
+        }
+    }
+    if (cfg.threads < 1)
+        err_quit("[LOAD] at least one client is needed");
+    if (cfg.hitRatio < 0 || cfg.hitRatio > 1)
+        err_quit("[LOAD] hit ratio must be 0.0-1.0");
+    ParseKeys(argc - optind, argv + optind);
+    if (cfg.keyCount == 0 && cfg.hitRatio > 0)
+        err_quit("[LOAD] a hit ratio above 0 needs cached keys");
+}
+
+/* --------------------------------------------------------------------------
+ *  main
+ *
+ *  Entry function
+ *
+ *  @param  : int   argc
+ *            char  **argv
+ *  @return : int
+ *
+ *  Warm the cache up, run the clients for the duration, then print one
+ *  summary of all clients
+ * --------------------------------------------------------------------------
+ */
+int main(int argc, char **argv) {
+    load_worker *workers;
+    hist latency;
+    uint64_t answered = 0, unanswered = 0, errors = 0, requests, start, elapsed, cpu;
+    int i;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    ParseOptions(argc, argv);
+    LoadWarmUp();
+
+    workers = Calloc(cfg.threads, sizeof(load_worker));
+    cpu = LoadDaemonCpu(cfg.pid);
+    start = UtilNowNs();
+    for (i = 0; i < cfg.threads; i++) {
+        HistInit(&workers[i].latency);
+        workers[i].rng = (start ^ ((uint64_t)(i + 1) * 0x9e3779b97f4a7c15ULL)) | 1;
+        pthread_create(&workers[i].tid, NULL, LoadWorker, &workers[i]);
+    }
+
+    usleep((useconds_t)(cfg.duration * 1000000));
+    cfg.stop = 1;
+
+    HistInit(&latency);
+    for (i = 0; i < cfg.threads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        HistMerge(&latency, &workers[i].latency);
+        answered += workers[i].answered;
+        unanswered += workers[i].unanswered;
+        errors += workers[i].errors;
+    }
+    elapsed = UtilNowNs() - start;
+    cpu = LoadDaemonCpu(cfg.pid) - cpu;
+    requests = answered + unanswered;
+
+    printf("[LOAD] clients=%d seconds=%.2f keys=%d hit_ratio=%.2f zipf=%.2f\n",
+        cfg.threads, elapsed / 1e9, cfg.keyCount, cfg.hitRatio, cfg.zipf);
+    printf("[LOAD] requests=%llu answered=%llu unanswered=%llu errors=%llu rps=%.0f\n",
+        (unsigned long long)requests, (unsigned long long)answered, (unsigned long long)unanswered,
+        (unsigned long long)errors, requests / (elapsed / 1e9));
+    printf("[LOAD] latency_ns p50=%llu p99=%llu p999=%llu max=%llu mean=%.0f\n",
+        (unsigned long long)HistPercentile(&latency, 50), (unsigned long long)HistPercentile(&latency, 99),
+        (unsigned long long)HistPercentile(&latency, 99.9), (unsigned long long)latency.max, HistMean(&latency));
+    if (cfg.pid && requests)
+        printf("[LOAD] daemon cpu_ns=%llu cpu_ns_per_request=%llu\n",
+            (unsigned long long)cpu, (unsigned long long)(cpu / requests));
+
+    free(workers);
+    exit(0);
+}
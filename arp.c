@@ -6,14 +6,8 @@
 *     ARP service functions
 *     - void PrintAddressPairs(arp_object *obj)
 *         [Print all address pairs]
-*     - void PrintARPFrame(char *frame)
-*         [Print ARP Frame Content]
-*     - arp_cache *GetCacheEntry(arp_object *obj, const uchar *ipaddr)
-*         [Get cache entry by IP address]
 *     - struct hwa_info *GetHwaEntry(arp_object *obj, const uchar *ipaddr)
 *         [Get hwa_info entry by IP address]
-*     - arp_cache *InsertOrUpdateCacheEntry(arp_object *obj, arp_cache *entry, arppayload *data, struct sockaddr_ll *from)
-*         [Insert or update cache entry]
 *     - void ReplyAREQ(arp_cache *entry)
 *         [Reply AREQ to connected domain socket]
 *     - void SendREQ(arp_object *obj, uchar *ipaddr)
@@ -51,80 +45,15 @@
  */
 void PrintAddressPairs(arp_object *obj) {
     struct hwa_info *hwa = obj->hwa_info;
-    int i;
+    char ip[IPSTR_BUFFSIZE], mac[MACSTR_BUFFSIZE];
 
     while (hwa) {
-        printf(" [ARP] Address pair found: <%s, ", UtilIpToString(hwa->ip_addr));
-        for (i = 0; i < 6; i++)
-            printf("%.2x%s", hwa->if_haddr[i] & 0xff, (i < 5) ? ":" : ">");
-        printf(" @ interface %d\n", hwa->if_index);
+        printf(" [ARP] Address pair found: <%s, %s> @ interface %d\n",
+            UtilFormatIp((uchar *)hwa->ip_addr, ip), UtilFormatMac((uchar *)hwa->if_haddr, mac), hwa->if_index);
         hwa = hwa->hwa_next;
     }
 }
 
-/* --------------------------------------------------------------------------
- *  PrintARPFrame
- *
- *  Print ARP Frame Content
- *
- *  @param  : char  *frame  [frame]
- *  @return : void
- *
- *  Print the content in ARP frame
- *    1. Ethernet frame header
- *    2. ARP packet header
- *    3. ARP packet payload
- * --------------------------------------------------------------------------
- */
-void PrintARPFrame(char *frame) {
-    int i;
-
-    ethhdr *eth = (ethhdr *)frame;
-    arphdr *arp = (arphdr *)(frame + ETHHDR_LEN);
-    arppayload *data = (arppayload *)(frame + ETHHDR_LEN + ARPHDR_LEN);
-    printf("      ETHHDR | dest: ");
-    for (i = 0; i < 6; i++)
-        printf("%.2x%s", eth->h_dest[i], (i < 5) ? ":" : ", source: ");
-    for (i = 0; i < 6; i++)
-        printf("%.2x%s", eth->h_source[i], (i < 5) ? ":" : ", proto: ");
-    printf("%d\n", ntohs(eth->h_proto));
-    printf("      ARPHDR | id: %d, hrd: 0x%.4x, pro: 0x%.4x, hln: %d, pln: %d, op: %d %s\n",
-            arp->ar_id, ntohs(arp->ar_hrd), ntohs(arp->ar_pro),
-            arp->ar_hln, arp->ar_pln, ntohs(arp->ar_op),
-            (arp->ar_op == ntohs(ARP_REQ)) ? "REQ" : "REP");
-    printf("        DATA | sender: ");
-    for (i = 0; i < 6; i++)
-        printf("%.2x%s", data->ar_shrd[i], (i < 5) ? ":" : " ");
-    printf("%s\n", UtilIpToString(data->ar_spro));
-    printf("        DATA | target: ");
-    for (i = 0; i < 6; i++)
-        printf("%.2x%s", data->ar_thrd[i], (i < 5) ? ":" : " ");
-    printf("%s\n", UtilIpToString(data->ar_tpro));
-}
-
-/* --------------------------------------------------------------------------
- *  GetCacheEntry
- *
- *  Get cache entry by IP address
- *
- *  @param  : arp_object    *obj    [ARP object]
- *            const uchar   *ipaddr [IP address]
- *  @return : arp_cache *   [ARP cache entry, NULL if does not exist]
- *
- *  Find and return the cache entry matches IP address
- *  Return NULL if not found
- * --------------------------------------------------------------------------
- */
-arp_cache *GetCacheEntry(arp_object *obj, const uchar *ipaddr) {
-    arp_cache *entry = obj->cache;
-    while (entry) {
-        if (strncmp(ipaddr, entry->ipaddr, IP_ALEN) == 0)
-            break;
-        entry = entry->next;
-    }
-    return entry;
-}
-
 /* --------------------------------------------------------------------------
  *  GetHwaEntry
  *
@@ -141,57 +70,13 @@ arp_cache *GetCacheEntry(arp_object *obj, const uchar *ipaddr) {
 struct hwa_info *GetHwaEntry(arp_object *obj, const uchar *ipaddr) {
     struct hwa_info *hwa = obj->hwa_info;
     while (hwa) {
-        if (strncmp(ipaddr, hwa->ip_addr, IP_ALEN) == 0)
+        if (memcmp(ipaddr, hwa->ip_addr, IP_ALEN) == 0)
             break;
         hwa = hwa->hwa_next;
     }
     return hwa;
 }
 
-/* --------------------------------------------------------------------------
- *  InsertOrUpdateCacheEntry
- *
- *  Insert or update cache entry
- *
- *  @param  : arp_object            *obj    [ARP object]
- *            arp_cache             *entry  [entry]
- *            arppayload            *data   [ARP frame payload]
- *            struct sockaddr_ll    *from   [sender address structure]
- *  @return : arp_cache *   [inserted/updated ARP cache entry]
- *
- *  If entry is NULL, insert a new entry into cache
- *  Otherwise the operation would be update
- *  The entry content will be update according to data and from
- * --------------------------------------------------------------------------
- */
-arp_cache *InsertOrUpdateCacheEntry(arp_object *obj, arp_cache *entry, arppayload *data, struct sockaddr_ll *from) {
-    int i;
-
-    printf(" [ARP] Cache ");
-    if (entry == NULL) {
-        // insert a new entry, calloc memory space
-        entry = Calloc(1, sizeof(arp_cache));
-        entry->next = obj->cache;
-        obj->cache = entry;
-        printf("insert: ");
-    } else
-        printf("update: ");
-
-    // fill entry content
-    memcpy(entry->ipaddr, data->ar_spro, IP_ALEN);
-    memcpy(entry->hwaddr, data->ar_shrd, ETH_ALEN);
-    entry->ifindex = from->sll_ifindex;
-    entry->hatype = from->sll_hatype;
-
-    // print entry information
-    printf("<%s, ", UtilIpToString(entry->ipaddr));
-    for (i = 0; i < 6; i++)
-        printf("%.2x%s", entry->hwaddr[i], (i < 5) ? ":" : ", ");
-    printf("%d, %d, %d>\n", entry->ifindex, entry->hatype, entry->sockfd);
-
-    return entry;
-}
-
 /* --------------------------------------------------------------------------
  *  ReplyAREQ
  *
@@ -206,7 +91,7 @@ arp_cache *InsertOrUpdateCacheEntry(arp_object *obj, arp_cache *entry, arppayloa
  * --------------------------------------------------------------------------
  */
 void ReplyAREQ(arp_cache *entry) {
-    int i;
+    char ip[IPSTR_BUFFSIZE], mac[MACSTR_BUFFSIZE];
     struct hwaddr HWaddr;
     bzero(&HWaddr, sizeof(HWaddr));
 
@@ -217,9 +102,7 @@ void ReplyAREQ(arp_cache *entry) {
     memcpy(HWaddr.sll_addr, entry->hwaddr, ETH_ALEN);
 
     // print out information
-    printf(" [ARP] Reply to AREQ <%s, ", UtilIpToString(entry->ipaddr));
-    for (i = 0; i < 6; i++)
-        printf("%.2x%s", HWaddr.sll_addr[i], (i < 5) ? ":" : ">\n");
+    printf(" [ARP] Reply to AREQ <%s, %s>\n", UtilFormatIp(entry->ipaddr, ip), UtilFormatMac(HWaddr.sll_addr, mac));
 
     // write and close the socket
     Write(entry->sockfd, &HWaddr, sizeof(HWaddr));
@@ -240,7 +123,6 @@ void ReplyAREQ(arp_cache *entry) {
  * --------------------------------------------------------------------------
  */
 void SendREQ(arp_object *obj, uchar *ipaddr) {
-    int i;
     char frame[ARP_FRAME_LEN];
     bzero(frame, sizeof(frame));
     // pointer
@@ -281,7 +163,6 @@ void SendREQ(arp_object *obj, uchar *ipaddr) {
  * --------------------------------------------------------------------------
  */
 void SendREP(arp_object *obj, arp_cache *entry, struct hwa_info *localhwa) {
-    int i;
     char frame[ARP_FRAME_LEN];
     bzero(frame, sizeof(frame));
     // pointer
@@ -326,8 +207,6 @@ void SendREP(arp_object *obj, arp_cache *entry, struct hwa_info *localhwa) {
  * --------------------------------------------------------------------------
  */
 void ProcessREQ(arp_object *obj, char *frame, struct sockaddr_ll *from) {
-    ethhdr *eth = (ethhdr *)frame;
-    arphdr *arp = (arphdr *)(frame + ETHHDR_LEN);
     arppayload *data = (arppayload *)(frame + ETHHDR_LEN + ARPHDR_LEN);
 
     // find sender's entry in cache
@@ -364,8 +243,6 @@ void ProcessREQ(arp_object *obj, char *frame, struct sockaddr_ll *from) {
  * --------------------------------------------------------------------------
  */
 void ProcessREP(arp_object *obj, char *frame, struct sockaddr_ll *from) {
-    ethhdr *eth = (ethhdr *)frame;
-    arphdr *arp = (arphdr *)(frame + ETHHDR_LEN);
     arppayload *data = (arppayload *)(frame + ETHHDR_LEN + ARPHDR_LEN);
 
     // find sender's entry in cache
@@ -405,9 +282,7 @@ void ProcessFrame(arp_object *obj) {
 
     len = RecvFrame(obj->pfSockfd, frame, ARP_FRAME_LEN, (SA *)&from, &fromlen);
     // pointer
-    ethhdr *eth = (ethhdr *)frame;
     arphdr *arp = (arphdr *)(frame + ETHHDR_LEN);
-    arppayload *data = (arppayload *)(frame + ETHHDR_LEN + ARPHDR_LEN);
 
     if (len < 0) {
         printf(" [ARP] Frame error.\n");
@@ -443,23 +318,24 @@ void ProcessFrame(arp_object *obj) {
 void ProcessDomainStream(arp_object *obj) {
     int connSockfd;
     uchar ipaddr[IP_ALEN];
+    char ip[IPSTR_BUFFSIZE];
     struct sockaddr_un from;
     socklen_t addrlen = sizeof(from);
     arp_cache *entry;
     // accept and read the socket
     connSockfd = Accept(obj->doSockfd, (struct sockaddr *) &from, &addrlen);
     Read(connSockfd, ipaddr, IP_ALEN);
-    printf(" [ARP] Domain socket: Incoming AREQ <%s> from %s\n", UtilIpToString(ipaddr), from.sun_path);
+    printf(" [ARP] Domain socket: Incoming AREQ <%s> from %s\n", UtilFormatIp(ipaddr, ip), from.sun_path);
     // try to find entry in cache
     entry = GetCacheEntry(obj, ipaddr);
     if (entry) {
         // found, send reply immediately
-        printf(" [ARP] AREQ <%s> found in cache, reply immediately.\n", UtilIpToString(ipaddr));
+        printf(" [ARP] AREQ <%s> found in cache, reply immediately.\n", ip);
         entry->sockfd = connSockfd;
         ReplyAREQ(entry);
     } else {
         // not found, create the incomplete entry
-        printf(" [ARP] AREQ <%s> not found in cache, create an incomplete entry.\n", UtilIpToString(ipaddr));
+        printf(" [ARP] AREQ <%s> not found in cache, create an incomplete entry.\n", ip);
         entry = Calloc(1, sizeof(arp_cache));
         memcpy(entry->ipaddr, ipaddr, IP_ALEN);
         entry->ifindex = obj->hwa_info->if_index;
@@ -487,8 +363,8 @@ void ProcessDomainStream(arp_object *obj) {
 void CreateSockets(arp_object *obj) {
     struct sockaddr_un arpaddr;
 
-    // Create PF_PACKET Socket
-    obj->pfSockfd = Socket(PF_PACKET, SOCK_RAW, htons(ARP_PROTOCOL_ID));
+    // Create PF_PACKET Socket, through the transport
+    obj->pfSockfd = TransportSocket(PF_PACKET, SOCK_RAW, htons(ARP_PROTOCOL_ID));
 
     bzero(&arpaddr, sizeof(arpaddr));
     arpaddr.sun_family = AF_LOCAL;
@@ -516,7 +392,7 @@ void CreateSockets(arp_object *obj) {
  * --------------------------------------------------------------------------
  */
 void ProcessSockets(arp_object *obj) {
-    int r, maxfd;
+    int maxfd;
     fd_set rset;
     arp_cache *entry, *prev;
 
@@ -536,7 +412,7 @@ void ProcessSockets(arp_object *obj) {
             entry = entry->next;
         }
 
-        r = Select(maxfd + 1, &rset, NULL, NULL, NULL);
+        Select(maxfd + 1, &rset, NULL, NULL, NULL);
 
         if (FD_ISSET(obj->pfSockfd, &rset)) {
             // from PF_PACKET Socket
@@ -581,12 +457,31 @@ checkagain:
  *  @return : int
  *
  *  ARP service entry function
+ *    -w file   capture the received ARP frames to a pcap file
+ *    -r file   replay a pcap file instead of the network, see transport.c
  * --------------------------------------------------------------------------
  */
 int main(int argc, char **argv) {
+    int c;
     arp_object obj;
     bzero(&obj, sizeof(obj));
 
+    // every log line is built by one printf, flush it with one write
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    while ((c = getopt(argc, argv, "w:r:")) != -1) {
+        switch (c) {
+        case 'w':
+            TransportInit(TRANSPORT_CAPTURE, optarg);
+            break;
+        case 'r':
+            TransportInit(TRANSPORT_REPLAY, optarg);
+            break;
+        default:
+            err_quit("usage: %s [-w file | -r file]", argv[0]);
+        }
+    }
+
     // Get interface information
     obj.hwa_info = Get_hw_addrs();
     obj.if_index = obj.hwa_info->if_index;
@@ -594,6 +489,7 @@ int main(int argc, char **argv) {
     printf(" [ARP] Module started.\n");
     PrintAddressPairs(&obj);
     CreateSockets(&obj);
+    TransportStart(obj.if_index);
     ProcessSockets(&obj);
     exit(0);
 }
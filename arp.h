@@ -10,6 +10,7 @@
 #include <linux/if_ether.h>
 #include <linux/if_arp.h>
 #include "unp.h"
+#include "transport.h"
 
 #define ARP_PROTOCOL_ID     61173
 #define ARP_ID_CODE         14508
@@ -29,6 +30,9 @@
 #define ARP_PATH    "/tmp/14508-61173-arpService"
 #define TMP_PATH    "/tmp/14508-61173-tourApplication-XXXXXX"
 
+#define IPSTR_BUFFSIZE      16
+#define MACSTR_BUFFSIZE     18
+
 #define IF_NAME             16
 #define IF_HADDR            6
 #define IP_ALIAS            1
@@ -99,6 +103,15 @@ struct hwaddr {
 };
 
 struct hwa_info *Get_hw_addrs();
-char *UtilIpToString(const uchar *);
+void BuildFrame(ethhdr *frame, uchar *dst_mac, uchar *src_mac, ushort proto);
+void BuildBcastFrame(ethhdr *frame, uchar *src_mac, ushort proto);
+int SendFrame(int sockfd, int if_index, void *frame, int framelen, uchar pkttype);
+int RecvFrame(int sockfd, void *frame, int framelen, struct sockaddr *from, socklen_t *fromlen);
+void PrintARPFrame(char *frame);
+arp_cache *GetCacheEntry(arp_object *obj, const uchar *ipaddr);
+arp_cache *InsertOrUpdateCacheEntry(arp_object *obj, arp_cache *entry, arppayload *data, struct sockaddr_ll *from);
+char *UtilFormatIp(const uchar *ipaddr, char *str);
+char *UtilFormatMac(const uchar *hwaddr, char *str);
+uint64_t UtilNowNs();
 
 #endif
@@ -0,0 +1,333 @@
+/*
+* @File:    bench.c
+* @Date:    2026-10-19 00:31:52
+* @Last Modified time: 2026-10-19 01:24:10
+* @Description:
+*     Microbenchmarks of the per-packet primitives, tour side
+*     - void *__wrap_malloc(size_t size)
+*         [Count an allocation]
+*     - int BenchSelected(const char *name)
+*         [Check a case against the command line filters]
+*     + void BenchRun(const char *name, bench_fn fn, void *arg)
+*         [Time a case and print its result]
+*     - void BenchCheckSum(void *arg, uint64_t iterations)
+*         [CheckSum of arg bytes]
+*     - void BenchInCksum(void *arg, uint64_t iterations)
+*         [in_cksum of arg bytes]
+*     - void BenchBuildIpHeader(void *arg, uint64_t iterations)
+*         [IP header of a tour packet]
+*     - void BenchBuildIpHdr(void *arg, uint64_t iterations)
+*         [IP header of a ping]
+*     - void BenchSessionVisit(void *arg, uint64_t iterations)
+*         [Record new edges of a tour of arg hops]
+*     - void BenchSessionRevisit(void *arg, uint64_t iterations)
+*         [Check known edges of a tour of arg hops]
+*     - void BenchSegmentEncode(void *arg, uint64_t iterations)
+*         [Encode a full window]
+*     + int main(int argc, char **argv)
+*         [Entry function]
+*/
+
+#include "tour.h"
+#include "ping.h"
+#include "bench.h"
+
+uint64_t benchAllocs;
+
+static FILE *results;
+static char **filters;
+static int filterCount;
+
+static uchar benchData[ETH_DATA_LEN];
+static uchar benchSrc[IPADDR_BUFFSIZE] = {10, 9, 1, 2};
+static uchar benchDst[IPADDR_BUFFSIZE] = {10, 9, 1, 3};
+
+/* --------------------------------------------------------------------------
+ *  __wrap_malloc
+ *
+ *  Count an allocation
+ *
+ *  @param  : size_t    size    [bytes]
+ *  @return : void      *       [memory from the real malloc]
+ *
+ *  The bench is linked with --wrap=malloc,--wrap=calloc,--wrap=realloc, so
+ *  every allocation of the linked objects and of libunp goes through here
+ * --------------------------------------------------------------------------
+ */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    benchAllocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    benchAllocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    benchAllocs++;
+    return __real_realloc(ptr, size);
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchSelected
+ *
+ *  Check a case against the command line filters
+ *
+ *  @param  : const char    *name   [case name]
+ *  @return : int           [1 if no filter is given or one is part of name]
+ * --------------------------------------------------------------------------
+ */
+static int BenchSelected(const char *name) {
+    int i;
+
+    if (filterCount == 0)
+        return 1;
+    for (i = 0; i < filterCount; i++)
+        if (strstr(name, filters[i]))
+            return 1;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchRun
+ *
+ *  Time a case and print its result
+ *
+ *  @param  : const char    *name   [case name, "primitive/size"]
+ *            bench_fn      fn      [case]
+ *            void          *arg    [case argument]
+ *  @return : void
+ *
+ *  The warm-up doubles the iterations until one call lasts BENCH_WARMUP_NS,
+ *  which also sizes the batches. The median of the batches is stable
+ *  against a preempted batch, the minimum is printed as well
+ * --------------------------------------------------------------------------
+ */
+void BenchRun(const char *name, bench_fn fn, void *arg) {
+    double perOp[BENCH_BATCHES], t;
+    uint64_t iterations, start, elapsed, allocs;
+    int i, j;
+
+    if (!BenchSelected(name))
+        return;
+
+    for (iterations = 1; ; iterations *= 2) {
+        start = UtilNowNs();
+        fn(arg, iterations);
+        elapsed = UtilNowNs() - start;
+        if (elapsed >= BENCH_WARMUP_NS)
+            break;
+    }
+    iterations = max(1, (uint64_t)((double)iterations * BENCH_BATCH_NS / elapsed));
+
+    allocs = benchAllocs;
+    for (i = 0; i < BENCH_BATCHES; i++) {
+        start = UtilNowNs();
+        fn(arg, iterations);
+        perOp[i] = (double)(UtilNowNs() - start) / iterations;
+    }
+    allocs = benchAllocs - allocs;
+
+    // insertion sort, a handful of batches
+    for (i = 1; i < BENCH_BATCHES; i++)
+        for (j = i; j > 0 && perOp[j - 1] > perOp[j]; j--) {
+            t = perOp[j];
+            perOp[j] = perOp[j - 1];
+            perOp[j - 1] = t;
+        }
+
+    fprintf(results, "bench=%s ns_per_op=%.1f min_ns_per_op=%.1f allocs_per_op=%.3f ops=%llu\n",
+        name, perOp[BENCH_BATCHES / 2], perOp[0], (double)allocs / (iterations * BENCH_BATCHES),
+        (unsigned long long)iterations * BENCH_BATCHES);
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchCheckSum
+ *
+ *  CheckSum of arg bytes
+ * --------------------------------------------------------------------------
+ */
+static void BenchCheckSum(void *arg, uint64_t iterations) {
+    int len = *(int *)arg;
+
+    while (iterations--)
+        benchData[0] += CheckSum((uint16_t *)benchData, len);
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchInCksum
+ *
+ *  in_cksum of arg bytes
+ * --------------------------------------------------------------------------
+ */
+static void BenchInCksum(void *arg, uint64_t iterations) {
+    int len = *(int *)arg;
+
+    while (iterations--)
+        benchData[0] += in_cksum((uint16_t *)benchData, len);
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchBuildIpHeader
+ *
+ *  IP header of a tour packet
+ * --------------------------------------------------------------------------
+ */
+static void BenchBuildIpHeader(void *arg, uint64_t iterations) {
+    while (iterations--)
+        BuildIpHeader((struct ip *)benchData, IP4_HDRLEN + TOUR_HDRLEN, benchSrc, benchDst);
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchBuildIpHdr
+ *
+ *  IP header of a ping
+ * --------------------------------------------------------------------------
+ */
+static void BenchBuildIpHdr(void *arg, uint64_t iterations) {
+    while (iterations--)
+        BuildIpHdr((struct ip *)benchData, benchSrc, benchDst, PING_MIN_DATALEN);
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchSessionVisit
+ *
+ *  Record new edges of a tour of arg hops
+ *
+ *  The session starts empty every arg edges, so the set grows to the size
+ *  of the tour over and over and its growth is part of the cost
+ * --------------------------------------------------------------------------
+ */
+static void BenchSessionVisit(void *arg, uint64_t iterations) {
+    uint32_t hops = *(uint32_t *)arg, hop = 0, prev, self;
+    tour_session s;
+
+    bzero(&s, sizeof(s));
+    while (iterations--) {
+        prev = htonl(0x0a000000 + hop);
+        self = htonl(0x0a000001 + hop);
+        SessionVisit(&s, (uchar *)&prev, (uchar *)&self);
+        if (++hop == hops) {
+            free(s.visited);
+            bzero(&s, sizeof(s));
+            hop = 0;
+        }
+    }
+    free(s.visited);
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchSessionRevisit
+ *
+ *  Check known edges of a tour of arg hops
+ *
+ *  The check every hop of a revisited node does before pinging
+ * --------------------------------------------------------------------------
+ */
+static void BenchSessionRevisit(void *arg, uint64_t iterations) {
+    static tour_session s;
+    static uint32_t filled;
+    uint32_t hops = *(uint32_t *)arg, hop = 0, prev, self;
+
+    if (filled != hops) {
+        free(s.visited);
+        bzero(&s, sizeof(s));
+        for (hop = 0; hop < hops; hop++) {
+            prev = htonl(0x0a000000 + hop);
+            self = htonl(0x0a000001 + hop);
+            SessionVisit(&s, (uchar *)&prev, (uchar *)&self);
+        }
+        filled = hops;
+        hop = 0;
+    }
+
+    while (iterations--) {
+        prev = htonl(0x0a000000 + hop);
+        self = htonl(0x0a000001 + hop);
+        SessionVisit(&s, (uchar *)&prev, (uchar *)&self);
+        if (++hop == hops)
+            hop = 0;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchSegmentEncode
+ *
+ *  Encode a full window
+ *
+ *  TOUR_WINDOW hops over arg unique nodes, as the source does for every
+ *  window it sends
+ * --------------------------------------------------------------------------
+ */
+static void BenchSegmentEncode(void *arg, uint64_t iterations) {
+    static char ipSeq[IPADDR_BUFFSIZE * TOUR_WINDOW];
+    static uchar packet[TOUR_HDRLEN + IPADDR_BUFFSIZE * TOUR_WINDOW + 2 * TOUR_WINDOW];
+    uint32_t nodes = *(uint32_t *)arg, ip;
+    int i;
+
+    for (i = 0; i < TOUR_WINDOW; i++) {
+        ip = htonl(0x0a090000 + i % nodes + 2);
+        memcpy(IP_SEQ(ipSeq, i), &ip, IPADDR_BUFFSIZE);
+    }
+    while (iterations--)
+        SegmentEncode((tourhdr *)packet, ipSeq, TOUR_WINDOW, 0, TOUR_WINDOW);
+}
+
+/* --------------------------------------------------------------------------
+ *  main
+ *
+ *  Entry function
+ *
+ *  @param  : int   argc
+ *            char  **argv  [filters, a case runs if its name contains one]
+ *  @return : int
+ *
+ *  Results go to the original stdout, one line per case. stdout itself is
+ *  sent to /dev/null, so the cases that log measure the formatting of the
+ *  log lines but not a terminal
+ * --------------------------------------------------------------------------
+ */
+int main(int argc, char **argv) {
+    static int lens[] = {IP4_HDRLEN, ETH_DATA_LEN};
+    static uint32_t hops[] = {1000, 100000};
+    static uint32_t nodes[] = {16, 256};
+    char name[64];
+    int i;
+
+    filters = argv + 1;
+    filterCount = argc - 1;
+
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    setvbuf(results, NULL, _IOLBF, 0);
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        err_sys("[BENCH] /dev/null");
+
+    for (i = 0; i < (int)sizeof(benchData); i++)
+        benchData[i] = i * 7;
+
+    for (i = 0; i < 2; i++) {
+        snprintf(name, sizeof(name), "checksum/%d", lens[i]);
+        BenchRun(name, BenchCheckSum, &lens[i]);
+        snprintf(name, sizeof(name), "in_cksum/%d", lens[i]);
+        BenchRun(name, BenchInCksum, &lens[i]);
+    }
+    BenchRun("ip_header/tour", BenchBuildIpHeader, NULL);
+    BenchRun("ip_header/ping", BenchBuildIpHdr, NULL);
+    for (i = 0; i < 2; i++) {
+        snprintf(name, sizeof(name), "session_visit/%u", hops[i]);
+        BenchRun(name, BenchSessionVisit, &hops[i]);
+        snprintf(name, sizeof(name), "session_revisit/%u", hops[i]);
+        BenchRun(name, BenchSessionRevisit, &hops[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        snprintf(name, sizeof(name), "segment_encode/%u", nodes[i]);
+        BenchRun(name, BenchSegmentEncode, &nodes[i]);
+    }
+    BenchArp();
+    exit(0);
+}
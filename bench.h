@@ -0,0 +1,24 @@
+#ifndef __bench_h
+#define __bench_h
+
+#include <stdint.h>
+
+/*
+ * Microbenchmarks of the per-packet primitives
+ *
+ * A case runs its primitive `iterations` times per call. BenchRun() warms it
+ * up, sizes a batch to about BENCH_BATCH_NS, times BENCH_BATCHES batches and
+ * prints one line with the median ns/op and the allocations per op.
+ */
+#define BENCH_WARMUP_NS     50000000ULL // warm-up before the batches
+#define BENCH_BATCH_NS      20000000ULL // duration of one timed batch
+#define BENCH_BATCHES       7           // timed batches, median is reported
+
+typedef void (*bench_fn)(void *arg, uint64_t iterations);
+
+extern uint64_t benchAllocs;            /* malloc/calloc/realloc calls  */
+
+void BenchRun(const char *name, bench_fn fn, void *arg);
+void BenchArp(void);
+
+#endif
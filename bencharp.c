@@ -0,0 +1,200 @@
+/*
+* @File:    bencharp.c
+* @Date:    2026-10-19 00:58:20
+* @Last Modified time: 2026-10-19 01:24:10
+* @Description:
+*     Microbenchmarks of the per-packet primitives, ARP side
+*     - void BenchFillCache(arp_object *obj, int size)
+*         [Fill the cache with size entries]
+*     - void BenchCacheLookup(void *arg, uint64_t iterations)
+*         [Look up the oldest entry of the cache]
+*     - void BenchCacheMiss(void *arg, uint64_t iterations)
+*         [Look up an address that is not cached]
+*     - void BenchCacheUpdate(void *arg, uint64_t iterations)
+*         [Refresh a cached entry from an ARP payload]
+*     - void BenchCacheInsert(void *arg, uint64_t iterations)
+*         [Miss, insert and remove an entry]
+*     - void BenchBuildFrame(void *arg, uint64_t iterations)
+*         [Ethernet header of an ARP frame]
+*     - void BenchPrintARPFrame(void *arg, uint64_t iterations)
+*         [Log an ARP frame]
+*     + void BenchArp(void)
+*         [Run the ARP cases]
+*/
+
+#include "arp.h"
+#include "bench.h"
+
+static arp_object benchObj;
+static arppayload benchPayload;
+static struct sockaddr_ll benchFrom;
+static char benchFrame[ARP_FRAME_LEN];
+
+/* --------------------------------------------------------------------------
+ *  BenchFillCache
+ *
+ *  Fill the cache with size entries
+ *
+ *  @param  : arp_object    *obj    [ARP object]
+ *            int           size    [entries, 10.0.0.1 first]
+ *  @return : void
+ *
+ *  Entries are pushed to the head like InsertOrUpdateCacheEntry does, so
+ *  the first address is the last one a lookup reaches
+ * --------------------------------------------------------------------------
+ */
+static void BenchFillCache(arp_object *obj, int size) {
+    arp_cache *entry;
+    uint32_t ip;
+    int i;
+
+    while ((entry = obj->cache) != NULL) {
+        obj->cache = entry->next;
+        free(entry);
+    }
+    for (i = 0; i < size; i++) {
+        entry = Calloc(1, sizeof(arp_cache));
+        ip = htonl(0x0a000001 + i);
+        memcpy(entry->ipaddr, &ip, IP_ALEN);
+        entry->hwaddr[ETH_ALEN - 1] = i;
+        entry->sockfd = -1;
+        entry->next = obj->cache;
+        obj->cache = entry;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchCacheLookup
+ *
+ *  Look up the oldest entry of the cache
+ * --------------------------------------------------------------------------
+ */
+static void BenchCacheLookup(void *arg, uint64_t iterations) {
+    uint32_t ip = htonl(0x0a000001);
+
+    while (iterations--)
+        if (GetCacheEntry(&benchObj, (uchar *)&ip) == NULL)
+            err_quit("[BENCH] cache lookup missed");
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchCacheMiss
+ *
+ *  Look up an address that is not cached
+ * --------------------------------------------------------------------------
+ */
+static void BenchCacheMiss(void *arg, uint64_t iterations) {
+    uint32_t ip = htonl(0xc6120001);
+
+    while (iterations--)
+        if (GetCacheEntry(&benchObj, (uchar *)&ip) != NULL)
+            err_quit("[BENCH] cache miss hit");
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchCacheUpdate
+ *
+ *  Refresh a cached entry from an ARP payload
+ *
+ *  What every ARP request and reply of a known host costs, including the
+ *  log line
+ * --------------------------------------------------------------------------
+ */
+static void BenchCacheUpdate(void *arg, uint64_t iterations) {
+    arp_cache *entry = benchObj.cache;
+
+    while (iterations--)
+        InsertOrUpdateCacheEntry(&benchObj, entry, &benchPayload, &benchFrom);
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchCacheInsert
+ *
+ *  Miss, insert and remove an entry
+ *
+ *  What the first reply from a host costs, the cache stays at its size
+ * --------------------------------------------------------------------------
+ */
+static void BenchCacheInsert(void *arg, uint64_t iterations) {
+    arp_cache *entry;
+
+    while (iterations--) {
+        entry = GetCacheEntry(&benchObj, benchPayload.ar_spro);
+        entry = InsertOrUpdateCacheEntry(&benchObj, entry, &benchPayload, &benchFrom);
+        benchObj.cache = entry->next;
+        free(entry);
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchBuildFrame
+ *
+ *  Ethernet header of an ARP frame
+ * --------------------------------------------------------------------------
+ */
+static void BenchBuildFrame(void *arg, uint64_t iterations) {
+    while (iterations--)
+        BuildFrame((ethhdr *)benchFrame, benchPayload.ar_thrd, benchPayload.ar_shrd, ARP_PROTOCOL_ID);
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchPrintARPFrame
+ *
+ *  Log an ARP frame
+ * --------------------------------------------------------------------------
+ */
+static void BenchPrintARPFrame(void *arg, uint64_t iterations) {
+    while (iterations--)
+        PrintARPFrame(benchFrame);
+}
+
+/* --------------------------------------------------------------------------
+ *  BenchArp
+ *
+ *  Run the ARP cases
+ *
+ *  @param  : void
+ *  @return : void
+ *
+ *  Lookups walk the whole list, so they are run at several cache sizes
+ * --------------------------------------------------------------------------
+ */
+void BenchArp(void) {
+    static int sizes[] = {16, 256, 4096};
+    arphdr *arp = (arphdr *)(benchFrame + ETHHDR_LEN);
+    uint32_t ip;
+    char name[64];
+    int i;
+
+    ip = htonl(0xc6120001);
+    memcpy(benchPayload.ar_spro, &ip, IP_ALEN);
+    memcpy(benchPayload.ar_shrd, "\x00\x0c\x29\x01\x02\x03", ETH_ALEN);
+    memcpy(benchPayload.ar_thrd, "\x00\x0c\x29\x04\x05\x06", ETH_ALEN);
+    ip = htonl(0x0a000001);
+    memcpy(benchPayload.ar_tpro, &ip, IP_ALEN);
+    benchFrom.sll_ifindex = 2;
+    benchFrom.sll_hatype = ARPHRD_ETHER;
+
+    for (i = 0; i < 3; i++) {
+        BenchFillCache(&benchObj, sizes[i]);
+        snprintf(name, sizeof(name), "cache_lookup/%d", sizes[i]);
+        BenchRun(name, BenchCacheLookup, NULL);
+        snprintf(name, sizeof(name), "cache_miss/%d", sizes[i]);
+        BenchRun(name, BenchCacheMiss, NULL);
+        snprintf(name, sizeof(name), "cache_insert/%d", sizes[i]);
+        BenchRun(name, BenchCacheInsert, NULL);
+    }
+    BenchRun("cache_update", BenchCacheUpdate, NULL);
+    BenchFillCache(&benchObj, 0);
+
+    BuildFrame((ethhdr *)benchFrame, benchPayload.ar_thrd, benchPayload.ar_shrd, ARP_PROTOCOL_ID);
+    arp->ar_id = htons(ARP_ID_CODE);
+    arp->ar_hrd = htons(ARPHRD_ETHER);
+    arp->ar_pro = htons(ETH_P_IP);
+    arp->ar_hln = ETH_ALEN;
+    arp->ar_pln = IP_ALEN;
+    arp->ar_op = htons(ARP_REP);
+    memcpy(benchFrame + ETHHDR_LEN + ARPHDR_LEN, &benchPayload, sizeof(benchPayload));
+    BenchRun("frame_build", BenchBuildFrame, NULL);
+    BenchRun("arp_frame_print", BenchPrintARPFrame, NULL);
+}
@@ -0,0 +1,77 @@
+/*
+* @File:    cache.c
+* @Date:    2026-10-19 00:12:40
+* @Last Modified time: 2026-10-19 00:12:40
+* @Description:
+*     ARP cache functions
+*     + arp_cache *GetCacheEntry(arp_object *obj, const uchar *ipaddr)
+*         [Get cache entry by IP address]
+*     + arp_cache *InsertOrUpdateCacheEntry(arp_object *obj, arp_cache *entry, arppayload *data, struct sockaddr_ll *from)
+*         [Insert or update cache entry]
+*/
+
+#include "arp.h"
+
+/* --------------------------------------------------------------------------
+ *  GetCacheEntry
+ *
+ *  Get cache entry by IP address
+ *
+ *  @param  : arp_object    *obj    [ARP object]
+ *            const uchar   *ipaddr [IP address]
+ *  @return : arp_cache *   [ARP cache entry, NULL if does not exist]
+ *
+ *  Find and return the cache entry matches IP address
+ *  Return NULL if not found
+ * --------------------------------------------------------------------------
+ */
+arp_cache *GetCacheEntry(arp_object *obj, const uchar *ipaddr) {
+    arp_cache *entry = obj->cache;
+    while (entry) {
+        if (memcmp(ipaddr, entry->ipaddr, IP_ALEN) == 0)
+            break;
+        entry = entry->next;
+    }
+    return entry;
+}
+
+/* --------------------------------------------------------------------------
+ *  InsertOrUpdateCacheEntry
+ *
+ *  Insert or update cache entry
+ *
+ *  @param  : arp_object            *obj    [ARP object]
+ *            arp_cache             *entry  [entry]
+ *            arppayload            *data   [ARP frame payload]
+ *            struct sockaddr_ll    *from   [sender address structure]
+ *  @return : arp_cache *   [inserted/updated ARP cache entry]
+ *
+ *  If entry is NULL, insert a new entry into cache
+ *  Otherwise the operation would be update
+ *  The entry content will be update according to data and from
+ * --------------------------------------------------------------------------
+ */
+arp_cache *InsertOrUpdateCacheEntry(arp_object *obj, arp_cache *entry, arppayload *data, struct sockaddr_ll *from) {
+    char ip[IPSTR_BUFFSIZE], mac[MACSTR_BUFFSIZE];
+    const char *op = "update";
+
+    if (entry == NULL) {
+        // insert a new entry, calloc memory space
+        entry = Calloc(1, sizeof(arp_cache));
+        entry->next = obj->cache;
+        obj->cache = entry;
+        op = "insert";
+    }
+
+    // fill entry content
+    memcpy(entry->ipaddr, data->ar_spro, IP_ALEN);
+    memcpy(entry->hwaddr, data->ar_shrd, ETH_ALEN);
+    entry->ifindex = from->sll_ifindex;
+    entry->hatype = from->sll_hatype;
+
+    // print entry information
+    printf(" [ARP] Cache %s: <%s, %s, %d, %d, %d>\n", op, UtilFormatIp(entry->ipaddr, ip), UtilFormatMac(entry->hwaddr, mac),
+        entry->ifindex, entry->hatype, entry->sockfd);
+
+    return entry;
+}
@@ -12,6 +12,8 @@
 *         [Frame send function]
 *     + int RecvFrame(int sockfd, void *frame, int framelen, struct sockaddr *from, socklen_t *fromlen)
 *         [Frame receive function]
+*     + void PrintARPFrame(char *frame)
+*         [Print ARP Frame Content]
 */
 
 #include "arp.h"
@@ -91,7 +93,7 @@ int SendFrame(int sockfd, int if_index, void *frame, int framelen, uchar pkttype
     socket_address.sll_addr[6]  = 0x00;
     socket_address.sll_addr[7]  = 0x00;
 
-    return sendto(sockfd, frame, framelen, 0,
+    return TransportSendto(sockfd, frame, framelen, 0,
           (struct sockaddr*)&socket_address, sizeof(socket_address));
 }
 
@@ -111,5 +113,35 @@ int SendFrame(int sockfd, int if_index, void *frame, int framelen, uchar pkttype
  * --------------------------------------------------------------------------
  */
 int RecvFrame(int sockfd, void *frame, int framelen, struct sockaddr *from, socklen_t *fromlen) {
-    return recvfrom(sockfd, frame, framelen, 0, from, fromlen);
+    return TransportRecvfrom(sockfd, frame, framelen, 0, from, fromlen);
+}
+
+/* --------------------------------------------------------------------------
+ *  PrintARPFrame
+ *
+ *  Print ARP Frame Content
+ *
+ *  @param  : char  *frame  [frame]
+ *  @return : void
+ *
+ *  Print the content in ARP frame
+ *    1. Ethernet frame header
+ *    2. ARP packet header
+ *    3. ARP packet payload
+ * --------------------------------------------------------------------------
+ */
+void PrintARPFrame(char *frame) {
+    char mac[MACSTR_BUFFSIZE], mac2[MACSTR_BUFFSIZE], ip[IPSTR_BUFFSIZE];
+
+    ethhdr *eth = (ethhdr *)frame;
+    arphdr *arp = (arphdr *)(frame + ETHHDR_LEN);
+    arppayload *data = (arppayload *)(frame + ETHHDR_LEN + ARPHDR_LEN);
+    printf("      ETHHDR | dest: %s, source: %s, proto: %d\n",
+            UtilFormatMac(eth->h_dest, mac), UtilFormatMac(eth->h_source, mac2), ntohs(eth->h_proto));
+    printf("      ARPHDR | id: %d, hrd: 0x%.4x, pro: 0x%.4x, hln: %d, pln: %d, op: %d %s\n",
+            arp->ar_id, ntohs(arp->ar_hrd), ntohs(arp->ar_pro),
+            arp->ar_hln, arp->ar_pln, ntohs(arp->ar_op),
+            (arp->ar_op == ntohs(ARP_REQ)) ? "REQ" : "REP");
+    printf("        DATA | sender: %s %s\n", UtilFormatMac(data->ar_shrd, mac), UtilFormatIp(data->ar_spro, ip));
+    printf("        DATA | target: %s %s\n", UtilFormatMac(data->ar_thrd, mac), UtilFormatIp(data->ar_tpro, ip));
 }
@@ -0,0 +1,188 @@
+/*
+* @File:    hist.c
+* @Date:    2026-10-18 10:14:51
+* @Last Modified time: 2026-10-18 15:02:37
+* @Description:
+*     Latency histogram library
+*     - int HistIndex(uint64_t value)
+*         [Map a value to its bucket index]
+*     - uint64_t HistBucketValue(int index)
+*         [Representative value of a bucket]
+*     + void HistInit(hist *h)
+*         [Reset a histogram]
+*     + void HistRecord(hist *h, uint64_t value)
+*         [Record a value]
+*     + uint64_t HistPercentile(const hist *h, double percentile)
+*         [Get the value at a percentile]
+*     + double HistMean(const hist *h)
+*         [Get the mean value]
+*     + void HistMerge(hist *h, const hist *other)
+*         [Add the values of another histogram]
+*/
+
+#include <string.h>
+#include "hist.h"
+
+/* --------------------------------------------------------------------------
+ *  HistIndex
+ *
+ *  Map a value to its bucket index
+ *
+ *  @param  : uint64_t  value   [recorded value]
+ *  @return : int               [bucket index]
+ *
+ *  Values below HIST_SUB_COUNT map to themselves. Otherwise the position
+ *  of the highest set bit selects the power of two and the next
+ *  HIST_SUB_BITS bits select the linear sub-bucket inside it
+ * --------------------------------------------------------------------------
+ */
+static int HistIndex(uint64_t value) {
+    int msb, shift;
+
+    if (value < HIST_SUB_COUNT)
+        return (int)value;
+
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + (int)((value >> shift) - HIST_SUB_COUNT);
+}
+
+/* --------------------------------------------------------------------------
+ *  HistBucketValue
+ *
+ *  Representative value of a bucket
+ *
+ *  @param  : int       index   [bucket index]
+ *  @return : uint64_t          [middle of the bucket range]
+ * --------------------------------------------------------------------------
+ */
+static uint64_t HistBucketValue(int index) {
+    int shift;
+    uint64_t low;
+
+    if (index < HIST_SUB_COUNT)
+        return (uint64_t)index;
+
+    shift = index / HIST_SUB_COUNT - 1;
+    low = (uint64_t)(HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift;
+    return low + (((uint64_t)1 << shift) >> 1);
+}
+
+/* --------------------------------------------------------------------------
+ *  HistInit
+ *
+ *  Reset a histogram
+ *
+ *  @param  : hist  *h  [histogram]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+void HistInit(hist *h) {
+    memset(h, 0, sizeof(hist));
+    h->min = UINT64_MAX;
+}
+
+/* --------------------------------------------------------------------------
+ *  HistRecord
+ *
+ *  Record a value
+ *
+ *  @param  : hist      *h      [histogram]
+ *            uint64_t  value   [value, e.g. latency in nanoseconds]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+void HistRecord(hist *h, uint64_t value) {
+    h->bucket[HistIndex(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+}
+
+/* --------------------------------------------------------------------------
+ *  HistPercentile
+ *
+ *  Get the value at a percentile
+ *
+ *  @param  : const hist    *h          [histogram]
+ *            double        percentile  [0.0 - 100.0]
+ *  @return : uint64_t      [value at the percentile, 0 if empty]
+ *
+ *  Walk the buckets until the cumulative count reaches the rank of the
+ *  percentile. The first and last ranks return the recorded min/max, so
+ *  p0 and p100 are exact
+ * --------------------------------------------------------------------------
+ */
+uint64_t HistPercentile(const hist *h, double percentile) {
+    uint64_t rank, seen = 0, value;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+
+    rank = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > h->count)
+        rank = h->count;
+    if (rank == 1)
+        return h->min;
+    if (rank == h->count)
+        return h->max;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank)
+            break;
+    }
+
+    value = HistBucketValue(i);
+    if (value < h->min)
+        value = h->min;
+    if (value > h->max)
+        value = h->max;
+    return value;
+}
+
+/* --------------------------------------------------------------------------
+ *  HistMean
+ *
+ *  Get the mean value
+ *
+ *  @param  : const hist    *h  [histogram]
+ *  @return : double        [mean of recorded values, 0 if empty]
+ * --------------------------------------------------------------------------
+ */
+double HistMean(const hist *h) {
+    if (h->count == 0)
+        return 0.0;
+    return (double)h->sum / h->count;
+}
+
+/* --------------------------------------------------------------------------
+ *  HistMerge
+ *
+ *  Add the values of another histogram
+ *
+ *  @param  : hist          *h      [histogram]
+ *            const hist    *other  [histogram to add, e.g. of one thread]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+void HistMerge(hist *h, const hist *other) {
+    int i;
+
+    if (other->count == 0)
+        return;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        h->bucket[i] += other->bucket[i];
+    h->count += other->count;
+    h->sum += other->sum;
+    if (other->min < h->min)
+        h->min = other->min;
+    if (other->max > h->max)
+        h->max = other->max;
+}
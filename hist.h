@@ -0,0 +1,31 @@
+#ifndef __hist_h
+#define __hist_h
+
+#include <stdint.h>
+
+/*
+ * Log-linear (HDR style) latency histogram
+ *
+ * Values below HIST_SUB_COUNT are counted exactly. Above that, every power
+ * of two is split into HIST_SUB_COUNT linear sub-buckets, which bounds the
+ * relative error of a reported percentile to 1 / HIST_SUB_COUNT.
+ */
+#define HIST_SUB_BITS       4
+#define HIST_SUB_COUNT      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS        ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct hist_t {
+    uint64_t    count;                  /* number of recorded values    */
+    uint64_t    sum;                    /* sum of recorded values       */
+    uint64_t    min;                    /* smallest recorded value      */
+    uint64_t    max;                    /* largest recorded value       */
+    uint32_t    bucket[HIST_BUCKETS];   /* log-linear bucket counters   */
+} hist;
+
+void HistInit(hist *h);
+void HistRecord(hist *h, uint64_t value);
+uint64_t HistPercentile(const hist *h, double percentile);
+double HistMean(const hist *h);
+void HistMerge(hist *h, const hist *other);
+
+#endif
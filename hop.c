@@ -0,0 +1,236 @@
+/*
+* @File:    hop.c
+* @Date:    2026-10-20 14:05:12
+* @Last Modified time: 2026-10-20 15:41:27
+* @Description:
+*     Hop-by-hop acknowledgement and retransmission of tour packets
+*     - uint64_t HopRto(tour_object *obj)
+*         [Time a hop may take to acknowledge a packet]
+*     - void HopResend(tour_object *obj, tour_hop *h, uint64_t now, const char *why)
+*         [Send the packet of a hop again]
+*     + void HopSent(tour_object *obj, const uchar *packet, int length)
+*         [Keep a packet sent to the next hop until it is acknowledged]
+*     + void HopReply(tour_object *obj, struct ip *iphdr)
+*         [Acknowledge a received tour packet to the preceding node]
+*     + void HopAck(tour_object *obj, struct ip *iphdr)
+*         [Process the acknowledgement of a hop]
+*     + void HopRunTimers(tour_object *obj)
+*         [Resend the packets of hops past their RTO]
+*/
+
+#include "tour.h"
+
+/* --------------------------------------------------------------------------
+ *  HopRto
+ *
+ *  Time a hop may take to acknowledge a packet
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *  @return : uint64_t      [ns]
+ *
+ *  Twice the smoothed hop RTT plus four mean deviations, as for the tours
+ *  of a stream; HOP_RTO_TIME until a hop acknowledged a packet
+ * --------------------------------------------------------------------------
+ */
+static uint64_t HopRto(tour_object *obj) {
+    if (obj->hopRtt == 0)
+        return HOP_RTO_TIME * 1000000ULL;
+    return 2 * obj->hopRtt + 4 * obj->hopRttVar;
+}
+
+/* --------------------------------------------------------------------------
+ *  HopResend
+ *
+ *  Send the packet of a hop again
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            tour_hop      *h      [hop not acknowledged]
+ *            uint64_t      now     [current time, ns]
+ *            const char    *why    [reason, for the log]
+ *  @return : void
+ *
+ *  The RTO doubles with every retransmission of the hop
+ * --------------------------------------------------------------------------
+ */
+static void HopResend(tour_object *obj, tour_hop *h, uint64_t now, const char *why) {
+    struct ip *iphdr = (struct ip *)h->packet;
+    char ip[IPSTR_BUFFSIZE];
+    struct sockaddr_in sin;
+
+    h->retries++;
+    h->sent = now;
+    h->deadline = now + (HopRto(obj) << h->retries);
+
+    bzero(&sin, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = iphdr->ip_dst.s_addr;
+
+    printf("[TOUR] tour %08x hop %u to %s not acknowledged, resent %d of %d (%s).\n", h->session->id,
+        h->index + 1, UtilFormatIp((uchar *)&iphdr->ip_dst, ip), h->retries, HOP_RETRIES, why);
+    if (TransportSendto(obj->rtSockfd, h->packet, h->length, 0, (struct sockaddr *) &sin, sizeof(struct sockaddr)) < 0)
+        err_sys("[TOUR] sendto error");
+}
+
+/* --------------------------------------------------------------------------
+ *  HopSent
+ *
+ *  Keep a packet sent to the next hop until it is acknowledged
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            uchar         *packet [tour packet sent, TOUR_FLAG_ACK]
+ *            int           length  [packet length]
+ *  @return : void
+ *
+ *  The packet is copied, the sender may reuse its buffer
+ * --------------------------------------------------------------------------
+ */
+void HopSent(tour_object *obj, const uchar *packet, int length) {
+    const tourhdr *rthdr = (const tourhdr *)(packet + IP4_HDRLEN);
+    tour_session *s = SessionFind(obj, ntohl(rthdr->id));
+    tour_hop *h;
+
+    if (s == NULL)
+        return;
+
+    h = Calloc(1, sizeof(tour_hop));
+    h->packet = Malloc(length);
+    memcpy(h->packet, packet, length);
+    h->length = length;
+    h->index = ntohl(rthdr->index);
+    h->seq = ntohl(rthdr->seq);
+    h->sent = UtilNowNs();
+    h->deadline = h->sent + HopRto(obj);
+    h->session = s;
+    h->next = obj->hops;
+    obj->hops = h;
+}
+
+/* --------------------------------------------------------------------------
+ *  HopReply
+ *
+ *  Acknowledge a received tour packet to the preceding node
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            struct ip     *iphdr  [received tour packet, TOUR_FLAG_ACK]
+ *  @return : void
+ *
+ *  The ack is a bare tour header with the ID, index and seq of the
+ *  packet. A repeated packet is acknowledged again, its first ack may be
+ *  the one lost.
+ *  A node sends a tour once, so it rarely measured a hop before its own
+ *  turn: until it did, it takes the hop RTT the preceding node carried in
+ *  the packet, the hops of a tour share the link
+ * --------------------------------------------------------------------------
+ */
+void HopReply(tour_object *obj, struct ip *iphdr) {
+    const tourhdr *rthdr = (const tourhdr *)((uchar *)iphdr + IP4_HDRLEN);
+    uchar packet[IP4_HDRLEN + TOUR_HDRLEN];
+    tourhdr *ack = (tourhdr *)(packet + IP4_HDRLEN);
+    struct sockaddr_in sin;
+
+    if (obj->hopRtt == 0 && rthdr->hopRtt != 0) {
+        obj->hopRtt = ntohs(rthdr->hopRtt) * 1000ULL;
+        obj->hopRttVar = obj->hopRtt / 2;
+    }
+
+    bzero(packet, sizeof(packet));
+    ack->version = TOUR_VERSION;
+    ack->type = TOUR_HOP_ACK;
+    ack->flags = TOUR_FLAG_ACK;
+    ack->id = rthdr->id;
+    ack->index = rthdr->index;
+    ack->seq = rthdr->seq;
+    BuildIpHeader((struct ip *)packet, sizeof(packet), obj->ipaddr, (uchar *)&iphdr->ip_src);
+
+    bzero(&sin, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = iphdr->ip_src.s_addr;
+    if (TransportSendto(obj->rtSockfd, packet, sizeof(packet), 0, (struct sockaddr *) &sin, sizeof(struct sockaddr)) < 0)
+        err_sys("[TOUR] sendto error");
+}
+
+/* --------------------------------------------------------------------------
+ *  HopAck
+ *
+ *  Process the acknowledgement of a hop
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            struct ip     *iphdr  [received ack]
+ *  @return : void
+ *
+ *  The acknowledged packet is released and, unless it was resent, its RTT
+ *  updates the smoothed hop RTT and deviation by 1/8 and 1/4 as TCP does.
+ *  The tours of a stream take the same hop in order: a packet passed by
+ *  HOP_DUPACKS acknowledged later tours is lost and resent at once,
+ *  without waiting for its RTO
+ * --------------------------------------------------------------------------
+ */
+void HopAck(tour_object *obj, struct ip *iphdr) {
+    const tourhdr *rthdr = (const tourhdr *)((uchar *)iphdr + IP4_HDRLEN);
+    uint32_t id = ntohl(rthdr->id), index = ntohl(rthdr->index), seq = ntohl(rthdr->seq);
+    uint64_t now = UtilNowNs(), rtt;
+    tour_hop **ph, *h;
+
+    for (ph = &obj->hops; *ph != NULL; ) {
+        h = *ph;
+        if (h->session->id != id || h->index != index
+            || ((struct ip *)h->packet)->ip_dst.s_addr != iphdr->ip_src.s_addr) {
+            ph = &h->next;
+            continue;
+        }
+        if (h->seq == seq) {
+            *ph = h->next;
+            if (h->retries == 0) {
+                rtt = now - h->sent;
+                if (obj->hopRtt == 0) {
+                    obj->hopRtt = rtt;
+                    obj->hopRttVar = rtt / 2;
+                } else {
+                    obj->hopRttVar = (3 * obj->hopRttVar + (rtt > obj->hopRtt ? rtt - obj->hopRtt : obj->hopRtt - rtt)) / 4;
+                    obj->hopRtt = (7 * obj->hopRtt + rtt) / 8;
+                }
+            }
+            free(h->packet);
+            free(h);
+            continue;
+        }
+        if (h->seq < seq && ++h->later == HOP_DUPACKS && h->retries < HOP_RETRIES)
+            HopResend(obj, h, now, "fast");
+        ph = &h->next;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  HopRunTimers
+ *
+ *  Resend the packets of hops past their RTO
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *  @return : void
+ *
+ *  A hop still silent after HOP_RETRIES retransmissions is given up
+ * --------------------------------------------------------------------------
+ */
+void HopRunTimers(tour_object *obj) {
+    uint64_t now = UtilNowNs();
+    char ip[IPSTR_BUFFSIZE];
+    tour_hop **ph, *h;
+
+    for (ph = &obj->hops; *ph != NULL; ) {
+        h = *ph;
+        if (h->deadline > now) {
+            ph = &h->next;
+            continue;
+        }
+        if (h->retries == HOP_RETRIES) {
+            *ph = h->next;
+            printf("[TOUR] tour %08x hop %u to %s lost, no ack after %d retransmissions.\n", h->session->id,
+                h->index + 1, UtilFormatIp((uchar *)&((struct ip *)h->packet)->ip_dst, ip), HOP_RETRIES);
+            free(h->packet);
+            free(h);
+            continue;
+        }
+        HopResend(obj, h, now, "timeout");
+        ph = &h->next;
+    }
+}
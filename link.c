@@ -0,0 +1,165 @@
+/*
+* @File:    link.c
+* @Date:    2026-10-18 13:20:05
+* @Last Modified time: 2026-10-18 16:47:12
+* @Description:
+*     Local link-layer identity of the tour process
+*     - int LinkFindInterface(const uchar *ipaddr, char *ifname)
+*         [Find the interface that owns an IP address]
+*     + void LinkInit(tour_object *obj)
+*         [Resolve the local link-layer identity]
+*     + void LinkProcessEvents(tour_object *obj)
+*         [Process netlink link events]
+*/
+
+#include "tour.h"
+#include "ping.h"
+
+#include <ifaddrs.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/* --------------------------------------------------------------------------
+ *  LinkFindInterface
+ *
+ *  Find the interface that owns an IP address
+ *
+ *  @param  : const uchar   *ipaddr [IP address]
+ *            char          *ifname [interface name, IFNAMSIZ bytes]
+ *  @return : int           [0 if found, -1 if not]
+ * --------------------------------------------------------------------------
+ */
+static int LinkFindInterface(const uchar *ipaddr, char *ifname) {
+    struct ifaddrs *ifap, *ifa;
+    int r = -1;
+
+    if (getifaddrs(&ifap) < 0)
+        return -1;
+
+    for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET)
+            continue;
+        if (memcmp(&((struct sockaddr_in *)ifa->ifa_addr)->sin_addr, ipaddr, IPADDR_BUFFSIZE) == 0) {
+            snprintf(ifname, IFNAMSIZ, "%s", ifa->ifa_name);
+            // alias "eth0:1" shares the link of "eth0"
+            if (strchr(ifname, ':'))
+                *strchr(ifname, ':') = 0;
+            r = 0;
+            break;
+        }
+    }
+    freeifaddrs(ifap);
+    return r;
+}
+
+/* --------------------------------------------------------------------------
+ *  LinkInit
+ *
+ *  Resolve the local link-layer identity
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *  @return : void
+ *
+ *  Resolve interface index, MAC address and MTU once at startup. The
+ *  interface is the one given by -I, otherwise the one that owns the node's
+ *  primary IP address, otherwise eth0.
+ *  Open a netlink socket subscribed to link events so that the identity can
+ *  be refreshed when the interface changes.
+ * --------------------------------------------------------------------------
+ */
+void LinkInit(tour_object *obj) {
+    link_info *link = &obj->link;
+    struct ifreq ifr;
+    struct sockaddr_nl snl;
+    char mac[MACSTR_BUFFSIZE];
+    int sockfd;
+
+    if (link->ifname[0] == 0 && LinkFindInterface(obj->ipaddr, link->ifname) < 0)
+        strcpy(link->ifname, "eth0");
+
+    sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+    bzero(&ifr, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", link->ifname);
+
+    if (ioctl(sockfd, SIOCGIFINDEX, &ifr) < 0)
+        err_sys("[TOUR] SIOCGIFINDEX %s", link->ifname);
+    link->ifindex = ifr.ifr_ifindex;
+
+    if (ioctl(sockfd, SIOCGIFHWADDR, &ifr) < 0)
+        err_sys("[TOUR] SIOCGIFHWADDR %s", link->ifname);
+    memcpy(link->hwaddr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    link->mtu = ETH_DATA_LEN;
+    if (ioctl(sockfd, SIOCGIFMTU, &ifr) == 0)
+        link->mtu = ifr.ifr_mtu;
+    Close(sockfd);
+
+    // subscribe to link events
+    link->nlSockfd = Socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    bzero(&snl, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+    snl.nl_groups = RTMGRP_LINK;
+    Bind(link->nlSockfd, (SA *)&snl, sizeof(snl));
+
+    printf("[TOUR] Local link %s (index %d) %s mtu %d\n",
+        link->ifname, link->ifindex, UtilFormatMac(link->hwaddr, mac), link->mtu);
+}
+
+/* --------------------------------------------------------------------------
+ *  LinkProcessEvents
+ *
+ *  Process netlink link events
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *  @return : void
+ *
+ *  Read one batch of RTM_NEWLINK / RTM_DELLINK messages. If the message is
+ *  about our interface, refresh name, MAC address and MTU, then push the
+ *  new source address to the running pings
+ * --------------------------------------------------------------------------
+ */
+void LinkProcessEvents(tour_object *obj) {
+    link_info *link = &obj->link;
+    char buf[8192];
+    struct nlmsghdr *nlh;
+    struct ifinfomsg *ifi;
+    struct rtattr *rta;
+    char mac[MACSTR_BUFFSIZE];
+    int len, attrlen, changed = 0;
+
+    len = recv(link->nlSockfd, buf, sizeof(buf), 0);
+    if (len <= 0)
+        return;
+
+    for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+        if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK)
+            continue;
+        ifi = (struct ifinfomsg *)NLMSG_DATA(nlh);
+        if (ifi->ifi_index != link->ifindex)
+            continue;
+
+        if (nlh->nlmsg_type == RTM_DELLINK) {
+            printf("[TOUR] Local link %s has been removed.\n", link->ifname);
+            continue;
+        }
+
+        attrlen = IFLA_PAYLOAD(nlh);
+        for (rta = IFLA_RTA(ifi); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+            if (rta->rta_type == IFLA_ADDRESS && RTA_PAYLOAD(rta) == ETH_ALEN
+                && memcmp(link->hwaddr, RTA_DATA(rta), ETH_ALEN) != 0) {
+                memcpy(link->hwaddr, RTA_DATA(rta), ETH_ALEN);
+                changed = 1;
+            } else if (rta->rta_type == IFLA_MTU) {
+                link->mtu = *(int *)RTA_DATA(rta);
+            } else if (rta->rta_type == IFLA_IFNAME) {
+                snprintf(link->ifname, IFNAMSIZ, "%s", (char *)RTA_DATA(rta));
+            }
+        }
+    }
+
+    if (changed) {
+        printf("[TOUR] Local link %s changed address to %s\n",
+            link->ifname, UtilFormatMac(link->hwaddr, mac));
+        PingLinkChanged(obj);
+    }
+}
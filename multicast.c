@@ -4,17 +4,21 @@
 * @Last Modified time: 2015-12-08 23:23:17
 * @Description:
 *     Multicast function library
-*     + void CreateMulticastGroup(uchar *grp, int *port)
+*     + void CreateMulticastGroup(tour_object *obj, uint32_t id, uchar *grp, int *port)
 *         [Multicast group generator]
-*     + void JoinMulticastGroup(tour_object *obj, uchar *grp, int port)
+*     + int JoinMulticastGroup(tour_object *obj, uchar *grp, int port)
 *         [Join the multicast group]
-*     + void LeaveMulticastGroup(tour_object *obj, uchar *grp, int port)
+*     + void LeaveMulticastGroup(tour_object *obj, int sockfd, uchar *grp, int port)
 *         [Leave the multicast group]
-*     - void SendMulticast(tour_object *obj, char *msg)
-*         [Send out multicast message]
-*     + void StartMulticast(tour_object *obj)
+*     - char *FormatMulticast(const mcasthdr *mchdr, char *text)
+*         [Render a multicast message for the log]
+*     - void SendMulticast(tour_object *obj, tour_session *s, uchar type)
+*         [Send out roll call message]
+*     + void StartMulticast(tour_object *obj, tour_session *s)
 *         [Start multicast]
-*     + void ProcessMulticast(tour_object *obj)
+*     + void IdentifyMember(tour_object *obj, tour_session *s)
+*         [Identify the local node to the source]
+*     + void ProcessMulticast(tour_object *obj, int sockfd)
 *         [Process received multicast message]
 */
 
@@ -25,19 +29,35 @@
  *
  *  Multicast group generator
  *
- *  @param  : uchar     *grp    [multicast group address]
- *            int       *port   [multicast port number]
+ *  @param  : tour_object   *obj    [tour object]
+ *            uint32_t      id      [tour ID]
+ *            uchar         *grp    [multicast group address]
+ *            int           *port   [multicast port number]
  *  @return : void
  *
- *  Create multicast group address and port number
+ *  Hash the tour ID into a group of 239.<range>.0.0/16 (administratively
+ *  scoped) and a port of MCAST_PORT + [0, MCAST_PORT_RANGE), so every tour
+ *  has its own group and members only receive the roll call of their own
+ *  tours. If a tour of this node already uses the group, probe the next
+ *  one; the .0 and .255 host parts are skipped
  * --------------------------------------------------------------------------
  */
-void CreateMulticastGroup(uchar *grp, int *port) {
-    // group ID should not be 1, 2
-    // we also do not use 0
-    uchar mcast_addr[4] = MCAST_ADDRESS;
-    memcpy(grp, mcast_addr, IPADDR_BUFFSIZE);
-    *port = MCAST_PORT;
+void CreateMulticastGroup(tour_object *obj, uint32_t id, uchar *grp, int *port) {
+    uint32_t h = id * 2654435761U;
+    uint i, g;
+
+    *port = MCAST_PORT + h % MCAST_PORT_RANGE;
+    for (i = 0; i < 65536; i++) {
+        g = ((h >> 16) + i) & 0xffff;
+        if ((g & 0xff) == 0 || (g & 0xff) == 0xff)
+            continue;
+        grp[0] = 239;
+        grp[1] = obj->mcastRange;
+        grp[2] = g >> 8;
+        grp[3] = g & 0xff;
+        if (SessionFindGroup(obj, grp, 0) == NULL)
+            return;
+    }
 }
 
 /* --------------------------------------------------------------------------
@@ -48,25 +68,40 @@ void CreateMulticastGroup(uchar *grp, int *port) {
  *  @param  : tour_object   *obj    [tour object]
  *            uchar         *grp    [multicast group address]
  *            int           port    [multicast port number]
- *  @return : void
+ *  @return : int           [receiving UDP socket of the group]
  *
- *  Bind the UDP socket to multicast address and join the multicast group
- *  Save multicast group information in tour object
+ *  Every group has its own receiving UDP socket bound to the group address
+ *  and port, with IP_MULTICAST_ALL off, so it only gets the datagrams of
+ *  the group it joined
  * --------------------------------------------------------------------------
  */
-void JoinMulticastGroup(tour_object *obj, uchar *grp, int port) {
-    struct ip_mreq mreq;
+int JoinMulticastGroup(tour_object *obj, uchar *grp, int port) {
+    const int on = 1, off = 0;
+    struct sockaddr_in mcastaddr;
+    struct ip_mreqn mreq;
+    int sockfd;
 
-    // Join the multicast group
-    memcpy(&mreq.imr_multiaddr, grp, IPADDR_BUFFSIZE);
-    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+    Setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef IP_MULTICAST_ALL
+    Setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+#endif
+    bzero(&mcastaddr, sizeof(mcastaddr));
+    mcastaddr.sin_family = AF_INET;
+    memcpy(&mcastaddr.sin_addr, grp, IPADDR_BUFFSIZE);
+    mcastaddr.sin_port = htons(port);
+    Bind(sockfd, (struct sockaddr *)&mcastaddr, sizeof(mcastaddr));
 
-    Setsockopt(obj->mrSockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    // Join the multicast group on the tour interface
+    bzero(&mreq, sizeof(mreq));
+    memcpy(&mreq.imr_multiaddr, grp, IPADDR_BUFFSIZE);
+    mreq.imr_address.s_addr = htonl(INADDR_ANY);
+    mreq.imr_ifindex = obj->link.ifindex;
 
-    memcpy(obj->mcastAddr, grp, IPADDR_BUFFSIZE);
-    obj->mcastPort = port;
+    Setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
 
     printf("[TOUR] Join multicast address: %d.%d.%d.%d:%d\n", grp[0], grp[1], grp[2], grp[3], port);
+    return sockfd;
 }
 
 /* --------------------------------------------------------------------------
@@ -75,50 +110,114 @@ void JoinMulticastGroup(tour_object *obj, uchar *grp, int port) {
  *  Leave the multicast group
  *
  *  @param  : tour_object   *obj    [tour object]
+ *            int           sockfd  [receiving UDP socket of the group]
  *            uchar         *grp    [multicast group address]
  *            int           port    [multicast port number]
  *  @return : void
  *
- *  Leave multicast group and clear the information in tour object
+ *  Leave multicast group and close its receiving socket
  * --------------------------------------------------------------------------
  */
-void LeaveMulticastGroup(tour_object *obj, uchar *grp, int port) {
-    struct ip_mreq mreq;
+void LeaveMulticastGroup(tour_object *obj, int sockfd, uchar *grp, int port) {
+    struct ip_mreqn mreq;
 
+    bzero(&mreq, sizeof(mreq));
     memcpy(&mreq.imr_multiaddr, grp, IPADDR_BUFFSIZE);
-    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    mreq.imr_address.s_addr = htonl(INADDR_ANY);
+    mreq.imr_ifindex = obj->link.ifindex;
 
-    Setsockopt(obj->mrSockfd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+    Setsockopt(sockfd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+    Close(sockfd);
 
     printf("[TOUR] Leave multicast address: %d.%d.%d.%d:%d\n",grp[0], grp[1], grp[2], grp[3], port);
+}
 
-    bzero(obj->mcastAddr, IPADDR_BUFFSIZE);
-    obj->mcastPort = 0;
+/* --------------------------------------------------------------------------
+ *  FormatMulticast
+ *
+ *  Render a multicast message for the log
+ *
+ *  @param  : const mcasthdr    *mchdr  [multicast message]
+ *            char              *text   [MCAST_BUFFSIZE bytes]
+ *  @return : char *            [text]
+ *
+ *  Messages travel in binary, the familiar text only exists in the log
+ * --------------------------------------------------------------------------
+ */
+static char *FormatMulticast(const mcasthdr *mchdr, char *text) {
+    char node[HOSTNAME_BUFFSIZE];
+
+    UtilIpToHostname(mchdr->node, node);
+    switch (mchdr->type) {
+    case MCAST_ROLLCALL:
+        snprintf(text, MCAST_BUFFSIZE, "<<<<<This is node %s. Tour has ended. Group members please identify yourselves.>>>>>", node);
+        break;
+    case MCAST_IDENTIFY:
+        snprintf(text, MCAST_BUFFSIZE, "<<<<<Node %s. I am a member of the group.>>>>>", node);
+        break;
+    default:
+        snprintf(text, MCAST_BUFFSIZE, "<<<<<Node %s. Roll call complete, %u members.>>>>>", node, ntohl(mchdr->members));
+        break;
+    }
+    return text;
 }
 
 /* --------------------------------------------------------------------------
  *  SendMulticast
  *
- *  Send out multicast message
+ *  Send out roll call message
  *
  *  @param  : tour_object   *obj    [tour object]
- *            char          *msg    [multicast message]
+ *            tour_session  *s      [tour session]
+ *            uchar         type    [MCAST_ROLLCALL, ...]
  *  @return : void
  *
- *  Use the multicast group information stored in tour object to send
- *  multicast message
+ *  Use the multicast group information stored in tour session to send
+ *  multicast message. A roster carries the addresses of the identified
+ *  members, as many as fit in MCAST_MAXLEN. An identification only
+ *  matters to the source collecting them, it goes there unicast to
+ *  MCAST_IDENTIFY_PORT, so a roll call of N members costs O(N) deliveries
+ *  instead of every member hearing every other
  * --------------------------------------------------------------------------
  */
-void SendMulticast(tour_object *obj, char *msg) {
+static void SendMulticast(tour_object *obj, tour_session *s, uchar type) {
     struct sockaddr_in mcastaddr;
+    uchar buff[MCAST_MAXLEN];
+    mcasthdr *mchdr = (mcasthdr *)buff;
+    char text[MCAST_BUFFSIZE];
+    uint i, count = 0;
+    uint32_t ip;
+
+    bzero(mchdr, MCAST_HDRLEN);
+    mchdr->type = type;
+    mchdr->id = htonl(s->id);
+    memcpy(mchdr->node, obj->ipaddr, IPADDR_BUFFSIZE);
+    mchdr->seq = htonl(s->mcastSeq++);
+
+    if (type == MCAST_ROSTER) {
+        mchdr->members = htonl(s->membersCount);
+        for (i = 0; i < s->membersSize && MCAST_HDRLEN + IPADDR_BUFFSIZE * (count + 1) <= MCAST_MAXLEN; i++) {
+            if (s->members[i] == 0)
+                continue;
+            ip = (uint32_t)s->members[i];
+            memcpy(buff + MCAST_HDRLEN + IPADDR_BUFFSIZE * count++, &ip, IPADDR_BUFFSIZE);
+        }
+        mchdr->count = htons(count);
+    }
 
     bzero(&mcastaddr, sizeof(mcastaddr));
     mcastaddr.sin_family = AF_INET;
-    memcpy(&mcastaddr.sin_addr, obj->mcastAddr, IPADDR_BUFFSIZE);
-    mcastaddr.sin_port = htons(obj->mcastPort);
+    if (type == MCAST_IDENTIFY) {
+        memcpy(&mcastaddr.sin_addr, s->src, IPADDR_BUFFSIZE);
+        mcastaddr.sin_port = htons(MCAST_IDENTIFY_PORT);
+    } else {
+        memcpy(&mcastaddr.sin_addr, s->grp, IPADDR_BUFFSIZE);
+        mcastaddr.sin_port = htons(s->port);
+    }
 
-    printf("[TOUR] Node %s. Sending : %s.\n", obj->hostname, msg);
-    Sendto(obj->msSockfd, msg, strlen(msg) + 1, 0, (struct sockaddr *)&mcastaddr, sizeof(mcastaddr));
+    printf("[TOUR] Node %s. Sending : %s.\n", obj->hostname, FormatMulticast(mchdr, text));
+    if (TransportSendto(obj->msSockfd, buff, MCAST_HDRLEN + IPADDR_BUFFSIZE * count, 0, (struct sockaddr *)&mcastaddr, sizeof(mcastaddr)) < 0)
+        err_sys("[TOUR] multicast sendto error");
 }
 
 /* --------------------------------------------------------------------------
@@ -127,18 +226,33 @@ void SendMulticast(tour_object *obj, char *msg) {
  *  Start multicast
  *
  *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [tour session]
  *  @return : void
  *
  *  When the last node on tour sequence reached and received a few echo
  *  replies, the node start the multicast indentification process
  * --------------------------------------------------------------------------
  */
-void StartMulticast(tour_object *obj) {
-    char msg[MCAST_BUFFSIZE];
+void StartMulticast(tour_object *obj, tour_session *s) {
+    SendMulticast(obj, s, MCAST_ROLLCALL);
+}
 
-    bzero(msg, MCAST_BUFFSIZE);
-    snprintf(msg, MCAST_BUFFSIZE, "<<<<<This is node %s. Tour has ended. Group members please identify yourselves.>>>>>", obj->hostname);
-    SendMulticast(obj, msg);
+/* --------------------------------------------------------------------------
+ *  IdentifyMember
+ *
+ *  Identify the local node to the source
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [tour session]
+ *  @return : void
+ *
+ *  Sent once per tour, when the randomized delay after the roll call
+ *  request expires
+ * --------------------------------------------------------------------------
+ */
+void IdentifyMember(tour_object *obj, tour_session *s) {
+    s->identified = 1;
+    SendMulticast(obj, s, MCAST_IDENTIFY);
 }
 
 /* --------------------------------------------------------------------------
@@ -147,52 +261,59 @@ void StartMulticast(tour_object *obj) {
  *  Process received multicast message
  *
  *  @param  : tour_object   *obj    [tour object]
+ *            int           sockfd  [UDP socket of a group, or msSockfd]
  *  @return : void
  *
- *  Process received multicast message
- *  If an identification process request has been received, start another
- *  select() to receive the multicast messages with 5 seconds timeout
- *  When timeout expires, exit the tour process
+ *  Process received multicast message, the tour ID selects the session
+ *  and the type the action:
+ *  1. MCAST_ROLLCALL: every member answers after a random delay of up to
+ *     ROLLCALL_SPREAD ms instead of all at once
+ *  2. MCAST_IDENTIFY: only the source receives them, on msSockfd. The
+ *     sender joins the member set of the session; the source knows how
+ *     many nodes the tour has and once all of them have identified it
+ *     publishes the roster
+ *  3. MCAST_ROSTER: the roll call is complete, finish the tour at once
+ *  Until then every message re-arms the MCAST_IDLE_TIME timer, which ends
+ *  the tour if the roster is lost
  * --------------------------------------------------------------------------
  */
-void ProcessMulticast(tour_object *obj) {
-    char msg[MCAST_BUFFSIZE];
-
-    int r;
-    r = Recvfrom(obj->mrSockfd, msg, MCAST_BUFFSIZE, 0, NULL, NULL);
+void ProcessMulticast(tour_object *obj, int sockfd) {
+    uchar buff[MCAST_MAXLEN];
+    mcasthdr *mchdr = (mcasthdr *)buff;
+    char text[MCAST_BUFFSIZE];
+    tour_session *s;
+    int n;
 
-    printf("[TOUR] Node %s. Received: %s.\n", obj->hostname, msg);
+    n = TransportRecvfrom(sockfd, buff, sizeof(buff), 0, NULL, NULL);
+    if (n < MCAST_HDRLEN || n < MCAST_HDRLEN + IPADDR_BUFFSIZE * ntohs(mchdr->count))
+        return;
+    if (mchdr->type < MCAST_ROLLCALL || mchdr->type > MCAST_ROSTER)
+        return;
 
+    // ignore the chatter of other tours hashed into the same group
+    if ((s = SessionFind(obj, ntohl(mchdr->id))) == NULL || s->state == TOUR_FINISHED)
+        return;
 
-    // identify request, send out multicast message
-    if (strstr(msg, "identify") != NULL) {
-        // TODO: stop pinging
-        snprintf(msg, MCAST_BUFFSIZE, "<<<<<Node %s. I am a member of the group.>>>>>", obj->hostname);
-        SendMulticast(obj, msg);
+    printf("[TOUR] Node %s. Received: %s.\n", obj->hostname, FormatMulticast(mchdr, text));
 
-        fd_set  rset;
-        FD_ZERO(&rset);
-
-        // Timeout = 5s
-        struct timeval timeout;
-        timeout.tv_sec  = 5;
-        timeout.tv_usec = 0;
-
-        // use select to receive multicast messages
-        while (1) {
-            FD_SET(obj->mrSockfd, &rset);
-            r = select(obj->mrSockfd + 1, &rset, NULL, NULL, &timeout);
-            if (r == -1 && errno == EINTR)
-                continue;
-
-            if (r == 0) {
-                // timeout, exit mcast and tour process
-                FinishTour(obj);
-                // exit mcast group // unbind?
-                break;
-            }
-            if (FD_ISSET(obj->mrSockfd, &rset))
-                ProcessMulticast(obj);
+    switch (mchdr->type) {
+    case MCAST_ROSTER:
+        SessionSetState(s, TOUR_FINISHED, 0);
+        return;
+    case MCAST_IDENTIFY:
+        if (SessionAddMember(s, mchdr->node) && s->expectedMembers != 0
+            && s->membersCount == s->expectedMembers)
+            SendMulticast(obj, s, MCAST_ROSTER);
+        break;
+    case MCAST_ROLLCALL:
+        // identify request, answer after a random delay
+        if (!s->identified && s->state != TOUR_IDENTIFYING) {
+            SessionSetState(s, TOUR_IDENTIFYING, UtilRandom(1, ROLLCALL_SPREAD));
+            return;
         }
+        break;
     }
+
+    if (s->identified)
+        SessionSetState(s, TOUR_COLLECTING, MCAST_IDLE_TIME * 1000);
 }
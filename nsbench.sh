@@ -0,0 +1,212 @@
+#!/bin/bash
+#
+# @File:    nsbench.sh
+# @Date:    2026-10-18 21:32:10
+# @Last Modified time: 2026-10-18 22:18:45
+# @Description:
+#     End-to-end benchmark of tour and ARP on one Linux host
+#     Builds N network namespaces vm1..vmN joined by veth pairs to a bridge,
+#     each with its own hosts file, host name and /tmp. arp_<user> and
+#     tour_<user> run in every namespace, vm1 starts traced tours over
+#     vm2..vmN, and the logs give tour completion, per-hop and AREQ latency.
+#     Must run as root.
+#
+# usage: nsbench.sh [-u user] [-r runs] [-t tours] [-w secs] [-o dir] nodes ... [-- tour options]
+#     nodes       namespaces of a run, one run set per count, e.g. 10 100 500
+#     -u user     binary suffix                       (default: logname)
+#     -r runs     runs per node count                 (default 3)
+#     -t tours    concurrent tours started by vm1     (default 1)
+#     -w secs     time limit of a run                 (default 60)
+#     -o dir      logs, one directory per run         (default ./nsbench.out)
+#     tour options follow "--" and are given to every tour process
+#
+
+USR=$(logname 2>/dev/null || echo "$USER")
+RUNS=3
+TOURS=1
+WAIT=60
+OUT=./nsbench.out
+BRIDGE=nsbr0
+
+while getopts "u:r:t:w:o:" c; do
+    case $c in
+    u) USR=$OPTARG ;;
+    r) RUNS=$OPTARG ;;
+    t) TOURS=$OPTARG ;;
+    w) WAIT=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) sed -n '/^# usage/,/^#$/p' "$0" | sed 's/^# \{0,1\}//'; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+COUNTS=
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    COUNTS="$COUNTS $1"
+    shift
+done
+[ "$1" = "--" ] && shift
+EXTRA="$*"
+[ -z "$COUNTS" ] && COUNTS=10
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+ARP=$BIN/arp_$USR
+TOUR=$BIN/tour_$USR
+[ -x "$ARP" ] && [ -x "$TOUR" ] || { echo "nsbench: build $ARP and $TOUR first"; exit 1; }
+[ "$(id -u)" = 0 ] || { echo "nsbench: must run as root"; exit 1; }
+mkdir -p "$OUT"
+OUT=$(cd "$OUT" && pwd)
+
+# address of node i, 250 nodes per /24 of 10.9.0.0/16
+addr() {
+    echo "10.9.$(($1 / 250 + 1)).$(($1 % 250 + 1))"
+}
+
+# ---------------------------------------------------------------------------
+#  Setup: bridge, one namespace per node, hosts file shared by all
+# ---------------------------------------------------------------------------
+setup() {
+    local n=$1 i
+
+    ip link add $BRIDGE type bridge || exit 1
+    ip link set $BRIDGE up
+
+    HOSTS=$(mktemp)
+    echo "127.0.0.1 localhost" > "$HOSTS"
+    for i in $(seq 1 "$n"); do
+        echo "$(addr "$i") vm$i" >> "$HOSTS"
+    done
+
+    for i in $(seq 1 "$n"); do
+        ip netns add vm$i
+        mkdir -p /etc/netns/vm$i
+        cp "$HOSTS" /etc/netns/vm$i/hosts
+        ip link add nsb$i type veth peer name eth0 netns vm$i
+        ip link set nsb$i master $BRIDGE up
+        ip -n vm$i addr add "$(addr "$i")/16" dev eth0
+        ip -n vm$i link set eth0 up
+        ip -n vm$i link set lo up
+    done
+    rm -f "$HOSTS"
+}
+
+teardown() {
+    local n=$1 i
+
+    for i in $(seq 1 "$n"); do
+        ip netns pids vm$i 2>/dev/null | xargs -r kill 2>/dev/null
+    done
+    sleep 0.5
+    for i in $(seq 1 "$n"); do
+        ip netns del vm$i 2>/dev/null
+        rm -rf /etc/netns/vm$i
+    done
+    ip link del $BRIDGE 2>/dev/null
+}
+
+# ---------------------------------------------------------------------------
+#  Start arp and tour in namespace i, tour arguments follow
+# ---------------------------------------------------------------------------
+start() {
+    local i=$1 dir=$2
+    shift 2
+
+    ip netns exec vm$i unshare --uts sh -c "hostname vm$i; mount -t tmpfs none /tmp; cd /;
+        $ARP > $dir/arp$i.log 2>&1 &
+        sleep 0.3;
+        exec stdbuf -oL $TOUR $EXTRA $* > $dir/tour$i.log 2>&1" &
+}
+
+# wait until <count> of the files have a line matching a regex
+# usage: await <count> <secs> <regex> files ...
+await() {
+    local want=$1 secs=$2 re=$3 end
+    shift 3
+    end=$((SECONDS + secs))
+    while [ $SECONDS -lt $end ]; do
+        [ "$(grep -lE "$re" "$@" 2>/dev/null | wc -l)" -ge "$want" ] && return 0
+        sleep 0.2
+    done
+    return 1
+}
+
+# p50 p99 max of numbers on stdin, "- - -" if none
+percentiles() {
+    sort -n | awk '{ v[NR] = $1 } END {
+        if (NR == 0) { print "- - -"; exit }
+        printf "%.0f %.0f %.0f\n", v[int((NR - 1) * 0.50) + 1], v[int((NR - 1) * 0.99) + 1], v[NR] }'
+}
+
+# packets dropped by the host backlog queues since boot
+backlog_drops() {
+    local sum=0 cpu dropped rest
+
+    while read -r cpu dropped rest; do
+        sum=$((sum + 16#$dropped))
+    done < /proc/net/softnet_stat
+    echo $sum
+}
+
+# ---------------------------------------------------------------------------
+#  One run: start the nodes, then the tours on vm1, collect the logs
+# ---------------------------------------------------------------------------
+run() {
+    local n=$1 r=$2 dir=$OUT/n$1.r$2 seq i logs end complete hop areq drops
+
+    rm -rf "$dir"
+    mkdir -p "$dir"
+    NODES=$n
+    drops=$(backlog_drops)
+    setup "$n"
+
+    for i in $(seq 2 "$n"); do
+        start "$i" "$dir"
+    done
+    logs=$(seq -f "$dir/tour%g.log" 2 "$n")
+    if [ "$n" -gt 1 ] && ! await $((n - 1)) "$WAIT" "Local link" $logs; then
+        echo "nsbench: nodes of n=$n run $r did not start"
+    fi
+
+    seq=$(seq -f "vm%g" 2 "$n" | tr '\n' ' ')
+    start 1 "$dir" -t -n "$TOURS" $seq
+
+    # the last node prints one trace summary per tour
+    end=$((SECONDS + WAIT))
+    while [ "$(grep -c "total_ns=" "$dir/tour$n.log" 2>/dev/null)" -lt "$TOURS" ] && [ $SECONDS -lt $end ]; do
+        sleep 0.2
+    done
+
+    teardown "$n"
+    wait 2>/dev/null
+    drops=$(($(backlog_drops) - drops))
+
+    complete=$(grep -h "total_ns=" "$dir/tour$n.log" | sed 's/.*total_ns=//' | percentiles)
+    # per hop: arrival at hop i to arrival at hop i+1
+    hop=$(grep -h "wire_ns=[0-9-]*[0-9]$" "$dir/tour$n.log" \
+        | sed 's/.*queue_ns=\([0-9]*\) proc_ns=\([0-9]*\) wire_ns=\([0-9-]*\)/\1 \2 \3/' \
+        | awk '{ print $1 + $2 + $3 }' | percentiles)
+    areq=$(grep -h "answered in" "$dir"/tour*.log | sed 's/.*answered in \([0-9]*\) ns.*/\1/' | percentiles)
+
+    if [ "$(grep -c "total_ns=" "$dir/tour$n.log")" -lt "$TOURS" ]; then
+        echo "nsbench: n=$n run $r incomplete, $(grep -c "total_ns=" "$dir/tour$n.log") of $TOURS tours finished"
+    fi
+    set -- $complete $hop $areq
+    printf "nodes=%d run=%d complete_p50_ns=%s complete_max_ns=%s hop_p50_ns=%s hop_p99_ns=%s hop_max_ns=%s areq_p50_ns=%s areq_p99_ns=%s areq_max_ns=%s backlog_drops=%s\n" \
+        "$n" "$r" "$1" "$3" "$4" "$5" "$6" "$7" "$8" "$9" "$drops" | tee -a "$OUT/summary"
+}
+
+# a broadcast is queued once per bridge port, the default backlog of 1000
+# packets drops ARP and tour packets from a few hundred nodes on
+BACKLOG=$(sysctl -n net.core.netdev_max_backlog)
+[ "$BACKLOG" -lt 100000 ] && sysctl -qw net.core.netdev_max_backlog=100000
+
+NODES=0
+trap 'teardown $NODES; sysctl -qw net.core.netdev_max_backlog=$BACKLOG; exit 1' INT TERM
+
+for n in $COUNTS; do
+    for r in $(seq 1 "$RUNS"); do
+        run "$n" "$r"
+    done
+done
+
+sysctl -qw net.core.netdev_max_backlog=$BACKLOG
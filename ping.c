@@ -11,11 +11,13 @@
 #include <pthread.h>
 #include <netinet/ip_icmp.h>
 #include <linux/if.h>   // struct ifreq
+#include <linux/sockios.h>      // SIOCSHWTSTAMP
+#include <linux/net_tstamp.h>   // SOF_TIMESTAMPING_*
+#include <linux/errqueue.h>     // struct sock_extended_err, scm_timestamping
 
 #define ETHHDR_LEN          14
 #define ICMP_HDRLEN         8
-#define ICMP_DATALEN        (sizeof(struct timeval))
-#define ICMP_FRAME_LEN      (ETHHDR_LEN + IP4_HDRLEN + ICMP_HDRLEN + ICMP_DATALEN)
+#define ICMP_FRAME_LEN(__datalen) (ETHHDR_LEN + IP4_HDRLEN + ICMP_HDRLEN + (__datalen))
 
 // Computing the internet checksum (RFC 1071).
 // Note that the internet checksum does not preclude collisions.
@@ -100,34 +102,6 @@ uint16_t Icmp4CheckSum(struct icmp icmphdr, uint8_t *payload, int payloadlen)
     return CheckSum((uint16_t *)buf, chksumlen);
 }
 
-// get local mac address
-int GetLocalMacAddr(int fd, struct hwaddr *hw)
-{
-    memset(hw, 0, sizeof(*hw));
-    struct ifreq ifr;
-    char interface[32] = { 0 };
-    strcpy(interface, "eth0");
-    // Use ioctl() to look up interface name and get its MAC address.
-    memset(&ifr, 0, sizeof(ifr));
-    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", interface);
-    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0)
-    {
-        perror("ioctl() failed to get source MAC address ");
-        return -1;
-    }
-
-    // Copy source MAC address.
-    memcpy(hw->sll_addr, ifr.ifr_hwaddr.sa_data, 6);
-
-    if ((hw->sll_ifindex = if_nametoindex(interface)) == 0)
-    {
-        perror("if_nametoindex() failed to obtain interface index ");
-        return -1;
-    }
-
-    return 0;
-}
-
 // build eth header
 void BuildEthHdr(uchar *eth, const uchar *srcMac, const uchar *dstMac, ushort proto)
 {
@@ -139,15 +113,14 @@ void BuildEthHdr(uchar *eth, const uchar *srcMac, const uchar *dstMac, ushort pr
 }
 
 // build ip header
-void BuildIpHdr(struct ip *iphdr, const uchar *src, const uchar *dst)
+void BuildIpHdr(struct ip *iphdr, const uchar *src, const uchar *dst, int datalen)
 {
     memset(iphdr, 0, sizeof(*iphdr));
-    int iplen = IPADDR_BUFFSIZE;
     // IPv4 header
     iphdr->ip_hl = 5;
     iphdr->ip_v = 4;
     iphdr->ip_tos = 0;
-    iphdr->ip_len = htons(IP4_HDRLEN + ICMP_HDRLEN + ICMP_DATALEN);
+    iphdr->ip_len = htons(IP4_HDRLEN + ICMP_HDRLEN + datalen);
     iphdr->ip_id = htons(TOUR_ID_CODE);
     iphdr->ip_off = htons(0);
     iphdr->ip_ttl = 255;
@@ -159,24 +132,145 @@ void BuildIpHdr(struct ip *iphdr, const uchar *src, const uchar *dst)
 }
 
 // build ICMP frame
-void BuildIcmpFrame(struct icmp *icmp, int seq)
+// the payload starts with the monotonic send time, the rest of datalen
+// is filled with a byte pattern like ping(8) does
+void BuildIcmpFrame(struct icmp *icmp, int seq, int datalen)
 {
     pid_t pid = getpid() & 0xffff;
-    memset(icmp, 0, sizeof(*icmp));
+    int i;
+    memset(icmp, 0, ICMP_HDRLEN);
     icmp->icmp_type = ICMP_ECHO;
     icmp->icmp_code = 0;
     icmp->icmp_id = pid;
     icmp->icmp_seq = htons(seq);
-    memset(icmp->icmp_data, 0, ICMP_DATALEN);
     //strcpy(icmp->icmp_data, "hello");
-    Gettimeofday((struct timeval *)icmp->icmp_data, NULL);
+    uint64_t now = UtilNowNs();
+    memcpy(icmp->icmp_data, &now, sizeof(now));
+    for (i = PING_MIN_DATALEN; i < datalen; i++)
+        icmp->icmp_data[i] = i & 0xff;
 
-    int len = 8 + ICMP_DATALEN; // checksum ICMP header and data
+    int len = ICMP_HDRLEN + datalen; // checksum ICMP header and data
     icmp->icmp_cksum = 0;
     icmp->icmp_cksum = in_cksum((uint16_t *)icmp, len);
     //icmp->icmp_cksum = icmp4_checksum(*icmp, data, ICMP_DATALEN);
 }
 
+// convert kernel timespec to nanoseconds, 0 if not stamped
+static uint64_t TimespecToNs(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// find the statistics of a target, NULL if it was never pinged
+// table->lock must be held
+static ping_target *PingFindTarget(ping_table *table, const uchar *ipaddr)
+{
+    ping_target *target = table->targets;
+
+    while (target)
+    {
+        if (memcmp(target->ipaddr, ipaddr, IPADDR_BUFFSIZE) == 0)
+            return target;
+        target = target->next;
+    }
+    return NULL;
+}
+
+// find the statistics of a target, create it if not exists; only the
+// send path creates targets
+// table->lock must be held
+static ping_target *PingGetTarget(ping_table *table, const uchar *ipaddr)
+{
+    ping_target *target = PingFindTarget(table, ipaddr);
+    int i;
+
+    if (target)
+        return target;
+
+    target = (ping_target *)Calloc(1, sizeof(ping_target));
+    memcpy(target->ipaddr, ipaddr, IPADDR_BUFFSIZE);
+    for (i = 0; i < PING_SEQ_SLOTS; i++)
+        target->stamp[i].seq = -1;
+    target->maxSeq = -1;
+    HistInit(&target->rtt);
+    target->next = table->targets;
+    table->targets = target;
+    return target;
+}
+
+// give up on probes that have been in flight for longer than
+// PING_TIMEOUT_NS: they count as expired and no longer hold a slot of the
+// flood window. The send thread runs it before every probe in both modes
+// table->lock must be held
+static void PingExpire(ping_target *target, uint64_t now)
+{
+    int i;
+    ping_stamp *stamp;
+
+    for (i = 0; i < PING_SEQ_SLOTS; i++)
+    {
+        stamp = &target->stamp[i];
+        if (stamp->seq >= 0 && !stamp->replied && now - stamp->sendNs > PING_TIMEOUT_NS)
+        {
+            stamp->seq = -1;
+            target->expired++;
+            target->outstanding--;
+        }
+    }
+}
+
+// read the TX timestamps queued on the PF_PACKET socket error queue and
+// attach them to the probes they belong to (matched by OPT_ID key)
+// table->lock must be held
+static void PingDrainTxStamps(ping_table *table, int sockfd)
+{
+    char control[256];
+    char data[1];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct scm_timestamping *tss;
+    struct sock_extended_err *serr;
+    ping_stamp *stamp;
+    int slot;
+
+    while (1)
+    {
+        iov.iov_base = data;
+        iov.iov_len = sizeof(data);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (TransportRecvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        tss = NULL;
+        serr = NULL;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+                tss = (struct scm_timestamping *)CMSG_DATA(cm);
+            else if (cm->cmsg_level == SOL_PACKET && cm->cmsg_type == PACKET_TX_TIMESTAMP)
+                serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        }
+        if (tss == NULL || serr == NULL || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+            continue;
+
+        slot = serr->ee_data % PING_TX_RING;
+        if (table->txRing[slot].target == NULL)
+            continue;
+        stamp = &table->txRing[slot].target->stamp[table->txRing[slot].seq % PING_SEQ_SLOTS];
+        if (stamp->seq != table->txRing[slot].seq)
+            continue;
+        if (TimespecToNs(&tss->ts[0]))
+            stamp->swNs = TimespecToNs(&tss->ts[0]);
+        if (TimespecToNs(&tss->ts[2]))
+            stamp->hwNs = TimespecToNs(&tss->ts[2]);
+    }
+}
+
 // Send ICMP data frame
 int SendIcmpFrame(int sockfd, int if_index, const uchar *src, void *frame, int framelen)
 {
@@ -190,153 +284,336 @@ int SendIcmpFrame(int sockfd, int if_index, const uchar *src, void *frame, int f
     sll.sll_halen = ETH_ALEN;
     memcpy(sll.sll_addr, src, 6);
 
-    return sendto(sockfd, frame, framelen, 0, (struct sockaddr *)&sll, sizeof(sll));
+    return TransportSendto(sockfd, frame, framelen, 0, (struct sockaddr *)&sll, sizeof(sll));
 }
 
 // Send ICMP echo request
-int SendIcmpRequestMsg(tour_object *obj, const uchar *dstIpAddr, const uchar *dstMacAddr, int seq)
+// frame must hold ICMP_FRAME_LEN(cfg.dataLen) bytes
+int SendIcmpRequestMsg(ping_context *ctx, uchar *frame, int seq)
 {
-    uchar frame[ICMP_FRAME_LEN] = { 0 };
+    ping_table *table = ctx->table;
+    int dataLen = table->cfg.dataLen;
+    const uchar *dstIpAddr = ctx->dstIp;
 
-    // get local mac address
-    struct hwaddr hwAddr;
-    GetLocalMacAddr(obj->pfSockfd, &hwAddr);
-
-    // build eth header
-    BuildEthHdr(frame, hwAddr.sll_addr, dstMacAddr, ETH_P_IP);
+    // build eth header, the source may be changed by PingLinkChanged
+    Pthread_mutex_lock(&ctx->lock);
+    BuildEthHdr(frame, ctx->srcMac, ctx->dstMac, ETH_P_IP);
+    int ifindex = ctx->ifindex;
+    Pthread_mutex_unlock(&ctx->lock);
 
     // build ip header
     struct ip *ipHdr = (struct ip *)(frame + ETHHDR_LEN);
-    BuildIpHdr(ipHdr, obj->ipaddr, dstIpAddr);
+    BuildIpHdr(ipHdr, ctx->srcIp, dstIpAddr, dataLen);
 
     // build ICMP frame
     struct icmp *icmpHdr = (struct icmp *)(frame + ETHHDR_LEN + IP4_HDRLEN);
-    BuildIcmpFrame(icmpHdr, seq);
+    BuildIcmpFrame(icmpHdr, seq, dataLen);
+
+    // send and register the probe under the table lock, so that the
+    // OPT_ID key of the TX timestamp maps to this probe
+    Pthread_mutex_lock(&table->lock);
+    ping_target *target = PingGetTarget(table, dstIpAddr);
+    ping_stamp *stamp = &target->stamp[seq % PING_SEQ_SLOTS];
+    if (stamp->seq >= 0 && !stamp->replied)
+    {
+        // slot reused before its reply came back, count it as lost
+        target->expired++;
+        target->outstanding--;
+    }
+    stamp->seq = seq;
+    stamp->replied = 0;
+    memcpy(&stamp->sendNs, icmpHdr->icmp_data, sizeof(stamp->sendNs));
+    stamp->swNs = 0;
+    stamp->hwNs = 0;
 
-    int n = SendIcmpFrame(obj->pfSockfd, hwAddr.sll_ifindex, dstMacAddr, frame, ICMP_FRAME_LEN);
+    int n = SendIcmpFrame(ctx->pfSockfd, ifindex, ctx->dstMac, frame, ICMP_FRAME_LEN(dataLen));
     if (n < 0)
     {
+        stamp->seq = -1;
+        Pthread_mutex_unlock(&table->lock);
         printf("[PING] Send frame error(%d) %s\n", errno, strerror(errno));
         return -1;
     }
 
-    /*
-    struct in_addr dstIn;
-    memcpy(&dstIn, dstIpAddr, IPADDR_BUFFSIZE);
-    char *ip = inet_ntoa(dstIn);
-    char mac[32] = { 0 };
-    sprintf(mac, "%.2x:%.2x:%.2x:%.2x:%.2x:%.2x",
-        dstMacAddr[0], dstMacAddr[1], dstMacAddr[2], dstMacAddr[3], dstMacAddr[4], dstMacAddr[5]);
-    printf("[PING] Send ICMP request to vm node ok, ip=%s mac=%s interface=%d bytes=%d\n",
-        ip, mac, hwAddr.sll_ifindex, n);
-    */
+    target->sent++;
+    target->outstanding++;
+    if (table->txStamping)
+    {
+        table->txRing[table->txId % PING_TX_RING].target = target;
+        table->txRing[table->txId % PING_TX_RING].seq = seq;
+        table->txId++;
+        PingDrainTxStamps(table, ctx->pfSockfd);
+    }
+    Pthread_mutex_unlock(&table->lock);
 
     return 0;
 }
 
 // Receive ICMP echo reply
+// Replies of every target arrive on the same raw socket, they are matched
+// to the probe by source address and sequence number
+// Return 0 when an echo reply is processed, -1 on error or timeout
 int RecvIcmpReplyMsg(tour_object *obj)
 {
-    char buffer[PACKET_BUFFSIZE] = {0};
+    static const char *clockName[] = { "mono", "sw", "hw" };
+    static char buffer[IP_MAXPACKET];   // only used by RecvThread
+    char control[256];
     struct sockaddr_in fromAddr;
-    int fromLen = sizeof(fromAddr);
-    int n = Recvfrom(obj->pgSockfd, buffer, PACKET_BUFFSIZE, 0, (struct sockaddr *)&fromAddr, &fromLen);
-    if (n == 0)
-        //return -1;
-        return RecvIcmpReplyMsg(obj);
-
-    // get peer ip address
-    char *fromIp = inet_ntoa(fromAddr.sin_addr);
-
-    char *p = buffer;
-    // get ip frame
-    struct ip *iphdr = (struct ip *)p;
-    if (iphdr->ip_p != IPPROTO_ICMP)
-        //return -2;  // not ICMP
-        return RecvIcmpReplyMsg(obj);
-
-    // get icmp frame
-    p += IP4_HDRLEN;
-    struct icmp *icmp = (struct icmp *)p;
-    int icmpLen = n - IP4_HDRLEN;
-    if (icmpLen < 8)
-        //return -3;  // malformed packet
-        return RecvIcmpReplyMsg(obj);
-
-    if (icmp->icmp_type == ICMP_ECHOREPLY)
+    char ip[IPSTR_BUFFSIZE];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    ping_table *table = obj->pingTable;
+
+    while (1)
     {
+        iov.iov_base = buffer;
+        iov.iov_len = sizeof(buffer);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &fromAddr;
+        msg.msg_namelen = sizeof(fromAddr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        int n = TransportRecvmsg(obj->pgSockfd, &msg, 0);
+        uint64_t recvNs = UtilNowNs();
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;  // error or SO_RCVTIMEO expired
+        }
+
+        // get ip frame
+        struct ip *iphdr = (struct ip *)buffer;
+        if (n < IP4_HDRLEN || iphdr->ip_p != IPPROTO_ICMP)
+            continue;   // not ICMP
+
+        // get icmp frame
+        struct icmp *icmp = (struct icmp *)(buffer + IP4_HDRLEN);
+        int icmpLen = n - IP4_HDRLEN;
+        if (icmpLen < ICMP_HDRLEN + PING_MIN_DATALEN)
+            continue;   // malformed packet, or not enough data to use
+
+        // If receive REQ, need to discard and recv again!
+        if (icmp->icmp_type != ICMP_ECHOREPLY)
+            continue;
+
         pid_t pid = getpid() & 0xffff;
         if (icmp->icmp_id != pid)
-            //return -4;  // not a response to our ECHO_REQUEST
-            return RecvIcmpReplyMsg(obj);
-
-        if (icmpLen < 16)
-            //return -5;  // not enough data to use
-            return RecvIcmpReplyMsg(obj);
-
-        struct timeval	*tvsend = NULL;
-        struct timeval tvrecv;
-        Gettimeofday(&tvrecv, NULL);
-        tvsend = (struct timeval *)icmp->icmp_data;
-        tv_sub(&tvrecv, tvsend);
-        double rtt = tvrecv.tv_sec * 1000.0 + tvrecv.tv_usec / 1000.0;
-
-        printf("[PING] %d bytes from %s: seq=%u, ttl=%d, rtt=%.3f ms\n",
-            icmpLen, fromIp, ntohs(icmp->icmp_seq), iphdr->ip_ttl, rtt);
+            continue;   // not a response to our ECHO_REQUEST
+
+        // kernel receive timestamps
+        uint64_t rxSw = 0, rxHw = 0;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+            {
+                struct scm_timestamping *tss = (struct scm_timestamping *)CMSG_DATA(cm);
+                rxSw = TimespecToNs(&tss->ts[0]);
+                rxHw = TimespecToNs(&tss->ts[2]);
+            }
+        }
+
+        // prefer hardware stamps, then software stamps, both taken in the
+        // kernel; fall back to the monotonic send time carried in payload
+        uint64_t sendNs;
+        memcpy(&sendNs, icmp->icmp_data, sizeof(sendNs));
+        int seq = ntohs(icmp->icmp_seq);
+        int clock = PING_CLOCK_MONO;
+        uint64_t rtt = recvNs - sendNs;
+
+        Pthread_mutex_lock(&table->lock);
+        ping_target *target = PingFindTarget(table, (uchar *)&fromAddr.sin_addr);
+        if (target == NULL)
+        {
+            // a source we never pinged, not worth a target
+            Pthread_mutex_unlock(&table->lock);
+            continue;
+        }
+        ping_stamp *stamp = &target->stamp[seq % PING_SEQ_SLOTS];
+        if (stamp->seq != seq)
+        {
+            // expired, or from a previous run; only counted for loss
+            Pthread_mutex_unlock(&table->lock);
+            continue;
+        }
+        if (stamp->replied)
+        {
+            target->duplicates++;
+            Pthread_mutex_unlock(&table->lock);
+            continue;
+        }
+        if (table->txStamping)
+            PingDrainTxStamps(table, obj->pfSockfd);
+        if (stamp->hwNs && rxHw > stamp->hwNs)
+        {
+            rtt = rxHw - stamp->hwNs;
+            clock = PING_CLOCK_HW;
+        }
+        else if (stamp->swNs && rxSw > stamp->swNs)
+        {
+            rtt = rxSw - stamp->swNs;
+            clock = PING_CLOCK_SW;
+        }
+        stamp->replied = 1;
+        target->received++;
+        target->outstanding--;
+        // sequence numbers are 16 bits on the wire, compare them mod 2^16
+        if (target->maxSeq >= 0 && (int16_t)(seq - target->maxSeq) < 0)
+            target->reordered++;
+        else
+            target->maxSeq = seq;
+        target->clockUsed[clock]++;
+        HistRecord(&target->rtt, rtt);
+        pthread_cond_broadcast(&table->replied);
+        Pthread_mutex_unlock(&table->lock);
+
+        if (!table->cfg.flood)
+            printf("[PING] %d bytes from %s: seq=%u, ttl=%d, rtt=%.3f ms (%s)\n",
+                icmpLen, UtilFormatIp((uchar *)&fromAddr.sin_addr, ip), seq, iphdr->ip_ttl, rtt / 1e6, clockName[clock]);
         return 0;
     }
-    else {
-        // If receive REQ, need to discard and recv again!
-        return RecvIcmpReplyMsg(obj);
+}
+
+// Receive work thread, one per tour process
+void *RecvThread(void *arg)
+{
+    tour_object *obj = (tour_object *)arg;
+    pthread_t tid = pthread_self();
+    Pthread_detach(tid);
+
+    while (1)
+        RecvIcmpReplyMsg(obj);
+
+    return NULL;
+}
+
+// drop one reference of the ping context, free it with the last one
+static void PingRelease(ping_context *ctx)
+{
+    Pthread_mutex_lock(&ctx->lock);
+    int refCount = --ctx->refCount;
+    Pthread_mutex_unlock(&ctx->lock);
+
+    if (refCount == 0)
+    {
+        pthread_cond_destroy(&ctx->cancel);
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx);
     }
+}
+
+// tell if the ping is cancelled; PingCancel() sets the flag under
+// ctx->lock, so it is read under the lock as well
+static int PingCancelled(ping_context *ctx)
+{
+    int cancelled;
+
+    Pthread_mutex_lock(&ctx->lock);
+    cancelled = ctx->cancelled;
+    Pthread_mutex_unlock(&ctx->lock);
+    return cancelled;
+}
 
+// sleep until the absolute CLOCK_MONOTONIC time, or until the ping is
+// cancelled. Return 1 if cancelled.
+static int PingWait(ping_context *ctx, const struct timespec *until)
+{
+    int cancelled;
+
+    Pthread_mutex_lock(&ctx->lock);
+    while (!ctx->cancelled)
+    {
+        if (pthread_cond_timedwait(&ctx->cancel, &ctx->lock, until) == ETIMEDOUT)
+            break;
+    }
+    cancelled = ctx->cancelled;
+    Pthread_mutex_unlock(&ctx->lock);
+    return cancelled;
 }
 
 // Send work thread
+// Interval mode sends on an absolute CLOCK_MONOTONIC schedule, so the time
+// spent sending does not stretch the interval. Flood mode sends as soon as
+// fewer than cfg.window probes are in flight.
+// The thread owns one reference of the context and drops it on exit.
 void *SendThread(void *arg)
 {
     pthread_t tid = pthread_self();
     Pthread_detach(tid);
 
-    char *p = (char *)arg;
-    tour_object obj;
-    uchar dstIpAddr[IPADDR_BUFFSIZE] = { 0 };
-    uchar dstMacAddr[8] = { 0 };
-
-    memcpy(&obj, p, sizeof(obj));
-    p += sizeof(obj);
-    memcpy(dstIpAddr, p, IPADDR_BUFFSIZE);
-    p += IPADDR_BUFFSIZE;
-    memcpy(dstMacAddr, p, 6);
-
-    char ip[INET_ADDRSTRLEN] = { 0 };
-    inet_ntop(AF_INET, dstIpAddr, ip, INET_ADDRSTRLEN);
-    int dataLen = ICMP_FRAME_LEN;
-    printf("[PING] %s (%.2x:%.2x:%.2x:%.2x:%.2x:%.2x): %d data bytes\n",
-        ip, dstMacAddr[0], dstMacAddr[1], dstMacAddr[2], dstMacAddr[3], dstMacAddr[4], dstMacAddr[5], dataLen);
-    int ret, count = 0;
-    while (1)
+    ping_context *ctx = (ping_context *)arg;
+    ping_table *table = ctx->table;
+    ping_config *cfg = &table->cfg;
+    uchar *frame = (uchar *)Calloc(1, ICMP_FRAME_LEN(cfg->dataLen));
+    const uchar *dstMacAddr = ctx->dstMac;
+
+    char ip[IPSTR_BUFFSIZE], mac[MACSTR_BUFFSIZE];
+    printf("[PING] %s (%s): %d data bytes%s\n",
+        UtilFormatIp(ctx->dstIp, ip), UtilFormatMac(dstMacAddr, mac), cfg->dataLen, cfg->flood ? ", flood" : "");
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    int count, seq, cancelled = 0;
+    for (count = 0; count < cfg->count && !cancelled; count++)
     {
-        if (count >= 4)
+        // reserve a sequence number, in flood mode wait for a free slot
+        // of the window first; ctx->lock nests in table->lock, never the
+        // other way round
+        Pthread_mutex_lock(&table->lock);
+        ping_target *target = PingGetTarget(table, ctx->dstIp);
+        PingExpire(target, UtilNowNs());
+        while (cfg->flood && target->outstanding >= cfg->window && !PingCancelled(ctx))
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 10000000;   // 10ms
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&table->replied, &table->lock, &deadline);
+            target = PingGetTarget(table, ctx->dstIp);
+            PingExpire(target, UtilNowNs());
+        }
+        seq = target->nextSeq;
+        target->nextSeq = (target->nextSeq + 1) & 0xffff;
+        Pthread_mutex_unlock(&table->lock);
+
+        if ((cancelled = PingCancelled(ctx)))
             break;
+
         // send a icmp echo request
-        if (SendIcmpRequestMsg(&obj, dstIpAddr, dstMacAddr, count) < 0)
+        if (SendIcmpRequestMsg(ctx, frame, seq) < 0)
         {
             printf("[PING] Send ICMP echo request error: %s\n", strerror(errno));
             break;
         }
-        count++;
-        // receive the icmp echo reply
-        ret = RecvIcmpReplyMsg(&obj);
-        if (ret == -1)
+
+        if (!cfg->flood && count + 1 < cfg->count)
         {
-            printf("[PING] Receive ICMP echo reply error: %s\n", strerror(errno));
-            break;
+            next.tv_sec += cfg->interval / 1000000;
+            next.tv_nsec += (cfg->interval % 1000000) * 1000;
+            if (next.tv_nsec >= 1000000000)
+            {
+                next.tv_sec++;
+                next.tv_nsec -= 1000000000;
+            }
+            cancelled = PingWait(ctx, &next);
         }
-        sleep(1);
     }
 
-    free(arg);
+    if (cfg->flood || cancelled)
+        printf("[PING] %s: %d probes sent%s\n", ip, count, cancelled ? ", cancelled" : " in flood mode");
+
+    free(frame);
+    PingRelease(ctx);
+    return NULL;
 }
 
 // Create a sending thread
@@ -344,12 +621,11 @@ int CreateSendThread(void *context, void * (*func)(void *))
 {
     int ret = 0;
     pthread_t tid = 0;
-    pthread_attr_t att;
 
     ret = pthread_create(&tid, NULL, func, context);
     if (ret != 0)
     {
-        printf("[PING] Create thread error, %s.\n", strerror(errno));
+        printf("[PING] Create thread error, %s.\n", strerror(ret));
         return -1;
     }
 
@@ -358,24 +634,230 @@ int CreateSendThread(void *context, void * (*func)(void *))
     return 0;
 }
 
-void Ping(tour_object *obj, const struct sockaddr_in *dstIp, const struct hwaddr *dstHw)
+void Ping(tour_object *obj, tour_session *s, const struct sockaddr_in *dstIp, const struct hwaddr *dstHw)
 {
-    uchar dstIpAddr[IPADDR_BUFFSIZE] = { 0 };
-    memcpy(dstIpAddr, &dstIp->sin_addr, IPADDR_BUFFSIZE);
-
-    int len = sizeof(*obj) + IPADDR_BUFFSIZE + 6;
-    char *context = (char *)malloc(len);
-    char *p = context;
-    memcpy(p, obj, sizeof(*obj));
-    p += sizeof(*obj);
-    memcpy(p, dstIpAddr, IPADDR_BUFFSIZE);
-    p += IPADDR_BUFFSIZE;
-    memcpy(p, dstHw->sll_addr, 6);
+    pthread_condattr_t attr;
+
+    ping_context *ctx = (ping_context *)Calloc(1, sizeof(ping_context));
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->cancel, &attr);
+    pthread_condattr_destroy(&attr);
+
+    ctx->pfSockfd = obj->pfSockfd;
+    ctx->ifindex = obj->link.ifindex;
+    memcpy(ctx->srcMac, obj->link.hwaddr, ETH_ALEN);
+    memcpy(ctx->srcIp, obj->ipaddr, IPADDR_BUFFSIZE);
+    memcpy(ctx->dstMac, dstHw->sll_addr, ETH_ALEN);
+    memcpy(ctx->dstIp, &dstIp->sin_addr, IPADDR_BUFFSIZE);
+    ctx->table = obj->pingTable;
+    ctx->session = s;
+
+    // one reference for the tour, one for the send thread
+    ctx->refCount = 2;
+    ctx->next = obj->pings;
+    obj->pings = ctx;
 
     // create a thread for sending ICMP echo
-    CreateSendThread(context, SendThread);
+    if (CreateSendThread(ctx, SendThread) < 0)
+        PingRelease(ctx);
+}
+
+void PingLinkChanged(tour_object *obj)
+{
+    ping_context *ctx;
+
+    for (ctx = obj->pings; ctx != NULL; ctx = ctx->next)
+    {
+        Pthread_mutex_lock(&ctx->lock);
+        ctx->ifindex = obj->link.ifindex;
+        memcpy(ctx->srcMac, obj->link.hwaddr, ETH_ALEN);
+        Pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+void PingCancel(tour_object *obj, tour_session *s)
+{
+    ping_context **pctx = &obj->pings, *ctx;
+
+    while ((ctx = *pctx) != NULL)
+    {
+        if (s != NULL && ctx->session != s)
+        {
+            pctx = &ctx->next;
+            continue;
+        }
+        *pctx = ctx->next;
+
+        Pthread_mutex_lock(&ctx->lock);
+        ctx->cancelled = 1;
+        pthread_cond_broadcast(&ctx->cancel);
+        Pthread_mutex_unlock(&ctx->lock);
+
+        PingRelease(ctx);
+    }
+
+    // wake up the send threads waiting for the flood window
+    Pthread_mutex_lock(&obj->pingTable->lock);
+    pthread_cond_broadcast(&obj->pingTable->replied);
+    Pthread_mutex_unlock(&obj->pingTable->lock);
+}
+
+// NIC stamping config replaced by -H, put back when the process exits
+static struct {
+    int         sockfd;                 // -1 = nothing to restore
+    struct ifreq ifr;                   // interface
+    struct hwtstamp_config saved;       // config found at start
+    struct sigaction oldInt, oldTerm;   // chained signal actions
+} hwStamp = { -1 };
+
+// put the NIC stamping config found at start back, only ioctl() so it is
+// async-signal-safe
+static void RestoreHwStamping(void)
+{
+    if (hwStamp.sockfd < 0)
+        return;
+    hwStamp.ifr.ifr_data = (void *)&hwStamp.saved;
+    ioctl(hwStamp.sockfd, SIOCSHWTSTAMP, &hwStamp.ifr);
+    hwStamp.sockfd = -1;
+}
+
+// restore on SIGINT and SIGTERM, then let the previous action run
+static void RestoreHwStampingSignal(int signo)
+{
+    RestoreHwStamping();
+    sigaction(signo, signo == SIGINT ? &hwStamp.oldInt : &hwStamp.oldTerm, NULL);
+    raise(signo);
 }
 
+// turn on NIC hardware timestamping (-H). It is a setting of the whole
+// NIC that PTP daemons may rely on: the current config is read first and
+// restored at exit, and nothing changes if it cannot be read
+static void EnableHwStamping(int sockfd, const char *ifname)
+{
+    struct hwtstamp_config cfg;
+    struct sigaction sa;
+
+    memset(&hwStamp.ifr, 0, sizeof(hwStamp.ifr));
+    snprintf(hwStamp.ifr.ifr_name, sizeof(hwStamp.ifr.ifr_name), "%s", ifname);
+    hwStamp.ifr.ifr_data = (void *)&hwStamp.saved;
+    if (ioctl(sockfd, SIOCGHWTSTAMP, &hwStamp.ifr) < 0)
+    {
+        printf("[PING] %s: hardware timestamping unavailable (%s), software stamps only\n", ifname, strerror(errno));
+        return;
+    }
 
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.tx_type = HWTSTAMP_TX_ON;
+    cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+    hwStamp.ifr.ifr_data = (void *)&cfg;
+    if (ioctl(sockfd, SIOCSHWTSTAMP, &hwStamp.ifr) < 0)
+    {
+        printf("[PING] %s: hardware timestamping not enabled (%s), software stamps only\n", ifname, strerror(errno));
+        return;
+    }
 
+    hwStamp.sockfd = sockfd;
+    atexit(RestoreHwStamping);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = RestoreHwStampingSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &hwStamp.oldInt);
+    sigaction(SIGTERM, &sa, &hwStamp.oldTerm);
+    printf("[PING] %s: hardware timestamping enabled (was tx %d, rx filter %d), restored on exit\n",
+        ifname, hwStamp.saved.tx_type, hwStamp.saved.rx_filter);
+}
 
+void PingInit(tour_object *obj, const ping_config *cfg)
+{
+    ping_table *table = (ping_table *)Calloc(1, sizeof(ping_table));
+    pthread_mutex_init(&table->lock, NULL);
+    pthread_cond_init(&table->replied, NULL);
+    obj->pingTable = table;
+
+    // the payload must fit in one frame of the interface MTU
+    int mtu = obj->link.mtu;
+
+    table->cfg = *cfg;
+    if (table->cfg.dataLen < PING_MIN_DATALEN)
+        table->cfg.dataLen = PING_MIN_DATALEN;
+    if (table->cfg.dataLen > mtu - IP4_HDRLEN - ICMP_HDRLEN)
+    {
+        table->cfg.dataLen = mtu - IP4_HDRLEN - ICMP_HDRLEN;
+        printf("[PING] Payload size limited to %d bytes by MTU %d\n", table->cfg.dataLen, mtu);
+    }
+    if (table->cfg.window < 1 || table->cfg.window > PING_WINDOW_MAX)
+        table->cfg.window = PING_WINDOW_MAX;
+
+    if (table->cfg.hwStamp)
+        EnableHwStamping(obj->pfSockfd, obj->link.ifname);
+
+    // TX stamps are reported on the error queue of the PF_PACKET socket,
+    // OPT_ID tags each of them with the send counter
+    int txFlags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE
+        | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE
+        | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    table->txStamping = TransportSetsockopt(obj->pfSockfd, SOL_SOCKET, SO_TIMESTAMPING, &txFlags, sizeof(txFlags)) == 0;
+
+    int rxFlags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE
+        | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    table->rxStamping = TransportSetsockopt(obj->pgSockfd, SOL_SOCKET, SO_TIMESTAMPING, &rxFlags, sizeof(rxFlags)) == 0;
+
+    // a lost reply must not block the ping thread forever
+    struct timeval timeout = { 1, 0 };
+    if (TransportSetsockopt(obj->pgSockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+        err_sys("[PING] setsockopt error");
+
+    printf("[PING] Kernel timestamping: tx %s, rx %s\n",
+        table->txStamping ? "on" : "off", table->rxStamping ? "on" : "off");
+
+    // a single thread receives the echo replies of all targets, so send
+    // threads never block on the receive path
+    CreateSendThread(obj, RecvThread);
+}
+
+void PingSummary(tour_object *obj)
+{
+    ping_table *table = obj->pingTable;
+    ping_target *target, *next;
+    char host[HOSTNAME_BUFFSIZE];
+    char ip[IPSTR_BUFFSIZE];
+    int learned = 0;
+
+    Pthread_mutex_lock(&table->lock);
+    target = table->targets;
+    table->targets = NULL;
+    memset(table->txRing, 0, sizeof(table->txRing));
+    Pthread_mutex_unlock(&table->lock);
+
+    while (target)
+    {
+        next = target->next;
+        memset(host, 0, sizeof(host));
+        if (UtilIpToHostname(target->ipaddr, host) < 0)
+            strcpy(host, "?");
+        UtilFormatIp(target->ipaddr, ip);
+
+        printf("[PING] --- %s (%s) ping statistics ---\n", host, ip);
+        printf("[PING] %u transmitted, %u received, %.1f%% loss, %u timed out, %u duplicates, %u reordered\n",
+            target->sent, target->received,
+            target->sent ? 100.0 * (target->sent - target->received) / target->sent : 0.0,
+            target->expired, target->duplicates, target->reordered);
+        if (target->rtt.count > 0)
+            printf("[PING] rtt min/avg/p50/p99/max = %.3f/%.3f/%.3f/%.3f/%.3f ms (hw %u, sw %u, mono %u)\n",
+                target->rtt.min / 1e6, HistMean(&target->rtt) / 1e6,
+                HistPercentile(&target->rtt, 50) / 1e6, HistPercentile(&target->rtt, 99) / 1e6,
+                target->rtt.max / 1e6, target->clockUsed[PING_CLOCK_HW],
+                target->clockUsed[PING_CLOCK_SW], target->clockUsed[PING_CLOCK_MONO]);
+        if (target->rtt.count > 0 && obj->routeFile)
+        {
+            RouteLearn(obj, obj->ipaddr, target->ipaddr, HistPercentile(&target->rtt, 50));
+            learned++;
+        }
+        free(target);
+        target = next;
+    }
+    if (learned)
+        RouteSave(obj);
+}
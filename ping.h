@@ -10,15 +10,155 @@
 #define __PING_H_
 
 #include "tour.h"
+#include "hist.h"
+
+#include <pthread.h>
+
+#define PING_TX_RING        256     // outstanding TX timestamp slots
+#define PING_SEQ_SLOTS      256     // per target probe slots, indexed by seq
+#define PING_WINDOW_MAX     PING_SEQ_SLOTS
+#define PING_TIMEOUT_NS     1000000000ULL   // probe is lost after 1s
+
+#define PING_MIN_DATALEN    8       // payload carries the monotonic send time
+#define PING_DEF_COUNT      4
+#define PING_DEF_INTERVAL   1000000 // microseconds
+#define PING_DEF_WINDOW     64      // outstanding probes in flood mode
+
+// RTT clock source of a reply
+#define PING_CLOCK_MONO     0       // CLOCK_MONOTONIC in the payload
+#define PING_CLOCK_SW       1       // kernel software timestamps
+#define PING_CLOCK_HW       2       // NIC hardware timestamps
+
+// Ping options, from the tour command line
+typedef struct ping_config_t {
+    int         count;                  // probes per target
+    uint        interval;               // microseconds between probes
+    int         dataLen;                // ICMP payload bytes
+    int         flood;                  // send as fast as the window allows
+    int         window;                 // max outstanding probes (flood)
+    int         hwStamp;                // enable NIC hardware stamping
+} ping_config;
+
+// Send stamps of one probe
+typedef struct ping_stamp_t {
+    int         seq;                    // ICMP sequence number, -1 = unused
+    int         replied;                // echo reply received
+    uint64_t    sendNs;                 // CLOCK_MONOTONIC send time
+    uint64_t    swNs;                   // kernel software TX stamp
+    uint64_t    hwNs;                   // NIC hardware TX stamp
+} ping_stamp;
+
+// Per target RTT statistics
+typedef struct ping_target_t {
+    uchar       ipaddr[IPADDR_BUFFSIZE];    // target IP address
+    uint        sent;                       // echo requests sent
+    uint        received;                   // echo replies received
+    uint        duplicates;                 // replies for answered seq
+    uint        reordered;                  // replies older than maxSeq
+    uint        expired;                    // probes timed out
+    int         outstanding;                // probes in flight
+    int         nextSeq;                    // next sequence number to send
+    int         maxSeq;                     // highest replied seq, -1 = none
+    uint        clockUsed[3];               // replies per clock source
+    ping_stamp  stamp[PING_SEQ_SLOTS];      // TX stamps, indexed by seq
+    hist        rtt;                        // RTT histogram (ns)
+    struct ping_target_t *next;
+} ping_target;
+
+// Ping statistics shared by all ping threads of a tour process
+typedef struct ping_table_t {
+    pthread_mutex_t lock;
+    pthread_cond_t  replied;            // signalled on every echo reply
+    ping_config cfg;                    // ping options
+    int         txStamping;             // SO_TIMESTAMPING on pfSockfd
+    int         rxStamping;             // SO_TIMESTAMPING on pgSockfd
+    uint        txId;                   // next SOF_TIMESTAMPING_OPT_ID key
+    struct {
+        ping_target *target;
+        int         seq;
+    } txRing[PING_TX_RING];             // OPT_ID key -> probe
+    ping_target *targets;
+} ping_table;
+
+// Ping context, shared by the tour that started the ping and the send
+// thread. It is reference counted: whoever drops the last reference frees
+// it, so the tour can be torn down while the thread is still sleeping.
+typedef struct ping_context_t {
+    pthread_mutex_t lock;
+    pthread_cond_t  cancel;             // signalled by PingCancel
+    int         refCount;               // tour + send thread
+    int         cancelled;              // stop sending
+    int         pfSockfd;               // PF_PACKET socket to send on
+    int         ifindex;                // interface index to send on
+    uchar       srcMac[ETH_ALEN];       // source MAC address
+    uchar       srcIp[IPADDR_BUFFSIZE]; // source IP address
+    uchar       dstMac[ETH_ALEN];       // target MAC address
+    uchar       dstIp[IPADDR_BUFFSIZE]; // target IP address
+    ping_table  *table;                 // statistics, process lifetime
+    tour_session *session;              // tour that started the ping
+    struct ping_context_t *next;        // next ping of the tour process
+} ping_context;
+
+/**
+* @brief Create the ping statistics, enable kernel timestamping and start
+*        the echo reply receiving thread
+* @param[in] obj    : tour object, sockets already created
+* @param[in] cfg    : ping options
+* @return NULL
+**/
+void PingInit(tour_object *obj, const ping_config *cfg);
+
+/**
+* @brief Stop every ping started by the tour, the send threads exit as soon
+*        as they wake up instead of finishing their probe count
+* @param[in] obj    : tour object
+* @param[in] s      : tour session, NULL for all tours
+* @return NULL
+**/
+void PingCancel(tour_object *obj, tour_session *s);
+
+/**
+* @brief Push the refreshed local link identity to the running pings
+* @param[in] obj    : tour object
+* @return NULL
+**/
+void PingLinkChanged(tour_object *obj);
+
+/**
+* @brief Print RTT statistics of every pinged node then reset them,
+*        the median RTTs go to the RTT matrix file if there is one
+* @param[in] obj    : tour object
+* @return NULL
+**/
+void PingSummary(tour_object *obj);
 
 /**
 * @brief Start ping the node with dstIp and dstHw
 * @param[in] obj    : tour object
+* @param[in] s      : tour session starting the ping
 * @param[in] dstIp  : destination ip address
 * @param[in] dstHw  : destination mac address
 * @return NULL
 **/
-void Ping(tour_object *obj, const struct sockaddr_in *dstIp, const struct hwaddr *dstHw);
+void Ping(tour_object *obj, tour_session *s, const struct sockaddr_in *dstIp, const struct hwaddr *dstHw);
+
+/**
+* @brief Internet checksum (RFC 1071)
+* @param[in] addr   : data, 16-bit aligned
+* @param[in] len    : data length in bytes
+* @return checksum in network order
+**/
+uint16_t CheckSum(uint16_t *addr, int len);
+
+/**
+* @brief Build the IPv4 header of an ICMP echo request, checksum included
+* @param[out] iphdr : IP header
+* @param[in] src    : source ip address
+* @param[in] dst    : destination ip address
+* @param[in] datalen: ICMP payload bytes
+* @return NULL
+**/
+void BuildIpHdr(struct ip *iphdr, const uchar *src, const uchar *dst, int datalen);
 
 #endif // __PING_H_
 
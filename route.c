@@ -0,0 +1,417 @@
+/*
+* @File:    route.c
+* @Date:    2026-10-19 18:02:37
+* @Last Modified time: 2026-10-19 19:26:14
+* @Description:
+*     RTT matrix learned from the pings and tour route optimization
+*     - uint RouteHash(const uchar *a, const uchar *b)
+*         [Hash an unordered pair of nodes into a matrix bucket]
+*     - route_rtt *RouteFind(tour_object *obj, const uchar *a, const uchar *b)
+*         [Find the RTT of a pair of nodes]
+*     + void RouteLearn(tour_object *obj, const uchar *a, const uchar *b, uint64_t rttNs)
+*         [Add an RTT measurement to the matrix]
+*     - int RouteRead(tour_object *obj, int keep)
+*         [Read the RTT matrix file]
+*     + void RouteLoad(tour_object *obj)
+*         [Load the RTT matrix file]
+*     + void RouteSave(tour_object *obj)
+*         [Write the RTT matrix file]
+*     - double RouteLength(const float *d, int m, const int *order)
+*         [Cost of a segment visited in an order]
+*     - void RouteNearest(const float *d, int m, int *order)
+*         [Nearest neighbour order of a segment]
+*     - void RouteTwoOpt(const float *d, int m, int *order)
+*         [Improve the order of a segment by 2-opt moves]
+*     - double RouteSegment(tour_object *obj, char *ipSeq, char *nodeSeq, int first, int last, double fallback, double *before)
+*         [Reorder the free hops between two fixed hops]
+*     + void RouteOptimize(tour_object *obj, const uchar *fixed)
+*         [Reorder the intermediate hops of the tour sequence]
+*/
+
+#include "tour.h"
+
+/* --------------------------------------------------------------------------
+ *  RouteHash
+ *
+ *  Hash an unordered pair of nodes into a matrix bucket
+ *
+ *  @param  : const uchar   *a      [node address]
+ *            const uchar   *b      [node address]
+ *  @return : uint          [bucket, the same for (a, b) and (b, a)]
+ * --------------------------------------------------------------------------
+ */
+static uint RouteHash(const uchar *a, const uchar *b) {
+    uint32_t x, y;
+
+    memcpy(&x, a, IPADDR_BUFFSIZE);
+    memcpy(&y, b, IPADDR_BUFFSIZE);
+    return ((x ^ y) * 2654435761U + (x + y)) % ROUTE_HASH_SIZE;
+}
+
+/* --------------------------------------------------------------------------
+ *  RouteFind
+ *
+ *  Find the RTT of a pair of nodes
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            const uchar   *a      [node address]
+ *            const uchar   *b      [node address]
+ *  @return : route_rtt     *       [NULL if never measured]
+ * --------------------------------------------------------------------------
+ */
+static route_rtt *RouteFind(tour_object *obj, const uchar *a, const uchar *b) {
+    route_rtt *r;
+
+    for (r = obj->routes[RouteHash(a, b)]; r != NULL; r = r->next)
+        if ((memcmp(r->a, a, IPADDR_BUFFSIZE) == 0 && memcmp(r->b, b, IPADDR_BUFFSIZE) == 0)
+            || (memcmp(r->a, b, IPADDR_BUFFSIZE) == 0 && memcmp(r->b, a, IPADDR_BUFFSIZE) == 0))
+            return r;
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  RouteLearn
+ *
+ *  Add an RTT measurement to the matrix
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            const uchar   *a      [node that pinged]
+ *            const uchar   *b      [node pinged]
+ *            uint64_t      rttNs   [median RTT of the ping, ns]
+ *  @return : void
+ *
+ *  RTTs are taken as symmetric. A known pair keeps 3/4 of its RTT and
+ *  takes 1/4 of the new one, so one slow ping does not move it far
+ * --------------------------------------------------------------------------
+ */
+void RouteLearn(tour_object *obj, const uchar *a, const uchar *b, uint64_t rttNs) {
+    route_rtt *r;
+    uint h;
+
+    if (memcmp(a, b, IPADDR_BUFFSIZE) == 0)
+        return;
+    if ((r = RouteFind(obj, a, b)) != NULL) {
+        r->rttNs = (3 * r->rttNs + rttNs) / 4;
+        r->samples++;
+        return;
+    }
+
+    h = RouteHash(a, b);
+    r = Calloc(1, sizeof(route_rtt));
+    memcpy(r->a, a, IPADDR_BUFFSIZE);
+    memcpy(r->b, b, IPADDR_BUFFSIZE);
+    r->rttNs = rttNs;
+    r->samples = 1;
+    r->next = obj->routes[h];
+    obj->routes[h] = r;
+    obj->routeCount++;
+}
+
+/* --------------------------------------------------------------------------
+ *  RouteRead
+ *
+ *  Read the RTT matrix file
+ *
+ *  @param  : tour_object   *obj    [tour object, routeFile set]
+ *            int           keep    [1: pairs already known keep their RTT]
+ *  @return : int           [0, -1 if there is no file]
+ *
+ *  One pair per line: <address> <address> <RTT ns> <samples>, lines
+ *  starting with # are ignored
+ * --------------------------------------------------------------------------
+ */
+static int RouteRead(tour_object *obj, int keep) {
+    char line[128], ipA[IPSTR_BUFFSIZE], ipB[IPSTR_BUFFSIZE];
+    uchar a[IPADDR_BUFFSIZE], b[IPADDR_BUFFSIZE];
+    unsigned long long rtt;
+    route_rtt *r;
+    uint samples;
+    FILE *fp;
+
+    if ((fp = fopen(obj->routeFile, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%15s %15s %llu %u", ipA, ipB, &rtt, &samples) != 4)
+            continue;
+        if (inet_pton(AF_INET, ipA, a) != 1 || inet_pton(AF_INET, ipB, b) != 1)
+            continue;
+        if ((r = RouteFind(obj, a, b)) != NULL && keep)
+            continue;
+        // the file has the smoothed RTT already
+        if (r == NULL) {
+            RouteLearn(obj, a, b, rtt);
+            r = RouteFind(obj, a, b);
+        }
+        if (r != NULL) {
+            r->rttNs = rtt;
+            r->samples = samples;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  RouteLoad
+ *
+ *  Load the RTT matrix file
+ *
+ *  @param  : tour_object   *obj    [tour object, routeFile set]
+ *  @return : void
+ *
+ *  A missing file is an empty matrix, the first tour of a cluster has
+ *  nothing to learn from
+ * --------------------------------------------------------------------------
+ */
+void RouteLoad(tour_object *obj) {
+    if (RouteRead(obj, 0) == 0)
+        printf("[TOUR] RTT matrix %s: %u pairs.\n", obj->routeFile, obj->routeCount);
+}
+
+/* --------------------------------------------------------------------------
+ *  RouteSave
+ *
+ *  Write the RTT matrix file
+ *
+ *  @param  : tour_object   *obj    [tour object, routeFile set]
+ *  @return : void
+ *
+ *  Pairs other nodes saved since the file was loaded are merged first, in
+ *  case the file is shared. It is written aside and renamed over the old
+ *  one, a reader never sees half of it
+ * --------------------------------------------------------------------------
+ */
+void RouteSave(tour_object *obj) {
+    char *path = Malloc(strlen(obj->routeFile) + 16), ipA[IPSTR_BUFFSIZE], ipB[IPSTR_BUFFSIZE];
+    route_rtt *r;
+    FILE *fp;
+    int i;
+
+    RouteRead(obj, 1);
+    sprintf(path, "%s.%d", obj->routeFile, (int)getpid());
+    if ((fp = fopen(path, "w")) == NULL) {
+        printf("[TOUR] Cannot write the RTT matrix %s: %s.\n", path, strerror(errno));
+        free(path);
+        return;
+    }
+    fprintf(fp, "# node node rtt_ns samples\n");
+    for (i = 0; i < ROUTE_HASH_SIZE; i++)
+        for (r = obj->routes[i]; r != NULL; r = r->next)
+            fprintf(fp, "%s %s %llu %u\n", UtilFormatIp(r->a, ipA), UtilFormatIp(r->b, ipB),
+                (unsigned long long)r->rttNs, r->samples);
+    if (fclose(fp) != 0 || rename(path, obj->routeFile) < 0)
+        printf("[TOUR] Cannot write the RTT matrix %s: %s.\n", obj->routeFile, strerror(errno));
+    else
+        printf("[TOUR] RTT matrix %s: %u pairs saved.\n", obj->routeFile, obj->routeCount);
+    free(path);
+}
+
+/* --------------------------------------------------------------------------
+ *  RouteLength
+ *
+ *  Cost of a segment visited in an order
+ *
+ *  @param  : const float   *d      [m x m costs]
+ *            int           m       [nodes of the segment]
+ *            const int     *order  [visit order]
+ *  @return : double        [sum of the costs of consecutive nodes]
+ * --------------------------------------------------------------------------
+ */
+static double RouteLength(const float *d, int m, const int *order) {
+    double length = 0;
+    int i;
+
+    for (i = 0; i + 1 < m; i++)
+        length += d[order[i] * m + order[i + 1]];
+    return length;
+}
+
+/* --------------------------------------------------------------------------
+ *  RouteNearest
+ *
+ *  Nearest neighbour order of a segment
+ *
+ *  @param  : const float   *d      [m x m costs]
+ *            int           m       [nodes, 0 and m - 1 are the fixed ends]
+ *            int           *order  [visit order, filled]
+ *  @return : void
+ *
+ *  From the first end, go to the closest node not visited yet
+ * --------------------------------------------------------------------------
+ */
+static void RouteNearest(const float *d, int m, int *order) {
+    uchar *used = Calloc(m, 1);
+    int i, j, best;
+
+    order[0] = 0;
+    order[m - 1] = m - 1;
+    for (i = 1; i < m - 1; i++) {
+        best = -1;
+        for (j = 1; j < m - 1; j++)
+            if (!used[j] && (best < 0 || d[order[i - 1] * m + j] < d[order[i - 1] * m + best]))
+                best = j;
+        order[i] = best;
+        used[best] = 1;
+    }
+    free(used);
+}
+
+/* --------------------------------------------------------------------------
+ *  RouteTwoOpt
+ *
+ *  Improve the order of a segment by 2-opt moves
+ *
+ *  @param  : const float   *d      [m x m costs]
+ *            int           m       [nodes, 0 and m - 1 are the fixed ends]
+ *            int           *order  [visit order, improved in place]
+ *  @return : void
+ *
+ *  Reverse order[i..k] whenever that makes the segment shorter, until a
+ *  pass finds nothing or after ROUTE_PASSES passes. The ends never move
+ * --------------------------------------------------------------------------
+ */
+static void RouteTwoOpt(const float *d, int m, int *order) {
+    int pass, improved, i, k, t;
+    double delta;
+
+    for (pass = 0; pass < ROUTE_PASSES; pass++) {
+        improved = 0;
+        for (i = 1; i < m - 2; i++) {
+            for (k = i + 1; k < m - 1; k++) {
+                delta = d[order[i - 1] * m + order[k]] + d[order[i] * m + order[k + 1]]
+                      - d[order[i - 1] * m + order[i]] - d[order[k] * m + order[k + 1]];
+                if (delta >= -1e-3)
+                    continue;
+                for (t = 0; t < (k - i + 1) / 2; t++) {
+                    int swap = order[i + t];
+                    order[i + t] = order[k - t];
+                    order[k - t] = swap;
+                }
+                improved = 1;
+            }
+        }
+        if (!improved)
+            break;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  RouteSegment
+ *
+ *  Reorder the free hops between two fixed hops
+ *
+ *  @param  : tour_object   *obj        [tour object]
+ *            char          *ipSeq      [IP sequence, reordered in place]
+ *            char          *nodeSeq    [node sequence, reordered alike]
+ *            int           first       [fixed hop]
+ *            int           last        [next fixed hop]
+ *            double        fallback    [cost of a pair never measured]
+ *            double        *before     [cost in the given order, added]
+ *  @return : double        [cost in the new order]
+ *
+ *  Costs are the RTTs in ns, the same node twice costs nothing. A segment
+ *  of more than ROUTE_MAX_HOPS free hops keeps its order
+ * --------------------------------------------------------------------------
+ */
+static double RouteSegment(tour_object *obj, char *ipSeq, char *nodeSeq, int first, int last, double fallback, double *before) {
+    int m = last - first + 1, i, j, *order;
+    char *ipTmp, *nodeTmp;
+    double given, after;
+    route_rtt *r;
+    float *d;
+
+    d = Malloc(sizeof(float) * m * m);
+    for (i = 0; i < m; i++) {
+        d[i * m + i] = 0;
+        for (j = i + 1; j < m; j++) {
+            if (memcmp(IP_SEQ(ipSeq, first + i), IP_SEQ(ipSeq, first + j), IPADDR_BUFFSIZE) == 0)
+                d[i * m + j] = 0;
+            else if ((r = RouteFind(obj, (uchar *)IP_SEQ(ipSeq, first + i), (uchar *)IP_SEQ(ipSeq, first + j))) != NULL)
+                d[i * m + j] = r->rttNs;
+            else
+                d[i * m + j] = fallback;
+            d[j * m + i] = d[i * m + j];
+        }
+    }
+
+    order = Malloc(sizeof(int) * m);
+    for (i = 0; i < m; i++)
+        order[i] = i;
+    given = RouteLength(d, m, order);
+    *before += given;
+    if (m - 2 > ROUTE_MAX_HOPS) {
+        printf("[TOUR] %d hops between fixed hops %d and %d, over %d: order kept.\n", m - 2, first, last, ROUTE_MAX_HOPS);
+    } else if (m > 3) {
+        RouteNearest(d, m, order);
+        RouteTwoOpt(d, m, order);
+        // the heuristics may still lose to the given order
+        if (RouteLength(d, m, order) >= given)
+            for (i = 0; i < m; i++)
+                order[i] = i;
+    }
+    after = RouteLength(d, m, order);
+
+    ipTmp = Malloc(IPADDR_BUFFSIZE * m);
+    nodeTmp = Malloc(HOSTNAME_BUFFSIZE * m);
+    memcpy(ipTmp, IP_SEQ(ipSeq, first), IPADDR_BUFFSIZE * m);
+    memcpy(nodeTmp, NODE_SEQ(nodeSeq, first), HOSTNAME_BUFFSIZE * m);
+    for (i = 0; i < m; i++) {
+        memcpy(IP_SEQ(ipSeq, first + i), IP_SEQ(ipTmp, order[i]), IPADDR_BUFFSIZE);
+        memcpy(NODE_SEQ(nodeSeq, first + i), NODE_SEQ(nodeTmp, order[i]), HOSTNAME_BUFFSIZE);
+    }
+    free(ipTmp);
+    free(nodeTmp);
+    free(order);
+    free(d);
+    return after;
+}
+
+/* --------------------------------------------------------------------------
+ *  RouteOptimize
+ *
+ *  Reorder the intermediate hops of the tour sequence
+ *
+ *  @param  : tour_object   *obj    [tour object, sequence parsed]
+ *            const uchar   *fixed  [1 for the hops that keep their place]
+ *  @return : void
+ *
+ *  The source, the last hop and the fixed hops stay, the hops between two
+ *  of them are ordered by nearest neighbour then 2-opt on the RTT matrix.
+ *  A pair never measured costs the mean of the measured ones. Hops that
+ *  end up next to themselves are merged, as on the command line
+ * --------------------------------------------------------------------------
+ */
+void RouteOptimize(tour_object *obj, const uchar *fixed) {
+    double fallback = 0, before = 0, after = 0;
+    route_rtt *r;
+    int i, j, first;
+
+    if (obj->routeCount == 0) {
+        printf("[TOUR] No RTT measured yet, the tour keeps the given order.\n");
+        return;
+    }
+    for (i = 0; i < ROUTE_HASH_SIZE; i++)
+        for (r = obj->routes[i]; r != NULL; r = r->next)
+            fallback += r->rttNs;
+    fallback /= obj->routeCount;
+
+    first = 0;
+    for (i = 1; i < obj->seqLength; i++) {
+        if (i < obj->seqLength - 1 && !fixed[i])
+            continue;
+        after += RouteSegment(obj, obj->ipSeq, obj->nodeSeq, first, i, fallback, &before);
+        first = i;
+    }
+
+    for (i = j = 1; i < obj->seqLength; i++) {
+        if (strcmp(NODE_SEQ(obj->nodeSeq, j - 1), NODE_SEQ(obj->nodeSeq, i)) == 0)
+            continue;
+        memmove(NODE_SEQ(obj->nodeSeq, j), NODE_SEQ(obj->nodeSeq, i), HOSTNAME_BUFFSIZE);
+        memmove(IP_SEQ(obj->ipSeq, j), IP_SEQ(obj->ipSeq, i), IPADDR_BUFFSIZE);
+        j++;
+    }
+    obj->seqLength = j;
+
+    printf("[TOUR] Route optimized on %u measured pairs: RTT sum %.3f ms -> %.3f ms.\n",
+        obj->routeCount, before / 1e6, after / 1e6);
+}
@@ -0,0 +1,246 @@
+/*
+* @File:    segment.c
+* @Date:    2026-10-18 19:21:37
+* @Last Modified time: 2026-10-18 20:02:55
+* @Description:
+*     Tour segment codec
+*     + int SegmentEncode(tourhdr *rthdr, const char *ipSeq, int seqLength, uint base, uint hopCount)
+*         [Encode a window of a tour sequence behind the tour header]
+*     + uint SegmentWindow(const char *ipSeq, int seqLength, uint base, int budget)
+*         [Largest window starting at a hop that fits in a budget]
+*     + int SegmentCheck(const tourhdr *rthdr, int length)
+*         [Validate a received tour segment]
+*     + uint SegmentLength(const tourhdr *rthdr)
+*         [Length of the dictionary and hop list]
+*     + uint SegmentHopIndex(const tourhdr *rthdr, uint hop)
+*         [Dictionary index of a carried hop]
+*     + uchar *SegmentHop(tourhdr *rthdr, uint hop)
+*         [IP address of a carried hop]
+*/
+
+#include "tour.h"
+
+#define SEGMENT_NODES(__rthdr) ((uchar *)(__rthdr) + TOUR_HDRLEN)
+#define SEGMENT_HOPS(__rthdr) (SEGMENT_NODES(__rthdr) + IPADDR_BUFFSIZE * ntohs((__rthdr)->nodeCount))
+
+/* --------------------------------------------------------------------------
+ *  SegmentEncode
+ *
+ *  Encode a window of a tour sequence behind the tour header
+ *
+ *  @param  : tourhdr   *rthdr      [tour header, payload follows]
+ *            const char *ipSeq     [IP address sequence]
+ *            int       seqLength   [sequence length]
+ *            uint      base        [first hop of the window]
+ *            uint      hopCount    [hops of the window]
+ *  @return : int       [payload length after the header, -1 if the window
+ *                       has more than TOUR_MAX_NODES unique nodes]
+ *
+ *  Fill version, hopWidth, seqLength, nodeCount, base and hopCount of the
+ *  header, then the dictionary of unique nodes and one dictionary index
+ *  per hop. A window of up to 256 unique nodes costs 1 byte per hop,
+ *  otherwise 2 bytes.
+ *  rthdr may be NULL to only compute the length.
+ * --------------------------------------------------------------------------
+ */
+int SegmentEncode(tourhdr *rthdr, const char *ipSeq, int seqLength, uint base, uint hopCount) {
+    uint size, mask, h, *slot, i, nodeCount = 0;
+    ushort *index = Calloc(hopCount, sizeof(ushort));
+    uchar *nodes, *hops;
+    uint32_t ip;
+
+    ipSeq += IPADDR_BUFFSIZE * base;
+
+    // open addressing table from IP address to its first hop + 1
+    for (size = 16; size < 2 * hopCount; size <<= 1)
+        ;
+    mask = size - 1;
+    slot = Calloc(size, sizeof(uint));
+
+    for (i = 0; i < hopCount; i++) {
+        memcpy(&ip, IP_SEQ(ipSeq, i), IPADDR_BUFFSIZE);
+        for (h = (ip * 2654435761U) & mask; slot[h] != 0; h = (h + 1) & mask)
+            if (memcmp(IP_SEQ(ipSeq, i), IP_SEQ(ipSeq, slot[h] - 1), IPADDR_BUFFSIZE) == 0)
+                break;
+        if (slot[h] != 0) {
+            index[i] = index[slot[h] - 1];
+            continue;
+        }
+        if (nodeCount == TOUR_MAX_NODES) {
+            free(slot);
+            free(index);
+            return -1;
+        }
+        slot[h] = i + 1;
+        index[i] = nodeCount++;
+    }
+    free(slot);
+
+    size = IPADDR_BUFFSIZE * nodeCount + hopCount * (nodeCount > 256 ? 2 : 1);
+    if (rthdr == NULL) {
+        free(index);
+        return size;
+    }
+
+    rthdr->version = TOUR_VERSION;
+    rthdr->hopWidth = (nodeCount > 256) ? 2 : 1;
+    rthdr->seqLength = htonl(seqLength);
+    rthdr->nodeCount = htons(nodeCount);
+    rthdr->flags = 0;
+    rthdr->base = htonl(base);
+    rthdr->hopCount = htonl(hopCount);
+
+    nodes = SEGMENT_NODES(rthdr);
+    hops = SEGMENT_HOPS(rthdr);
+    for (i = 0; i < hopCount; i++) {
+        memcpy(nodes + IPADDR_BUFFSIZE * index[i], IP_SEQ(ipSeq, i), IPADDR_BUFFSIZE);
+        if (rthdr->hopWidth == 1) {
+            hops[i] = (uchar)index[i];
+        } else {
+            hops[2 * i] = index[i] >> 8;
+            hops[2 * i + 1] = index[i] & 0xff;
+        }
+    }
+    free(index);
+    return size;
+}
+
+/* --------------------------------------------------------------------------
+ *  SegmentWindow
+ *
+ *  Largest window starting at a hop that fits in a budget
+ *
+ *  @param  : const char *ipSeq     [IP address sequence]
+ *            int       seqLength   [sequence length]
+ *            uint      base        [first hop of the window]
+ *            int       budget      [bytes available after the header]
+ *  @return : uint      [hops of the window, 0 if not even two hops fit]
+ *
+ *  Start from TOUR_WINDOW hops and halve until the encoding fits. The
+ *  window needs at least the current and the next hop
+ * --------------------------------------------------------------------------
+ */
+uint SegmentWindow(const char *ipSeq, int seqLength, uint base, int budget) {
+    uint hopCount = min(TOUR_WINDOW, seqLength - base);
+    int size;
+
+    while (hopCount >= 2) {
+        size = SegmentEncode(NULL, ipSeq, seqLength, base, hopCount);
+        if (size >= 0 && size <= budget)
+            return hopCount;
+        hopCount /= 2;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  SegmentCheck
+ *
+ *  Validate a received tour segment
+ *
+ *  @param  : const tourhdr *rthdr  [tour header]
+ *            int           length  [received bytes from the tour header on]
+ *  @return : int           [0 if valid, -1 if not]
+ *
+ *  Check the version and that dictionary, hop list, every hop index and
+ *  the trace section lie inside the received bytes, so decoding never
+ *  reads past them.
+ *  The window must carry the current hop; a window request, a stream ack
+ *  or a hop ack carries none.
+ *  The branch of a scattered tour must be one of its branches
+ * --------------------------------------------------------------------------
+ */
+int SegmentCheck(const tourhdr *rthdr, int length) {
+    uint seqLength, nodeCount, base, hopCount, index, i;
+
+    if (length < TOUR_HDRLEN || rthdr->version != TOUR_VERSION)
+        return -1;
+    if (rthdr->type == TOUR_WINDOW_REQ || rthdr->type == TOUR_STREAM_ACK || rthdr->type == TOUR_HOP_ACK)
+        return 0;
+    if (rthdr->type != TOUR_ROUTE && rthdr->type != TOUR_WINDOW_REP)
+        return -1;
+    if (rthdr->branches > TOUR_MAX_BRANCHES || (rthdr->branches && rthdr->branch >= rthdr->branches))
+        return -1;
+    if (rthdr->hopWidth != 1 && rthdr->hopWidth != 2)
+        return -1;
+
+    seqLength = ntohl(rthdr->seqLength);
+    nodeCount = ntohs(rthdr->nodeCount);
+    base = ntohl(rthdr->base);
+    hopCount = ntohl(rthdr->hopCount);
+    index = ntohl(rthdr->index);
+    if (nodeCount == 0 || hopCount == 0 || index >= seqLength)
+        return -1;
+    if (index < base || index - base >= hopCount || hopCount > seqLength - base)
+        return -1;
+    if ((uint64_t)TOUR_HDRLEN + IPADDR_BUFFSIZE * nodeCount
+        + (uint64_t)hopCount * rthdr->hopWidth > (uint)length)
+        return -1;
+
+    for (i = base; i < base + hopCount; i++)
+        if (SegmentHopIndex(rthdr, i) >= nodeCount)
+            return -1;
+
+    if (rthdr->flags & TOUR_FLAG_TRACE) {
+        const tracehdr *trhdr = (const tracehdr *)((const uchar *)rthdr + TOUR_HDRLEN + SegmentLength(rthdr));
+        ushort count;
+
+        if (TOUR_HDRLEN + SegmentLength(rthdr) + TRACE_HDRLEN > (uint)length)
+            return -1;
+        memcpy(&count, &trhdr->count, sizeof(count));
+        if (ntohs(count) > TRACE_MAX || TOUR_HDRLEN + SegmentLength(rthdr) + TRACE_HDRLEN
+            + TRACE_RECLEN * ntohs(count) > (uint)length)
+            return -1;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  SegmentLength
+ *
+ *  Length of the dictionary and hop list
+ *
+ *  @param  : const tourhdr *rthdr  [tour header]
+ *  @return : uint          [bytes between the tour header and the trace]
+ * --------------------------------------------------------------------------
+ */
+uint SegmentLength(const tourhdr *rthdr) {
+    return IPADDR_BUFFSIZE * ntohs(rthdr->nodeCount) + ntohl(rthdr->hopCount) * rthdr->hopWidth;
+}
+
+/* --------------------------------------------------------------------------
+ *  SegmentHopIndex
+ *
+ *  Dictionary index of a carried hop
+ *
+ *  @param  : const tourhdr *rthdr  [tour header]
+ *            uint          hop     [hop number, base <= hop < base + hopCount]
+ *  @return : uint          [index into the node dictionary]
+ *
+ *  Two hops of a window visit the same node if and only if their indices
+ *  are equal
+ * --------------------------------------------------------------------------
+ */
+uint SegmentHopIndex(const tourhdr *rthdr, uint hop) {
+    const uchar *hops = SEGMENT_HOPS(rthdr);
+
+    hop -= ntohl(rthdr->base);
+
+    if (rthdr->hopWidth == 1)
+        return hops[hop];
+    return (hops[2 * hop] << 8) | hops[2 * hop + 1];
+}
+
+/* --------------------------------------------------------------------------
+ *  SegmentHop
+ *
+ *  IP address of a carried hop
+ *
+ *  @param  : tourhdr   *rthdr  [tour header]
+ *            uint      hop     [hop number, base <= hop < base + hopCount]
+ *  @return : uchar     *       [IPADDR_BUFFSIZE bytes inside the segment]
+ * --------------------------------------------------------------------------
+ */
+uchar *SegmentHop(tourhdr *rthdr, uint hop) {
+    return SEGMENT_NODES(rthdr) + IPADDR_BUFFSIZE * SegmentHopIndex(rthdr, hop);
+}
@@ -0,0 +1,771 @@
+/*
+* @File:    session.c
+* @Date:    2026-10-18 18:20:41
+* @Last Modified time: 2026-10-18 19:05:13
+* @Description:
+*     Tour session table, state machine and timers
+*     + uint32_t SessionNewId(tour_object *obj)
+*         [Generate the ID of a tour started by the local node]
+*     - int SessionGroupUsers(tour_object *obj, int sockfd)
+*         [Count the sessions using a multicast group socket]
+*     + tour_session *SessionFind(tour_object *obj, uint32_t id)
+*         [Find the session of a tour]
+*     + tour_session *SessionFindGroup(tour_object *obj, const uchar *grp, int port)
+*         [Find a session using a multicast group]
+*     + tour_session *SessionCreate(tour_object *obj, uint32_t id, uchar *grp, int port)
+*         [Create the session of a newly seen tour]
+*     + void SessionDestroy(tour_object *obj, tour_session *s)
+*         [Remove a session and its pending ARP requests]
+*     + void SessionSetState(tour_session *s, tour_state state, uint delay)
+*         [Move a session to a new state and arm its timer]
+*     - int SessionSetAdd(uint64_t **set, uint *size, uint *count, uint64_t key)
+*         [Add a key to an open addressing set]
+*     + int SessionVisit(tour_session *s, const uchar *prev, const uchar *self)
+*         [Record a (preceding node, local node) edge of a tour]
+*     + int SessionAddMember(tour_session *s, const uchar *ipaddr)
+*         [Record a node that identified itself in the roll call]
+*     + int SessionReceive(tour_session *s, const tourhdr *rthdr)
+*         [Record a tour packet received by the local hop]
+*     + int SessionEnded(tour_object *obj, uint32_t id)
+*         [Tell if a hop-acked tour ended here recently]
+*     + void SessionExpectMembers(tour_session *s)
+*         [Count the group members of a tour started by the local node]
+*     + void SessionScatter(tour_session *s, const char *ipSeq, int seqLength, int branches)
+*         [Lay out the branches of a scattered tour]
+*     + uint SessionBranchEnd(tour_session *s, uint hop, uchar *branch)
+*         [Find the branch of a hop of the source sequence]
+*     + int SessionGather(tour_session *s, const tourhdr *rthdr)
+*         [Record a branch reaching the gather node]
+*     + void SessionStartAreq(tour_object *obj, tour_session *s, struct sockaddr_in *preceding)
+*         [Ask the ARP service for a preceding node without blocking]
+*     + int SessionFdSet(tour_object *obj, fd_set *rset, int maxfd)
+*         [Add the multicast and pending ARP sockets to a select() set]
+*     + void SessionProcessAreqs(tour_object *obj, fd_set *rset)
+*         [Ping the preceding nodes whose ARP response arrived]
+*     + void SessionProcessMulticast(tour_object *obj, fd_set *rset)
+*         [Read the multicast groups with pending datagrams]
+*     + struct timeval *SessionNextTimeout(tour_object *obj, struct timeval *tv)
+*         [Time left until the earliest timer]
+*     + void SessionRunTimers(tour_object *obj)
+*         [Fire the expired timers]
+*/
+
+#include "tour.h"
+#include "ping.h"
+
+#define SESSION_HASH(__id) (((__id) * 2654435761U) % SESSION_HASH_SIZE)
+
+/* --------------------------------------------------------------------------
+ *  SessionNewId
+ *
+ *  Generate the ID of a tour started by the local node
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *  @return : uint32_t      [tour ID]
+ *
+ *  The high 16 bits are the low 16 bits of the node IP address, the low
+ *  16 bits a per-process counter starting at a random value, so tours
+ *  started by different nodes of a /16 never share an ID
+ * --------------------------------------------------------------------------
+ */
+uint32_t SessionNewId(tour_object *obj) {
+    if (obj->nextTourId == 0)
+        obj->nextTourId = (uint32_t)(UtilNowNs() ^ getpid()) | 1;
+    return ((uint32_t)obj->ipaddr[2] << 24) | ((uint32_t)obj->ipaddr[3] << 16)
+        | (obj->nextTourId++ & 0xffff);
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionGroupUsers
+ *
+ *  Count the sessions using a multicast group socket
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            int           sockfd  [receiving UDP socket of the group]
+ *  @return : int           [number of sessions]
+ * --------------------------------------------------------------------------
+ */
+static int SessionGroupUsers(tour_object *obj, int sockfd) {
+    tour_session *s;
+    int i, n = 0;
+
+    for (i = 0; i < SESSION_HASH_SIZE; i++)
+        for (s = obj->sessions[i]; s != NULL; s = s->next)
+            if (s->mrSockfd == sockfd)
+                n++;
+    return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionFind
+ *
+ *  Find the session of a tour
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            uint32_t      id      [tour ID]
+ *  @return : tour_session  *       [session, NULL if not found]
+ * --------------------------------------------------------------------------
+ */
+tour_session *SessionFind(tour_object *obj, uint32_t id) {
+    tour_session *s;
+
+    for (s = obj->sessions[SESSION_HASH(id)]; s != NULL; s = s->next)
+        if (s->id == id)
+            return s;
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionFindGroup
+ *
+ *  Find a session using a multicast group
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            const uchar   *grp    [multicast group address]
+ *            int           port    [multicast port number, 0 = any]
+ *  @return : tour_session  *       [session, NULL if the group is unused]
+ * --------------------------------------------------------------------------
+ */
+tour_session *SessionFindGroup(tour_object *obj, const uchar *grp, int port) {
+    tour_session *s;
+    int i;
+
+    for (i = 0; i < SESSION_HASH_SIZE; i++)
+        for (s = obj->sessions[i]; s != NULL; s = s->next)
+            if ((port == 0 || s->port == port) && memcmp(s->grp, grp, IPADDR_BUFFSIZE) == 0)
+                return s;
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionCreate
+ *
+ *  Create the session of a newly seen tour
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            uint32_t      id      [tour ID]
+ *            uchar         *grp    [multicast group address]
+ *            int           port    [multicast port number]
+ *  @return : tour_session  *       [new session, NULL if refused]
+ *
+ *  Join the multicast group of the tour unless another session already
+ *  did, in which case its receiving socket is shared. A socket select()
+ *  cannot watch, FD_SETSIZE or above, refuses the tour. The session starts
+ *  traversing, for TOUR_IDLE_TIME unless another packet of the tour comes
+ * --------------------------------------------------------------------------
+ */
+tour_session *SessionCreate(tour_object *obj, uint32_t id, uchar *grp, int port) {
+    tour_session *s = Calloc(1, sizeof(tour_session));
+    tour_session **bucket = &obj->sessions[SESSION_HASH(id)];
+    tour_session *g;
+
+    if ((g = SessionFindGroup(obj, grp, port)) != NULL) {
+        s->mrSockfd = g->mrSockfd;
+    } else if ((s->mrSockfd = JoinMulticastGroup(obj, grp, port)) >= FD_SETSIZE) {
+        printf("[TOUR] tour %08x refused, descriptor %d is past FD_SETSIZE.\n", id, s->mrSockfd);
+        LeaveMulticastGroup(obj, s->mrSockfd, grp, port);
+        free(s);
+        return NULL;
+    }
+
+    s->id = id;
+    memcpy(s->grp, grp, IPADDR_BUFFSIZE);
+    s->port = port;
+    SessionSetState(s, TOUR_TRAVERSING, TOUR_IDLE_TIME * 1000);
+    s->next = *bucket;
+    *bucket = s;
+    obj->sessionCount++;
+    return s;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionDestroy
+ *
+ *  Remove a session and its pending ARP requests
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [session]
+ *  @return : void
+ *
+ *  Leave the multicast group once no other session uses it. Packets of
+ *  the tour not acknowledged by their hop are given up. A hop-acked tour
+ *  leaves its ID in the ring of ended tours, see SessionEnded()
+ * --------------------------------------------------------------------------
+ */
+void SessionDestroy(tour_object *obj, tour_session *s) {
+    tour_session **ps;
+    tour_areq **pa, *a;
+    tour_hop **ph, *h;
+
+    for (pa = &obj->areqs; *pa != NULL; ) {
+        a = *pa;
+        if (a->session == s) {
+            *pa = a->next;
+            close(a->sockfd);
+            free(a);
+        } else {
+            pa = &a->next;
+        }
+    }
+
+    for (ph = &obj->hops; *ph != NULL; ) {
+        h = *ph;
+        if (h->session == s) {
+            *ph = h->next;
+            free(h->packet);
+            free(h);
+        } else {
+            ph = &h->next;
+        }
+    }
+
+    for (ps = &obj->sessions[SESSION_HASH(s->id)]; *ps != NULL; ps = &(*ps)->next) {
+        if (*ps == s) {
+            *ps = s->next;
+            obj->sessionCount--;
+            break;
+        }
+    }
+
+    if (s->hopAck) {
+        obj->ended[obj->endedNext] = s->id;
+        obj->endedAt[obj->endedNext] = UtilNowNs();
+        obj->endedNext = (obj->endedNext + 1) % HOP_ENDED_TOURS;
+    }
+
+    if (SessionGroupUsers(obj, s->mrSockfd) == 0)
+        LeaveMulticastGroup(obj, s->mrSockfd, s->grp, s->port);
+    if (s->ipSeq)
+        free(s->ipSeq);
+    if (s->visited)
+        free(s->visited);
+    if (s->received)
+        free(s->received);
+    if (s->members)
+        free(s->members);
+    if (s->trace)
+        free(s->trace);
+    if (s->branchEnd)
+        free(s->branchEnd);
+    if (s->streamAcked)
+        free(s->streamAcked);
+    if (s->streamSent)
+        free(s->streamSent);
+    if (s->streamPacket)
+        free(s->streamPacket);
+    free(s);
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionSetState
+ *
+ *  Move a session to a new state and arm its timer
+ *
+ *  @param  : tour_session  *s      [session]
+ *            tour_state    state   [new state]
+ *            uint          delay   [timer in milliseconds, 0 = no timer]
+ *  @return : void
+ *
+ *  TOUR_FINISHED always fires at once, so a tour can be finished from a
+ *  socket handler and reaped by SessionRunTimers()
+ * --------------------------------------------------------------------------
+ */
+void SessionSetState(tour_session *s, tour_state state, uint delay) {
+    s->state = state;
+    s->deadline = delay ? UtilNowNs() + (uint64_t)delay * 1000000ULL : 0;
+    if (state == TOUR_FINISHED)
+        s->deadline = UtilNowNs();
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionSetAdd
+ *
+ *  Add a key to an open addressing set
+ *
+ *  @param  : uint64_t  **set   [slots, grown as needed]
+ *            uint      *size   [slots, power of 2]
+ *            uint      *count  [keys]
+ *            uint64_t  key     [key, not 0]
+ *  @return : int       [1 if the key was in the set, 0 if added]
+ *
+ *  The set doubles at half load, so lookups stay O(1)
+ * --------------------------------------------------------------------------
+ */
+static int SessionSetAdd(uint64_t **set, uint *size, uint *count, uint64_t key) {
+    uint64_t *old;
+    uint i, h, oldSize;
+
+    if (2 * (*count + 1) > *size) {
+        old = *set;
+        oldSize = *size;
+        *size = oldSize ? 2 * oldSize : 16;
+        *set = Calloc(*size, sizeof(uint64_t));
+        *count = 0;
+        for (i = 0; i < oldSize; i++)
+            if (old[i] != 0)
+                SessionSetAdd(set, size, count, old[i]);
+        if (old)
+            free(old);
+    }
+
+    for (h = (key * 0x9e3779b97f4a7c15ULL) >> 32 & (*size - 1); (*set)[h] != 0; h = (h + 1) & (*size - 1))
+        if ((*set)[h] == key)
+            return 1;
+    (*set)[h] = key;
+    (*count)++;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionVisit
+ *
+ *  Record a (preceding node, local node) edge of a tour
+ *
+ *  @param  : tour_session  *s      [session]
+ *            const uchar   *prev   [preceding node address]
+ *            const uchar   *self   [local hop address]
+ *  @return : int           [1 if the edge was recorded before, 0 if new]
+ *
+ *  The edges live in a set of 64-bit keys owned by the session, so the
+ *  check is O(1) and does not need the history of the tour in the packet
+ * --------------------------------------------------------------------------
+ */
+int SessionVisit(tour_session *s, const uchar *prev, const uchar *self) {
+    uint32_t a, b;
+
+    memcpy(&a, prev, IPADDR_BUFFSIZE);
+    memcpy(&b, self, IPADDR_BUFFSIZE);
+    // never 0, 0.0.0.0 is not a node
+    return SessionSetAdd(&s->visited, &s->visitedSize, &s->visitedCount, ((uint64_t)a << 32) | b);
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionAddMember
+ *
+ *  Record a node that identified itself in the roll call
+ *
+ *  @param  : tour_session  *s      [session]
+ *            const uchar   *ipaddr [member address]
+ *  @return : int           [1 if the member is new, 0 if heard before]
+ * --------------------------------------------------------------------------
+ */
+int SessionAddMember(tour_session *s, const uchar *ipaddr) {
+    uint32_t a;
+
+    memcpy(&a, ipaddr, IPADDR_BUFFSIZE);
+    return !SessionSetAdd(&s->members, &s->membersSize, &s->membersCount, (uint64_t)a);
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionReceive
+ *
+ *  Record a tour packet received by the local hop
+ *
+ *  @param  : tour_session  *s      [session]
+ *            tourhdr       *rthdr  [received tour packet]
+ *  @return : int           [1 if the packet was received before, 0 if new]
+ *
+ *  A packet is its hop and, in a stream, its tour; with the session that
+ *  keys it by tour ID and index. A hop resent because its ack was lost
+ *  is processed once
+ * --------------------------------------------------------------------------
+ */
+int SessionReceive(tour_session *s, const tourhdr *rthdr) {
+    // never 0, index + 1 is not
+    return SessionSetAdd(&s->received, &s->receivedSize, &s->receivedCount,
+        ((uint64_t)ntohl(rthdr->seq) << 32) | ((uint64_t)ntohl(rthdr->index) + 1));
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionEnded
+ *
+ *  Tell if a hop-acked tour ended here recently
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            uint32_t      id      [tour ID without a session]
+ *  @return : int           [1 if it ended less than HOP_ENDED_TIME ago]
+ *
+ *  The preceding node resends a packet until its ack arrives, long after
+ *  this hop may have finished the tour; such a packet must not start the
+ *  tour over. The last HOP_ENDED_TOURS ended tours are kept in a ring,
+ *  only looked up for a packet without a session
+ * --------------------------------------------------------------------------
+ */
+int SessionEnded(tour_object *obj, uint32_t id) {
+    uint64_t now = UtilNowNs();
+    uint i;
+
+    for (i = 0; i < HOP_ENDED_TOURS; i++)
+        if (obj->endedAt[i] != 0 && obj->ended[i] == id
+            && now - obj->endedAt[i] < HOP_ENDED_TIME * 1000000000ULL)
+            return 1;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionExpectMembers
+ *
+ *  Count the group members of a tour started by the local node
+ *
+ *  @param  : tour_session  *s      [session, ipSeq is set]
+ *  @return : void
+ *
+ *  Every node of the sequence joins the group, so the members are the
+ *  unique nodes of the sequence. The source collects the roll call and
+ *  publishes the roster once all of them have identified
+ * --------------------------------------------------------------------------
+ */
+void SessionExpectMembers(tour_session *s) {
+    uint64_t *set = NULL;
+    uint size = 0, count = 0;
+    uint32_t a;
+    int i;
+
+    for (i = 0; i < s->seqLength; i++) {
+        memcpy(&a, IP_SEQ(s->ipSeq, i), IPADDR_BUFFSIZE);
+        SessionSetAdd(&set, &size, &count, (uint64_t)a);
+    }
+    if (set)
+        free(set);
+    s->expectedMembers = count;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionScatter
+ *
+ *  Lay out the branches of a scattered tour
+ *
+ *  @param  : tour_session  *s          [session of the source]
+ *            const char    *ipSeq      [tour sequence]
+ *            int           seqLength   [hops, the last one gathers]
+ *            int           branches    [branches wanted]
+ *  @return : void
+ *
+ *  The hops between the source and the last node are cut into branches
+ *  of consecutive hops, as even as they can be, at most one per hop. The
+ *  session sequence has them one after the other, each as source, its
+ *  hops, last node; branchEnd keeps the hop of the last node of each
+ * --------------------------------------------------------------------------
+ */
+void SessionScatter(tour_session *s, const char *ipSeq, int seqLength, int branches) {
+    int middle = seqLength - 2, k, size, from = 1, hop = 0;
+
+    branches = min(min(branches, middle), TOUR_MAX_BRANCHES);
+    if (branches < 2) {
+        s->seqLength = seqLength;
+        s->ipSeq = Malloc(IPADDR_BUFFSIZE * seqLength);
+        memcpy(s->ipSeq, ipSeq, IPADDR_BUFFSIZE * seqLength);
+        return;
+    }
+
+    s->branches = branches;
+    s->branchEnd = Malloc(sizeof(uint) * branches);
+    s->seqLength = middle + 2 * branches;
+    s->ipSeq = Malloc(IPADDR_BUFFSIZE * s->seqLength);
+    for (k = 0; k < branches; k++) {
+        size = middle / branches + (k < middle % branches);
+        memcpy(IP_SEQ(s->ipSeq, hop), IP_SEQ(ipSeq, 0), IPADDR_BUFFSIZE);
+        memcpy(IP_SEQ(s->ipSeq, hop + 1), IP_SEQ(ipSeq, from), IPADDR_BUFFSIZE * size);
+        hop += size + 1;
+        from += size;
+        memcpy(IP_SEQ(s->ipSeq, hop), IP_SEQ(ipSeq, seqLength - 1), IPADDR_BUFFSIZE);
+        s->branchEnd[k] = hop++;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionBranchEnd
+ *
+ *  Find the branch of a hop of the source sequence
+ *
+ *  @param  : tour_session  *s      [session of the source]
+ *            uint          hop     [hop of the session sequence]
+ *            uchar         *branch [branch of the hop, 0 if not scattered]
+ *  @return : uint          [hop of the gather node ending the branch]
+ * --------------------------------------------------------------------------
+ */
+uint SessionBranchEnd(tour_session *s, uint hop, uchar *branch) {
+    int k;
+
+    *branch = 0;
+    for (k = 0; k < s->branches; k++) {
+        if (hop <= s->branchEnd[k]) {
+            *branch = k;
+            return s->branchEnd[k];
+        }
+    }
+    return s->seqLength - 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionGather
+ *
+ *  Record a branch reaching the gather node
+ *
+ *  @param  : tour_session  *s      [session of the gather node]
+ *            tourhdr       *rthdr  [tour packet at the end of its branch]
+ *  @return : int           [1 once every branch has arrived]
+ *
+ *  A tour that is not scattered has arrived with its only packet. A
+ *  branch arriving twice counts once, SegmentCheck() bounds the branch
+ * --------------------------------------------------------------------------
+ */
+int SessionGather(tour_session *s, const tourhdr *rthdr) {
+    uint64_t bit = 1ULL << rthdr->branch;
+    int k, count = 0;
+
+    if (rthdr->branches < 2)
+        return 1;
+    if (s->gathered & bit)
+        return 0;
+    s->gathered |= bit;
+    for (k = 0; k < rthdr->branches; k++)
+        count += (s->gathered >> k) & 1;
+    printf("[TOUR] tour %08x branch %u of %u gathered, %d of %u arrived.\n",
+        s->id, rthdr->branch + 1, rthdr->branches, count, rthdr->branches);
+    return count == rthdr->branches;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionStartAreq
+ *
+ *  Ask the ARP service for a preceding node without blocking
+ *
+ *  @param  : tour_object           *obj        [tour object]
+ *            tour_session          *s          [session]
+ *            struct sockaddr_in    *preceding  [node to ping]
+ *  @return : void
+ *
+ *  The request waits in obj->areqs until its response arrives or
+ *  AREQ_TIMEOUT seconds pass
+ * --------------------------------------------------------------------------
+ */
+void SessionStartAreq(tour_object *obj, tour_session *s, struct sockaddr_in *preceding) {
+    tour_areq *a;
+    int sockfd;
+
+    if ((sockfd = AreqSend((struct sockaddr *)preceding, sizeof(*preceding))) < 0)
+        return;
+    if (sockfd >= FD_SETSIZE) {
+        // select() cannot watch it
+        printf("[AREQ] descriptor %d is past FD_SETSIZE, preceding node not pinged.\n", sockfd);
+        close(sockfd);
+        return;
+    }
+
+    a = Calloc(1, sizeof(tour_areq));
+    a->sockfd = sockfd;
+    memcpy(&a->preceding, preceding, sizeof(*preceding));
+    a->sent = UtilNowNs();
+    a->deadline = a->sent + AREQ_TIMEOUT * 1000000000ULL;
+    a->session = s;
+    a->next = obj->areqs;
+    obj->areqs = a;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionFdSet
+ *
+ *  Add the multicast and pending ARP sockets to a select() set
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            fd_set        *rset   [read set]
+ *            int           maxfd   [largest descriptor so far]
+ *  @return : int           [largest descriptor in the set]
+ * --------------------------------------------------------------------------
+ */
+int SessionFdSet(tour_object *obj, fd_set *rset, int maxfd) {
+    tour_session *s;
+    tour_areq *a;
+    int i;
+
+    for (i = 0; i < SESSION_HASH_SIZE; i++) {
+        for (s = obj->sessions[i]; s != NULL; s = s->next) {
+            FD_SET(s->mrSockfd, rset);
+            maxfd = max(maxfd, s->mrSockfd);
+        }
+    }
+    for (a = obj->areqs; a != NULL; a = a->next) {
+        FD_SET(a->sockfd, rset);
+        maxfd = max(maxfd, a->sockfd);
+    }
+    return maxfd;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionProcessAreqs
+ *
+ *  Ping the preceding nodes whose ARP response arrived
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            fd_set        *rset   [read set returned by select()]
+ *  @return : void
+ *
+ *  The time from request to response is logged for benchmarks
+ * --------------------------------------------------------------------------
+ */
+void SessionProcessAreqs(tour_object *obj, fd_set *rset) {
+    tour_areq **pa, *a;
+    struct hwaddr HWaddr;
+    char ip[IPSTR_BUFFSIZE];
+
+    for (pa = &obj->areqs; *pa != NULL; ) {
+        a = *pa;
+        if (!FD_ISSET(a->sockfd, rset)) {
+            pa = &a->next;
+            continue;
+        }
+        *pa = a->next;
+
+        bzero(&HWaddr, sizeof(struct hwaddr));
+        if (AreqRecv(a->sockfd, (struct sockaddr *)&a->preceding, &HWaddr) > 0) {
+            printf("[AREQ] AREQ \"%s\" answered in %llu ns.\n", UtilFormatIp((uchar *)&a->preceding.sin_addr, ip),
+                (unsigned long long)(UtilNowNs() - a->sent));
+            Ping(obj, a->session, &a->preceding, &HWaddr);
+        }
+        free(a);
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionProcessMulticast
+ *
+ *  Read the multicast groups with pending datagrams
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            fd_set        *rset   [read set returned by select()]
+ *  @return : void
+ *
+ *  A socket shared by several sessions is read once
+ * --------------------------------------------------------------------------
+ */
+void SessionProcessMulticast(tour_object *obj, fd_set *rset) {
+    tour_session *s;
+    int i;
+
+    for (i = 0; i < SESSION_HASH_SIZE; i++) {
+        for (s = obj->sessions[i]; s != NULL; s = s->next) {
+            if (FD_ISSET(s->mrSockfd, rset)) {
+                FD_CLR(s->mrSockfd, rset);
+                ProcessMulticast(obj, s->mrSockfd);
+            }
+        }
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionNextTimeout
+ *
+ *  Time left until the earliest timer
+ *
+ *  @param  : tour_object       *obj    [tour object]
+ *            struct timeval    *tv     [select() timeout to fill]
+ *  @return : struct timeval    *       [tv, NULL if no timer is armed]
+ * --------------------------------------------------------------------------
+ */
+struct timeval *SessionNextTimeout(tour_object *obj, struct timeval *tv) {
+    tour_session *s;
+    tour_areq *a;
+    tour_hop *h;
+    uint64_t next = 0, now;
+    int i;
+
+    for (i = 0; i < SESSION_HASH_SIZE; i++)
+        for (s = obj->sessions[i]; s != NULL; s = s->next)
+            if (s->deadline && (next == 0 || s->deadline < next))
+                next = s->deadline;
+    for (a = obj->areqs; a != NULL; a = a->next)
+        if (next == 0 || a->deadline < next)
+            next = a->deadline;
+    for (h = obj->hops; h != NULL; h = h->next)
+        if (next == 0 || h->deadline < next)
+            next = h->deadline;
+
+    if (next == 0)
+        return NULL;
+
+    now = UtilNowNs();
+    next = (next > now) ? next - now : 0;
+    tv->tv_sec = next / 1000000000ULL;
+    tv->tv_usec = (next % 1000000000ULL) / 1000;
+    return tv;
+}
+
+/* --------------------------------------------------------------------------
+ *  SessionRunTimers
+ *
+ *  Fire the expired timers
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *  @return : void
+ *
+ *  TOUR_TRAVERSING  -> the tour was lost downstream, finish it
+ *  TOUR_AWAIT_WINDOW -> request the window again
+ *  TOUR_STREAMING   -> give up the stream tours older than the RTO
+ *  TOUR_AWAIT_PING  -> start the roll call
+ *  TOUR_IDENTIFYING -> identify the local node
+ *  TOUR_COLLECTING  -> roll call is silent, finish the tour
+ *  TOUR_FINISHED    -> roster received, finish the tour
+ *  Pending ARP requests past AREQ_TIMEOUT are dropped, hops past their RTO
+ *  resent, see HopRunTimers()
+ * --------------------------------------------------------------------------
+ */
+void SessionRunTimers(tour_object *obj) {
+    tour_session *s, *next;
+    tour_areq **pa, *a;
+    uint64_t now = UtilNowNs();
+    int i;
+
+    for (pa = &obj->areqs; *pa != NULL; ) {
+        a = *pa;
+        if (a->deadline > now) {
+            pa = &a->next;
+            continue;
+        }
+        *pa = a->next;
+        printf("[AREQ] AREQ timeout.\n");
+        close(a->sockfd);
+        free(a);
+    }
+    HopRunTimers(obj);
+
+    for (i = 0; i < SESSION_HASH_SIZE; i++) {
+        for (s = obj->sessions[i]; s != NULL; s = next) {
+            next = s->next;
+            if (s->deadline == 0 || s->deadline > now)
+                continue;
+            s->deadline = 0;
+
+            switch (s->state) {
+            case TOUR_TRAVERSING:
+                printf("[TOUR] tour %08x idle for %d s, no roll call came.\n", s->id, TOUR_IDLE_TIME);
+                s->state = TOUR_FINISHED;
+                FinishTour(obj, s);
+                break;
+            case TOUR_AWAIT_WINDOW:
+                RequestWindow(obj, s);
+                break;
+            case TOUR_STREAMING:
+                StreamTimeout(obj, s);
+                break;
+            case TOUR_AWAIT_PING:
+                StartMulticast(obj, s);
+                SessionSetState(s, TOUR_COLLECTING, MCAST_IDLE_TIME * 1000);
+                break;
+            case TOUR_IDENTIFYING:
+                IdentifyMember(obj, s);
+                SessionSetState(s, TOUR_COLLECTING, MCAST_IDLE_TIME * 1000);
+                break;
+            case TOUR_COLLECTING:
+                s->state = TOUR_FINISHED;
+                FinishTour(obj, s);
+                break;
+            case TOUR_FINISHED:
+                FinishTour(obj, s);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,1769 @@
+/*
+* @File:    sim.c
+* @Date:    2026-10-19 12:21:05
+* @Last Modified time: 2026-10-19 15:02:48
+* @Description:
+*     Discrete-event simulation of tour and ARP nodes, tour side
+*     - void SimNodeIp(int node, uchar *ipaddr)
+*         [Address of a node]
+*     - int SimIpNode(const uchar *ipaddr)
+*         [Node of an address]
+*     - void SimNodeMac(int node, uchar *hwaddr)
+*         [MAC address of a node]
+*     - int SimMacNode(const uchar *hwaddr)
+*         [Node of a MAC address]
+*     - void SimPush(uint64_t time, int type, int node, int sockfd, uint64_t arg, sim_packet *pkt, sim_ping *ping)
+*         [Schedule an event]
+*     - int SimPop(sim_event *ev)
+*         [Take the earliest event]
+*     - uint64_t SimDelay()
+*         [One way delay of a packet]
+*     - int SimLost()
+*         [Draw the loss of a packet]
+*     - sim_packet *SimPacket(const void *buf, size_t len)
+*         [Copy a sent packet]
+*     - void SimRelease(sim_packet *pkt)
+*         [Drop the reference of an event to its packet]
+*     - void SimPingRelease(int node, sim_ping *p)
+*         [Drop the reference of an event to its ping]
+*     - void SimUnicast(int type, int node, const void *buf, size_t len)
+*         [Send a packet to one node]
+*     - int SimFdOpen(sim_node *n, int kind)
+*         [Allocate the lowest free descriptor of a node]
+*     - sim_fd *SimFd(sim_node *n, int sockfd)
+*         [Find an open descriptor of a node]
+*     - int SimFdClose(int sockfd)
+*         [Close a descriptor of the running node]
+*     - sim_group *SimGroup(uint32_t grp, int port, int create)
+*         [Find a multicast group]
+*     - void SimArm(int node, uint64_t deadline)
+*         [Make sure a timer event fires by deadline]
+*     - void SimArmNext(int node)
+*         [Arm the earliest session timer of a node]
+*     - void SimSessions(int node, int before)
+*         [Account the sessions created or ended by a handler]
+*     + void TransportInit(int mode, const char *path)
+*         [Nothing to select, the simulator is the transport]
+*     + void TransportStart(int ifindex)
+*         [Nothing to start]
+*     + int TransportSocket(int family, int type, int protocol)
+*         [Refuse real sockets]
+*     + int TransportSetsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen)
+*         [Accept every option]
+*     + ssize_t TransportSendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen)
+*         [Put a packet on the virtual segment]
+*     + ssize_t TransportRecvmsg(int sockfd, struct msghdr *msg, int flags)
+*         [Receive the packet being delivered]
+*     + ssize_t TransportRecvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen)
+*         [Receive the packet being delivered]
+*     + uint64_t __wrap_UtilNowNs()
+*         [Virtual clock]
+*     + void __wrap_UtilTime(char *timestr)
+*         [Virtual time for the log]
+*     + int __wrap_UtilIpToHostname(const uchar *ipaddr, char *hostname)
+*         [Name of a node address]
+*     + int __wrap_UtilHostnameToIp(const char *hostname, uchar *ipaddr)
+*         [Address of a node name]
+*     + int __wrap_JoinMulticastGroup(tour_object *obj, uchar *grp, int port)
+*         [Join a virtual multicast group]
+*     + void __wrap_LeaveMulticastGroup(tour_object *obj, int sockfd, uchar *grp, int port)
+*         [Leave a virtual multicast group]
+*     + int __wrap_AreqSend(struct sockaddr *IPaddr, socklen_t sockaddrlen)
+*         [Connect to the ARP service of the node]
+*     + int __wrap_AreqRecv(int sockfd, struct sockaddr *IPaddr, struct hwaddr *HWaddr)
+*         [Read the response of an AREQ]
+*     + int __wrap_Accept(int fd, SA *sa, socklen_t *salenptr)
+*         [ARP side of AreqSend]
+*     + ssize_t __wrap_Read(int fd, void *ptr, size_t nbytes)
+*         [ARP reads the requested address]
+*     + void __wrap_Write(int fd, void *ptr, size_t nbytes)
+*         [ARP writes the response]
+*     + void __wrap_Close(int fd)
+*         [Close a descriptor of ARP or of the groups]
+*     + int __wrap_close(int fd)
+*         [Close a descriptor of the tour]
+*     + void PingInit(tour_object *obj, const ping_config *cfg)
+*         [Nothing to set up, pings are events]
+*     + void PingLinkChanged(tour_object *obj)
+*         [The link of a node never changes]
+*     + void PingSummary(tour_object *obj)
+*         [Statistics are summed by the simulator]
+*     + void PingCancel(tour_object *obj, tour_session *s)
+*         [Stop the pings of a tour]
+*     + void Ping(tour_object *obj, tour_session *s, const struct sockaddr_in *dstIp, const struct hwaddr *dstHw)
+*         [Start pinging a node]
+*     - void SimDeliverTour(sim_event *ev)
+*         [A tour packet reaches a node]
+*     - void SimDeliverFrame(sim_event *ev)
+*         [An ARP frame reaches one or every node]
+*     - void SimDeliverMulticast(sim_event *ev)
+*         [A multicast datagram reaches the members of its group]
+*     - void SimDeliverIdentify(sim_event *ev)
+*         [An identification reaches the source of its tour]
+*     - void SimTimer(sim_event *ev)
+*         [Run the expired timers of a node]
+*     - void SimAreqReady(sim_event *ev)
+*         [The response of an AREQ is readable]
+*     - void SimProbe(sim_event *ev)
+*         [Send a probe and schedule its reply]
+*     - void SimReply(sim_event *ev)
+*         [An echo reply reaches the pinging node]
+*     - void SimNodeInit(int node)
+*         [Bring up a node]
+*     - void SimParseOptions(int argc, char **argv)
+*         [Parse the command line options]
+*     - void SimReport(uint64_t wallNs)
+*         [Print the results]
+*     + int main(int argc, char **argv)
+*         [Entry function]
+*/
+
+#include "tour.h"
+#include "ping.h"
+#include "sim.h"
+
+#define SIM_GROUP_HASH      1024    // buckets of the multicast group table
+
+// event types
+#define SIM_EV_TOUR         1   // tour packet reaches a node
+#define SIM_EV_FRAME        2   // ARP frame reaches a node, node 0 = broadcast
+#define SIM_EV_MCAST        3   // multicast datagram reaches its group
+#define SIM_EV_TIMER        4   // session timer of a node
+#define SIM_EV_AREQ         5   // ARP response readable on an AREQ socket
+#define SIM_EV_PROBE        6   // ping sends a probe
+#define SIM_EV_REPLY        7   // echo reply reaches the pinging node
+#define SIM_EV_IDENTIFY     8   // unicast identification reaches the source
+
+// virtual descriptors
+#define SIM_VFD_FREE        0
+#define SIM_VFD_GROUP       1   // multicast receiving socket
+#define SIM_VFD_CLIENT      2   // AREQ socket of the tour
+#define SIM_VFD_SERVER      3   // AREQ connection accepted by ARP
+
+// Packet in flight, shared by the events delivering it
+typedef struct sim_packet_t {
+    int     refCount;               /* Events holding it        */
+    int     length;                 /* Bytes                    */
+    int     from;                   /* Sending node             */
+    uchar   data[];                 /* Packet or frame          */
+} sim_packet;
+
+// AREQ connection between the tour and the ARP service of a node
+typedef struct sim_areq_t {
+    uchar   ipaddr[IPADDR_BUFFSIZE];    /* Requested address    */
+    struct hwaddr HWaddr;               /* Response             */
+    int     answered;                   /* HWaddr written       */
+    int     client;                     /* Tour end, -1 closed  */
+    int     server;                     /* ARP end, -1 closed   */
+} sim_areq;
+
+// Virtual descriptor of a node
+typedef struct sim_fd_t {
+    int     kind;                   /* SIM_VFD_GROUP, ...       */
+    sim_areq *areq;                 /* AREQ connection          */
+} sim_fd;
+
+// Ping of a preceding node, one probe event at a time
+typedef struct sim_ping_t {
+    tour_session *session;          /* Tour that started it     */
+    int     target;                 /* Pinged node              */
+    int     remaining;              /* Probes left to send      */
+    int     cancelled;              /* Set by PingCancel        */
+    int     refCount;               /* Queued probes, replies   */
+    struct sim_ping_t *next;        /* next ping of the node    */
+} sim_ping;
+
+// Simulated node, the tour and ARP objects of one host
+typedef struct sim_node_t {
+    tour_object tour;               /* Tour of the node         */
+    void    *arp;                   /* ARP service, simarp.c    */
+    uint64_t timerAt;               /* Armed timer event, 0 = none */
+    sim_fd  *fds;                   /* Descriptors from SIM_FD_DYN */
+    int     fdCount;                /* Descriptor slots         */
+    sim_ping *pings;                /* Pings in progress        */
+} sim_node;
+
+// Multicast group, the receiving sockets bound to one address and port
+typedef struct sim_group_t {
+    uint32_t grp;                   /* Group, network order     */
+    int     port;                   /* Port                     */
+    struct {
+        int node;
+        int sockfd;
+    } *members;                     /* Receiving sockets        */
+    int     count;                  /* Members                  */
+    int     size;                   /* Member slots             */
+    struct sim_group_t *next;       /* next in hash bucket      */
+} sim_group;
+
+// Event, ordered by time then by scheduling order
+typedef struct sim_event_t {
+    uint64_t time;                  /* Virtual ns               */
+    uint64_t seq;                   /* Scheduling order         */
+    int     type;                   /* SIM_EV_TOUR, ...         */
+    int     node;                   /* Node, 0 = every receiver */
+    int     sockfd;                 /* Descriptor, or mcast port */
+    uint64_t arg;                   /* Mcast group, probe sent  */
+    sim_packet *pkt;                /* Delivered packet         */
+    sim_ping *ping;                 /* Ping of the probe        */
+} sim_event;
+
+static struct {
+    // options
+    int     nodes;                  /* vm1..vmN                 */
+    int     hops;                   /* Hops of a tour           */
+    int     tours;                  /* Tours started by vm1     */
+    int     trace;                  /* Trace the tours          */
+    int     branches;               /* Scatter the tours        */
+    int     stream;                 /* Tours of each stream     */
+    int     window;                 /* Stream tours in flight   */
+    int     hopAck;                 /* Acknowledge the hops     */
+    int     verbose;                /* Keep the node logs       */
+    uint    latency;                /* One way latency, us      */
+    uint    jitter;                 /* Extra random delay, us   */
+    double  loss;                   /* Loss of one delivery     */
+    uint    seed;                   /* srandom() seed           */
+    uint64_t limit;                 /* Virtual run time, ns     */
+    int     pingCount;              /* Probes per pinged node   */
+    uint    pingInterval;           /* us between probes        */
+    // state
+    uint64_t now;                   /* Virtual clock, ns        */
+    uint64_t seq;                   /* Events scheduled         */
+    sim_event *heap;                /* Pending events           */
+    int     heapCount;
+    int     heapSize;
+    sim_node *node;                 /* node[1] is vm1           */
+    sim_group *groups[SIM_GROUP_HASH];
+    int     current;                /* Node running, 0 = none   */
+    sim_packet *inbox;              /* Packet being delivered   */
+    struct sockaddr_ll inboxFrom;   /* Its link layer sender    */
+    socklen_t inboxFromLen;         /* 0 for IP packets         */
+    int     accepted;               /* AREQ connection to accept */
+    int     sessions;               /* Sessions of all nodes    */
+    // results
+    uint64_t events, tourPackets, windowPackets, streamAcks, hopAcks, areqs, areqAnswers;
+    uint64_t arpFrames, arpBroadcasts, arpDeliveries;
+    uint64_t mcastSent, mcastDeliveries, identifies, probes, replies, dropped;
+    int     traversed;              /* Tours reaching last node */
+    uint64_t traverseNs;            /* Last one got there       */
+    uint64_t doneNs;                /* Last session ended       */
+    hist    rtt;                    /* Ping RTT                 */
+} sim;
+
+static FILE *results;
+
+uint64_t __real_UtilNowNs();
+int __real_Accept(int fd, SA *sa, socklen_t *salenptr);
+ssize_t __real_Read(int fd, void *ptr, size_t nbytes);
+void __real_Write(int fd, void *ptr, size_t nbytes);
+void __real_Close(int fd);
+int __real_close(int fd);
+
+void StartTour(tour_object *obj);  // tour.c
+void ProcessTour(tour_object *obj);    // tour.c
+
+/* --------------------------------------------------------------------------
+ *  SimNodeIp
+ *
+ *  Address of a node
+ *
+ *  @param  : int   node    [node number, vm<node>]
+ *            uchar *ipaddr [10.9.<node/250+1>.<node%250+1>]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void SimNodeIp(int node, uchar *ipaddr) {
+    ipaddr[0] = 10;
+    ipaddr[1] = 9;
+    ipaddr[2] = node / 250 + 1;
+    ipaddr[3] = node % 250 + 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimIpNode
+ *
+ *  Node of an address
+ *
+ *  @param  : const uchar   *ipaddr [IP address]
+ *  @return : int           [node number, 0 if no node has the address]
+ * --------------------------------------------------------------------------
+ */
+static int SimIpNode(const uchar *ipaddr) {
+    int node;
+
+    if (ipaddr[0] != 10 || ipaddr[1] != 9 || ipaddr[2] == 0 || ipaddr[3] == 0 || ipaddr[3] > 250)
+        return 0;
+    node = (ipaddr[2] - 1) * 250 + ipaddr[3] - 1;
+    return (node >= 1 && node <= sim.nodes) ? node : 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimNodeMac
+ *
+ *  MAC address of a node
+ *
+ *  @param  : int   node    [node number]
+ *            uchar *hwaddr [02:00:00 followed by the node number]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void SimNodeMac(int node, uchar *hwaddr) {
+    hwaddr[0] = 0x02;
+    hwaddr[1] = 0;
+    hwaddr[2] = 0;
+    hwaddr[3] = node >> 16;
+    hwaddr[4] = node >> 8;
+    hwaddr[5] = node;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimMacNode
+ *
+ *  Node of a MAC address
+ *
+ *  @param  : const uchar   *hwaddr [MAC address]
+ *  @return : int           [node number, 0 if no node has the address]
+ * --------------------------------------------------------------------------
+ */
+static int SimMacNode(const uchar *hwaddr) {
+    int node;
+
+    if (hwaddr[0] != 0x02 || hwaddr[1] != 0 || hwaddr[2] != 0)
+        return 0;
+    node = (hwaddr[3] << 16) | (hwaddr[4] << 8) | hwaddr[5];
+    return (node >= 1 && node <= sim.nodes) ? node : 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimPush
+ *
+ *  Schedule an event
+ *
+ *  @param  : uint64_t      time    [virtual ns]
+ *            int           type    [SIM_EV_TOUR, ...]
+ *            int           node    [node, 0 = every receiver]
+ *            int           sockfd  [descriptor, or multicast port]
+ *            uint64_t      arg     [multicast group, probe send time]
+ *            sim_packet    *pkt    [packet, the event holds a reference]
+ *            sim_ping      *ping   [ping of a probe or reply]
+ *  @return : void
+ *
+ *  The pending events are a binary heap. Events of the same time run in
+ *  the order they were scheduled, so a run is repeatable with its seed
+ * --------------------------------------------------------------------------
+ */
+static int SimBefore(const sim_event *a, const sim_event *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void SimPush(uint64_t time, int type, int node, int sockfd, uint64_t arg, sim_packet *pkt, sim_ping *ping) {
+    sim_event ev;
+    int i, p;
+
+    if (sim.heapCount == sim.heapSize) {
+        sim.heapSize = sim.heapSize ? sim.heapSize * 2 : 1024;
+        if ((sim.heap = realloc(sim.heap, sim.heapSize * sizeof(sim_event))) == NULL)
+            err_quit("[SIM] out of memory for %d events", sim.heapSize);
+    }
+
+    ev.time = time;
+    ev.seq = sim.seq++;
+    ev.type = type;
+    ev.node = node;
+    ev.sockfd = sockfd;
+    ev.arg = arg;
+    ev.pkt = pkt;
+    ev.ping = ping;
+    if (pkt)
+        pkt->refCount++;
+    if (ping)
+        ping->refCount++;
+
+    for (i = sim.heapCount++; i > 0; i = p) {
+        p = (i - 1) / 2;
+        if (!SimBefore(&ev, &sim.heap[p]))
+            break;
+        sim.heap[i] = sim.heap[p];
+    }
+    sim.heap[i] = ev;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimPop
+ *
+ *  Take the earliest event
+ *
+ *  @param  : sim_event *ev [filled with the event]
+ *  @return : int           [0 if no event is pending]
+ * --------------------------------------------------------------------------
+ */
+static int SimPop(sim_event *ev) {
+    sim_event last;
+    int i, c;
+
+    if (sim.heapCount == 0)
+        return 0;
+    *ev = sim.heap[0];
+    last = sim.heap[--sim.heapCount];
+
+    for (i = 0; (c = 2 * i + 1) < sim.heapCount; i = c) {
+        if (c + 1 < sim.heapCount && SimBefore(&sim.heap[c + 1], &sim.heap[c]))
+            c++;
+        if (!SimBefore(&sim.heap[c], &last))
+            break;
+        sim.heap[i] = sim.heap[c];
+    }
+    sim.heap[i] = last;
+    return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimDelay
+ *
+ *  One way delay of a packet
+ *
+ *  @param  : void
+ *  @return : uint64_t  [ns, latency plus a uniform share of the jitter]
+ * --------------------------------------------------------------------------
+ */
+static uint64_t SimDelay() {
+    uint64_t us = sim.latency;
+
+    if (sim.jitter)
+        us += random() % (sim.jitter + 1);
+    return us * 1000;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimLost
+ *
+ *  Draw the loss of a packet
+ *
+ *  @param  : void
+ *  @return : int   [1 if the delivery is lost]
+ * --------------------------------------------------------------------------
+ */
+static int SimLost() {
+    return sim.loss > 0 && (double)random() / RAND_MAX < sim.loss;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimPacket
+ *
+ *  Copy a sent packet
+ *
+ *  @param  : const void    *buf    [packet]
+ *            size_t        len     [bytes]
+ *  @return : sim_packet    *       [copy, freed with its last event]
+ * --------------------------------------------------------------------------
+ */
+static sim_packet *SimPacket(const void *buf, size_t len) {
+    sim_packet *pkt = Malloc(sizeof(sim_packet) + len);
+
+    pkt->refCount = 0;
+    pkt->length = len;
+    pkt->from = sim.current;
+    memcpy(pkt->data, buf, len);
+    return pkt;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimRelease
+ *
+ *  Drop the reference of an event to its packet
+ *
+ *  @param  : sim_packet    *pkt    [packet, may be NULL]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void SimRelease(sim_packet *pkt) {
+    if (pkt && --pkt->refCount == 0)
+        free(pkt);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimPingRelease
+ *
+ *  Drop the reference of an event to its ping
+ *
+ *  @param  : int       node    [pinging node]
+ *            sim_ping  *p      [ping, may be NULL]
+ *  @return : void
+ *
+ *  Only a probe event schedules more, so a ping without queued events is
+ *  over, finished or cancelled, and leaves the list of the node
+ * --------------------------------------------------------------------------
+ */
+static void SimPingRelease(int node, sim_ping *p) {
+    sim_ping **pp;
+
+    if (p == NULL || --p->refCount > 0)
+        return;
+    for (pp = &sim.node[node].pings; *pp != p; pp = &(*pp)->next)
+        ;
+    *pp = p->next;
+    free(p);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimUnicast
+ *
+ *  Send a packet to one node
+ *
+ *  @param  : int           type    [SIM_EV_TOUR or SIM_EV_FRAME]
+ *            int           node    [receiver, 0 if unknown]
+ *            const void    *buf    [packet]
+ *            size_t        len     [bytes]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void SimUnicast(int type, int node, const void *buf, size_t len) {
+    if (node == 0 || SimLost()) {
+        sim.dropped++;
+        return;
+    }
+    SimPush(sim.now + SimDelay(), type, node, 0, 0, SimPacket(buf, len), NULL);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimFdOpen
+ *
+ *  Allocate the lowest free descriptor of a node
+ *
+ *  @param  : sim_node  *n      [node]
+ *            int       kind    [SIM_VFD_GROUP, ...]
+ *  @return : int               [descriptor, SIM_FD_DYN or above]
+ *
+ *  Descriptors may reach FD_SETSIZE like real ones; the tour refuses them
+ * --------------------------------------------------------------------------
+ */
+static int SimFdOpen(sim_node *n, int kind) {
+    int i;
+
+    for (i = 0; i < n->fdCount && n->fds[i].kind != SIM_VFD_FREE; i++)
+        ;
+    if (i == n->fdCount) {
+        if ((n->fds = realloc(n->fds, ++n->fdCount * sizeof(sim_fd))) == NULL)
+            err_quit("[SIM] out of memory for descriptors");
+    }
+    n->fds[i].kind = kind;
+    n->fds[i].areq = NULL;
+    return SIM_FD_DYN + i;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimFd
+ *
+ *  Find an open descriptor of a node
+ *
+ *  @param  : sim_node  *n      [node]
+ *            int       sockfd  [descriptor]
+ *  @return : sim_fd    *       [descriptor, NULL if it is not open]
+ * --------------------------------------------------------------------------
+ */
+static sim_fd *SimFd(sim_node *n, int sockfd) {
+    int i = sockfd - SIM_FD_DYN;
+
+    if (i < 0 || i >= n->fdCount || n->fds[i].kind == SIM_VFD_FREE)
+        return NULL;
+    return &n->fds[i];
+}
+
+/* --------------------------------------------------------------------------
+ *  SimFdClose
+ *
+ *  Close a descriptor of the running node
+ *
+ *  @param  : int   sockfd  [descriptor]
+ *  @return : int           [-1 if it is not a virtual descriptor]
+ *
+ *  A tour closing an unanswered AREQ makes the connection readable on the
+ *  ARP side, which then drops the incomplete entry; the accepted end is
+ *  closed with it
+ * --------------------------------------------------------------------------
+ */
+static int SimFdClose(int sockfd) {
+    sim_node *n;
+    sim_fd *f;
+    sim_areq *a;
+
+    if (sim.current == 0 || (f = SimFd(n = &sim.node[sim.current], sockfd)) == NULL)
+        return -1;
+
+    if ((a = f->areq) != NULL) {
+        if (f->kind == SIM_VFD_CLIENT) {
+            a->client = -1;
+            if (a->server >= 0) {
+                SimArpAbandoned(n->arp, a->server);
+                n->fds[a->server - SIM_FD_DYN].kind = SIM_VFD_FREE;
+                n->fds[a->server - SIM_FD_DYN].areq = NULL;
+                a->server = -1;
+            }
+        } else {
+            a->server = -1;
+        }
+        if (a->client < 0 && a->server < 0)
+            free(a);
+    }
+    f->kind = SIM_VFD_FREE;
+    f->areq = NULL;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimGroup
+ *
+ *  Find a multicast group
+ *
+ *  @param  : uint32_t  grp     [group address, network order]
+ *            int       port    [port]
+ *            int       create  [add the group if it is missing]
+ *  @return : sim_group *       [group, NULL if missing]
+ * --------------------------------------------------------------------------
+ */
+static sim_group *SimGroup(uint32_t grp, int port, int create) {
+    uint h = ((grp * 2654435761U) ^ port) % SIM_GROUP_HASH;
+    sim_group *g;
+
+    for (g = sim.groups[h]; g != NULL; g = g->next)
+        if (g->grp == grp && g->port == port)
+            return g;
+    if (!create)
+        return NULL;
+
+    g = Calloc(1, sizeof(sim_group));
+    g->grp = grp;
+    g->port = port;
+    g->next = sim.groups[h];
+    sim.groups[h] = g;
+    return g;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimArm
+ *
+ *  Make sure a timer event fires by deadline
+ *
+ *  @param  : int       node        [node]
+ *            uint64_t  deadline    [virtual ns, 0 = none]
+ *  @return : void
+ *
+ *  A node has one armed timer event, the earliest one. A timer that fires
+ *  early runs no session and arms the next one, an event replaced by an
+ *  earlier one is skipped
+ * --------------------------------------------------------------------------
+ */
+static void SimArm(int node, uint64_t deadline) {
+    sim_node *n = &sim.node[node];
+
+    if (deadline == 0)
+        return;
+    if (deadline < sim.now)
+        deadline = sim.now;
+    if (n->timerAt != 0 && n->timerAt <= deadline)
+        return;
+    n->timerAt = deadline;
+    SimPush(deadline, SIM_EV_TIMER, node, 0, 0, NULL, NULL);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimArmNext
+ *
+ *  Arm the earliest session timer of a node
+ *
+ *  @param  : int   node    [node]
+ *  @return : void
+ *
+ *  SessionNextTimeout() is what select() of the real loop waits for. It is
+ *  cut to microseconds, so the event is rounded up to the next one: an
+ *  event before the deadline would find nothing to run and arm itself again
+ *  at the same time
+ * --------------------------------------------------------------------------
+ */
+static void SimArmNext(int node) {
+    struct timeval tv;
+
+    if (SessionNextTimeout(&sim.node[node].tour, &tv) != NULL)
+        SimArm(node, sim.now + tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL + 999);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimSessions
+ *
+ *  Account the sessions created or ended by a handler
+ *
+ *  @param  : int   node    [node that ran the handler]
+ *            int   before  [its sessions before the handler]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void SimSessions(int node, int before) {
+    sim.sessions += sim.node[node].tour.sessionCount - before;
+    if (sim.sessions == 0)
+        sim.doneNs = sim.now - SIM_START_NS;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportInit
+ *
+ *  Nothing to select, the simulator is the transport
+ * --------------------------------------------------------------------------
+ */
+void TransportInit(int mode, const char *path) {
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportStart
+ *
+ *  Nothing to start
+ * --------------------------------------------------------------------------
+ */
+void TransportStart(int ifindex) {
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportSocket
+ *
+ *  Refuse real sockets
+ *
+ *  @return : int   [-1, the nodes are given their descriptors]
+ * --------------------------------------------------------------------------
+ */
+int TransportSocket(int family, int type, int protocol) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportSetsockopt
+ *
+ *  Accept every option
+ * --------------------------------------------------------------------------
+ */
+int TransportSetsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportSendto
+ *
+ *  Put a packet on the virtual segment
+ *
+ *  @param  : as for sendto
+ *  @return : ssize_t   [len, -1 for a socket the simulator does not carry]
+ *
+ *  Tour packets go to the node owning the destination address and ARP
+ *  frames to the node owning the destination MAC, each after its own delay
+ *  and loss draw, as do the identifications sent to the source. A broadcast frame or a multicast datagram is one event
+ *  reaching every receiver at once, the loss is drawn per receiver
+ * --------------------------------------------------------------------------
+ */
+ssize_t TransportSendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)to;
+    const tourhdr *rthdr = (const tourhdr *)((const uchar *)buf + IP4_HDRLEN);
+    const uchar *dst = buf;
+
+    switch (sockfd) {
+    case SIM_FD_RT:
+        if (len >= IP4_HDRLEN + TOUR_HDRLEN && rthdr->type == TOUR_STREAM_ACK)
+            sim.streamAcks++;
+        else if (len >= IP4_HDRLEN + TOUR_HDRLEN && rthdr->type == TOUR_HOP_ACK)
+            sim.hopAcks++;
+        else if (len >= IP4_HDRLEN + TOUR_HDRLEN && rthdr->type != TOUR_ROUTE)
+            sim.windowPackets++;
+        else
+            sim.tourPackets++;
+        SimUnicast(SIM_EV_TOUR, SimIpNode((const uchar *)&sin->sin_addr), buf, len);
+        break;
+    case SIM_FD_MS:
+        if (!IN_MULTICAST(ntohl(sin->sin_addr.s_addr))) {
+            sim.identifies++;
+            SimUnicast(SIM_EV_IDENTIFY, SimIpNode((const uchar *)&sin->sin_addr), buf, len);
+            break;
+        }
+        sim.mcastSent++;
+        SimPush(sim.now + SimDelay(), SIM_EV_MCAST, 0, ntohs(sin->sin_port), sin->sin_addr.s_addr,
+            SimPacket(buf, len), NULL);
+        break;
+    case SIM_FD_ARP:
+        sim.arpFrames++;
+        if (memcmp(dst, "\xff\xff\xff\xff\xff\xff", ETH_ALEN) == 0) {
+            sim.arpBroadcasts++;
+            SimPush(sim.now + SimDelay(), SIM_EV_FRAME, 0, 0, 0, SimPacket(buf, len), NULL);
+        } else {
+            SimUnicast(SIM_EV_FRAME, SimMacNode(dst), buf, len);
+        }
+        break;
+    default:
+        errno = EBADF;
+        return -1;
+    }
+    return len;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportRecvmsg
+ *
+ *  Receive the packet being delivered
+ *
+ *  @param  : as for recvmsg
+ *  @return : ssize_t   [bytes received, -1 if nothing is delivered]
+ *
+ *  Handlers run once per delivered packet, which waits in sim.inbox until
+ *  it is read. No control message is returned: a packet waits no time in
+ *  a simulated socket
+ * --------------------------------------------------------------------------
+ */
+ssize_t TransportRecvmsg(int sockfd, struct msghdr *msg, int flags) {
+    sim_packet *pkt = sim.inbox;
+    size_t copied = 0, n;
+    int i;
+
+    if (pkt == NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    for (i = 0; i < (int)msg->msg_iovlen && copied < (size_t)pkt->length; i++) {
+        n = msg->msg_iov[i].iov_len;
+        if (n > pkt->length - copied)
+            n = pkt->length - copied;
+        if (n > 0)
+            memcpy(msg->msg_iov[i].iov_base, pkt->data + copied, n);
+        copied += n;
+    }
+    msg->msg_flags = (copied < (size_t)pkt->length) ? MSG_TRUNC : 0;
+    msg->msg_controllen = 0;
+    if (msg->msg_name) {
+        memcpy(msg->msg_name, &sim.inboxFrom, min(msg->msg_namelen, sim.inboxFromLen));
+        msg->msg_namelen = sim.inboxFromLen;
+    }
+
+    if (!(flags & MSG_PEEK))
+        sim.inbox = NULL;
+    return (flags & MSG_TRUNC) ? pkt->length : (ssize_t)copied;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportRecvfrom
+ *
+ *  Receive the packet being delivered
+ *
+ *  @param  : as for recvfrom
+ *  @return : ssize_t   [bytes received, -1 if failed]
+ * --------------------------------------------------------------------------
+ */
+ssize_t TransportRecvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen) {
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n;
+
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_name = from;
+    msg.msg_namelen = fromlen ? *fromlen : 0;
+
+    n = TransportRecvmsg(sockfd, &msg, flags);
+    if (n >= 0 && fromlen)
+        *fromlen = msg.msg_namelen;
+    return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_UtilNowNs
+ *
+ *  Virtual clock
+ *
+ *  @param  : void
+ *  @return : uint64_t  [virtual ns, starts at SIM_START_NS]
+ *
+ *  The simulator is linked with --wrap for the functions below, so every
+ *  call of the linked objects lands here instead of the real one
+ * --------------------------------------------------------------------------
+ */
+uint64_t __wrap_UtilNowNs() {
+    return sim.now;
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_UtilTime
+ *
+ *  Virtual time for the log
+ *
+ *  @param  : char  *timestr    [seconds since the start, ns precision]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+void __wrap_UtilTime(char *timestr) {
+    uint64_t t = sim.now - SIM_START_NS;
+
+    snprintf(timestr, TIMESTR_BUFFSIZE, "%llu.%09llu",
+        (unsigned long long)(t / 1000000000ULL), (unsigned long long)(t % 1000000000ULL));
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_UtilIpToHostname
+ *
+ *  Name of a node address
+ *
+ *  @param  : const uchar   *ipaddr     [IP address]
+ *            char          *hostname   [vm<node>, "?" if unknown]
+ *  @return : int           [-1 if no node has the address]
+ * --------------------------------------------------------------------------
+ */
+int __wrap_UtilIpToHostname(const uchar *ipaddr, char *hostname) {
+    int node = SimIpNode(ipaddr);
+
+    if (node == 0) {
+        snprintf(hostname, HOSTNAME_BUFFSIZE, "?");
+        return -1;
+    }
+    snprintf(hostname, HOSTNAME_BUFFSIZE, "vm%u", (uint)node % 100000);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_UtilHostnameToIp
+ *
+ *  Address of a node name
+ *
+ *  @param  : const char    *hostname   [vm<node>]
+ *            uchar         *ipaddr     [IP address]
+ *  @return : int           [-1 if no node has the name]
+ * --------------------------------------------------------------------------
+ */
+int __wrap_UtilHostnameToIp(const char *hostname, uchar *ipaddr) {
+    int node;
+
+    if (sscanf(hostname, "vm%d", &node) != 1 || node < 1 || node > sim.nodes)
+        return -1;
+    SimNodeIp(node, ipaddr);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_JoinMulticastGroup
+ *
+ *  Join a virtual multicast group
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            uchar         *grp    [multicast group address]
+ *            int           port    [multicast port number]
+ *  @return : int           [receiving descriptor of the group]
+ * --------------------------------------------------------------------------
+ */
+int __wrap_JoinMulticastGroup(tour_object *obj, uchar *grp, int port) {
+    sim_group *g;
+    uint32_t a;
+    int sockfd = SimFdOpen(&sim.node[sim.current], SIM_VFD_GROUP);
+
+    memcpy(&a, grp, IPADDR_BUFFSIZE);
+    g = SimGroup(a, port, 1);
+    if (g->count == g->size) {
+        g->size = g->size ? g->size * 2 : 8;
+        if ((g->members = realloc(g->members, g->size * sizeof(*g->members))) == NULL)
+            err_quit("[SIM] out of memory for group members");
+    }
+    g->members[g->count].node = sim.current;
+    g->members[g->count].sockfd = sockfd;
+    g->count++;
+
+    printf("[TOUR] Join multicast address: %d.%d.%d.%d:%d\n", grp[0], grp[1], grp[2], grp[3], port);
+    return sockfd;
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_LeaveMulticastGroup
+ *
+ *  Leave a virtual multicast group
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            int           sockfd  [receiving descriptor of the group]
+ *            uchar         *grp    [multicast group address]
+ *            int           port    [multicast port number]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+void __wrap_LeaveMulticastGroup(tour_object *obj, int sockfd, uchar *grp, int port) {
+    sim_group *g;
+    uint32_t a;
+    int i;
+
+    memcpy(&a, grp, IPADDR_BUFFSIZE);
+    if ((g = SimGroup(a, port, 0)) != NULL) {
+        for (i = 0; i < g->count; i++) {
+            if (g->members[i].node == sim.current && g->members[i].sockfd == sockfd) {
+                g->members[i] = g->members[--g->count];
+                break;
+            }
+        }
+    }
+    SimFdClose(sockfd);
+
+    printf("[TOUR] Leave multicast address: %d.%d.%d.%d:%d\n", grp[0], grp[1], grp[2], grp[3], port);
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_AreqSend
+ *
+ *  Connect to the ARP service of the node
+ *
+ *  @param  : struct sockaddr   *IPaddr         [IP address structure]
+ *            socklen_t         sockaddrlen     [address structure length]
+ *  @return : int               [tour end of the connection]
+ *
+ *  The service accepts the connection and reads the request at once:
+ *  ProcessDomainStream() of arp.c runs with Accept and Read served by the
+ *  connection. A cached address is answered before this returns
+ * --------------------------------------------------------------------------
+ */
+int __wrap_AreqSend(struct sockaddr *IPaddr, socklen_t sockaddrlen) {
+    sim_node *n = &sim.node[sim.current];
+    uchar *ipaddr = ((uchar *)IPaddr) + 4;
+    char ip[IPSTR_BUFFSIZE];
+    sim_areq *a = Calloc(1, sizeof(sim_areq));
+
+    memcpy(a->ipaddr, ipaddr, IPADDR_BUFFSIZE);
+    a->client = SimFdOpen(n, SIM_VFD_CLIENT);
+    a->server = SimFdOpen(n, SIM_VFD_SERVER);
+    SimFd(n, a->client)->areq = a;
+    SimFd(n, a->server)->areq = a;
+    sim.areqs++;
+
+    printf("[AREQ] AREQ \"%s\" to local ARP service...\n", UtilFormatIp(ipaddr, ip));
+    sim.accepted = a->server;
+    SimArpAreq(n->arp);
+    return a->client;
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_AreqRecv
+ *
+ *  Read the response of an AREQ
+ *
+ *  @param  : int               sockfd      [descriptor returned by AreqSend]
+ *            struct sockaddr   *IPaddr     [IP address structure]
+ *            struct hwaddr     *HWaddr     [Hardware address structure]
+ *  @return : int               [The number of bytes read, -1 if failed]
+ * --------------------------------------------------------------------------
+ */
+int __wrap_AreqRecv(int sockfd, struct sockaddr *IPaddr, struct hwaddr *HWaddr) {
+    uchar *ipaddr = ((uchar *)IPaddr) + 4;
+    char ip[IPSTR_BUFFSIZE], mac[MACSTR_BUFFSIZE];
+    sim_fd *f = SimFd(&sim.node[sim.current], sockfd);
+    int answered = f && f->areq && f->areq->answered;
+
+    if (answered)
+        memcpy(HWaddr, &f->areq->HWaddr, sizeof(struct hwaddr));
+    SimFdClose(sockfd);
+    if (!answered) {
+        printf("[AREQ] AREQ \"%s\" failed.\n", UtilFormatIp(ipaddr, ip));
+        return -1;
+    }
+
+    sim.areqAnswers++;
+    printf("[AREQ] AREQ \"%s\" received: <%d, %d, %d, %s>\n", UtilFormatIp(ipaddr, ip),
+        HWaddr->sll_ifindex, HWaddr->sll_hatype, HWaddr->sll_halen, UtilFormatMac(HWaddr->sll_addr, mac));
+    return sizeof(struct hwaddr);
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_Accept
+ *
+ *  ARP side of AreqSend
+ *
+ *  @param  : as for Accept
+ *  @return : int   [connection being set up by AreqSend]
+ * --------------------------------------------------------------------------
+ */
+int __wrap_Accept(int fd, SA *sa, socklen_t *salenptr) {
+    struct sockaddr_un *from = (struct sockaddr_un *)sa;
+
+    if (sim.current == 0 || fd != SIM_FD_DO)
+        return __real_Accept(fd, sa, salenptr);
+
+    bzero(from, *salenptr);
+    from->sun_family = AF_LOCAL;
+    snprintf(from->sun_path, sizeof(from->sun_path), "%s", sim.node[sim.current].tour.hostname);
+    return sim.accepted;
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_Read
+ *
+ *  ARP reads the requested address
+ *
+ *  @param  : as for Read
+ *  @return : ssize_t   [bytes read]
+ * --------------------------------------------------------------------------
+ */
+ssize_t __wrap_Read(int fd, void *ptr, size_t nbytes) {
+    sim_fd *f;
+
+    if (sim.current == 0 || (f = SimFd(&sim.node[sim.current], fd)) == NULL || f->kind != SIM_VFD_SERVER)
+        return __real_Read(fd, ptr, nbytes);
+
+    nbytes = min(nbytes, IPADDR_BUFFSIZE);
+    memcpy(ptr, f->areq->ipaddr, nbytes);
+    return nbytes;
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_Write
+ *
+ *  ARP writes the response
+ *
+ *  @param  : as for Write
+ *  @return : void
+ *
+ *  The tour end becomes readable at once. A node writes nowhere else, a
+ *  write to a descriptor that is not open is dropped
+ * --------------------------------------------------------------------------
+ */
+void __wrap_Write(int fd, void *ptr, size_t nbytes) {
+    sim_fd *f;
+    sim_areq *a;
+
+    if (sim.current == 0) {
+        __real_Write(fd, ptr, nbytes);
+        return;
+    }
+    if ((f = SimFd(&sim.node[sim.current], fd)) == NULL || f->kind != SIM_VFD_SERVER)
+        return;
+
+    a = f->areq;
+    memcpy(&a->HWaddr, ptr, min(nbytes, sizeof(struct hwaddr)));
+    a->answered = 1;
+    if (a->client >= 0)
+        SimPush(sim.now, SIM_EV_AREQ, sim.current, a->client, 0, NULL, NULL);
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_Close
+ *
+ *  Close a descriptor of ARP or of the groups
+ *
+ *  @param  : int   fd  [descriptor]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+void __wrap_Close(int fd) {
+    if (sim.current == 0)
+        __real_Close(fd);
+    else
+        SimFdClose(fd);
+}
+
+/* --------------------------------------------------------------------------
+ *  __wrap_close
+ *
+ *  Close a descriptor of the tour
+ *
+ *  @param  : int   fd  [descriptor]
+ *  @return : int       [0, -1 if failed]
+ *
+ *  libunp calls close() as well, its descriptors are real
+ * --------------------------------------------------------------------------
+ */
+int __wrap_close(int fd) {
+    if (SimFdClose(fd) == 0)
+        return 0;
+    return __real_close(fd);
+}
+
+/* --------------------------------------------------------------------------
+ *  PingInit
+ *
+ *  Nothing to set up, pings are events
+ * --------------------------------------------------------------------------
+ */
+void PingInit(tour_object *obj, const ping_config *cfg) {
+}
+
+/* --------------------------------------------------------------------------
+ *  PingLinkChanged
+ *
+ *  The link of a node never changes
+ * --------------------------------------------------------------------------
+ */
+void PingLinkChanged(tour_object *obj) {
+}
+
+/* --------------------------------------------------------------------------
+ *  PingSummary
+ *
+ *  Statistics are summed by the simulator
+ * --------------------------------------------------------------------------
+ */
+void PingSummary(tour_object *obj) {
+}
+
+/* --------------------------------------------------------------------------
+ *  PingCancel
+ *
+ *  Stop the pings of a tour
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [tour session, NULL for all tours]
+ *  @return : void
+ *
+ *  Replies in flight still arrive, as with the real ping
+ * --------------------------------------------------------------------------
+ */
+void PingCancel(tour_object *obj, tour_session *s) {
+    sim_ping *p;
+
+    for (p = sim.node[sim.current].pings; p != NULL; p = p->next)
+        if (s == NULL || p->session == s)
+            p->cancelled = 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Ping
+ *
+ *  Start pinging a node
+ *
+ *  @param  : tour_object           *obj    [tour object]
+ *            tour_session          *s      [tour session starting the ping]
+ *            const struct sockaddr_in *dstIp   [destination ip address]
+ *            const struct hwaddr   *dstHw  [destination mac address]
+ *  @return : void
+ *
+ *  The send and receive threads of ping.c cannot run on a virtual clock,
+ *  so a ping is a chain of probe events: a probe every interval, a reply
+ *  after the delay of both ways unless one of them is lost
+ * --------------------------------------------------------------------------
+ */
+void Ping(tour_object *obj, tour_session *s, const struct sockaddr_in *dstIp, const struct hwaddr *dstHw) {
+    sim_node *n = &sim.node[sim.current];
+    char ip[IPSTR_BUFFSIZE];
+    sim_ping *p;
+    int target = SimIpNode((const uchar *)&dstIp->sin_addr);
+
+    if (target == 0 || sim.pingCount <= 0)
+        return;
+
+    p = Calloc(1, sizeof(sim_ping));
+    p->session = s;
+    p->target = target;
+    p->remaining = sim.pingCount;
+    p->next = n->pings;
+    n->pings = p;
+
+    printf("[PING] %s: %d probes every %u us\n", UtilFormatIp((const uchar *)&dstIp->sin_addr, ip),
+        sim.pingCount, sim.pingInterval);
+    SimPush(sim.now, SIM_EV_PROBE, sim.current, 0, 0, NULL, p);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimDeliverTour
+ *
+ *  A tour packet reaches a node
+ *
+ *  @param  : sim_event *ev [SIM_EV_TOUR]
+ *  @return : void
+ *
+ *  A routing packet for the last hop completes the traversal of its tour
+ * --------------------------------------------------------------------------
+ */
+static void SimDeliverTour(sim_event *ev) {
+    sim_node *n = &sim.node[ev->node];
+    const tourhdr *rthdr = (const tourhdr *)(ev->pkt->data + IP4_HDRLEN);
+    int before = n->tour.sessionCount;
+
+    if (ev->pkt->length >= IP4_HDRLEN + TOUR_HDRLEN && rthdr->type == TOUR_ROUTE
+        && ntohl(rthdr->index) + 1 == ntohl(rthdr->seqLength)) {
+        sim.traversed++;
+        sim.traverseNs = sim.now - SIM_START_NS;
+    }
+
+    sim.inbox = ev->pkt;
+    sim.inboxFromLen = 0;
+    ProcessTour(&n->tour);
+    sim.inbox = NULL;
+
+    SimSessions(ev->node, before);
+    SimArmNext(ev->node);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimDeliverFrame
+ *
+ *  An ARP frame reaches one or every node
+ *
+ *  @param  : sim_event *ev [SIM_EV_FRAME, node 0 for a broadcast]
+ *  @return : void
+ *
+ *  The sender does not receive its own broadcast
+ * --------------------------------------------------------------------------
+ */
+static void SimDeliverFrame(sim_event *ev) {
+    int node, first = ev->node, last = ev->node;
+
+    if (ev->node == 0) {
+        first = 1;
+        last = sim.nodes;
+    }
+
+    bzero(&sim.inboxFrom, sizeof(sim.inboxFrom));
+    sim.inboxFrom.sll_family = AF_PACKET;
+    memcpy(&sim.inboxFrom.sll_protocol, ev->pkt->data + 2 * ETH_ALEN, sizeof(ushort));
+    sim.inboxFrom.sll_ifindex = SIM_IFINDEX;
+    sim.inboxFrom.sll_hatype = ARPHRD_ETHER;
+    sim.inboxFrom.sll_pkttype = (ev->node == 0) ? PACKET_BROADCAST : PACKET_HOST;
+    sim.inboxFrom.sll_halen = ETH_ALEN;
+    memcpy(sim.inboxFrom.sll_addr, ev->pkt->data + ETH_ALEN, ETH_ALEN);
+    sim.inboxFromLen = sizeof(sim.inboxFrom);
+
+    for (node = first; node <= last; node++) {
+        if (node == ev->pkt->from)
+            continue;
+        if (ev->node == 0 && SimLost()) {
+            sim.dropped++;
+            continue;
+        }
+        sim.arpDeliveries++;
+        sim.current = node;
+        sim.inbox = ev->pkt;
+        SimArpFrame(sim.node[node].arp);
+        sim.inbox = NULL;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  SimDeliverMulticast
+ *
+ *  A multicast datagram reaches the members of its group
+ *
+ *  @param  : sim_event *ev [SIM_EV_MCAST, sockfd is the port, arg the group]
+ *  @return : void
+ *
+ *  The sender is a member as well, multicast loops back. ProcessMulticast()
+ *  never joins or leaves a group, so the members stay put while they are
+ *  walked. Only the session of the message can have a new timer
+ * --------------------------------------------------------------------------
+ */
+static void SimDeliverMulticast(sim_event *ev) {
+    sim_group *g = SimGroup((uint32_t)ev->arg, ev->sockfd, 0);
+    const mcasthdr *mchdr = (const mcasthdr *)ev->pkt->data;
+    tour_session *s;
+    int i, node;
+
+    if (g == NULL)
+        return;
+
+    sim.inboxFromLen = 0;
+    for (i = 0; i < g->count; i++) {
+        if (SimLost()) {
+            sim.dropped++;
+            continue;
+        }
+        node = g->members[i].node;
+        sim.mcastDeliveries++;
+        sim.current = node;
+        sim.inbox = ev->pkt;
+        ProcessMulticast(&sim.node[node].tour, g->members[i].sockfd);
+        sim.inbox = NULL;
+        if (ev->pkt->length >= MCAST_HDRLEN && (s = SessionFind(&sim.node[node].tour, ntohl(mchdr->id))) != NULL)
+            SimArm(node, s->deadline);
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  SimDeliverIdentify
+ *
+ *  An identification reaches the source of its tour
+ *
+ *  @param  : sim_event *ev [SIM_EV_IDENTIFY]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void SimDeliverIdentify(sim_event *ev) {
+    sim.inbox = ev->pkt;
+    sim.inboxFromLen = 0;
+    ProcessMulticast(&sim.node[ev->node].tour, SIM_FD_MS);
+    sim.inbox = NULL;
+    SimArmNext(ev->node);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimTimer
+ *
+ *  Run the expired timers of a node
+ *
+ *  @param  : sim_event *ev [SIM_EV_TIMER]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void SimTimer(sim_event *ev) {
+    sim_node *n = &sim.node[ev->node];
+    int before = n->tour.sessionCount;
+
+    if (n->timerAt != ev->time)
+        return;
+    n->timerAt = 0;
+
+    SessionRunTimers(&n->tour);
+    SimSessions(ev->node, before);
+    SimArmNext(ev->node);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimAreqReady
+ *
+ *  The response of an AREQ is readable
+ *
+ *  @param  : sim_event *ev [SIM_EV_AREQ, sockfd is the tour end]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void SimAreqReady(sim_event *ev) {
+    sim_node *n = &sim.node[ev->node];
+    sim_fd *f = SimFd(n, ev->sockfd);
+    fd_set rset;
+
+    if (f == NULL || f->kind != SIM_VFD_CLIENT || !f->areq->answered ||
+        ev->sockfd >= FD_SETSIZE)
+        return;
+
+    FD_ZERO(&rset);
+    FD_SET(ev->sockfd, &rset);
+    SessionProcessAreqs(&n->tour, &rset);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimProbe
+ *
+ *  Send a probe and schedule its reply
+ *
+ *  @param  : sim_event *ev [SIM_EV_PROBE]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void SimProbe(sim_event *ev) {
+    sim_ping *p = ev->ping;
+
+    if (p->cancelled)
+        return;
+
+    sim.probes++;
+    if (SimLost() || SimLost())
+        sim.dropped++;
+    else
+        SimPush(sim.now + SimDelay() + SimDelay(), SIM_EV_REPLY, ev->node, 0, sim.now, NULL, p);
+
+    if (--p->remaining > 0)
+        SimPush(sim.now + sim.pingInterval * 1000ULL, SIM_EV_PROBE, ev->node, 0, 0, NULL, p);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimReply
+ *
+ *  An echo reply reaches the pinging node
+ *
+ *  @param  : sim_event *ev [SIM_EV_REPLY, arg is the probe send time]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void SimReply(sim_event *ev) {
+    uchar ipaddr[IPADDR_BUFFSIZE];
+    char ip[IPSTR_BUFFSIZE];
+
+    sim.replies++;
+    HistRecord(&sim.rtt, sim.now - ev->arg);
+    SimNodeIp(ev->ping->target, ipaddr);
+    printf("[PING] reply from %s: rtt=%.3f ms\n", UtilFormatIp(ipaddr, ip), (sim.now - ev->arg) / 1e6);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimNodeInit
+ *
+ *  Bring up a node
+ *
+ *  @param  : int   node    [node number]
+ *  @return : void
+ *
+ *  What main() of tour.c and arp.c find out about their host, without
+ *  asking the host
+ * --------------------------------------------------------------------------
+ */
+static void SimNodeInit(int node) {
+    sim_node *n = &sim.node[node];
+    tour_object *obj = &n->tour;
+
+    SimNodeIp(node, obj->ipaddr);
+    // node <= SIM_MAX_NODES, "vm" and five digits fit the host name
+    snprintf(obj->hostname, HOSTNAME_BUFFSIZE, "vm%u", (uint)node % 100000);
+    strcpy(obj->link.ifname, "eth0");
+    obj->link.ifindex = SIM_IFINDEX;
+    SimNodeMac(node, obj->link.hwaddr);
+    obj->link.mtu = ETH_DATA_LEN;
+    obj->link.nlSockfd = -1;
+    obj->rtSockfd = SIM_FD_RT;
+    obj->pgSockfd = SIM_FD_PG;
+    obj->pfSockfd = SIM_FD_PF;
+    obj->msSockfd = SIM_FD_MS;
+    obj->mcastRange = MCAST_RANGE;
+    obj->nextTourId = (uint32_t)random() | 1;
+
+    n->arp = SimArpCreate(obj->ipaddr, obj->link.hwaddr);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimParseOptions
+ *
+ *  Parse the command line options
+ *
+ *  @param  : int   argc
+ *            char  **argv
+ *  @return : void
+ *
+ *    -n nodes      simulated nodes vm1..vmN                 (default 100)
+ *    -L hops       hops of a tour, vm2, vm3, ... vmN, vm1, vm2, ...
+ *                  (default nodes - 1)
+ *    -c tours      tours started by vm1 at once             (default 1)
+ *    -t            trace the tours
+ *    -b branches   scatter the tours, gathering at the last hop (default 1)
+ *    -d latency    one way latency in us                    (default 50)
+ *    -j jitter     extra uniform delay in us, 0 to jitter   (default 0)
+ *    -p loss       loss of each delivery, e.g. 0.01         (default 0)
+ *    -S seed       random seed                              (default 1)
+ *    -P count      probes per pinged node                   (default 4)
+ *    -I interval   us between probes                        (default 1000000)
+ *    -T seconds    virtual time to stop at                  (default 600)
+ *    -v            keep the log of the nodes
+ * --------------------------------------------------------------------------
+ */
+static void SimParseOptions(int argc, char **argv) {
+    int c;
+
+    sim.nodes = 100;
+    sim.hops = 0;
+    sim.tours = 1;
+    sim.latency = 50;
+    sim.seed = 1;
+    sim.window = STREAM_WINDOW;
+    sim.pingCount = PING_DEF_COUNT;
+    sim.pingInterval = PING_DEF_INTERVAL;
+    sim.limit = 600 * 1000000000ULL;
+
+    while ((c = getopt(argc, argv, "n:L:c:tb:s:w:ad:j:p:S:P:I:T:v")) != -1) {
+        switch (c) {
+        case 'n':
+            sim.nodes = atoi(optarg);
+            break;
+        case 'L':
+            sim.hops = atoi(optarg);
+            break;
+        case 'c':
+            sim.tours = atoi(optarg);
+            break;
+        case 't':
+            sim.trace = 1;
+            break;
+        case 'b':
+            sim.branches = atoi(optarg);
+            break;
+        case 's':
+            sim.stream = atoi(optarg);
+            break;
+        case 'w':
+            sim.window = atoi(optarg);
+            break;
+        case 'a':
+            sim.hopAck = 1;
+            break;
+        case 'd':
+            sim.latency = atoi(optarg);
+            break;
+        case 'j':
+            sim.jitter = atoi(optarg);
+            break;
+        case 'p':
+            sim.loss = atof(optarg);
+            break;
+        case 'S':
+            sim.seed = atoi(optarg);
+            break;
+        case 'P':
+            sim.pingCount = atoi(optarg);
+            break;
+        case 'I':
+            sim.pingInterval = atoi(optarg);
+            break;
+        case 'T':
+            sim.limit = (uint64_t)(atof(optarg) * 1e9);
+            break;
+        case 'v':
+            sim.verbose = 1;
+            break;
+        default:
+            err_quit("usage: %s [-n nodes] [-L hops] [-c tours] [-t] [-b branches] [-s tours [-w window]] [-a] [-d latency] [-j jitter] [-p loss] "
+                "[-S seed] [-P count] [-I interval] [-T seconds] [-v]", argv[0]);
+        }
+    }
+
+    if (sim.nodes < 2 || sim.nodes > SIM_MAX_NODES)
+        err_quit("[SIM] nodes must be 2 - %d", SIM_MAX_NODES);
+    if (sim.hops <= 0)
+        sim.hops = sim.nodes - 1;
+    if (sim.tours < 1)
+        sim.tours = 1;
+    if (sim.tours > TOUR_MAX_TOURS)
+        err_quit("[SIM] tours must be at most %d", TOUR_MAX_TOURS);
+    if (sim.stream < 0 || sim.window < 1)
+        err_quit("[SIM] stream tours must be positive, window at least 1");
+    if (sim.stream && (sim.trace || sim.branches > 1))
+        err_quit("[SIM] -s does not mix with -t or -b");
+}
+
+/* --------------------------------------------------------------------------
+ *  SimReport
+ *
+ *  Print the results
+ *
+ *  @param  : uint64_t  wallNs  [real time of the run]
+ *  @return : void
+ *
+ *  Times are virtual ns since the start. done_ns is when the last session
+ *  ended, 0 if some did not; unfinished counts the nodes still in a tour
+ *  when the events ran out or the time limit was reached
+ * --------------------------------------------------------------------------
+ */
+static void SimReport(uint64_t wallNs) {
+    int i, unfinished = 0, cache = 0;
+
+    for (i = 1; i <= sim.nodes; i++) {
+        if (sim.node[i].tour.sessionCount > 0)
+            unfinished++;
+        cache += SimArpCacheSize(sim.node[i].arp);
+    }
+
+    fprintf(results, "[SIM] nodes=%d hops=%d tours=%d branches=%d stream=%d window=%d hop_ack=%d latency_us=%u jitter_us=%u loss=%g seed=%u\n",
+        sim.nodes, sim.hops, sim.tours, max(sim.branches, 1), sim.stream, sim.window, sim.hopAck, sim.latency, sim.jitter, sim.loss, sim.seed);
+    fprintf(results, "[SIM] traversed=%d traverse_ns=%llu done_ns=%llu unfinished=%d "
+        "events=%llu wall_ns=%llu events_per_sec=%.0f\n",
+        sim.traversed, (unsigned long long)sim.traverseNs,
+        (unsigned long long)(sim.sessions == 0 ? sim.doneNs : 0), unfinished,
+        (unsigned long long)sim.events, (unsigned long long)wallNs,
+        wallNs ? sim.events * 1e9 / wallNs : 0);
+    fprintf(results, "[SIM] tour_packets=%llu window_packets=%llu stream_acks=%llu hop_acks=%llu areqs=%llu areq_answers=%llu "
+        "arp_frames=%llu arp_broadcasts=%llu arp_deliveries=%llu arp_cache_entries=%d\n",
+        (unsigned long long)sim.tourPackets, (unsigned long long)sim.windowPackets,
+        (unsigned long long)sim.streamAcks, (unsigned long long)sim.hopAcks,
+        (unsigned long long)sim.areqs, (unsigned long long)sim.areqAnswers,
+        (unsigned long long)sim.arpFrames, (unsigned long long)sim.arpBroadcasts,
+        (unsigned long long)sim.arpDeliveries, cache);
+    fprintf(results, "[SIM] mcast_sent=%llu mcast_deliveries=%llu identifies=%llu ping_probes=%llu ping_replies=%llu "
+        "rtt_p50_ns=%llu rtt_p99_ns=%llu dropped=%llu\n",
+        (unsigned long long)sim.mcastSent, (unsigned long long)sim.mcastDeliveries, (unsigned long long)sim.identifies,
+        (unsigned long long)sim.probes, (unsigned long long)sim.replies,
+        (unsigned long long)HistPercentile(&sim.rtt, 50.0), (unsigned long long)HistPercentile(&sim.rtt, 99.0),
+        (unsigned long long)sim.dropped);
+}
+
+/* --------------------------------------------------------------------------
+ *  main
+ *
+ *  Entry function
+ *
+ *  @param  : int   argc
+ *            char  **argv
+ *  @return : int
+ *
+ *  vm1 starts the tours, then the events run in time order until none is
+ *  left or the virtual time limit is reached. Results go to the original
+ *  stdout; stdout itself, the log of every node, goes to /dev/null unless
+ *  -v is given
+ * --------------------------------------------------------------------------
+ */
+int main(int argc, char **argv) {
+    tour_object *src;
+    sim_event ev;
+    uint64_t wall;
+    int i;
+
+    SimParseOptions(argc, argv);
+
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    setvbuf(results, NULL, _IOLBF, 0);
+    if (!sim.verbose) {
+        if (freopen("/dev/null", "w", stdout) == NULL)
+            err_sys("[SIM] /dev/null");
+        // every delivery logs, write the discarded log in large blocks
+        setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+    }
+
+    srandom(sim.seed);
+    sim.now = SIM_START_NS;
+    HistInit(&sim.rtt);
+    sim.node = Calloc(sim.nodes + 1, sizeof(sim_node));
+    for (i = 1; i <= sim.nodes; i++)
+        SimNodeInit(i);
+
+    // hop i of the sequence is node i % nodes + 1, hop 0 is vm1 itself
+    src = &sim.node[1].tour;
+    src->seqLength = sim.hops + 1;
+    src->ipSeq = Malloc(IPADDR_BUFFSIZE * src->seqLength);
+    for (i = 0; i < src->seqLength; i++)
+        SimNodeIp(i % sim.nodes + 1, (uchar *)IP_SEQ(src->ipSeq, i));
+    src->tourCount = sim.tours;
+    src->trace = sim.trace;
+    src->branches = sim.branches;
+    src->streamCount = sim.stream;
+    src->streamWindow = sim.window;
+    src->hopAck = sim.hopAck;
+
+    wall = __real_UtilNowNs();
+    sim.current = 1;
+    for (i = 0; i < sim.tours; i++)
+        StartTour(src);
+    SimSessions(1, 0);
+    SimArmNext(1);
+
+    while (SimPop(&ev)) {
+        if (ev.time > SIM_START_NS + sim.limit) {
+            SimRelease(ev.pkt);
+            break;
+        }
+        sim.now = ev.time;
+        sim.events++;
+        sim.current = ev.node;
+
+        switch (ev.type) {
+        case SIM_EV_TOUR:
+            SimDeliverTour(&ev);
+            break;
+        case SIM_EV_FRAME:
+            SimDeliverFrame(&ev);
+            break;
+        case SIM_EV_MCAST:
+            SimDeliverMulticast(&ev);
+            break;
+        case SIM_EV_IDENTIFY:
+            SimDeliverIdentify(&ev);
+            break;
+        case SIM_EV_TIMER:
+            SimTimer(&ev);
+            break;
+        case SIM_EV_AREQ:
+            SimAreqReady(&ev);
+            break;
+        case SIM_EV_PROBE:
+            SimProbe(&ev);
+            break;
+        case SIM_EV_REPLY:
+            SimReply(&ev);
+            break;
+        }
+        sim.current = 0;
+        SimRelease(ev.pkt);
+        SimPingRelease(ev.node, ev.ping);
+    }
+
+    SimReport(__real_UtilNowNs() - wall);
+    exit(0);
+}
@@ -0,0 +1,34 @@
+#ifndef __sim_h
+#define __sim_h
+
+#include <stdint.h>
+
+/*
+ * Discrete-event simulation of tour and ARP nodes
+ *
+ * Every simulated node runs the tour and ARP code of the real programs in
+ * one process. Their sockets are virtual descriptors served by the
+ * simulated transport of sim.c: packets cross one virtual L2 segment with
+ * a configured latency, jitter and loss, and the clock jumps from one event
+ * to the next. Nodes are vm1..vmN with address 10.9.<i/250+1>.<i%250+1>.
+ */
+#define SIM_MAX_NODES   60000   // addresses of 10.9.0.0/16 handed out
+#define SIM_START_NS    1000000000ULL   // virtual clock of the first event
+#define SIM_IFINDEX     2       // interface of every node
+
+// descriptors of every node, the real programs never see other ones
+#define SIM_FD_RT       3       // tour IP raw socket
+#define SIM_FD_PG       4       // ping IP raw socket
+#define SIM_FD_PF       5       // ping PF_PACKET socket
+#define SIM_FD_MS       6       // multicast send socket
+#define SIM_FD_ARP      7       // ARP PF_PACKET socket
+#define SIM_FD_DO       8       // ARP domain socket
+#define SIM_FD_DYN      16      // first group or AREQ descriptor
+
+void *SimArpCreate(const unsigned char *ipaddr, const unsigned char *hwaddr);
+void SimArpFrame(void *arp);
+void SimArpAreq(void *arp);
+void SimArpAbandoned(void *arp, int sockfd);
+int SimArpCacheSize(void *arp);
+
+#endif
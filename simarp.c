@@ -0,0 +1,125 @@
+/*
+* @File:    simarp.c
+* @Date:    2026-10-19 13:10:27
+* @Last Modified time: 2026-10-19 15:02:48
+* @Description:
+*     Discrete-event simulation, ARP side
+*     + void *SimArpCreate(const uchar *ipaddr, const uchar *hwaddr)
+*         [Create the ARP service of a node]
+*     + void SimArpFrame(void *arp)
+*         [Process the frame waiting on the PF_PACKET socket]
+*     + void SimArpAreq(void *arp)
+*         [Process the AREQ waiting on the domain socket]
+*     + void SimArpAbandoned(void *arp, int sockfd)
+*         [Remove the incomplete entry of a closed AREQ connection]
+*     + int SimArpCacheSize(void *arp)
+*         [Count the cache entries]
+*/
+
+#include "arp.h"
+#include "sim.h"
+
+// arp.c, linked with its main() renamed
+void ProcessFrame(arp_object *obj);
+void ProcessDomainStream(arp_object *obj);
+
+/* --------------------------------------------------------------------------
+ *  SimArpCreate
+ *
+ *  Create the ARP service of a node
+ *
+ *  @param  : const uchar   *ipaddr [node IP address]
+ *            const uchar   *hwaddr [node MAC address]
+ *  @return : void          *       [ARP object]
+ *
+ *  The node has one interface, the sockets are the virtual descriptors
+ *  SIM_FD_ARP and SIM_FD_DO
+ * --------------------------------------------------------------------------
+ */
+void *SimArpCreate(const uchar *ipaddr, const uchar *hwaddr) {
+    arp_object *obj = Calloc(1, sizeof(arp_object));
+    struct hwa_info *hwa = Calloc(1, sizeof(struct hwa_info));
+
+    strcpy(hwa->if_name, "eth0");
+    memcpy(hwa->if_haddr, hwaddr, IF_HADDR);
+    memcpy(hwa->ip_addr, ipaddr, IP_ALEN);
+    hwa->if_index = SIM_IFINDEX;
+
+    obj->hwa_info = hwa;
+    obj->if_index = SIM_IFINDEX;
+    obj->pfSockfd = SIM_FD_ARP;
+    obj->doSockfd = SIM_FD_DO;
+    return obj;
+}
+
+/* --------------------------------------------------------------------------
+ *  SimArpFrame
+ *
+ *  Process the frame waiting on the PF_PACKET socket
+ *
+ *  @param  : void  *arp    [ARP object]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+void SimArpFrame(void *arp) {
+    ProcessFrame((arp_object *)arp);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimArpAreq
+ *
+ *  Process the AREQ waiting on the domain socket
+ *
+ *  @param  : void  *arp    [ARP object]
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+void SimArpAreq(void *arp) {
+    ProcessDomainStream((arp_object *)arp);
+}
+
+/* --------------------------------------------------------------------------
+ *  SimArpAbandoned
+ *
+ *  Remove the incomplete entry of a closed AREQ connection
+ *
+ *  @param  : void  *arp    [ARP object]
+ *            int   sockfd  [accepted connection of the entry]
+ *  @return : void
+ *
+ *  What ProcessSockets() does when the connection of an incomplete entry
+ *  becomes readable because the tour gave up on it
+ * --------------------------------------------------------------------------
+ */
+void SimArpAbandoned(void *arp, int sockfd) {
+    arp_object *obj = (arp_object *)arp;
+    arp_cache **pe, *entry;
+
+    for (pe = &obj->cache; *pe != NULL; pe = &(*pe)->next) {
+        if ((*pe)->sockfd == sockfd) {
+            entry = *pe;
+            *pe = entry->next;
+            free(entry);
+            printf(" [ARP] Socket connection terminated. Incomplete entry has been removed.\n");
+            return;
+        }
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  SimArpCacheSize
+ *
+ *  Count the cache entries
+ *
+ *  @param  : void  *arp    [ARP object]
+ *  @return : int           [entries, complete or not]
+ * --------------------------------------------------------------------------
+ */
+int SimArpCacheSize(void *arp) {
+    arp_cache *entry;
+    int n = 0;
+
+    for (entry = ((arp_object *)arp)->cache; entry != NULL; entry = entry->next)
+        n++;
+    return n;
+}
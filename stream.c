@@ -0,0 +1,253 @@
+/*
+* @File:    stream.c
+* @Date:    2026-10-20 10:12:48
+* @Last Modified time: 2026-10-20 12:18:31
+* @Description:
+*     Tour streams, many tours pipelined along one sequence
+*     + void StreamStart(tour_object *obj, tour_session *s)
+*         [Start a stream of tours from the source]
+*     - uint64_t StreamRto(tour_session *s)
+*         [Time a tour of a stream may take before it is lost]
+*     - void StreamSend(tour_object *obj, tour_session *s)
+*         [Send the tours the window allows]
+*     - void StreamFinish(tour_object *obj, tour_session *s)
+*         [Report the throughput of a finished stream]
+*     + void StreamArrive(tour_object *obj, tour_session *s, const tourhdr *rthdr)
+*         [Acknowledge a tour of a stream at the last node]
+*     + void StreamAck(tour_object *obj, const tourhdr *rthdr)
+*         [Count an acknowledged tour at the source]
+*     + void StreamTimeout(tour_object *obj, tour_session *s)
+*         [Give up the tours of a stream older than the RTO]
+*/
+
+#include "tour.h"
+
+#define STREAM_BIT(__set, __seq) ((__set)[(__seq) / 64] & (1ULL << ((__seq) % 64)))
+
+static void StreamSend(tour_object *obj, tour_session *s);
+static void StreamFinish(tour_object *obj, tour_session *s);
+
+/* --------------------------------------------------------------------------
+ *  StreamStart
+ *
+ *  Start a stream of tours from the source
+ *
+ *  @param  : tour_object   *obj    [tour object, streamCount is set]
+ *            tour_session  *s      [tour session, started by this node]
+ *  @return : void
+ *
+ *  The tours of a stream share the session, the multicast group and the
+ *  packet, which is built once and must carry the whole sequence: the
+ *  nodes forward every tour as it comes, without window requests. Each
+ *  tour is the same packet with its own seq, the last node acknowledges
+ *  it to the source and at most streamWindow tours are in flight
+ * --------------------------------------------------------------------------
+ */
+void StreamStart(tour_object *obj, tour_session *s) {
+    s->streamLength = BuildTourPacket(obj, s, TOUR_ROUTE, 0, TOUR_FLAG_STREAM | (s->hopAck ? TOUR_FLAG_ACK : 0), &s->streamPacket);
+    if (s->streamLength < 0
+        || ntohl(((tourhdr *)(s->streamPacket + IP4_HDRLEN))->hopCount) != (uint)s->seqLength) {
+        printf("[TOUR] tour %08x stream needs the tour sequence in one packet, MTU %d.\n", s->id, obj->link.mtu);
+        SessionDestroy(obj, s);
+        return;
+    }
+
+    s->streamCount = obj->streamCount;
+    s->streamWindow = obj->streamWindow;
+    s->streamAcked = Calloc((s->streamCount + 63) / 64, sizeof(uint64_t));
+    s->streamSent = Calloc(s->streamWindow, sizeof(uint64_t));
+    s->streamStart = UtilNowNs();
+    printf("[TOUR] tour %08x streaming %u tours, %u in flight.\n", s->id, s->streamCount, s->streamWindow);
+    StreamSend(obj, s);
+}
+
+/* --------------------------------------------------------------------------
+ *  StreamRto
+ *
+ *  Time a tour of a stream may take before it is lost
+ *
+ *  @param  : tour_session  *s      [streaming session of the source]
+ *  @return : uint64_t      [ns]
+ *
+ *  Twice the smoothed tour RTT plus four mean deviations, so a tour
+ *  delayed by queueing is not lost; STREAM_RTO_TIME until a tour came back
+ * --------------------------------------------------------------------------
+ */
+static uint64_t StreamRto(tour_session *s) {
+    if (s->streamRtt == 0)
+        return STREAM_RTO_TIME * 1000000000ULL;
+    return 2 * s->streamRtt + 4 * s->streamRttVar;
+}
+
+/* --------------------------------------------------------------------------
+ *  StreamSend
+ *
+ *  Send the tours the window allows
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [streaming session of the source]
+ *  @return : void
+ *
+ *  A tour is in flight until it is acknowledged or given up. The stream
+ *  ends once every tour is either, otherwise the timer is armed for the
+ *  oldest tour in flight, streamBase. A tour in flight keeps its send time
+ *  in slot seq % streamWindow, so only the tours below streamBase +
+ *  streamWindow are sent: the tour streamWindow later takes the slot once
+ *  the tour is done, even if later tours were acknowledged before it
+ * --------------------------------------------------------------------------
+ */
+static void StreamSend(tour_object *obj, tour_session *s) {
+    tourhdr *rthdr = (tourhdr *)(s->streamPacket + IP4_HDRLEN);
+
+    while (s->streamBase < s->streamNext && STREAM_BIT(s->streamAcked, s->streamBase))
+        s->streamBase++;
+    while (s->streamNext < s->streamCount && s->streamNext < s->streamBase + s->streamWindow) {
+        s->streamSent[s->streamNext % s->streamWindow] = UtilNowNs();
+        rthdr->seq = htonl(s->streamNext++);
+        ForwardTour(obj, s->streamPacket, s->streamLength, 1);
+    }
+
+    if (s->streamArrived + s->streamLost == s->streamCount) {
+        StreamFinish(obj, s);
+        return;
+    }
+    // finer than the millisecond timers of SessionSetState()
+    SessionSetState(s, TOUR_STREAMING, 0);
+    s->deadline = s->streamSent[s->streamBase % s->streamWindow] + StreamRto(s);
+}
+
+/* --------------------------------------------------------------------------
+ *  StreamFinish
+ *
+ *  Report the throughput of a finished stream
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [streaming session of the source]
+ *  @return : void
+ *
+ *  The time runs from the first tour sent to the last acknowledged. The
+ *  session then waits for the roll call like any tour, the source starts
+ *  it if it is the last node
+ * --------------------------------------------------------------------------
+ */
+static void StreamFinish(tour_object *obj, tour_session *s) {
+    double sec = (s->streamEnd > s->streamStart ? s->streamEnd - s->streamStart : 1) / 1e9;
+
+    printf("[TOUR] tour %08x stream of %u tours: %u arrived, %u lost in %.3f ms, %.1f tours/s, %.1f hops/s, RTT %.3f ms.\n",
+        s->id, s->streamCount, s->streamArrived, s->streamLost, sec * 1e3,
+        s->streamArrived / sec, (double)s->streamArrived * (s->seqLength - 1) / sec, s->streamRtt / 1e6);
+
+    if (memcmp(IP_SEQ(s->ipSeq, s->seqLength - 1), obj->ipaddr, IPADDR_BUFFSIZE) == 0)
+        SessionSetState(s, TOUR_AWAIT_PING, PING_WAIT_TIME * 1000);
+    else
+        SessionSetState(s, TOUR_TRAVERSING, TOUR_IDLE_TIME * 1000);
+}
+
+/* --------------------------------------------------------------------------
+ *  StreamArrive
+ *
+ *  Acknowledge a tour of a stream at the last node
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [session of the last node]
+ *            tourhdr       *rthdr  [tour packet, TOUR_FLAG_STREAM]
+ *  @return : void
+ *
+ *  The ack is a bare tour header with the ID and seq of the tour, sent to
+ *  the source; a source ending its own tour counts it at once. With hop
+ *  acks the source acknowledges it in turn, it is resent as a hop
+ * --------------------------------------------------------------------------
+ */
+void StreamArrive(tour_object *obj, tour_session *s, const tourhdr *rthdr) {
+    uchar packet[IP4_HDRLEN + TOUR_HDRLEN];
+    tourhdr *ack = (tourhdr *)(packet + IP4_HDRLEN);
+    struct sockaddr_in sin;
+
+    if (s->streamPacket) {
+        StreamAck(obj, rthdr);
+        return;
+    }
+
+    bzero(packet, sizeof(packet));
+    ack->version = TOUR_VERSION;
+    ack->type = TOUR_STREAM_ACK;
+    ack->flags = TOUR_FLAG_STREAM | (rthdr->flags & TOUR_FLAG_ACK);
+    ack->id = rthdr->id;
+    ack->index = rthdr->index;
+    ack->seq = rthdr->seq;
+    BuildIpHeader((struct ip *)packet, sizeof(packet), obj->ipaddr, s->src);
+
+    bzero(&sin, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    memcpy(&sin.sin_addr, s->src, IPADDR_BUFFSIZE);
+    if (TransportSendto(obj->rtSockfd, packet, sizeof(packet), 0, (struct sockaddr *) &sin, sizeof(struct sockaddr)) < 0)
+        err_sys("[TOUR] sendto error");
+    if (ack->flags & TOUR_FLAG_ACK)
+        HopSent(obj, packet, sizeof(packet));
+}
+
+/* --------------------------------------------------------------------------
+ *  StreamAck
+ *
+ *  Count an acknowledged tour at the source
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            tourhdr       *rthdr  [ack or the tour packet itself]
+ *  @return : void
+ *
+ *  A tour counts once, a repeated ack or the ack of a tour given up is
+ *  ignored. The RTT of the tour updates the smoothed RTT and deviation
+ *  by 1/8 and 1/4 as TCP does. Every ack frees a place in the window for
+ *  the next tour
+ * --------------------------------------------------------------------------
+ */
+void StreamAck(tour_object *obj, const tourhdr *rthdr) {
+    tour_session *s = SessionFind(obj, ntohl(rthdr->id));
+    uint seq = ntohl(rthdr->seq);
+    uint64_t rtt;
+
+    if (s == NULL || s->streamAcked == NULL || seq >= s->streamNext || STREAM_BIT(s->streamAcked, seq))
+        return;
+
+    s->streamAcked[seq / 64] |= 1ULL << (seq % 64);
+    s->streamArrived++;
+    s->streamEnd = UtilNowNs();
+
+    rtt = s->streamEnd - s->streamSent[seq % s->streamWindow];
+    if (s->streamRtt == 0) {
+        s->streamRtt = rtt;
+        s->streamRttVar = rtt / 2;
+    } else {
+        s->streamRttVar = (3 * s->streamRttVar + (rtt > s->streamRtt ? rtt - s->streamRtt : s->streamRtt - rtt)) / 4;
+        s->streamRtt = (7 * s->streamRtt + rtt) / 8;
+    }
+    StreamSend(obj, s);
+}
+
+/* --------------------------------------------------------------------------
+ *  StreamTimeout
+ *
+ *  Give up the tours of a stream older than the RTO
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [streaming session of the source]
+ *  @return : void
+ *
+ *  The tours are sent in seq order, so the expired ones are the oldest in
+ *  flight. A tour given up counts as acknowledged, its late ack is
+ *  ignored, and frees its place in the window
+ * --------------------------------------------------------------------------
+ */
+void StreamTimeout(tour_object *obj, tour_session *s) {
+    uint64_t now = UtilNowNs(), rto = StreamRto(s);
+
+    for (; s->streamBase < s->streamNext; s->streamBase++) {
+        if (STREAM_BIT(s->streamAcked, s->streamBase))
+            continue;
+        if (s->streamSent[s->streamBase % s->streamWindow] + rto > now)
+            break;
+        s->streamAcked[s->streamBase / 64] |= 1ULL << (s->streamBase % 64);
+        s->streamLost++;
+    }
+    StreamSend(obj, s);
+}
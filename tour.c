@@ -4,14 +4,22 @@
 * @Last Modified time: 2015-12-09 11:41:40
 * @Description:
 *     Tour application basic functions
-*     - int IsVisitedPrecedingNode(tourhdr *rthdr, uchar *data)
-*         [Check if the preceding node has been pinged by local node before]
+*     + int BuildTourPacket(tour_object *obj, tour_session *s, uchar type, uint base, uchar flags, uchar **packet)
+*         [Build a tour packet carrying a window of the source sequence]
+*     + void ForwardTour(tour_object *obj, uchar *packet, int length, uint index)
+*         [Send a tour packet to the hop it points to]
 *     - void StartTour(tour_object *obj)
 *         [Start route traversal]
+*     + void RequestWindow(tour_object *obj, tour_session *s)
+*         [Get the window following the local hop of a tour]
+*     - void ProcessWindow(tour_object *obj, struct ip *iphdr, int length)
+*         [Process a window request or reply]
 *     - void ProcessTour(tour_object *obj)
 *         [Process tour packet]
-*     + void FinishTour(tour_object *obj)
+*     + void FinishTour(tour_object *obj, tour_session *s)
 *         [Exit the tour process]
+*     - int ParseOptions(int argc, char **argv, tour_object *obj, ping_config *cfg)
+*         [Parse the command line options]
 *     - void ParseArguments(int argc, char **argv, tour_object *obj)
 *         [Parse the tour sequence]
 *     - void CreateSockets(tour_object *obj)
@@ -26,29 +34,100 @@
 #include "ping.h"
 
 /* --------------------------------------------------------------------------
- *  IsVisitedPrecedingNode
+ *  BuildTourPacket
  *
- *  Check if the preceding node has been pinged by local node before
+ *  Build a tour packet carrying a window of the source sequence
  *
- *  @param  : tourhdr   *rthdr  [tour header]
- *            uchar     *data   [tour payload]
- *  @return : int       [0 = no, 1 = yes]
+ *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [tour session, started by this node]
+ *            uchar         type    [TOUR_ROUTE or TOUR_WINDOW_REP]
+ *            uint          base    [first hop of the window]
+ *            uchar         flags   [TOUR_FLAG_TRACE or 0]
+ *            uchar         **packet [allocated packet]
+ *  @return : int           [packet length, -1 if the window does not fit]
  *
- *  local index = current index - 1
- *  prev index = current index - 2
- *  find match pair in the previous list
+ *  The window is as many hops from base as fit in one frame of the MTU,
+ *  at most TOUR_WINDOW, and ends with the branch of base if the tour is
+ *  scattered. A traced packet keeps TRACE_SPACE bytes of the
+ *  frame for the trace and starts with an empty trace section.
+ *  The IP header is left to the sender
  * --------------------------------------------------------------------------
  */
-int IsVisitedPrecedingNode(tourhdr *rthdr, uchar *data) {
-    int i, local, prev;
-    local = rthdr->index - 1;
-    prev = rthdr->index - 2;
-    for (i = 1; i < rthdr->index - 1; i++) {
-        if (strncmp(IP_SEQ(data, i), IP_SEQ(data, local), IPADDR_BUFFSIZE) == 0
-            && strncmp(IP_SEQ(data, i-1), IP_SEQ(data, prev), IPADDR_BUFFSIZE) == 0)
-            return 1;
+int BuildTourPacket(tour_object *obj, tour_session *s, uchar type, uint base, uchar flags, uchar **packet) {
+    uint hopCount, length, room = (flags & TOUR_FLAG_TRACE) ? TRACE_SPACE : 0, end;
+    tourhdr *rthdr;
+    uchar branch;
+
+    end = SessionBranchEnd(s, base, &branch) + 1;
+    hopCount = SegmentWindow(s->ipSeq, end, base, obj->link.mtu - IP4_HDRLEN - TOUR_HDRLEN - room);
+    if (hopCount == 0)
+        return -1;
+
+    length = IP4_HDRLEN + TOUR_HDRLEN + SegmentEncode(NULL, s->ipSeq, end, base, hopCount);
+    *packet = Calloc(length + room, 1);
+
+    rthdr = (tourhdr *)(*packet + IP4_HDRLEN);
+    SegmentEncode(rthdr, s->ipSeq, end, base, hopCount);
+    rthdr->branch = branch;
+    rthdr->branches = s->branches;
+    rthdr->type = type;
+    rthdr->id = htonl(s->id);
+    memcpy(rthdr->grp, s->grp, IPADDR_BUFFSIZE);
+    rthdr->port = htons(s->port);
+    memcpy(rthdr->src, s->src, IPADDR_BUFFSIZE);
+    rthdr->index = htonl(base);
+    rthdr->flags = flags;
+    return (flags & TOUR_FLAG_TRACE) ? length + TRACE_HDRLEN : length;
+}
+
+/* --------------------------------------------------------------------------
+ *  ForwardTour
+ *
+ *  Send a tour packet to the hop it points to
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            uchar         *packet [tour packet]
+ *            int           length  [packet length]
+ *            uint          index   [hop to send to, carried by the window]
+ *  @return : void
+ *
+ *  A traced packet gets the processing time of the local hop just before
+ *  it is sent. Only the first tour of a stream is logged
+ *  A packet of a tour with hop acks is kept until the hop acknowledges it,
+ *  see HopSent()
+ * --------------------------------------------------------------------------
+ */
+void ForwardTour(tour_object *obj, uchar *packet, int length, uint index) {
+    char timeString[TIMESTR_BUFFSIZE], nodeTo[HOSTNAME_BUFFSIZE];
+    struct ip *iphdr = (struct ip *)packet;
+    tourhdr *rthdr = (tourhdr *)(packet + IP4_HDRLEN);
+    struct sockaddr_in sin;
+
+    rthdr->type = TOUR_ROUTE;
+    rthdr->index = htonl(index);
+
+    // fill the IP header
+    BuildIpHeader(iphdr, length, obj->ipaddr, SegmentHop(rthdr, index));
+
+    // fill the sockaddr
+    bzero(&sin, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = iphdr->ip_dst.s_addr;
+
+    if (!TOUR_QUIET(rthdr)) {
+        UtilTime(timeString);
+        UtilIpToHostname((uchar *)&iphdr->ip_dst, nodeTo);
+        printf("[TOUR] <%s> tour %08x sending routing packet to <%s> %u of %u\n", timeString, ntohl(rthdr->id), nodeTo, index + 1, ntohl(rthdr->seqLength));
     }
-    return 0;
+    if (rthdr->flags & TOUR_FLAG_TRACE)
+        TraceSent(rthdr, index - 1);
+    if (rthdr->flags & TOUR_FLAG_ACK)
+        rthdr->hopRtt = htons(min(obj->hopRtt / 1000, 65535));
+    // send to the next node
+    if (TransportSendto(obj->rtSockfd, packet, length, 0, (struct sockaddr *) &sin, sizeof(struct sockaddr)) < 0)
+        err_sys("[TOUR] sendto error");
+    if (rthdr->flags & TOUR_FLAG_ACK)
+        HopSent(obj, packet, length);
 }
 
 /* --------------------------------------------------------------------------
@@ -60,50 +139,181 @@ int IsVisitedPrecedingNode(tourhdr *rthdr, uchar *data) {
  *  @return : void
  *
  *  For node explicitly invoked with tour sequence, start the tour by:
- *  1. Fill the sequence data
- *  2. Create and join a multicast group
- *  3. Fill the tour header
+ *  1. Allocate a tour ID, create and join a multicast group
+ *  2. Keep the sequence in the session, other nodes fetch windows of it
+ *  3. Fill the tour header and the first window of the sequence, with the
+ *     record of hop 0 if the tour is traced
  *  4. Fill the IP header
  *  5. Send tour packet through rtSocket
+ *  With -b the hops between the source and the last node are scattered
+ *  over branches that traverse in parallel, one packet each, and gather
+ *  at the last node, see SessionScatter()
+ *  With -S the tour is a stream of tours pipelined along the sequence,
+ *  see StreamStart()
+ *  With -a every hop acknowledges the tour packets, see hop.c
  * --------------------------------------------------------------------------
  */
 void StartTour(tour_object *obj) {
-    char timeString[TIMESTR_BUFFSIZE], nodeTo[HOSTNAME_BUFFSIZE];
-    struct sockaddr_in sin;
+    char ip[IPSTR_BUFFSIZE];
+    tour_session *s;
+    uchar grp[IPADDR_BUFFSIZE], *packet;
+    int port, length, k;
+    uint32_t id;
+    uint hop;
+
+    // create multicast group
+    id = SessionNewId(obj);
+    CreateMulticastGroup(obj, id, grp, &port);
+    if ((s = SessionCreate(obj, id, grp, port)) == NULL)
+        return;
+    memcpy(s->src, obj->ipaddr, IPADDR_BUFFSIZE);
+    s->hopAck = obj->hopAck;
+    SessionScatter(s, obj->ipSeq, obj->seqLength, obj->branches);
+    SessionExpectMembers(s);
+    if (s->branches)
+        printf("[TOUR] tour %08x scattered into %d branches, gathering at %s.\n", id, s->branches,
+            UtilFormatIp(IP_SEQ(obj->ipSeq, obj->seqLength - 1), ip));
+    if (obj->streamCount) {
+        StreamStart(obj, s);
+        return;
+    }
 
-    uint  length = IP4_HDRLEN + TOUR_HDRLEN + IPADDR_BUFFSIZE * obj->seqLength;
-    uchar *packet = Calloc(length, 1);
+    for (k = 0, hop = 0; k < max(s->branches, 1); k++) {
+        if ((length = BuildTourPacket(obj, s, TOUR_ROUTE, hop, (obj->trace ? TOUR_FLAG_TRACE : 0)
+            | (s->hopAck ? TOUR_FLAG_ACK : 0), &packet)) < 0) {
+            printf("[TOUR] Tour window does not fit in MTU %d.\n", obj->link.mtu);
+            SessionDestroy(obj, s);
+            return;
+        }
+        if (obj->trace)
+            length = IP4_HDRLEN + TraceAppend((tourhdr *)(packet + IP4_HDRLEN), hop, obj->ipaddr, UtilNowNs(), 0);
 
-    struct ip *iphdr = (struct ip *)packet;
-    tourhdr *rthdr = (tourhdr *)(packet + IP4_HDRLEN);
-    uchar *data = packet + IP4_HDRLEN + TOUR_HDRLEN;
+        // point to the next other node
+        ForwardTour(obj, packet, length, hop + 1);
 
-    // fill the sequence data
-    memcpy(data, obj->ipSeq, IPADDR_BUFFSIZE * obj->seqLength);
+        // free the packet
+        free(packet);
+        if (s->branches)
+            hop = s->branchEnd[k] + 1;
+    }
+}
 
-    // fill tour header: create multicast group, fill sequence length
-    // then point to the next other node
-    CreateMulticastGroup(rthdr->grp, &(rthdr->port));
-    JoinMulticastGroup(obj, rthdr->grp, rthdr->port);
-    rthdr->seqLength = obj->seqLength;
-    rthdr->index = 1;
+/* --------------------------------------------------------------------------
+ *  RequestWindow
+ *
+ *  Get the window following the local hop of a tour
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [tour session, windowHop is the local hop]
+ *  @return : void
+ *
+ *  The source builds the window itself. Other nodes send a window request
+ *  to the source and wait WINDOW_RETRY_TIME seconds for the reply, the
+ *  request is sent WINDOW_RETRIES times at most, then the tour is lost
+ *  and its session finished
+ *  The trace of a traced tour waits in the session and moves into the new
+ *  window; the request asks the source to keep room for it
+ * --------------------------------------------------------------------------
+ */
+void RequestWindow(tour_object *obj, tour_session *s) {
+    struct sockaddr_in sin;
+    uchar packet[IP4_HDRLEN + TOUR_HDRLEN], *window;
+    tourhdr *rthdr = (tourhdr *)(packet + IP4_HDRLEN);
+    char ip[IPSTR_BUFFSIZE];
+    int length;
+
+    if (s->ipSeq) {
+        if ((length = BuildTourPacket(obj, s, TOUR_ROUTE, s->windowHop, (s->trace ? TOUR_FLAG_TRACE : 0)
+            | (s->hopAck ? TOUR_FLAG_ACK : 0), &window)) < 0)
+            return;
+        if (s->trace) {
+            length = IP4_HDRLEN + TraceRestore((tourhdr *)(window + IP4_HDRLEN), s->trace);
+            free(s->trace);
+            s->trace = NULL;
+        }
+        ForwardTour(obj, window, length, s->windowHop + 1);
+        free(window);
+        return;
+    }
 
-    // fill the IP header
-    BuildIpHeader(iphdr, length, obj->ipaddr, IP_SEQ(data, rthdr->index));
+    if (s->windowRetries++ == WINDOW_RETRIES) {
+        printf("[TOUR] tour %08x lost, the source did not send the next window.\n", s->id);
+        SessionSetState(s, TOUR_FINISHED, 0);
+        return;
+    }
+
+    bzero(packet, sizeof(packet));
+    rthdr->version = TOUR_VERSION;
+    rthdr->type = TOUR_WINDOW_REQ;
+    rthdr->flags = (s->trace ? TOUR_FLAG_TRACE : 0) | (s->hopAck ? TOUR_FLAG_ACK : 0);
+    rthdr->id = htonl(s->id);
+    rthdr->index = htonl(s->windowHop);
+    BuildIpHeader((struct ip *)packet, sizeof(packet), obj->ipaddr, s->src);
 
-    // fill the sockaddr
     bzero(&sin, sizeof(struct sockaddr_in));
     sin.sin_family = AF_INET;
-    sin.sin_addr.s_addr = iphdr->ip_dst.s_addr;
+    memcpy(&sin.sin_addr, s->src, IPADDR_BUFFSIZE);
 
-    UtilTime(timeString);
-    UtilIpToHostname((uchar *)&iphdr->ip_dst, nodeTo);
-    printf("[TOUR] <%s> sending routing packet to <%s> %d of %d\n", timeString, nodeTo, rthdr->index + 1, rthdr->seqLength);
-    // send to the next node
-    Sendto(obj->rtSockfd, packet, length, 0, (struct sockaddr *) &sin, sizeof(struct sockaddr));
+    printf("[TOUR] tour %08x requesting the window from hop %u of %s\n", s->id, s->windowHop + 1, UtilFormatIp(s->src, ip));
+    if (TransportSendto(obj->rtSockfd, packet, sizeof(packet), 0, (struct sockaddr *) &sin, sizeof(struct sockaddr)) < 0)
+        err_sys("[TOUR] sendto error");
+    SessionSetState(s, TOUR_AWAIT_WINDOW, WINDOW_RETRY_TIME * 1000);
+}
 
-    // free the packet
-    free(packet);
+/* --------------------------------------------------------------------------
+ *  ProcessWindow
+ *
+ *  Process a window request or reply
+ *
+ *  @param  : tour_object   *obj    [tour object]
+ *            struct ip     *iphdr  [received packet]
+ *            int           length  [received bytes]
+ *  @return : void
+ *
+ *  The source answers a request with the window starting at the requested
+ *  hop. The node waiting for that window forwards the tour with it, after
+ *  putting back the trace it kept. The receive buffer has TRACE_SPACE
+ *  spare bytes for it
+ * --------------------------------------------------------------------------
+ */
+void ProcessWindow(tour_object *obj, struct ip *iphdr, int length) {
+    tourhdr *rthdr = (tourhdr *)((uchar *)iphdr + IP4_HDRLEN);
+    tour_session *s = SessionFind(obj, ntohl(rthdr->id));
+    struct sockaddr_in sin;
+    uchar *packet;
+    uint hop = ntohl(rthdr->index);
+    int n;
+
+    if (s == NULL)
+        return;
+
+    if (rthdr->type == TOUR_WINDOW_REQ) {
+        if (s->ipSeq == NULL || hop + 1 >= (uint)s->seqLength)
+            return;
+        if ((n = BuildTourPacket(obj, s, TOUR_WINDOW_REP, hop, rthdr->flags & (TOUR_FLAG_TRACE | TOUR_FLAG_ACK), &packet)) < 0)
+            return;
+        BuildIpHeader((struct ip *)packet, n, obj->ipaddr, (uchar *)&iphdr->ip_src);
+
+        bzero(&sin, sizeof(struct sockaddr_in));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = iphdr->ip_src.s_addr;
+        if (TransportSendto(obj->rtSockfd, packet, n, 0, (struct sockaddr *) &sin, sizeof(struct sockaddr)) < 0)
+            err_sys("[TOUR] sendto error");
+        free(packet);
+        return;
+    }
+
+    // window reply, ignore duplicates and late replies
+    if (s->state != TOUR_AWAIT_WINDOW || hop != s->windowHop
+        || ntohl(rthdr->base) + ntohl(rthdr->hopCount) < hop + 2)
+        return;
+    SessionSetState(s, TOUR_TRAVERSING, TOUR_IDLE_TIME * 1000);
+    if (s->trace && (rthdr->flags & TOUR_FLAG_TRACE)) {
+        length = IP4_HDRLEN + TraceRestore(rthdr, s->trace);
+        free(s->trace);
+        s->trace = NULL;
+    }
+    ForwardTour(obj, (uchar *)iphdr, length, hop + 1);
 }
 
 /* --------------------------------------------------------------------------
@@ -115,73 +325,167 @@ void StartTour(tour_object *obj) {
  *  @return : void
  *
  *  For received tour packet
- *  1. Check the identification field
- *  2. If it is first time visit the node, join the multicast group
+ *  1. Check the identification field and the tour segment, pass window
+ *     packets and stream and hop acks on. Acknowledge the packet to the
+ *     preceding node if the tour asks for it, a packet received before or
+ *     belonging to a tour ended here is not processed again
+ *  2. If it is first time the tour visits the node, create the tour session
+ *     keyed by the tour ID and join the multicast group
  *  3. If the tour is not finished, modify the index in tour header then
- *     send to next node; Otherwise, wait for the echo replies then start
- *     multicast process
+ *     send to next node, fetching the next window first if the carried one
+ *     ends at the local hop; Otherwise, arm the PING_WAIT_TIME timer, the
+ *     multicast process starts when it expires. The gather node of a
+ *     scattered tour arms it once every branch has arrived, the last node
+ *     of a stream acknowledges every tour and arms it again each time
+ *  The preceding node is resolved by a non-blocking ARP request, the ping
+ *  starts when its response arrives
+ *  The receive buffer grows to the size of the pending datagram, at most
+ *  IP_MAXPACKET, plus TRACE_SPACE, so that a traced tour can append its
+ *  record in place; a datagram it cannot grow for is dropped. The record
+ *  takes the kernel arrival time of the packet, the last node
+ *  prints the trace
+ *  The tours of a stream after the first one only cost the session lookup
+ *  and the forwarding, the group is joined and the preceding node pinged
+ *  once per session
  * --------------------------------------------------------------------------
  */
 void ProcessTour(tour_object *obj) {
-    char timeString[TIMESTR_BUFFSIZE], nodeFrom[HOSTNAME_BUFFSIZE], nodeTo[HOSTNAME_BUFFSIZE];
-    struct sockaddr_in sin, preceding;
-    struct hwaddr HWaddr;
-    uchar pktBuff[PACKET_BUFFSIZE];
-    struct ip *iphdr = (struct ip *) pktBuff;
-    tourhdr *rthdr = (tourhdr *) (pktBuff + IP4_HDRLEN);
-    uchar *data = pktBuff + IP4_HDRLEN + TOUR_HDRLEN;
-
-    Recvfrom(obj->rtSockfd, pktBuff, PACKET_BUFFSIZE, 0, NULL, NULL);
+    char timeString[TIMESTR_BUFFSIZE], nodeFrom[HOSTNAME_BUFFSIZE];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct sockaddr_in preceding;
+    struct msghdr msg;
+    struct iovec iov;
+    tour_session *s;
+    struct ip *iphdr;
+    tourhdr *rthdr;
+    uint index, seqLength;
+    uint32_t queue;
+    uint64_t now;
+    uchar *buff;
+    int n, quiet;
+
+    n = TransportRecvfrom(obj->rtSockfd, NULL, 0, MSG_PEEK | MSG_TRUNC, NULL, NULL);
+    n = min(n, IP_MAXPACKET);
+    if (n + TRACE_SPACE > obj->rxSize) {
+        if ((buff = realloc(obj->rxBuff, n + TRACE_SPACE)) == NULL) {
+            printf("[TOUR] No memory for a %d byte packet, dropped.\n", n);
+            TransportRecvfrom(obj->rtSockfd, obj->rxBuff, obj->rxSize, 0, NULL, NULL);
+            return;
+        }
+        obj->rxBuff = buff;
+        obj->rxSize = n + TRACE_SPACE;
+    }
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = obj->rxBuff;
+    iov.iov_len = obj->rxSize - TRACE_SPACE;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    n = TransportRecvmsg(obj->rtSockfd, &msg, 0);
+    now = UtilNowNs();
+    queue = TraceQueueTime(&msg);
+    iphdr = (struct ip *) obj->rxBuff;
+    rthdr = (tourhdr *) (obj->rxBuff + IP4_HDRLEN);
 
     // ignore invalid packet (identification field != TOUR_ID_CODE)
-    if (iphdr->ip_id != TOUR_ID_CODE)
+    if (n < IP4_HDRLEN || iphdr->ip_id != TOUR_ID_CODE || iphdr->ip_hl != IP4_HDRLEN / 4)
         return;
+    if (SegmentCheck(rthdr, n - IP4_HDRLEN) < 0) {
+        printf("[TOUR] Ignore malformed tour packet.\n");
+        return;
+    }
+    if (rthdr->type == TOUR_STREAM_ACK) {
+        if (rthdr->flags & TOUR_FLAG_ACK)
+            HopReply(obj, iphdr);
+        StreamAck(obj, rthdr);
+        return;
+    }
+    if (rthdr->type == TOUR_HOP_ACK) {
+        HopAck(obj, iphdr);
+        return;
+    }
+    if (rthdr->type != TOUR_ROUTE) {
+        ProcessWindow(obj, iphdr, n);
+        return;
+    }
+    // first, the hop RTT of the preceding node ends with the ack
+    if (rthdr->flags & TOUR_FLAG_ACK)
+        HopReply(obj, iphdr);
+
+    quiet = TOUR_QUIET(rthdr);
+    if (!quiet) {
+        UtilTime(timeString);
+        UtilIpToHostname((uchar *)&iphdr->ip_src, nodeFrom);
+        printf("[TOUR] <%s> tour %08x received routing packet from <%s>\n", timeString, ntohl(rthdr->id), nodeFrom);
+    }
 
-    UtilTime(timeString);
-    UtilIpToHostname((uchar *)&iphdr->ip_src, nodeFrom);
-    printf("[TOUR] <%s> received routing packet from <%s>\n", timeString, nodeFrom);
-
-    // check if already in the multicast group
-    if (obj->mcastPort != rthdr->port)
-        JoinMulticastGroup(obj, rthdr->grp, rthdr->port);
+    // check if already in the tour
+    if ((s = SessionFind(obj, ntohl(rthdr->id))) == NULL) {
+        // a late resend of a tour ended here is acknowledged, not toured again
+        if ((rthdr->flags & TOUR_FLAG_ACK) && SessionEnded(obj, ntohl(rthdr->id))) {
+            if (!quiet)
+                printf("[TOUR] tour %08x hop %u received after the tour ended, ignored.\n",
+                    ntohl(rthdr->id), ntohl(rthdr->index) + 1);
+            return;
+        }
+        if ((s = SessionCreate(obj, ntohl(rthdr->id), rthdr->grp, ntohs(rthdr->port))) == NULL)
+            return;
+        memcpy(s->src, rthdr->src, IPADDR_BUFFSIZE);
+    }
+    // the tour is alive, keep waiting for its roll call
+    if (s->state == TOUR_TRAVERSING)
+        SessionSetState(s, TOUR_TRAVERSING, TOUR_IDLE_TIME * 1000);
+    if (rthdr->flags & TOUR_FLAG_ACK) {
+        s->hopAck = 1;
+        if (SessionReceive(s, rthdr)) {
+            if (!quiet)
+                printf("[TOUR] tour %08x hop %u received before, ignored.\n", s->id, ntohl(rthdr->index) + 1);
+            return;
+        }
+    }
 
-    rthdr->index++;
-    if (rthdr->index < rthdr->seqLength) {
+    // the sender is the preceding node, even when the window starts at
+    // this hop; keep it before forwarding rewrites the IP header in place
+    bzero(&preceding, sizeof(struct sockaddr_in));
+    preceding.sin_family = AF_INET;
+    preceding.sin_addr = iphdr->ip_src;
+
+    index = ntohl(rthdr->index) + 1;
+    seqLength = ntohl(rthdr->seqLength);
+    if (rthdr->flags & TOUR_FLAG_TRACE)
+        n = IP4_HDRLEN + TraceAppend(rthdr, index - 1, obj->ipaddr, now - queue, queue);
+    if (index >= seqLength) {
+        if (!quiet)
+            printf("[TOUR] <%s> routing packet reached the last node.\n", timeString);
+        if (rthdr->flags & TOUR_FLAG_TRACE)
+            TraceReport(rthdr);
+    } else if (index < ntohl(rthdr->base) + ntohl(rthdr->hopCount)) {
         // send to next
-        // fill the IP header
-        BuildIpHeader(iphdr, ntohs(iphdr->ip_len), obj->ipaddr, IP_SEQ(data, rthdr->index));
-
-        // fill the sockaddr
-        bzero(&sin, sizeof(struct sockaddr_in));
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = iphdr->ip_dst.s_addr;
-
-        UtilIpToHostname((uchar *)&iphdr->ip_dst, nodeTo);
-        printf("[TOUR] <%s> sending routing packet to <%s> %d of %d\n", timeString, nodeTo, rthdr->index + 1, rthdr->seqLength);
-        // send to the next node
-        Sendto(obj->rtSockfd, pktBuff, ntohs(iphdr->ip_len), 0, (struct sockaddr *) &sin, sizeof(struct sockaddr));
+        ForwardTour(obj, obj->rxBuff, n, index);
     } else {
-        printf("[TOUR] <%s> routing packet reached the last node.\n", timeString);
+        // the carried window ends here
+        s->windowHop = index - 1;
+        s->windowRetries = 0;
+        free(s->trace);
+        s->trace = (rthdr->flags & TOUR_FLAG_TRACE) ? TraceSave(rthdr) : NULL;
+        RequestWindow(obj, s);
     }
+    rthdr->index = htonl(index);
 
-    // check if preceding node has been visited in the same order
-    if (IsVisitedPrecedingNode(rthdr, data) == 0) {
+    // check if preceding node has been pinged by local node before
+    if (SessionVisit(s, (uchar *)&preceding.sin_addr, SegmentHop(rthdr, index - 1)) == 0) {
         printf("[TOUR] New preceding node, call areq and ping.\n");
-        bzero(&preceding, sizeof(struct sockaddr_in));
-        sin.sin_family = AF_INET;
-        memcpy((void *)&preceding.sin_addr, IP_SEQ(data, rthdr->index - 2), IPADDR_BUFFSIZE);
-
-        bzero(&HWaddr, sizeof(struct hwaddr));
-        areq((struct sockaddr *) &preceding, sizeof(preceding), &HWaddr);
-
-        Ping(obj, &preceding, &HWaddr);
-    } else {
+        SessionStartAreq(obj, s, &preceding);
+    } else if (!quiet) {
         printf("[TOUR] Preceding node has been pinged before.\n");
     }
 
-    if (rthdr->index == rthdr->seqLength) {
-        sleep(5);
-        StartMulticast(obj, rthdr->grp, rthdr->port);
+    if (index == seqLength && SessionGather(s, rthdr)) {
+        if (rthdr->flags & TOUR_FLAG_STREAM)
+            StreamArrive(obj, s, rthdr);
+        if (s->state == TOUR_TRAVERSING || s->state == TOUR_AWAIT_PING)
+            SessionSetState(s, TOUR_AWAIT_PING, PING_WAIT_TIME * 1000);
     }
 
 }
@@ -192,22 +496,148 @@ void ProcessTour(tour_object *obj) {
  *  Exit the tour process
  *
  *  @param  : tour_object   *obj    [tour object]
+ *            tour_session  *s      [finished tour]
  *  @return : void
  *
- *  Stop the tour process and clean tour sequence and multicast information
+ *  Stop the tour process and clean the session and multicast information
+ *  Cancel the pings started by the tour, once no tour is active print the
+ *  RTT statistics of every pinged node
  * --------------------------------------------------------------------------
  */
-void FinishTour(tour_object *obj) {
-    printf("[TOUR] <%s> tour has ended.\n", obj->hostname);
+void FinishTour(tour_object *obj, tour_session *s) {
+    printf("[TOUR] <%s> tour %08x has ended.\n", obj->hostname, s->id);
+    PingCancel(obj, s);
 
-    obj->seqLength = 0;
-    if (obj->nodeSeq)
-        free(obj->nodeSeq);
-    if (obj->ipSeq)
-        free(obj->ipSeq);
-    obj->nodeSeq = NULL;
-    obj->ipSeq = NULL;
-    LeaveMulticastGroup(obj, obj->mcastAddr, obj->mcastPort);
+    SessionDestroy(obj, s);
+    if (obj->sessionCount == 0)
+        PingSummary(obj);
+}
+
+/* --------------------------------------------------------------------------
+ *  ParseOptions
+ *
+ *  Parse the command line options
+ *
+ *  @param  : int           argc
+ *            char          **argv
+ *            tour_object   *obj    [tour object]
+ *            ping_config   *cfg    [ping options]
+ *  @return : int           [index of the first tour sequence argument]
+ *
+ *  Options precede the tour sequence:
+ *    -I ifname     tour interface (default: the one owning the node's IP)
+ *    -n tours      start the tour sequence this many times at once (default 1,
+ *                  at most 512)
+ *    -g range      multicast groups of started tours are 239.<range>.0.0/16
+ *                  (default 83)
+ *    -t            trace started tours, the last node prints per-hop times
+ *    -b branches   scatter started tours over parallel branches gathering
+ *                  at the last node (default 1)
+ *    -S tours      make each started tour a stream of this many tours
+ *    -W window     tours of a stream in flight at most     (default 16)
+ *    -a            every hop acknowledges the packets of started tours,
+ *                  lost ones are resent
+ *    -c count      probes per pinged node                 (default 4)
+ *    -i interval   seconds between probes, e.g. 0.0005    (default 1)
+ *    -s size       ICMP payload bytes, up to the MTU      (default 8)
+ *    -f            flood, keep up to <window> probes in flight
+ *    -l window     max outstanding probes in flood mode   (default 64)
+ *    -H            enable NIC hardware timestamping, restored at exit
+ *    -w file       capture the received tour and ICMP packets to a pcap file
+ *    -r file       replay a pcap file instead of the network, see transport.c
+ *    -m file       RTT matrix, loaded at start, the pings update it
+ *    -O            reorder the hops of the tour sequence for the lowest RTT
+ *                  sum on the matrix of -m, @node keeps its place
+ * --------------------------------------------------------------------------
+ */
+int ParseOptions(int argc, char **argv, tour_object *obj, ping_config *cfg) {
+    int c;
+
+    cfg->count = PING_DEF_COUNT;
+    cfg->interval = PING_DEF_INTERVAL;
+    cfg->dataLen = PING_MIN_DATALEN;
+    cfg->flood = 0;
+    cfg->window = PING_DEF_WINDOW;
+    cfg->hwStamp = 0;
+    obj->tourCount = 1;
+    obj->mcastRange = MCAST_RANGE;
+    obj->streamWindow = STREAM_WINDOW;
+
+    while ((c = getopt(argc, argv, "I:n:g:tb:S:W:ac:i:s:fl:Hw:r:m:O")) != -1) {
+        switch (c) {
+        case 'I':
+            snprintf(obj->link.ifname, IFNAMSIZ, "%s", optarg);
+            break;
+        case 'n':
+            obj->tourCount = atoi(optarg);
+            break;
+        case 'g':
+            if (atoi(optarg) < 0 || atoi(optarg) > 255)
+                err_quit("[TOUR] multicast range must be 0-255");
+            obj->mcastRange = atoi(optarg);
+            break;
+        case 't':
+            obj->trace = 1;
+            break;
+        case 'b':
+            obj->branches = atoi(optarg);
+            break;
+        case 'S':
+            obj->streamCount = atoi(optarg);
+            break;
+        case 'W':
+            obj->streamWindow = atoi(optarg);
+            break;
+        case 'a':
+            obj->hopAck = 1;
+            break;
+        case 'c':
+            cfg->count = atoi(optarg);
+            break;
+        case 'i':
+            cfg->interval = (uint)(atof(optarg) * 1000000);
+            break;
+        case 's':
+            cfg->dataLen = atoi(optarg);
+            break;
+        case 'f':
+            cfg->flood = 1;
+            break;
+        case 'l':
+            cfg->window = atoi(optarg);
+            break;
+        case 'H':
+            cfg->hwStamp = 1;
+            break;
+        case 'w':
+            TransportInit(TRANSPORT_CAPTURE, optarg);
+            break;
+        case 'r':
+            TransportInit(TRANSPORT_REPLAY, optarg);
+            break;
+        case 'm':
+            obj->routeFile = optarg;
+            break;
+        case 'O':
+            obj->optimize = 1;
+            break;
+        default:
+            err_quit("usage: %s [-I ifname] [-n tours] [-g range] [-t] [-b branches] [-S tours [-W window]] [-a] [-c count] [-i interval] [-s size] [-f] [-l window] [-H] [-w file | -r file] [-m file [-O]] [node ...]", argv[0]);
+        }
+    }
+    if (obj->optimize && obj->routeFile == NULL)
+        err_quit("[TOUR] -O needs the RTT matrix of -m");
+    if (cfg->count < 1)
+        err_quit("[TOUR] ping count must be at least 1");
+    if (obj->tourCount < 1 || obj->tourCount > TOUR_MAX_TOURS)
+        err_quit("[TOUR] tour count must be 1-%d", TOUR_MAX_TOURS);
+    if (obj->branches < 0 || obj->branches > TOUR_MAX_BRANCHES)
+        err_quit("[TOUR] branches must be 1-%d", TOUR_MAX_BRANCHES);
+    if (obj->streamCount < 0 || obj->streamWindow < 1)
+        err_quit("[TOUR] stream tours must be positive, window at least 1");
+    if (obj->streamCount && (obj->trace || obj->branches > 1))
+        err_quit("[TOUR] -S does not mix with -t or -b");
+    return optind;
 }
 
 /* --------------------------------------------------------------------------
@@ -222,9 +652,13 @@ void FinishTour(tour_object *obj) {
  *
  *  Parse the tour sequence, remove the same nodes appear consequentively
  *  If the final sequence is only source itself, the tour sequence is invalid
+ *  A node prefixed with ROUTE_FIXED keeps its place when the sequence is
+ *  optimized (-O), like the source and the last node
  * --------------------------------------------------------------------------
  */
 void ParseArguments(int argc, char **argv, tour_object *obj) {
+    char ip[IPSTR_BUFFSIZE], *name;
+    uchar *fixed;
     int i, j;
 
     // return if the traversal sequence does not exist
@@ -240,17 +674,22 @@ void ParseArguments(int argc, char **argv, tour_object *obj) {
 
     // the source: the node itself
     strncpy(NODE_SEQ(obj->nodeSeq, 0), obj->hostname, HOSTNAME_BUFFSIZE);
-    strncpy(IP_SEQ(obj->ipSeq, 0), obj->ipaddr, IPADDR_BUFFSIZE);
+    memcpy(IP_SEQ(obj->ipSeq, 0), obj->ipaddr, IPADDR_BUFFSIZE);
 
+    fixed = Calloc(obj->seqLength, 1);
     j = 1;
 
     // copy node name and convert it into IP address
     for (i = 1; i < argc; i++) {
+        name = argv[i][0] == ROUTE_FIXED ? argv[i] + 1 : argv[i];
         // skip if previous node is the same as current node
-        if (strcmp(NODE_SEQ(obj->nodeSeq, j - 1), argv[i]) == 0)
+        if (strcmp(NODE_SEQ(obj->nodeSeq, j - 1), name) == 0) {
+            fixed[j - 1] |= name != argv[i];
             continue;
-        strncpy(NODE_SEQ(obj->nodeSeq, j), argv[i], HOSTNAME_BUFFSIZE);
+        }
+        strncpy(NODE_SEQ(obj->nodeSeq, j), name, HOSTNAME_BUFFSIZE);
         UtilHostnameToIp(NODE_SEQ(obj->nodeSeq, j), IP_SEQ(obj->ipSeq, j));
+        fixed[j] = name != argv[i];
         j++;
     }
 
@@ -261,16 +700,21 @@ void ParseArguments(int argc, char **argv, tour_object *obj) {
         free(obj->ipSeq);
         obj->nodeSeq = NULL;
         obj->ipSeq = NULL;
+        free(fixed);
         return;
     } else {
         obj->seqLength = j;
+        if (obj->optimize)
+            RouteOptimize(obj, fixed);
         obj->nodeSeq = realloc(obj->nodeSeq, obj->seqLength * HOSTNAME_BUFFSIZE);
         obj->ipSeq = realloc(obj->ipSeq, obj->seqLength * IPADDR_BUFFSIZE);
     }
 
+    free(fixed);
+
     printf("[TOUR] Received node sequence(%d) from command line arguments:\n", obj->seqLength);
     for (i = 0; i < obj->seqLength; i++)
-        printf("%*s - %-*s%s\n", HOSTNAME_BUFFSIZE, NODE_SEQ(obj->nodeSeq, i), IPSTR_BUFFSIZE, UtilIpToString(IP_SEQ(obj->ipSeq, i)), (i == 0) ? " * source" : "");
+        printf("%*s - %-*s%s\n", HOSTNAME_BUFFSIZE, NODE_SEQ(obj->nodeSeq, i), IPSTR_BUFFSIZE, UtilFormatIp(IP_SEQ(obj->ipSeq, i), ip), (i == 0) ? " * source" : "");
 }
 
 /* --------------------------------------------------------------------------
@@ -281,45 +725,55 @@ void ParseArguments(int argc, char **argv, tour_object *obj) {
  *  @param  : tour_object   *obj    [tour object]
  *  @return : void
  *
- *  Create two IP raw sockets, one PF_PACKET socket and two UDP socket
+ *  Create two IP raw sockets, one PF_PACKET socket and one UDP socket
+ *  The receiving multicast sockets are created per group when joined
+ *  Tour and multicast traffic is pinned to the local link interface
+ *  The raw sockets are created by the transport, which may replay them
  * --------------------------------------------------------------------------
  */
 void CreateSockets(tour_object *obj) {
     const int on = 1;
-    struct sockaddr_in mcastaddr;
-    uchar grp[4];
-    int port;
+    struct ip_mreqn mreq;
+    struct sockaddr_in addr;
 
     // rtSocket: IP raw socket
     //           used for tour packet
     //   option: IP_HDRINCL
-    obj->rtSockfd = Socket(AF_INET, SOCK_RAW, TOUR_PROTOCOL_ID);
-    Setsockopt(obj->rtSockfd, IPPROTO_IP, IP_HDRINCL, &on, sizeof(on));
+    //   option: SO_TIMESTAMPNS, arrival time of traced tours
+    obj->rtSockfd = TransportSocket(AF_INET, SOCK_RAW, TOUR_PROTOCOL_ID);
+    if (TransportSetsockopt(obj->rtSockfd, IPPROTO_IP, IP_HDRINCL, &on, sizeof(on)) < 0
+        || TransportSetsockopt(obj->rtSockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0
+        || TransportSetsockopt(obj->rtSockfd, SOL_SOCKET, SO_BINDTODEVICE, obj->link.ifname, strlen(obj->link.ifname) + 1) < 0)
+        err_sys("[TOUR] setsockopt error");
 
-    obj->pgSockfd = Socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    obj->pgSockfd = TransportSocket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
 
-    obj->pfSockfd = Socket(PF_PACKET, SOCK_RAW, ETH_P_IP);
+    obj->pfSockfd = TransportSocket(PF_PACKET, SOCK_RAW, ETH_P_IP);
 
     // msSocket: UDP socket
     //           used for sending multicast datagram
+    //           and receiving the identifications of our tours
     //   option: SO_REUSEADDR
     //   option: IP_MULTICAST_TTL = 1
+    //   option: IP_MULTICAST_IF = tour interface
+    //     bind: INADDR_ANY:MCAST_IDENTIFY_PORT
     obj->msSockfd = Socket(AF_INET, SOCK_DGRAM, 0);
     Setsockopt(obj->msSockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
     Setsockopt(obj->msSockfd, IPPROTO_IP, IP_MULTICAST_TTL, &on, sizeof(on));
-
-    // mrSocket: UDP socket
-    //           used for receiving multicast datagram
-    //   option: SO_REUSEADDR
-    obj->mrSockfd = Socket(AF_INET, SOCK_DGRAM, 0);
-    Setsockopt(obj->mrSockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-    CreateMulticastGroup(grp, &port);
-    // bind UDP socket to multicast group address / port
-    bzero(&mcastaddr, sizeof(mcastaddr));
-    mcastaddr.sin_family = AF_INET;
-    memcpy(&mcastaddr.sin_addr, grp, IPADDR_BUFFSIZE);
-    mcastaddr.sin_port = htons(port);
-    Bind(obj->mrSockfd, (struct sockaddr *)&mcastaddr, sizeof(mcastaddr));
+    bzero(&mreq, sizeof(mreq));
+    mreq.imr_ifindex = obj->link.ifindex;
+    Setsockopt(obj->msSockfd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq));
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(MCAST_IDENTIFY_PORT);
+    Bind(obj->msSockfd, (struct sockaddr *)&addr, sizeof(addr));
+
+    // mrSocket: UDP socket per multicast group, see JoinMulticastGroup()
+
+    // tour receive buffer, grows for larger datagrams
+    obj->rxSize = obj->link.mtu;
+    obj->rxBuff = Malloc(obj->rxSize);
 }
 
 /* --------------------------------------------------------------------------
@@ -331,32 +785,55 @@ void CreateSockets(tour_object *obj) {
  *  @return : void
  *
  *  Process the incoming message from sockets
+ *  This is the only place the tour process waits: every wait of a tour
+ *  (ARP response, pings before the roll call, roll call silence) is a
+ *  session timer, and select() sleeps until the earliest one
  * --------------------------------------------------------------------------
  */
 void ProcessSockets(tour_object *obj) {
-    int maxfdp1 = max(obj->rtSockfd, obj->mrSockfd) + 1;
-    int r;
+    int maxfd, r;
     fd_set rset;
+    struct timeval tv;
 
-    FD_ZERO(&rset);
     while (1) {
+        FD_ZERO(&rset);
         FD_SET(obj->rtSockfd, &rset);
-        FD_SET(obj->mrSockfd, &rset);
+        FD_SET(obj->link.nlSockfd, &rset);
+        FD_SET(obj->msSockfd, &rset);
+        maxfd = max(max(obj->rtSockfd, obj->link.nlSockfd), obj->msSockfd);
+        maxfd = SessionFdSet(obj, &rset, maxfd);
 
-        r = select(maxfdp1, &rset, NULL, NULL, NULL);
+        r = select(maxfd + 1, &rset, NULL, NULL, SessionNextTimeout(obj, &tv));
 
         if (r == -1 && errno == EINTR)
             continue;
+        if (r == -1)
+            err_sys("[TOUR] select error");
+
+        if (r == 0) {
+            // timer expired
+            SessionRunTimers(obj);
+            continue;
+        }
 
         if (FD_ISSET(obj->rtSockfd, &rset)) {
             // from rt socket
             ProcessTour(obj);
         }
-        if (FD_ISSET(obj->mrSockfd, &rset)) {
-            // from UDP multicast socket
-            ProcessMulticast(obj);
+        if (FD_ISSET(obj->link.nlSockfd, &rset)) {
+            // from netlink socket, local link changed
+            LinkProcessEvents(obj);
+        }
+        if (FD_ISSET(obj->msSockfd, &rset)) {
+            // from ms socket, identifications of our tours
+            ProcessMulticast(obj, obj->msSockfd);
         }
+        // from UDP multicast sockets, one per group
+        SessionProcessMulticast(obj, &rset);
+        // from domain sockets, ARP responses
+        SessionProcessAreqs(obj, &rset);
 
+        SessionRunTimers(obj);
     }
 
 }
@@ -375,30 +852,49 @@ void ProcessSockets(tour_object *obj) {
  */
 int main(int argc, char **argv) {
     int i;
+    char ip[IPSTR_BUFFSIZE];
+    ping_config pingCfg;
 
     // init tour_object
     tour_object obj;
     bzero(&obj, sizeof(tour_object));
 
+    // every log line is built by one printf, flush it with one write
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    // roll call delays must differ between nodes
+    srandom((uint)(UtilNowNs() ^ getpid()));
+
+    // parse options, the remaining arguments are the tour sequence
+    i = ParseOptions(argc, argv, &obj, &pingCfg);
+    argc -= i - 1;
+    argv += i - 1;
+
     // get hostname and primary IP address of the node
     UtilHostname(obj.hostname);
     UtilHostnameToIp(obj.hostname, obj.ipaddr);
 
-    printf("[TOUR] module started on %s (%s).\n", obj.hostname, UtilIpToString(obj.ipaddr));
+    printf("[TOUR] module started on %s (%s).\n", obj.hostname, UtilFormatIp(obj.ipaddr, ip));
 
-    // parse arguments to tour sequence
+    // parse arguments to tour sequence, on the RTTs of earlier tours
+    if (obj.routeFile)
+        RouteLoad(&obj);
     ParseArguments(argc, argv, &obj);
 
+    // resolve the local interface once
+    LinkInit(&obj);
+
     // create sockets
     CreateSockets(&obj);
+    PingInit(&obj, &pingCfg);
+    TransportStart(obj.link.ifindex);
 
     if (obj.seqLength > 0) {
         // as the source node, initial route traversal
-        StartTour(&obj);
+        for (i = 0; i < obj.tourCount; i++)
+            StartTour(&obj);
     }
 
     // process the incoming frame/packet from sockets
     ProcessSockets(&obj);
-
-
+    return 0;
 }
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <net/ethernet.h>
 #include <netinet/ip.h>
@@ -10,30 +11,91 @@
 #include <linux/if_ether.h>
 #include <linux/if_arp.h>
 #include "unp.h"
+#include "transport.h"
 
 #define TOUR_PROTOCOL_ID    222
 #define TOUR_ID_CODE        14508
 #define ARP_PROTOCOL_ID     14508
 #define ARP_ID_CODE         61375
 
-#define MCAST_ADDRESS       {0xee, 0x5c, 0x53, 0x12}
-#define MCAST_PORT          7518
+#define MCAST_RANGE         83      // tour groups are 239.<range>.0.0/16
+#define MCAST_PORT          7518    // first port of the tour groups
+#define MCAST_PORT_RANGE    512     // ports of the tour groups
+#define MCAST_IDENTIFY_PORT 7517    // unicast identifications to the source
 
 #define IPADDR_BUFFSIZE     4
 #define HWADDR_BUFFSIZE     6
 #define HOSTNAME_BUFFSIZE   10
 #define PATHNAME_BUFFSIZE   108
 #define IPSTR_BUFFSIZE      16
+#define MACSTR_BUFFSIZE     18
 #define TIMESTR_BUFFSIZE    60
-#define PACKET_BUFFSIZE     1024
 #define MCAST_BUFFSIZE      100
 #define PING_BUFFSIZE       10
 
+#define AREQ_TIMEOUT        3   // seconds to wait for the ARP service
+#define PING_WAIT_TIME      5   // seconds the last node pings before roll call
+#define MCAST_IDLE_TIME     5   // seconds of roll call silence ending a tour
+#define TOUR_IDLE_TIME      60  // seconds a passed tour waits for its roll call
+#define ROLLCALL_SPREAD     500 // max ms a member delays its identification
+
+#define SESSION_HASH_SIZE   256 // buckets of the tour session table
+#define TOUR_MAX_TOURS      512 // tours started at once (-n), one socket each
+
+#define ROUTE_HASH_SIZE     1024    // buckets of the RTT matrix
+#define ROUTE_MAX_HOPS      2048    // free hops one segment may reorder
+#define ROUTE_PASSES        100     // 2-opt passes at most
+#define ROUTE_FIXED         '@'     // prefix of a hop that keeps its place
+
+#define RESOLVER_HASH_SIZE  1024    // buckets of each resolver cache table
+#define RESOLVER_NAMESIZE   64      // longest cached host name
+#define RESOLVER_QUEUE_SIZE 64      // pending reverse lookups
+#define RESOLVER_POSITIVE_TTL   300 // seconds a resolved entry is trusted
+#define RESOLVER_NEGATIVE_TTL   30  // seconds a failed lookup is trusted
+
 #define IP4_HDRLEN          20  // IPv4 header length
-#define TOUR_HDRLEN         8   // TOUR header length, excludes data
+#define TOUR_VERSION        5   // TOUR header version
+#define TOUR_HDRLEN         44  // TOUR header length, excludes data
+#define TOUR_MAX_NODES      65535   // unique nodes of one window
+#define TOUR_WINDOW         256 // hops carried by one tour packet
+#define WINDOW_RETRY_TIME   1   // seconds before a window request is resent
+#define WINDOW_RETRIES      3   // window requests before giving up
+#define TOUR_MAX_BRANCHES   64  // branches of a scattered tour
+#define STREAM_WINDOW       16  // tours of a stream in flight by default
+#define STREAM_RTO_TIME     1   // seconds before a tour is lost, until an RTT is known
+#define HOP_RTO_TIME        200 // ms before a hop is resent, until an RTT is known
+#define HOP_RETRIES         5   // retransmissions of a hop before giving up
+#define HOP_DUPACKS         3   // later tours acked on a hop, resend it at once
+#define HOP_ENDED_TOURS     256 // ended tours whose late resends are dropped
+#define HOP_ENDED_TIME      30  // seconds an ended tour drops its late resends
+
+// tour packet types
+#define TOUR_ROUTE          0   // the tour itself
+#define TOUR_WINDOW_REQ     1   // ask the source for the next window
+#define TOUR_WINDOW_REP     2   // next window, from the source
+#define TOUR_STREAM_ACK     3   // last node: a tour of a stream arrived
+#define TOUR_HOP_ACK        4   // receiver: the tour packet of a hop arrived
+#define MCAST_HDRLEN        20  // TOUR multicast header length
+#define MCAST_MAXLEN        1472    // multicast datagram, fits one frame
+
+// tour header flags
+#define TOUR_FLAG_TRACE     0x01    // hops append trace records
+#define TOUR_FLAG_STREAM    0x02    // one tour of a stream, seq is set
+#define TOUR_FLAG_ACK       0x04    // every hop acknowledges the packet
+#define TRACE_HDRLEN        4   // trace section header length
+#define TRACE_RECLEN        24  // trace record length
+#define TRACE_MAX           32  // hops recorded by one trace
+#define TRACE_SPACE         (TRACE_HDRLEN + TRACE_MAX * TRACE_RECLEN)
+
+// multicast message types
+#define MCAST_ROLLCALL      1   // last node: members, identify yourselves
+#define MCAST_IDENTIFY      2   // member to the source: I am a member
+#define MCAST_ROSTER        3   // source: every member has identified
 
 #define NODE_SEQ(__node_seq, __index) ((__node_seq) + (HOSTNAME_BUFFSIZE * (__index)))
-#define IP_SEQ(__ip_seq, __index) ((__ip_seq) + (IPADDR_BUFFSIZE * (__index)))
+#define IP_SEQ(__ip_seq, __index) ((uchar *)(__ip_seq) + (IPADDR_BUFFSIZE * (__index)))
+// only the first tour of a stream is logged by the nodes it passes
+#define TOUR_QUIET(__rthdr) (((__rthdr)->flags & TOUR_FLAG_STREAM) && (__rthdr)->seq != 0)
 
 typedef unsigned char   BITFIELD8;
 typedef unsigned char   uchar;
@@ -48,32 +110,281 @@ struct hwaddr {
     uchar   sll_addr[8];    /* Physical layer address   */
 };
 
-// TOUR IP packet payload
+// TOUR IP packet payload, multi-byte fields in network order
+// The packet carries a window of hopCount hops starting at hop base: a
+// dictionary of the unique node addresses of the window followed by one
+// dictionary index per hop, hopWidth bytes each
+// A branch of a scattered tour has the hops of that branch only, its
+// seqLength ends at the gather node
+// The tours of a stream share the ID, the session and the packet, seq
+// tells them apart
 typedef struct tourhdr_t {
-    uchar   grp[4];     /* Multicast group address  */
+    uchar   version;    /* TOUR_VERSION             */
+    uchar   hopWidth;   /* Bytes per hop, 1 or 2    */
     ushort  port;       /* Multicast port number    */
-    uchar   seqLength;  /* Tour sequence length     */
-    uchar   index;      /* Current node index       */
-  //uchar   seq[seqLength*4]; This is payload
+    uint32_t id;        /* Tour ID                  */
+    uchar   grp[4];     /* Multicast group address  */
+    uint32_t seqLength; /* Tour sequence length     */
+    uint32_t index;     /* Current node index       */
+    ushort  nodeCount;  /* Unique nodes of window   */
+    uchar   type;       /* TOUR_ROUTE, ...          */
+    uchar   flags;      /* TOUR_FLAG_TRACE          */
+    uchar   src[4];     /* Source node address      */
+    uint32_t base;      /* First hop of window      */
+    uint32_t hopCount;  /* Hops of window           */
+    uchar   branch;     /* Branch of scattered tour */
+    uchar   branches;   /* Branches, 0 = no scatter */
+    ushort  hopRtt;     /* Sender hop RTT, us, ack  */
+    uint32_t seq;       /* Tour of a stream         */
+  //uchar   node[nodeCount*4];          This is payload
+  //uchar   hop[hopCount*hopWidth];     This is payload
+  //tracehdr trace;                     If TOUR_FLAG_TRACE
 } tourhdr;
 
+// Trace section behind the hop list of a traced tour packet
+typedef struct tracehdr_t {
+    ushort  count;      /* Records that follow      */
+    ushort  dropped;    /* Hops past TRACE_MAX      */
+  //tracerec rec[count];                This is payload
+} tracehdr;
+
+// Trace record of one hop, times in CLOCK_MONOTONIC ns of that node
+typedef struct tracerec_t {
+    uint64_t rx;        /* Kernel arrival of packet */
+    uint32_t hop;       /* Hop number               */
+    uint32_t queue;     /* Arrival to read, ns      */
+    uint32_t proc;      /* Read to send, ns         */
+    uchar   node[4];    /* Node address             */
+} tracerec;
+
+// TOUR multicast datagram, multi-byte fields in network order
+typedef struct mcasthdr_t {
+    uchar   type;       /* MCAST_ROLLCALL, ...      */
+    uchar   reserved;   /* Zero                     */
+    ushort  count;      /* Roster entries carried   */
+    uint32_t id;        /* Tour ID                  */
+    uchar   node[4];    /* Sender node address      */
+    uint32_t seq;       /* Sender message sequence  */
+    uint32_t members;   /* Roster: tour members     */
+  //uchar   roster[count*4];    This is payload
+} mcasthdr;
+
+// Local link-layer identity, resolved once and shared by the tour, ping
+// and multicast paths; refreshed on netlink link events
+typedef struct link_info_t {
+    char    ifname[IFNAMSIZ];       /* Interface name       */
+    int     ifindex;                /* Interface index      */
+    uchar   hwaddr[ETH_ALEN];       /* MAC address          */
+    int     mtu;                    /* Interface MTU        */
+    int     nlSockfd;               /* netlink link events  */
+} link_info;
+
+// State of a tour seen by the local node
+typedef enum tour_state_t {
+    TOUR_TRAVERSING,        /* tour passed through, waiting for roll call, */
+                            /* at most TOUR_IDLE_TIME after its last packet */
+    TOUR_AWAIT_WINDOW,      /* waiting for the source to send next window   */
+    TOUR_STREAMING,         /* source, tours of a stream in flight          */
+    TOUR_AWAIT_PING,        /* last node, let the pings run first           */
+    TOUR_IDENTIFYING,       /* roll call heard, identification is delayed   */
+    TOUR_COLLECTING,        /* multicast roll call in progress              */
+    TOUR_FINISHED           /* roster published or roll call is silent      */
+} tour_state;
+
+// Tour session, one per tour the local node takes part in
+typedef struct tour_session_t {
+    uint32_t id;                    /* Tour ID                  */
+    uchar   grp[IPADDR_BUFFSIZE];   /* Multicast group address  */
+    int     port;                   /* Multicast port number    */
+    int     mrSockfd;               /* Mcast recv socket, group */
+    tour_state state;               /* Current state            */
+    uint64_t deadline;              /* Timer, ns, 0 = none      */
+    int     identified;             /* Answered the roll call   */
+    uint64_t *members;              /* Identified members set   */
+    uint    membersSize;            /* Set slots, power of 2    */
+    uint    membersCount;           /* Identified members       */
+    uint    expectedMembers;        /* Tour nodes, source only  */
+    uint32_t mcastSeq;              /* Multicast messages sent  */
+    uchar   *trace;                 /* Trace kept for a window  */
+    uchar   src[IPADDR_BUFFSIZE];   /* Source node address      */
+    int     seqLength;              /* Sequence length, source  */
+    char    *ipSeq;                 /* IP sequence, source only */
+    int     branches;               /* Scattered, source only   */
+    uint    *branchEnd;             /* Gather hop of branches   */
+    uint64_t gathered;              /* Branches arrived, gather */
+    uint    streamCount;            /* Tours of stream, source  */
+    uint    streamWindow;           /* Tours in flight at most  */
+    uint    streamNext;             /* Next tour to send        */
+    uint    streamBase;             /* First tour in flight     */
+    uint    streamArrived;          /* Tours acked              */
+    uint    streamLost;             /* Tours given up           */
+    uint64_t *streamAcked;          /* Acked or lost tours      */
+    uint64_t *streamSent;           /* Send time, by seq%window */
+    uint64_t streamRtt;             /* Smoothed tour RTT, ns    */
+    uint64_t streamRttVar;          /* Its mean deviation, ns   */
+    uint64_t streamStart;           /* First tour sent, ns      */
+    uint64_t streamEnd;             /* Last ack, ns             */
+    uchar   *streamPacket;          /* Packet of every tour     */
+    int     streamLength;           /* Its length               */
+    int     hopAck;                 /* Hops are acknowledged    */
+    uint64_t *received;             /* (seq, hop) received set  */
+    uint    receivedSize;           /* Set slots, power of 2    */
+    uint    receivedCount;          /* Set entries              */
+    uint    windowHop;              /* Hop waiting for a window */
+    int     windowRetries;          /* Window requests sent     */
+    uint64_t *visited;              /* Pinged (prev, self) set  */
+    uint    visitedSize;            /* Set slots, power of 2    */
+    uint    visitedCount;           /* Set entries              */
+    struct tour_session_t *next;    /* next in hash bucket      */
+} tour_session;
+
+// ARP request waiting for the ARP service, ping starts on its response
+typedef struct tour_areq_t {
+    int     sockfd;                 /* Domain socket to ARP     */
+    struct sockaddr_in preceding;   /* Node to ping             */
+    uint64_t sent;                  /* Request sent, ns         */
+    uint64_t deadline;              /* Timeout, ns              */
+    tour_session *session;          /* Owning tour              */
+    struct tour_areq_t *next;       /* next pointer             */
+} tour_areq;
+
+// Tour packet sent to the next hop, kept until the hop acknowledges it
+typedef struct tour_hop_t {
+    uchar   *packet;                /* Copy of the packet sent  */
+    int     length;                 /* Its length               */
+    uint32_t index;                 /* Hop sent to              */
+    uint32_t seq;                   /* Tour of a stream         */
+    uint64_t sent;                  /* Last sent, ns            */
+    uint64_t deadline;              /* Resend, ns               */
+    int     retries;                /* Retransmissions          */
+    int     later;                  /* Later tours acked on hop */
+    tour_session *session;          /* Owning tour              */
+    struct tour_hop_t *next;        /* next pointer             */
+} tour_hop;
+
+// RTT between two nodes, learned from the pings, RTTs are symmetric
+typedef struct route_rtt_t {
+    uchar   a[IPADDR_BUFFSIZE];     /* Node address             */
+    uchar   b[IPADDR_BUFFSIZE];     /* Node address             */
+    uint64_t rttNs;                 /* Smoothed median RTT, ns  */
+    uint    samples;                /* Pings measured           */
+    struct route_rtt_t *next;       /* next in hash bucket      */
+} route_rtt;
+
 // Main TOUR information object
 typedef struct tour_object_t {
     uchar   ipaddr[IPADDR_BUFFSIZE];        /* IP address           */
     char    hostname[HOSTNAME_BUFFSIZE];    /* Host name            */
+    link_info link;                         /* Local link identity  */
     int     rtSockfd;                       /* tour IP raw socket   */
     int     pgSockfd;                       /* ping IP raw socket   */
     int     pfSockfd;                       /* PF_PACKET socket     */
     int     msSockfd;                       /* Mcast send socket    */
-    int     mrSockfd;                       /* Mcast recv socket    */
+    uchar   mcastRange;                     /* Group range, 239.x   */
     int     seqLength;                      /* Sequence length      */
     char    *nodeSeq;                       /* pointer to node seq  */
     char    *ipSeq;                         /* pointer to ip seq    */
-    uchar   mcastAddr[IPADDR_BUFFSIZE];     /* Multicast group addr */
-    int     mcastPort;                      /* Multicast port #     */
+    int     tourCount;                      /* Tours to start       */
+    int     trace;                          /* Trace started tours  */
+    int     branches;                       /* Scatter started tours */
+    int     streamCount;                    /* Tours of a stream    */
+    int     streamWindow;                   /* Stream tours in flight */
+    int     hopAck;                         /* Acknowledge hops     */
+    tour_hop *hops;                         /* Hops not acked yet   */
+    uint64_t hopRtt;                        /* Smoothed hop RTT, ns */
+    uint64_t hopRttVar;                     /* Its mean deviation   */
+    uint32_t ended[HOP_ENDED_TOURS];        /* Ended hop-acked tours */
+    uint64_t endedAt[HOP_ENDED_TOURS];      /* When they ended, ns  */
+    uint    endedNext;                      /* Oldest ended slot    */
+    int     optimize;                       /* Reorder the sequence */
+    char    *routeFile;                     /* RTT matrix file      */
+    route_rtt *routes[ROUTE_HASH_SIZE];     /* RTT matrix, by pair  */
+    uint    routeCount;                     /* Pairs measured       */
+    struct ping_table_t *pingTable;         /* Ping RTT statistics  */
+    struct ping_context_t *pings;           /* Pings of all tours   */
+    tour_session *sessions[SESSION_HASH_SIZE]; /* Active tours, by ID */
+    int     sessionCount;                   /* Active tours         */
+    uint32_t nextTourId;                    /* Tour ID generator    */
+    tour_areq *areqs;                       /* Pending ARP requests */
+    uchar   *rxBuff;                        /* Tour receive buffer  */
+    int     rxSize;                         /* Receive buffer size  */
 } tour_object;
 
 
-char *UtilIpToString(const uchar *);
+char *UtilFormatIp(const uchar *ipaddr, char *str);
+char *UtilFormatMac(const uchar *hwaddr, char *str);
+uint64_t UtilNowNs();
+uint UtilRandom(uint min, uint max);
+void UtilTime(char *timestr);
+void UtilHostname(char *hostname);
+int UtilIpToHostname(const uchar *ipaddr, char *hostname);
+int UtilHostnameToIp(const char *hostname, uchar *ipaddr);
+void BuildIpHeader(struct ip *iphdr, uint length, uchar *src, uchar *dst);
+void LinkInit(tour_object *obj);
+void LinkProcessEvents(tour_object *obj);
+
+int AreqSend(struct sockaddr *IPaddr, socklen_t sockaddrlen);
+int AreqRecv(int sockfd, struct sockaddr *IPaddr, struct hwaddr *HWaddr);
+
+void CreateMulticastGroup(tour_object *obj, uint32_t id, uchar *grp, int *port);
+int JoinMulticastGroup(tour_object *obj, uchar *grp, int port);
+void LeaveMulticastGroup(tour_object *obj, int sockfd, uchar *grp, int port);
+void StartMulticast(tour_object *obj, tour_session *s);
+void IdentifyMember(tour_object *obj, tour_session *s);
+void ProcessMulticast(tour_object *obj, int sockfd);
+
+uint32_t SessionNewId(tour_object *obj);
+tour_session *SessionFind(tour_object *obj, uint32_t id);
+tour_session *SessionFindGroup(tour_object *obj, const uchar *grp, int port);
+tour_session *SessionCreate(tour_object *obj, uint32_t id, uchar *grp, int port);
+void SessionDestroy(tour_object *obj, tour_session *s);
+void SessionSetState(tour_session *s, tour_state state, uint delay);
+int SessionVisit(tour_session *s, const uchar *prev, const uchar *self);
+int SessionAddMember(tour_session *s, const uchar *ipaddr);
+int SessionReceive(tour_session *s, const tourhdr *rthdr);
+int SessionEnded(tour_object *obj, uint32_t id);
+void SessionExpectMembers(tour_session *s);
+void SessionScatter(tour_session *s, const char *ipSeq, int seqLength, int branches);
+uint SessionBranchEnd(tour_session *s, uint hop, uchar *branch);
+int SessionGather(tour_session *s, const tourhdr *rthdr);
+void SessionStartAreq(tour_object *obj, tour_session *s, struct sockaddr_in *preceding);
+int SessionFdSet(tour_object *obj, fd_set *rset, int maxfd);
+void SessionProcessAreqs(tour_object *obj, fd_set *rset);
+void SessionProcessMulticast(tour_object *obj, fd_set *rset);
+struct timeval *SessionNextTimeout(tour_object *obj, struct timeval *tv);
+void SessionRunTimers(tour_object *obj);
+void FinishTour(tour_object *obj, tour_session *s);
+void RequestWindow(tour_object *obj, tour_session *s);
+int BuildTourPacket(tour_object *obj, tour_session *s, uchar type, uint base, uchar flags, uchar **packet);
+void ForwardTour(tour_object *obj, uchar *packet, int length, uint index);
+
+void StreamStart(tour_object *obj, tour_session *s);
+void StreamArrive(tour_object *obj, tour_session *s, const tourhdr *rthdr);
+void StreamAck(tour_object *obj, const tourhdr *rthdr);
+void StreamTimeout(tour_object *obj, tour_session *s);
+
+void HopSent(tour_object *obj, const uchar *packet, int length);
+void HopReply(tour_object *obj, struct ip *iphdr);
+void HopAck(tour_object *obj, struct ip *iphdr);
+void HopRunTimers(tour_object *obj);
+
+int SegmentEncode(tourhdr *rthdr, const char *ipSeq, int seqLength, uint base, uint hopCount);
+uint SegmentWindow(const char *ipSeq, int seqLength, uint base, int budget);
+int SegmentCheck(const tourhdr *rthdr, int length);
+uint SegmentLength(const tourhdr *rthdr);
+uint SegmentHopIndex(const tourhdr *rthdr, uint hop);
+uchar *SegmentHop(tourhdr *rthdr, uint hop);
+
+void RouteLearn(tour_object *obj, const uchar *a, const uchar *b, uint64_t rttNs);
+void RouteLoad(tour_object *obj);
+void RouteSave(tour_object *obj);
+void RouteOptimize(tour_object *obj, const uchar *fixed);
+
+uint32_t TraceQueueTime(struct msghdr *msg);
+int TraceAppend(tourhdr *rthdr, uint hop, const uchar *node, uint64_t rx, uint32_t queue);
+void TraceSent(tourhdr *rthdr, uint hop);
+uchar *TraceSave(tourhdr *rthdr);
+int TraceRestore(tourhdr *rthdr, const uchar *trace);
+void TraceReport(tourhdr *rthdr);
 
 #endif
@@ -0,0 +1,251 @@
+/*
+* @File:    trace.c
+* @Date:    2026-10-18 20:14:08
+* @Last Modified time: 2026-10-18 21:05:46
+* @Description:
+*     Per-hop latency trace carried by a tour packet
+*     - uchar *TraceSection(tourhdr *rthdr)
+*         [Locate the trace section of a tour packet]
+*     - uint TraceLength(tourhdr *rthdr)
+*         [Length of a traced tour packet from the tour header on]
+*     + uint32_t TraceQueueTime(struct msghdr *msg)
+*         [Time a received packet waited in the socket]
+*     + int TraceAppend(tourhdr *rthdr, uint hop, const uchar *node, uint64_t rx, uint32_t queue)
+*         [Append the record of a hop]
+*     + void TraceSent(tourhdr *rthdr, uint hop)
+*         [Complete the record of a hop when the packet leaves]
+*     + uchar *TraceSave(tourhdr *rthdr)
+*         [Copy the trace section out of a tour packet]
+*     + int TraceRestore(tourhdr *rthdr, const uchar *trace)
+*         [Put a saved trace section into a tour packet]
+*     + void TraceReport(tourhdr *rthdr)
+*         [Print the trace of a finished tour]
+*/
+
+#include "tour.h"
+
+#include <endian.h>
+
+/* --------------------------------------------------------------------------
+ *  TraceSection
+ *
+ *  Locate the trace section of a tour packet
+ *
+ *  @param  : tourhdr   *rthdr  [tour header of a traced packet]
+ *  @return : uchar     *       [trace header, right behind the hop list]
+ *
+ *  The section is not aligned, read and write it with memcpy
+ * --------------------------------------------------------------------------
+ */
+static uchar *TraceSection(tourhdr *rthdr) {
+    return (uchar *)rthdr + TOUR_HDRLEN + SegmentLength(rthdr);
+}
+
+/* --------------------------------------------------------------------------
+ *  TraceLength
+ *
+ *  Length of a traced tour packet from the tour header on
+ *
+ *  @param  : tourhdr   *rthdr  [tour header of a traced packet]
+ *  @return : uint      [header, segment and trace section bytes]
+ * --------------------------------------------------------------------------
+ */
+static uint TraceLength(tourhdr *rthdr) {
+    tracehdr trhdr;
+
+    memcpy(&trhdr, TraceSection(rthdr), TRACE_HDRLEN);
+    return TOUR_HDRLEN + SegmentLength(rthdr) + TRACE_HDRLEN + TRACE_RECLEN * ntohs(trhdr.count);
+}
+
+/* --------------------------------------------------------------------------
+ *  TraceQueueTime
+ *
+ *  Time a received packet waited in the socket
+ *
+ *  @param  : struct msghdr *msg    [message returned by recvmsg]
+ *  @return : uint32_t      [ns from kernel arrival to now, 0 if the message
+ *                           carries no SO_TIMESTAMPNS stamp]
+ *
+ *  The stamp is CLOCK_REALTIME, so it is compared with the realtime clock
+ *  and only the difference is kept
+ * --------------------------------------------------------------------------
+ */
+uint32_t TraceQueueTime(struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+    struct timespec stamp, now;
+    int64_t queue;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+            continue;
+        memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+        clock_gettime(CLOCK_REALTIME, &now);
+        queue = (int64_t)(now.tv_sec - stamp.tv_sec) * 1000000000LL + (now.tv_nsec - stamp.tv_nsec);
+        if (queue < 0)
+            return 0;
+        return queue > UINT32_MAX ? UINT32_MAX : (uint32_t)queue;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  TraceAppend
+ *
+ *  Append the record of a hop
+ *
+ *  @param  : tourhdr   *rthdr  [tour header of a traced packet]
+ *            uint      hop     [hop number]
+ *            const uchar *node [local IP address]
+ *            uint64_t  rx      [kernel arrival, CLOCK_MONOTONIC ns]
+ *            uint32_t  queue   [ns from kernel arrival to read]
+ *  @return : int       [packet length from the tour header on]
+ *
+ *  The record is written behind the last one, the caller keeps
+ *  TRACE_RECLEN bytes free there. Once TRACE_MAX records are kept the last
+ *  one is replaced and counted as dropped, so the trace always ends with
+ *  the latest hop and spans the whole tour
+ * --------------------------------------------------------------------------
+ */
+int TraceAppend(tourhdr *rthdr, uint hop, const uchar *node, uint64_t rx, uint32_t queue) {
+    uchar *section = TraceSection(rthdr);
+    tracehdr trhdr;
+    tracerec rec;
+    uint count;
+
+    memcpy(&trhdr, section, TRACE_HDRLEN);
+    count = ntohs(trhdr.count);
+    if (count == TRACE_MAX) {
+        if (ntohs(trhdr.dropped) < 0xffff)
+            trhdr.dropped = htons(ntohs(trhdr.dropped) + 1);
+        count--;
+    }
+
+    rec.rx = htobe64(rx);
+    rec.hop = htonl(hop);
+    rec.queue = htonl(queue);
+    rec.proc = 0;
+    memcpy(rec.node, node, IPADDR_BUFFSIZE);
+    memcpy(section + TRACE_HDRLEN + TRACE_RECLEN * count, &rec, TRACE_RECLEN);
+
+    trhdr.count = htons(count + 1);
+    memcpy(section, &trhdr, TRACE_HDRLEN);
+    return TraceLength(rthdr);
+}
+
+/* --------------------------------------------------------------------------
+ *  TraceSent
+ *
+ *  Complete the record of a hop when the packet leaves
+ *
+ *  @param  : tourhdr   *rthdr  [tour header of a traced packet]
+ *            uint      hop     [local hop number]
+ *  @return : void
+ *
+ *  The processing time runs from the read to now. Nothing is done if the
+ *  last record is not the local hop
+ * --------------------------------------------------------------------------
+ */
+void TraceSent(tourhdr *rthdr, uint hop) {
+    uchar *section = TraceSection(rthdr), *last;
+    tracehdr trhdr;
+    tracerec rec;
+    uint64_t proc;
+
+    memcpy(&trhdr, section, TRACE_HDRLEN);
+    if (trhdr.count == 0)
+        return;
+    last = section + TRACE_HDRLEN + TRACE_RECLEN * (ntohs(trhdr.count) - 1);
+    memcpy(&rec, last, TRACE_RECLEN);
+    if (ntohl(rec.hop) != hop)
+        return;
+
+    proc = UtilNowNs() - be64toh(rec.rx) - ntohl(rec.queue);
+    rec.proc = htonl(proc > UINT32_MAX ? UINT32_MAX : (uint32_t)proc);
+    memcpy(last, &rec, TRACE_RECLEN);
+}
+
+/* --------------------------------------------------------------------------
+ *  TraceSave
+ *
+ *  Copy the trace section out of a tour packet
+ *
+ *  @param  : tourhdr   *rthdr  [tour header of a traced packet]
+ *  @return : uchar     *       [allocated copy of header and records]
+ *
+ *  A node whose window ends keeps the trace in its session until the next
+ *  window arrives
+ * --------------------------------------------------------------------------
+ */
+uchar *TraceSave(tourhdr *rthdr) {
+    uint length = TraceLength(rthdr) - TOUR_HDRLEN - SegmentLength(rthdr);
+    uchar *trace = Malloc(length);
+
+    memcpy(trace, TraceSection(rthdr), length);
+    return trace;
+}
+
+/* --------------------------------------------------------------------------
+ *  TraceRestore
+ *
+ *  Put a saved trace section into a tour packet
+ *
+ *  @param  : tourhdr   *rthdr  [tour header of a packet built with room
+ *                               for TRACE_SPACE bytes of trace]
+ *            const uchar *trace [section returned by TraceSave]
+ *  @return : int       [packet length from the tour header on]
+ * --------------------------------------------------------------------------
+ */
+int TraceRestore(tourhdr *rthdr, const uchar *trace) {
+    tracehdr trhdr;
+
+    memcpy(&trhdr, trace, TRACE_HDRLEN);
+    memcpy(TraceSection(rthdr), trace, TRACE_HDRLEN + TRACE_RECLEN * ntohs(trhdr.count));
+    rthdr->flags |= TOUR_FLAG_TRACE;
+    return TraceLength(rthdr);
+}
+
+/* --------------------------------------------------------------------------
+ *  TraceReport
+ *
+ *  Print the trace of a finished tour
+ *
+ *  @param  : tourhdr   *rthdr  [tour header of a traced packet]
+ *  @return : void
+ *
+ *  One line per recorded hop and a summary line, as key=value pairs for
+ *  scripts. The wire time of a hop is from its send to the arrival at the
+ *  next hop, it is only meaningful when the nodes share a clock and only
+ *  printed when the next hop is recorded too
+ * --------------------------------------------------------------------------
+ */
+void TraceReport(tourhdr *rthdr) {
+    uchar *section = TraceSection(rthdr);
+    char ip[IPSTR_BUFFSIZE];
+    tracehdr trhdr;
+    tracerec rec, next;
+    uint i, count;
+    uint64_t first = 0;
+
+    memcpy(&trhdr, section, TRACE_HDRLEN);
+    count = ntohs(trhdr.count);
+    if (count == 0)
+        return;
+
+    for (i = 0; i < count; i++) {
+        memcpy(&rec, section + TRACE_HDRLEN + TRACE_RECLEN * i, TRACE_RECLEN);
+        if (i == 0)
+            first = be64toh(rec.rx);
+        if (i + 1 < count)
+            memcpy(&next, section + TRACE_HDRLEN + TRACE_RECLEN * (i + 1), TRACE_RECLEN);
+        if (i + 1 < count && ntohl(next.hop) == ntohl(rec.hop) + 1) {
+            printf("[TRACE] tour=%08x hop=%u node=%s queue_ns=%u proc_ns=%u wire_ns=%lld\n",
+                ntohl(rthdr->id), ntohl(rec.hop), UtilFormatIp(rec.node, ip), ntohl(rec.queue), ntohl(rec.proc),
+                (long long)(be64toh(next.rx) - be64toh(rec.rx) - ntohl(rec.queue) - ntohl(rec.proc)));
+        } else {
+            printf("[TRACE] tour=%08x hop=%u node=%s queue_ns=%u proc_ns=%u wire_ns=-\n",
+                ntohl(rthdr->id), ntohl(rec.hop), UtilFormatIp(rec.node, ip), ntohl(rec.queue), ntohl(rec.proc));
+        }
+    }
+    printf("[TRACE] tour=%08x hops=%u dropped=%u total_ns=%llu\n", ntohl(rthdr->id), count, ntohs(trhdr.dropped),
+        (unsigned long long)(be64toh(rec.rx) + ntohl(rec.queue) - first));
+}
@@ -0,0 +1,1178 @@
+/*
+* @File:    transport.c
+* @Date:    2026-10-19 09:02:41
+* @Last Modified time: 2026-10-19 17:24:52
+* @Description:
+*     Packet transport of the raw sockets: live, pcap capture, pcap replay,
+*     impairments
+*     - transport_socket *TransportFind(int sockfd)
+*         [Find a registered socket]
+*     - double ImpairRandom()
+*         [Uniform random number in [0, 1)]
+*     - uint64_t ImpairDelay(impair *im)
+*         [Draw the delay of a packet]
+*     - int ImpairLose(impair *im)
+*         [Decide whether a packet is lost]
+*     - uint64_t ImpairDuration(const char *key, const char *value)
+*         [Parse a duration]
+*     - double ImpairProbability(const char *key, const char *value)
+*         [Parse a probability]
+*     - void ImpairParse(char *spec)
+*         [Parse an impairment specification]
+*     - void ImpairSummary()
+*         [Print the impairment counters]
+*     - char *ImpairText(char *p, const char *text)
+*         [Append text to a line, async-signal-safe]
+*     - char *ImpairNumber(char *p, uint64_t v)
+*         [Append a number to a line, async-signal-safe]
+*     - void ImpairSignal(int signo)
+*         [Print the counters on SIGINT or SIGTERM]
+*     - void ImpairLoad()
+*         [Read the impairments from the environment]
+*     - void *ImpairThread(void *arg)
+*         [Send the delayed packets when they are due]
+*     - void ImpairQueue(impair *im, int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen, uint64_t due)
+*         [Hold a packet until it is due]
+*     - ssize_t ImpairSend(impair *im, int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen)
+*         [Send a packet through the impairments]
+*     - void TransportCapture(transport_socket *ts, struct msghdr *msg, ssize_t n)
+*         [Append a received packet to the capture file]
+*     - transport_socket *TransportRoute(const uchar *frame, uint32_t len)
+*         [Find the socket a replayed frame is delivered to]
+*     - void TransportFeed()
+*         [Queue the next replayed frame]
+*     - void TransportSummary()
+*         [Print the replay statistics and exit]
+*     - ssize_t TransportReplay(transport_socket *ts, struct msghdr *msg, int flags)
+*         [Receive a replayed frame]
+*     + void TransportInit(int mode, const char *path)
+*         [Select the transport]
+*     + void TransportStart(int ifindex)
+*         [Start the replay]
+*     + int TransportSocket(int family, int type, int protocol)
+*         [Create a raw socket]
+*     + int TransportSetsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen)
+*         [Set a socket option]
+*     + ssize_t TransportSendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen)
+*         [Send a packet]
+*     + ssize_t TransportRecvmsg(int sockfd, struct msghdr *msg, int flags)
+*         [Receive a packet]
+*     + ssize_t TransportRecvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen)
+*         [Receive a packet]
+*/
+
+#include "unp.h"
+#include "transport.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <linux/if_packet.h>
+#include <linux/if_arp.h>
+
+typedef unsigned char uchar;
+
+uint64_t UtilNowNs();   // utils.c
+
+// replayed frame as queued on the socket pair, the frame follows
+typedef struct replay_rec_t {
+    struct timespec rx;         /* queued, CLOCK_REALTIME   */
+    uint32_t    len;            /* frame bytes              */
+} replay_rec;
+
+typedef struct transport_socket_t {
+    int         sockfd;         /* socket of the caller     */
+    int         peerfd;         /* replay: queueing end     */
+    int         family;         /* AF_INET or PF_PACKET     */
+    int         protocol;       /* IP protocol or ethertype */
+    int         stamps;         /* SO_TIMESTAMPNS requested */
+    int         cls;            /* IMPAIR_TOUR, ...         */
+    uchar       *buff;          /* replay: receive buffer   */
+} transport_socket;
+
+static struct {
+    int         mode;
+    FILE        *file;          /* capture or replay file   */
+    int         swapped;        /* replay file byte order   */
+    int         ifindex;        /* replay: arrival interface */
+    pthread_mutex_t lock;       /* file and counters        */
+    transport_socket sock[TRANSPORT_MAXSOCK];
+    int         count;
+    transport_socket *last;     /* replay: last fed socket  */
+    uchar       frame[TRANSPORT_SNAPLEN + sizeof(replay_rec)];
+    uint64_t    start;          /* replay start, ns         */
+    uint64_t    packets;        /* replayed frames          */
+    uint64_t    bytes;          /* replayed frame bytes     */
+    uint64_t    skipped;        /* frames no socket takes   */
+    uint64_t    dropped;        /* sends during the replay  */
+} transport = { .mode = TRANSPORT_LIVE, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// impairments of one class of sockets
+typedef struct impair_t {
+    int         set;            /* configured               */
+    double      loss;           /* send loss probability    */
+    double      burst;          /* mean loss burst, packets */
+    double      rxloss;         /* receive loss probability */
+    uint64_t    delay;          /* mean send delay, ns      */
+    uint64_t    jitter;         /* delay spread, ns         */
+    int         dist;           /* IMPAIR_UNIFORM, ...      */
+    double      dup;            /* duplicate probability    */
+    double      reorder;        /* undelayed probability    */
+    int         bad;            /* in a loss burst          */
+    uint64_t    sent;           /* packets given to send    */
+    uint64_t    lost;           /* sends dropped            */
+    uint64_t    delayed;        /* sends held back          */
+    uint64_t    reordered;      /* sends passing held ones  */
+    uint64_t    duplicated;     /* sends copied             */
+    uint64_t    rxlost;         /* receives dropped         */
+    uint64_t    errors;         /* delayed sends failed     */
+} impair;
+
+// delayed packet, the data follows
+typedef struct impair_packet_t {
+    uint64_t    due;            /* UtilNowNs() to send at   */
+    impair      *im;            /* class, for the errors    */
+    int         sockfd;
+    int         flags;
+    struct sockaddr_storage to;
+    socklen_t   tolen;
+    size_t      len;
+    struct impair_packet_t *next;
+    uchar       data[];
+} impair_packet;
+
+static const char *impairClass[IMPAIR_CLASSES] = {"tour", "ping", "arp", "mcast"};
+static const char *impairDist[] = {"uniform", "normal", "exp"};
+
+static struct {
+    int         enabled;        /* a class is configured    */
+    pthread_once_t once;
+    pthread_mutex_t lock;       /* everything below         */
+    pthread_cond_t ready;       /* queue head changed       */
+    int         started;        /* sending thread running   */
+    uint64_t    seed;           /* random state             */
+    impair      cls[IMPAIR_CLASSES];
+    impair_packet *queue;       /* by due time              */
+    struct sigaction oldInt;    /* chained signal actions   */
+    struct sigaction oldTerm;
+} impairment = { .once = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* --------------------------------------------------------------------------
+ *  TransportFind
+ *
+ *  Find a registered socket
+ *
+ *  @param  : int   sockfd  [socket file descriptor]
+ *  @return : transport_socket *    [NULL if not created by TransportSocket]
+ * --------------------------------------------------------------------------
+ */
+static transport_socket *TransportFind(int sockfd) {
+    int i;
+
+    for (i = 0; i < transport.count; i++)
+        if (transport.sock[i].sockfd == sockfd)
+            return &transport.sock[i];
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairRandom
+ *
+ *  Uniform random number in [0, 1)
+ *
+ *  @param  : void
+ *  @return : double
+ *
+ *  xorshift64*, called with the impairment lock held
+ * --------------------------------------------------------------------------
+ */
+static double ImpairRandom() {
+    impairment.seed ^= impairment.seed >> 12;
+    impairment.seed ^= impairment.seed << 25;
+    impairment.seed ^= impairment.seed >> 27;
+    return ((impairment.seed * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairDelay
+ *
+ *  Draw the delay of a packet
+ *
+ *  @param  : impair    *im     [class of the socket]
+ *  @return : uint64_t  [delay in ns]
+ *
+ *  uniform: delay +- jitter, normal: delay with jitter as the standard
+ *  deviation, exp: delay plus an exponential tail of mean jitter. Negative
+ *  draws are clamped to 0
+ * --------------------------------------------------------------------------
+ */
+static uint64_t ImpairDelay(impair *im) {
+    double d = im->delay, u;
+
+    if (im->jitter == 0)
+        return im->delay;
+    switch (im->dist) {
+        case IMPAIR_NORMAL:
+            u = 1.0 - ImpairRandom();
+            d += im->jitter * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * ImpairRandom());
+            break;
+        case IMPAIR_EXP:
+            d -= im->jitter * log(1.0 - ImpairRandom());
+            break;
+        default:
+            d += im->jitter * (2.0 * ImpairRandom() - 1.0);
+            break;
+    }
+    return d > 0 ? (uint64_t)d : 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairLose
+ *
+ *  Decide whether a packet is lost
+ *
+ *  @param  : impair    *im     [class of the socket]
+ *  @return : int       [1 if lost]
+ *
+ *  Two state Gilbert model: every packet of a burst is lost and bursts
+ *  last burst packets on average, starting often enough that the overall
+ *  rate is loss. With burst 1 the losses are independent
+ * --------------------------------------------------------------------------
+ */
+static int ImpairLose(impair *im) {
+    if (im->loss <= 0)
+        return 0;
+    if (im->burst <= 1 || im->loss >= 1)
+        return ImpairRandom() < im->loss;
+
+    if (im->bad)
+        im->bad = ImpairRandom() >= 1.0 / im->burst;
+    else
+        im->bad = ImpairRandom() < im->loss / (im->burst * (1.0 - im->loss));
+    return im->bad;
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairDuration
+ *
+ *  Parse a duration
+ *
+ *  @param  : const char    *key    [option, for the error message]
+ *            const char    *value  [number with ns, us, ms or s, ms if none]
+ *  @return : uint64_t      [ns, exits if malformed]
+ * --------------------------------------------------------------------------
+ */
+static uint64_t ImpairDuration(const char *key, const char *value) {
+    char *end;
+    double d = strtod(value, &end);
+
+    if (end == value || d < 0)
+        err_quit("[IMPAIR] bad %s: %s", key, value);
+    if (strcmp(end, "ns") == 0)
+        return d;
+    if (strcmp(end, "us") == 0)
+        return d * 1e3;
+    if (strcmp(end, "ms") == 0 || *end == 0)
+        return d * 1e6;
+    if (strcmp(end, "s") == 0)
+        return d * 1e9;
+    err_quit("[IMPAIR] bad %s: %s", key, value);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairProbability
+ *
+ *  Parse a probability
+ *
+ *  @param  : const char    *key    [option, for the error message]
+ *            const char    *value  [0 to 1, or 0% to 100%]
+ *  @return : double        [exits if malformed]
+ * --------------------------------------------------------------------------
+ */
+static double ImpairProbability(const char *key, const char *value) {
+    char *end;
+    double p = strtod(value, &end);
+
+    if (strcmp(end, "%") == 0) {
+        p /= 100;
+        end++;
+    }
+    if (end == value || *end != 0 || p < 0 || p > 1)
+        err_quit("[IMPAIR] bad %s: %s", key, value);
+    return p;
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairParse
+ *
+ *  Parse an impairment specification
+ *
+ *  @param  : char  *spec   [clauses separated by ';', modified]
+ *  @return : void
+ *
+ *  A clause is [class:]key=value,key=value... and sets the keys of its
+ *  class, or of every class without one, so later clauses refine earlier
+ *  ones. Exits on anything it does not know
+ * --------------------------------------------------------------------------
+ */
+static void ImpairParse(char *spec) {
+    char *clause, *option, *value, *colon, *save1, *save2;
+    int first, last, c, i;
+
+    for (clause = strtok_r(spec, ";", &save1); clause != NULL; clause = strtok_r(NULL, ";", &save1)) {
+        first = 0;
+        last = IMPAIR_CLASSES - 1;
+        if ((colon = strchr(clause, ':')) != NULL) {
+            *colon = 0;
+            for (first = 0; first < IMPAIR_CLASSES && strcmp(clause, impairClass[first]) != 0; first++)
+                ;
+            if (first == IMPAIR_CLASSES && strcmp(clause, "all") != 0)
+                err_quit("[IMPAIR] unknown class: %s", clause);
+            if (first == IMPAIR_CLASSES)
+                first = 0;
+            else
+                last = first;
+            clause = colon + 1;
+        }
+
+        for (option = strtok_r(clause, ",", &save2); option != NULL; option = strtok_r(NULL, ",", &save2)) {
+            while (*option == ' ')
+                option++;
+            if ((value = strchr(option, '=')) == NULL)
+                err_quit("[IMPAIR] missing value: %s", option);
+            *value++ = 0;
+            if (strcmp(option, "seed") == 0) {
+                impairment.seed = strtoull(value, NULL, 0);
+                continue;
+            }
+            for (c = first; c <= last; c++) {
+                impair *im = &impairment.cls[c];
+
+                if (strcmp(option, "loss") == 0)
+                    im->loss = ImpairProbability(option, value);
+                else if (strcmp(option, "burst") == 0)
+                    im->burst = atof(value);
+                else if (strcmp(option, "rxloss") == 0)
+                    im->rxloss = ImpairProbability(option, value);
+                else if (strcmp(option, "delay") == 0)
+                    im->delay = ImpairDuration(option, value);
+                else if (strcmp(option, "jitter") == 0)
+                    im->jitter = ImpairDuration(option, value);
+                else if (strcmp(option, "dup") == 0)
+                    im->dup = ImpairProbability(option, value);
+                else if (strcmp(option, "reorder") == 0)
+                    im->reorder = ImpairProbability(option, value);
+                else if (strcmp(option, "dist") == 0) {
+                    for (i = 0; i <= IMPAIR_EXP && strcmp(value, impairDist[i]) != 0; i++)
+                        ;
+                    if (i > IMPAIR_EXP)
+                        err_quit("[IMPAIR] unknown dist: %s", value);
+                    im->dist = i;
+                } else
+                    err_quit("[IMPAIR] unknown key: %s", option);
+                im->set = 1;
+            }
+        }
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairSummary
+ *
+ *  Print the impairment counters
+ *
+ *  @param  : void
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void ImpairSummary() {
+    impair *im;
+    int c;
+
+    for (c = 0; c < IMPAIR_CLASSES; c++) {
+        im = &impairment.cls[c];
+        if (!im->set)
+            continue;
+        printf("[IMPAIR] %s: sent=%llu lost=%llu delayed=%llu reordered=%llu duplicated=%llu rxlost=%llu errors=%llu\n",
+            impairClass[c], (unsigned long long)im->sent, (unsigned long long)im->lost,
+            (unsigned long long)im->delayed, (unsigned long long)im->reordered,
+            (unsigned long long)im->duplicated, (unsigned long long)im->rxlost,
+            (unsigned long long)im->errors);
+    }
+    fflush(stdout);
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairText
+ *
+ *  Append text to a line, async-signal-safe
+ *
+ *  @param  : char          *p      [end of the line]
+ *            const char    *text   [text]
+ *  @return : char *                [new end of the line]
+ * --------------------------------------------------------------------------
+ */
+static char *ImpairText(char *p, const char *text) {
+    while (*text)
+        *p++ = *text++;
+    return p;
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairNumber
+ *
+ *  Append a number to a line, async-signal-safe
+ *
+ *  @param  : char      *p  [end of the line]
+ *            uint64_t  v   [number]
+ *  @return : char *        [new end of the line]
+ * --------------------------------------------------------------------------
+ */
+static char *ImpairNumber(char *p, uint64_t v) {
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    while (n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairSignal
+ *
+ *  Print the counters on SIGINT or SIGTERM
+ *
+ *  @param  : int   signo   [signal number]
+ *  @return : void
+ *
+ *  Only write() is used, the signal may come inside stdio. The previous
+ *  action then runs, so the process ends the way it would have without
+ *  the impairments, and ImpairSummary() is not run again
+ * --------------------------------------------------------------------------
+ */
+static void ImpairSignal(int signo) {
+    char line[320], *p;
+    impair *im;
+    int c;
+
+    for (c = 0; c < IMPAIR_CLASSES; c++) {
+        im = &impairment.cls[c];
+        if (!im->set)
+            continue;
+        p = ImpairText(line, "[IMPAIR] ");
+        p = ImpairText(p, impairClass[c]);
+        p = ImpairNumber(ImpairText(p, ": sent="), im->sent);
+        p = ImpairNumber(ImpairText(p, " lost="), im->lost);
+        p = ImpairNumber(ImpairText(p, " delayed="), im->delayed);
+        p = ImpairNumber(ImpairText(p, " reordered="), im->reordered);
+        p = ImpairNumber(ImpairText(p, " duplicated="), im->duplicated);
+        p = ImpairNumber(ImpairText(p, " rxlost="), im->rxlost);
+        p = ImpairNumber(ImpairText(p, " errors="), im->errors);
+        *p++ = '\n';
+        if (write(STDOUT_FILENO, line, p - line) < 0)
+            break;
+    }
+
+    sigaction(signo, signo == SIGINT ? &impairment.oldInt : &impairment.oldTerm, NULL);
+    raise(signo);
+    // the previous action returned or ignores the signal
+    _exit(128 + signo);
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairLoad
+ *
+ *  Read the impairments from the environment
+ *
+ *  @param  : void
+ *  @return : void
+ *
+ *  TRANSPORT_IMPAIR holds the specification, or @path of a file that
+ *  does. Run once, by the first socket created or packet sent
+ * --------------------------------------------------------------------------
+ */
+static void ImpairLoad() {
+    char spec[1024], *env = getenv(TRANSPORT_IMPAIR_ENV);
+    struct sigaction sa;
+    impair *im;
+    FILE *fp;
+    size_t n;
+    int c;
+
+    if (env == NULL || *env == 0)
+        return;
+    if (*env == '@') {
+        if ((fp = fopen(env + 1, "r")) == NULL)
+            err_sys("[IMPAIR] %s", env + 1);
+        n = fread(spec, 1, sizeof(spec) - 1, fp);
+        fclose(fp);
+        spec[n] = 0;
+        // a file may put the clauses on lines of their own
+        for (env = spec; *env; env++)
+            if (*env == '\n' || *env == '\r')
+                *env = ';';
+    } else {
+        snprintf(spec, sizeof(spec), "%s", env);
+    }
+
+    impairment.seed = UtilNowNs() ^ ((uint64_t)getpid() << 32);
+    ImpairParse(spec);
+    if (impairment.seed == 0)
+        impairment.seed = 1;
+
+    for (c = 0; c < IMPAIR_CLASSES; c++) {
+        im = &impairment.cls[c];
+        if (!im->set)
+            continue;
+        impairment.enabled = 1;
+        printf("[IMPAIR] %s: loss=%.4f burst=%.1f rxloss=%.4f delay_us=%llu jitter_us=%llu dist=%s dup=%.4f reorder=%.4f\n",
+            impairClass[c], im->loss, im->burst > 1 ? im->burst : 1.0, im->rxloss,
+            (unsigned long long)im->delay / 1000, (unsigned long long)im->jitter / 1000,
+            impairDist[im->dist], im->dup, im->reorder);
+    }
+    if (impairment.enabled) {
+        atexit(ImpairSummary);
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = ImpairSignal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, &impairment.oldInt);
+        sigaction(SIGTERM, &sa, &impairment.oldTerm);
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairThread
+ *
+ *  Send the delayed packets when they are due
+ *
+ *  @param  : void  *arg    [unused]
+ *  @return : void  *
+ * --------------------------------------------------------------------------
+ */
+static void *ImpairThread(void *arg) {
+    impair_packet *p;
+    struct timespec until;
+    int failed;
+
+    Pthread_mutex_lock(&impairment.lock);
+    for ( ; ; ) {
+        if ((p = impairment.queue) == NULL) {
+            pthread_cond_wait(&impairment.ready, &impairment.lock);
+            continue;
+        }
+        if (p->due > UtilNowNs()) {
+            until.tv_sec = p->due / 1000000000ULL;
+            until.tv_nsec = p->due % 1000000000ULL;
+            pthread_cond_timedwait(&impairment.ready, &impairment.lock, &until);
+            continue;
+        }
+
+        impairment.queue = p->next;
+        Pthread_mutex_unlock(&impairment.lock);
+        failed = sendto(p->sockfd, p->data, p->len, p->flags, (struct sockaddr *)&p->to, p->tolen) < 0;
+        Pthread_mutex_lock(&impairment.lock);
+        if (failed)
+            p->im->errors++;
+        free(p);
+    }
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairQueue
+ *
+ *  Hold a packet until it is due
+ *
+ *  @param  : impair        *im     [class of the socket]
+ *            int           sockfd  [socket to send on]
+ *            ...                   [as for sendto]
+ *            uint64_t      due     [UtilNowNs() to send at]
+ *  @return : void
+ *
+ *  Called with the impairment lock held. The queue is sorted by due time,
+ *  packets due at the same time keep their order. The sending thread is
+ *  started by the first delayed packet
+ * --------------------------------------------------------------------------
+ */
+static void ImpairQueue(impair *im, int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen, uint64_t due) {
+    impair_packet *p = Malloc(sizeof(impair_packet) + len), **pp;
+    pthread_condattr_t attr;
+    pthread_t tid;
+
+    p->due = due;
+    p->im = im;
+    p->sockfd = sockfd;
+    p->flags = flags;
+    memcpy(&p->to, to, min(tolen, sizeof(p->to)));
+    p->tolen = min(tolen, sizeof(p->to));
+    p->len = len;
+    memcpy(p->data, buf, len);
+
+    for (pp = &impairment.queue; *pp != NULL && (*pp)->due <= due; pp = &(*pp)->next)
+        ;
+    p->next = *pp;
+    *pp = p;
+
+    if (!impairment.started) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&impairment.ready, &attr);
+        pthread_condattr_destroy(&attr);
+        Pthread_create(&tid, NULL, ImpairThread, NULL);
+        Pthread_detach(tid);
+        impairment.started = 1;
+    } else if (impairment.queue == p) {
+        pthread_cond_signal(&impairment.ready);
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  ImpairSend
+ *
+ *  Send a packet through the impairments
+ *
+ *  @param  : impair    *im     [class of the socket]
+ *            ...               [as for sendto]
+ *  @return : ssize_t   [len, -1 if an undelayed send failed]
+ *
+ *  A lost packet is reported as sent. A duplicate gets a delay of its own.
+ *  A reordered packet is sent at once, passing the ones still delayed,
+ *  as with netem: reorder needs a delay to have an effect
+ * --------------------------------------------------------------------------
+ */
+static ssize_t ImpairSend(impair *im, int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    uint64_t delay, now = UtilNowNs();
+    int copies, i, immediate = 0;
+
+    Pthread_mutex_lock(&impairment.lock);
+    im->sent++;
+    if (ImpairLose(im)) {
+        im->lost++;
+        Pthread_mutex_unlock(&impairment.lock);
+        return len;
+    }
+    copies = 1;
+    if (im->dup > 0 && ImpairRandom() < im->dup) {
+        im->duplicated++;
+        copies = 2;
+    }
+    for (i = 0; i < copies; i++) {
+        delay = ImpairDelay(im);
+        if (delay > 0 && im->reorder > 0 && ImpairRandom() < im->reorder) {
+            im->reordered++;
+            delay = 0;
+        }
+        if (delay == 0) {
+            immediate++;
+            continue;
+        }
+        im->delayed++;
+        ImpairQueue(im, sockfd, buf, len, flags, to, tolen, now + delay);
+    }
+    Pthread_mutex_unlock(&impairment.lock);
+
+    for (i = 0; i < immediate; i++)
+        if (sendto(sockfd, buf, len, flags, to, tolen) < 0)
+            return -1;
+    return len;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportCapture
+ *
+ *  Append a received packet to the capture file
+ *
+ *  @param  : transport_socket  *ts     [receiving socket]
+ *            struct msghdr     *msg    [message returned by recvmsg]
+ *            ssize_t           n       [bytes received]
+ *  @return : void
+ *
+ *  The file has Ethernet frames. IP raw sockets receive no link header,
+ *  their packets get one with zero addresses. The stamp is the kernel
+ *  arrival time when the socket has SO_TIMESTAMPNS. Every record is
+ *  flushed, the processes are usually stopped by a signal
+ * --------------------------------------------------------------------------
+ */
+static void TransportCapture(transport_socket *ts, struct msghdr *msg, ssize_t n) {
+    struct ether_header eth;
+    struct cmsghdr *cmsg;
+    struct timespec stamp;
+    pcap_rechdr rec;
+    size_t left, part;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &stamp);
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+
+    left = min(n, TRANSPORT_SNAPLEN - (ts->family == AF_INET ? ETHER_HDR_LEN : 0));
+    rec.sec = stamp.tv_sec;
+    rec.frac = stamp.tv_nsec;
+    rec.caplen = left + (ts->family == AF_INET ? ETHER_HDR_LEN : 0);
+    rec.len = n + (ts->family == AF_INET ? ETHER_HDR_LEN : 0);
+
+    Pthread_mutex_lock(&transport.lock);
+    fwrite(&rec, sizeof(rec), 1, transport.file);
+    if (ts->family == AF_INET) {
+        bzero(&eth, sizeof(eth));
+        eth.ether_type = htons(ETHERTYPE_IP);
+        fwrite(&eth, sizeof(eth), 1, transport.file);
+    }
+    for (i = 0; i < (int)msg->msg_iovlen && left > 0; i++) {
+        part = min(left, msg->msg_iov[i].iov_len);
+        fwrite(msg->msg_iov[i].iov_base, 1, part, transport.file);
+        left -= part;
+    }
+    fflush(transport.file);
+    Pthread_mutex_unlock(&transport.lock);
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportRoute
+ *
+ *  Find the socket a replayed frame is delivered to
+ *
+ *  @param  : const uchar   *frame  [Ethernet frame]
+ *            uint32_t      len     [frame bytes]
+ *  @return : transport_socket *    [NULL if no socket takes the frame]
+ *
+ *  IPv4 packets go to the IP raw socket of their protocol, other frames to
+ *  the PF_PACKET socket of their ethertype. A PF_PACKET socket of IPv4 is
+ *  only used to send, so it never gets a frame
+ * --------------------------------------------------------------------------
+ */
+static transport_socket *TransportRoute(const uchar *frame, uint32_t len) {
+    const struct ether_header *eth = (const struct ether_header *)frame;
+    const struct ip *iphdr = (const struct ip *)(frame + ETHER_HDR_LEN);
+    int i;
+
+    if (len < ETHER_HDR_LEN)
+        return NULL;
+    for (i = 0; i < transport.count; i++) {
+        if (ntohs(eth->ether_type) == ETHERTYPE_IP) {
+            if (transport.sock[i].family == AF_INET && len >= ETHER_HDR_LEN + sizeof(struct ip)
+                && iphdr->ip_p == transport.sock[i].protocol)
+                return &transport.sock[i];
+        } else if (transport.sock[i].family == PF_PACKET && ntohs(eth->ether_type) == transport.sock[i].protocol) {
+            return &transport.sock[i];
+        }
+    }
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportFeed
+ *
+ *  Queue the next replayed frame
+ *
+ *  @param  : void
+ *  @return : void
+ *
+ *  Only one frame is queued at a time: the next one is read when the
+ *  previous one is received, so the frames are processed in file order
+ *  and as fast as the process can. At the end of the file the socket of
+ *  the last frame is shut down, its reader gets end of file once it is
+ *  done with that frame. Called with the lock held
+ * --------------------------------------------------------------------------
+ */
+static void TransportFeed() {
+    replay_rec *rr = (replay_rec *)transport.frame;
+    uchar *frame = transport.frame + sizeof(replay_rec);
+    transport_socket *ts;
+    pcap_rechdr rec;
+    int i;
+
+    while (fread(&rec, sizeof(rec), 1, transport.file) == 1) {
+        if (transport.swapped)
+            rec.caplen = __builtin_bswap32(rec.caplen);
+        if (rec.caplen > TRANSPORT_SNAPLEN || fread(frame, 1, rec.caplen, transport.file) != rec.caplen)
+            err_quit("[REPLAY] truncated or corrupt capture file");
+        if ((ts = TransportRoute(frame, rec.caplen)) == NULL) {
+            transport.skipped++;
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &rr->rx);
+        rr->len = rec.caplen;
+        if (write(ts->peerfd, transport.frame, sizeof(replay_rec) + rec.caplen) < 0)
+            err_sys("[REPLAY] queue error");
+        transport.last = ts;
+        return;
+    }
+
+    if (transport.last) {
+        shutdown(transport.last->peerfd, SHUT_WR);
+        return;
+    }
+    // nothing replayed, end every socket
+    for (i = 0; i < transport.count; i++)
+        shutdown(transport.sock[i].peerfd, SHUT_WR);
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportSummary
+ *
+ *  Print the replay statistics and exit
+ *
+ *  @param  : void
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void TransportSummary() {
+    uint64_t elapsed = UtilNowNs() - transport.start;
+
+    printf("[REPLAY] packets=%llu bytes=%llu skipped=%llu sends_dropped=%llu elapsed_ns=%llu ns_per_packet=%.0f\n",
+        (unsigned long long)transport.packets, (unsigned long long)transport.bytes,
+        (unsigned long long)transport.skipped, (unsigned long long)transport.dropped,
+        (unsigned long long)elapsed, transport.packets ? (double)elapsed / transport.packets : 0.0);
+    exit(0);
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportReplay
+ *
+ *  Receive a replayed frame
+ *
+ *  @param  : transport_socket  *ts     [replay socket]
+ *            struct msghdr     *msg    [as for recvmsg]
+ *            int               flags   [MSG_PEEK, MSG_TRUNC, MSG_DONTWAIT]
+ *  @return : ssize_t   [bytes, -1 if failed]
+ *
+ *  Fills the message as the raw socket would: an IP raw socket gets the
+ *  IP packet and its source address, a PF_PACKET socket the whole frame
+ *  and a sockaddr_ll of the interface given to TransportStart(). With
+ *  SO_TIMESTAMPNS the stamp is the time the frame was queued
+ * --------------------------------------------------------------------------
+ */
+static ssize_t TransportReplay(transport_socket *ts, struct msghdr *msg, int flags) {
+    replay_rec *rr = (replay_rec *)ts->buff;
+    uchar *frame = ts->buff + sizeof(replay_rec), *data;
+    struct ether_header *eth = (struct ether_header *)frame;
+    struct sockaddr_in *sin;
+    struct sockaddr_ll *sll;
+    struct cmsghdr *cmsg;
+    ssize_t n, len, left, part;
+    int i;
+
+    if (flags & MSG_ERRQUEUE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    n = recv(ts->sockfd, ts->buff, sizeof(replay_rec) + TRANSPORT_SNAPLEN, flags & (MSG_PEEK | MSG_DONTWAIT));
+    if (n < 0)
+        return -1;
+    if (n == 0)
+        TransportSummary();
+
+    data = frame;
+    len = rr->len;
+    if (ts->family == AF_INET) {
+        data += ETHER_HDR_LEN;
+        len -= ETHER_HDR_LEN;
+    }
+
+    // the caller gets the packet, the name and the stamp
+    left = len;
+    for (i = 0; i < (int)msg->msg_iovlen && left > 0; i++) {
+        part = min(left, (ssize_t)msg->msg_iov[i].iov_len);
+        if (part > 0)
+            memcpy(msg->msg_iov[i].iov_base, data + (len - left), part);
+        left -= part;
+    }
+    msg->msg_flags = left > 0 ? MSG_TRUNC : 0;
+
+    if (msg->msg_name && ts->family == AF_INET && msg->msg_namelen >= sizeof(struct sockaddr_in)) {
+        sin = (struct sockaddr_in *)msg->msg_name;
+        bzero(sin, sizeof(*sin));
+        sin->sin_family = AF_INET;
+        sin->sin_addr = ((struct ip *)data)->ip_src;
+        msg->msg_namelen = sizeof(struct sockaddr_in);
+    } else if (msg->msg_name && ts->family == PF_PACKET && msg->msg_namelen >= sizeof(struct sockaddr_ll)) {
+        sll = (struct sockaddr_ll *)msg->msg_name;
+        bzero(sll, sizeof(*sll));
+        sll->sll_family = AF_PACKET;
+        sll->sll_protocol = eth->ether_type;
+        sll->sll_ifindex = transport.ifindex;
+        sll->sll_hatype = ARPHRD_ETHER;
+        sll->sll_pkttype = (eth->ether_dhost[0] & 1) ? PACKET_MULTICAST : PACKET_HOST;
+        if (memcmp(eth->ether_dhost, "\xff\xff\xff\xff\xff\xff", ETH_ALEN) == 0)
+            sll->sll_pkttype = PACKET_BROADCAST;
+        sll->sll_halen = ETH_ALEN;
+        memcpy(sll->sll_addr, eth->ether_shost, ETH_ALEN);
+        msg->msg_namelen = sizeof(struct sockaddr_ll);
+    } else {
+        msg->msg_namelen = 0;
+    }
+
+    if (ts->stamps && msg->msg_control && msg->msg_controllen >= CMSG_SPACE(sizeof(struct timespec))) {
+        cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TIMESTAMPNS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct timespec));
+        memcpy(CMSG_DATA(cmsg), &rr->rx, sizeof(struct timespec));
+        msg->msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+    } else {
+        msg->msg_controllen = 0;
+    }
+
+    if (!(flags & MSG_PEEK)) {
+        Pthread_mutex_lock(&transport.lock);
+        transport.packets++;
+        transport.bytes += rr->len;
+        TransportFeed();
+        Pthread_mutex_unlock(&transport.lock);
+    }
+    return (flags & MSG_TRUNC) ? len : len - left;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportInit
+ *
+ *  Select the transport
+ *
+ *  @param  : int           mode    [TRANSPORT_LIVE, _CAPTURE or _REPLAY]
+ *            const char    *path   [pcap file to write or to replay]
+ *  @return : void
+ *
+ *  Call before the sockets are created. A replay file may be written by
+ *  capture or by tcpdump -w, with Ethernet frames
+ * --------------------------------------------------------------------------
+ */
+void TransportInit(int mode, const char *path) {
+    pcap_filehdr hdr;
+
+    transport.mode = mode;
+    if (mode == TRANSPORT_CAPTURE) {
+        if ((transport.file = fopen(path, "wb")) == NULL)
+            err_sys("[CAPTURE] %s", path);
+        bzero(&hdr, sizeof(hdr));
+        hdr.magic = PCAP_MAGIC_NS;
+        hdr.major = 2;
+        hdr.minor = 4;
+        hdr.snaplen = TRANSPORT_SNAPLEN;
+        hdr.linktype = PCAP_LINK_ETHERNET;
+        fwrite(&hdr, sizeof(hdr), 1, transport.file);
+        fflush(transport.file);
+    } else if (mode == TRANSPORT_REPLAY) {
+        if ((transport.file = fopen(path, "rb")) == NULL)
+            err_sys("[REPLAY] %s", path);
+        if (fread(&hdr, sizeof(hdr), 1, transport.file) != 1)
+            err_quit("[REPLAY] %s is not a pcap file", path);
+        if (hdr.magic == __builtin_bswap32(PCAP_MAGIC_US) || hdr.magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+            transport.swapped = 1;
+            hdr.magic = __builtin_bswap32(hdr.magic);
+            hdr.linktype = __builtin_bswap32(hdr.linktype);
+        }
+        if (hdr.magic != PCAP_MAGIC_US && hdr.magic != PCAP_MAGIC_NS)
+            err_quit("[REPLAY] %s is not a pcap file", path);
+        if (hdr.linktype != PCAP_LINK_ETHERNET)
+            err_quit("[REPLAY] %s has link type %u, only Ethernet is replayed", path, hdr.linktype);
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportStart
+ *
+ *  Start the replay
+ *
+ *  @param  : int   ifindex [interface replayed frames arrive on]
+ *  @return : void
+ *
+ *  Call once every socket is created, the first frame is queued then.
+ *  Nothing to do for the other transports
+ * --------------------------------------------------------------------------
+ */
+void TransportStart(int ifindex) {
+    if (transport.mode != TRANSPORT_REPLAY)
+        return;
+
+    printf("[REPLAY] replaying the capture to %d sockets.\n", transport.count);
+    transport.ifindex = ifindex;
+    transport.start = UtilNowNs();
+    Pthread_mutex_lock(&transport.lock);
+    TransportFeed();
+    Pthread_mutex_unlock(&transport.lock);
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportSocket
+ *
+ *  Create a raw socket
+ *
+ *  @param  : int   family      [AF_INET or PF_PACKET]
+ *            int   type        [SOCK_RAW]
+ *            int   protocol    [IP protocol, or ethertype in network order]
+ *  @return : int   [socket file descriptor, exits if failed]
+ *
+ *  A replay socket is one end of a sequenced packet socket pair, so that
+ *  select() and blocking reads work unchanged. The other end queues the
+ *  replayed frames
+ * --------------------------------------------------------------------------
+ */
+int TransportSocket(int family, int type, int protocol) {
+    transport_socket *ts;
+    int pair[2];
+
+    if (transport.count == TRANSPORT_MAXSOCK)
+        err_quit("[TRANSPORT] too many sockets");
+    ts = &transport.sock[transport.count];
+    bzero(ts, sizeof(*ts));
+    ts->family = family;
+    ts->protocol = family == PF_PACKET ? ntohs(protocol) : protocol;
+    // ping opens its send-only PF_PACKET socket with ETH_P_IP in host order
+    if (family == PF_PACKET)
+        ts->cls = (protocol == ETHERTYPE_IP || ts->protocol == ETHERTYPE_IP) ? IMPAIR_PING : IMPAIR_ARP;
+    else
+        ts->cls = protocol == IPPROTO_ICMP ? IMPAIR_PING : IMPAIR_TOUR;
+    pthread_once(&impairment.once, ImpairLoad);
+
+    if (transport.mode == TRANSPORT_REPLAY) {
+        if (socketpair(AF_LOCAL, SOCK_SEQPACKET, 0, pair) < 0)
+            err_sys("[REPLAY] socketpair error");
+        ts->sockfd = pair[0];
+        ts->peerfd = pair[1];
+        ts->buff = Malloc(sizeof(replay_rec) + TRANSPORT_SNAPLEN);
+    } else {
+        ts->sockfd = Socket(family, type, protocol);
+        ts->peerfd = -1;
+    }
+    transport.count++;
+    return ts->sockfd;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportSetsockopt
+ *
+ *  Set a socket option
+ *
+ *  @param  : as for setsockopt
+ *  @return : int   [0 if succeed, -1 if failed]
+ *
+ *  A replay socket takes SO_RCVTIMEO and SO_TIMESTAMPNS, ignores the
+ *  options that only affect sending or the interface and refuses the
+ *  others, as a socket without kernel timestamping support
+ * --------------------------------------------------------------------------
+ */
+int TransportSetsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+    transport_socket *ts = TransportFind(sockfd);
+
+    if (ts && level == SOL_SOCKET && optname == SO_TIMESTAMPNS)
+        ts->stamps = *(const int *)optval;
+    if (ts == NULL || transport.mode != TRANSPORT_REPLAY)
+        return setsockopt(sockfd, level, optname, optval, optlen);
+
+    if (level == SOL_SOCKET && optname == SO_RCVTIMEO)
+        return setsockopt(sockfd, level, optname, optval, optlen);
+    if ((level == SOL_SOCKET && (optname == SO_TIMESTAMPNS || optname == SO_BINDTODEVICE))
+        || (level == IPPROTO_IP && optname == IP_HDRINCL))
+        return 0;
+    errno = ENOPROTOOPT;
+    return -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportSendto
+ *
+ *  Send a packet
+ *
+ *  @param  : as for sendto
+ *  @return : ssize_t   [bytes sent, -1 if failed]
+ *
+ *  During a replay the packet is counted and dropped. Otherwise it goes
+ *  through the impairments of its class, if any
+ * --------------------------------------------------------------------------
+ */
+ssize_t TransportSendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    transport_socket *ts = TransportFind(sockfd);
+    impair *im;
+
+    if (transport.mode == TRANSPORT_REPLAY && ts) {
+        Pthread_mutex_lock(&transport.lock);
+        transport.dropped++;
+        Pthread_mutex_unlock(&transport.lock);
+        return len;
+    }
+
+    pthread_once(&impairment.once, ImpairLoad);
+    if (impairment.enabled && (im = &impairment.cls[ts ? ts->cls : IMPAIR_MCAST])->set)
+        return ImpairSend(im, sockfd, buf, len, flags, to, tolen);
+    return sendto(sockfd, buf, len, flags, to, tolen);
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportRecvmsg
+ *
+ *  Receive a packet
+ *
+ *  @param  : as for recvmsg
+ *  @return : ssize_t   [bytes received, -1 if failed]
+ *
+ *  A capture saves the received packets, not the peeked ones nor the
+ *  error queue. A packet dropped by rxloss is captured, then reported as
+ *  an interrupted call: the select() loops go back to select(), a blocking
+ *  reader to its read
+ * --------------------------------------------------------------------------
+ */
+ssize_t TransportRecvmsg(int sockfd, struct msghdr *msg, int flags) {
+    transport_socket *ts = TransportFind(sockfd);
+    impair *im;
+    ssize_t n;
+    int lost;
+
+    if (ts && transport.mode == TRANSPORT_REPLAY) {
+        n = TransportReplay(ts, msg, flags);
+    } else {
+        n = recvmsg(sockfd, msg, flags);
+        if (n > 0 && ts && transport.mode == TRANSPORT_CAPTURE && !(flags & (MSG_PEEK | MSG_ERRQUEUE)))
+            TransportCapture(ts, msg, n);
+    }
+
+    if (n < 0 || (flags & (MSG_PEEK | MSG_ERRQUEUE)) || !impairment.enabled)
+        return n;
+    im = &impairment.cls[ts ? ts->cls : IMPAIR_MCAST];
+    if (im->rxloss <= 0)
+        return n;
+    Pthread_mutex_lock(&impairment.lock);
+    if ((lost = ImpairRandom() < im->rxloss))
+        im->rxlost++;
+    Pthread_mutex_unlock(&impairment.lock);
+    if (lost) {
+        errno = EINTR;
+        return -1;
+    }
+    return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  TransportRecvfrom
+ *
+ *  Receive a packet
+ *
+ *  @param  : as for recvfrom
+ *  @return : ssize_t   [bytes received, -1 if failed]
+ * --------------------------------------------------------------------------
+ */
+ssize_t TransportRecvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen) {
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n;
+
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_name = from;
+    msg.msg_namelen = fromlen ? *fromlen : 0;
+
+    n = TransportRecvmsg(sockfd, &msg, flags);
+    if (n >= 0 && fromlen)
+        *fromlen = msg.msg_namelen;
+    return n;
+}
@@ -0,0 +1,73 @@
+#ifndef __transport_h
+#define __transport_h
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Packet transport of the raw sockets
+ *
+ * Tour and ARP send and receive their raw packets through the functions
+ * below instead of the socket calls. Live passes them to the sockets,
+ * capture also appends every received packet to a pcap file and replay
+ * feeds the packets of a pcap file to the sockets at full speed, without
+ * any network: sends are counted and dropped.
+ *
+ * Impairments apply to any of them. TRANSPORT_IMPAIR in the environment,
+ * or @path of a file holding it, lists clauses [class:]key=value,... split
+ * by ';'. The class is tour, ping, arp, mcast or all (no class): loss and
+ * burst drop sends, rxloss receives, delay, jitter and dist hold sends back
+ * in the process, dup sends twice and reorder sends a packet without its
+ * delay, seed fixes the random numbers. For example
+ *     TRANSPORT_IMPAIR="delay=2ms,jitter=1ms;arp:loss=30%,burst=3"
+ */
+#define TRANSPORT_LIVE      0   // sockets only
+#define TRANSPORT_CAPTURE   1   // sockets, received packets saved to a pcap file
+#define TRANSPORT_REPLAY    2   // packets of a pcap file, nothing is sent
+
+#define TRANSPORT_MAXSOCK   8       // raw sockets of one process
+#define TRANSPORT_SNAPLEN   65535   // largest captured or replayed frame
+
+#define TRANSPORT_IMPAIR_ENV "TRANSPORT_IMPAIR"
+
+#define IMPAIR_TOUR         0   // tour IP raw socket
+#define IMPAIR_PING         1   // ping ICMP and PF_PACKET sockets
+#define IMPAIR_ARP          2   // ARP PF_PACKET socket
+#define IMPAIR_MCAST        3   // sockets not created by TransportSocket
+#define IMPAIR_CLASSES      4
+
+#define IMPAIR_UNIFORM      0   // delay +- jitter
+#define IMPAIR_NORMAL       1   // jitter is the standard deviation
+#define IMPAIR_EXP          2   // delay + exponential tail of mean jitter
+
+#define PCAP_MAGIC_US       0xa1b2c3d4  // pcap file, microsecond stamps
+#define PCAP_MAGIC_NS       0xa1b23c4d  // pcap file, nanosecond stamps
+#define PCAP_LINK_ETHERNET  1           // frames start with the Ethernet header
+
+typedef struct pcap_filehdr_t {
+    uint32_t    magic;
+    uint16_t    major;          /* 2                        */
+    uint16_t    minor;          /* 4                        */
+    int32_t     thiszone;       /* 0, stamps are UTC        */
+    uint32_t    sigfigs;        /* 0                        */
+    uint32_t    snaplen;        /* largest record           */
+    uint32_t    linktype;       /* PCAP_LINK_ETHERNET       */
+} pcap_filehdr;
+
+typedef struct pcap_rechdr_t {
+    uint32_t    sec;            /* arrival, seconds         */
+    uint32_t    frac;           /* micro or nanoseconds     */
+    uint32_t    caplen;         /* bytes in the file        */
+    uint32_t    len;            /* bytes on the wire        */
+} pcap_rechdr;
+
+void TransportInit(int mode, const char *path);
+void TransportStart(int ifindex);
+int TransportSocket(int family, int type, int protocol);
+int TransportSetsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
+ssize_t TransportSendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen);
+ssize_t TransportRecvmsg(int sockfd, struct msghdr *msg, int flags);
+ssize_t TransportRecvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen);
+
+#endif
@@ -8,18 +8,63 @@
 *         [Random unsigned integer generator]
 *     + void UtilTime(char *timestr)
 *         [Time string generator]
+*     + uint64_t UtilNowNs()
+*         [Monotonic clock in nanoseconds]
 *     + void UtilHostname(char *hostname)
 *         [Get hostname of current node]
+*     - uint ResolverHashName(const char *name)
+*         [Hash a host name into a resolver bucket]
+*     - resolver_entry *ResolverFind(int byName, const void *key)
+*         [Find a resolver cache entry]
+*     - resolver_entry *ResolverInsert(int byName, const uchar *ipaddr, const char *name)
+*         [Insert a resolver cache entry]
+*     - void ResolverLoadHosts()
+*         [Bulk-load the resolver cache from /etc/hosts]
+*     - void *ResolverWorker(void *arg)
+*         [Resolve queued reverse lookups in the background]
+*     - void ResolverInit()
+*         [Initialize the resolver cache once]
 *     + int UtilIpToHostname(const uchar *ipaddr, char *hostname)
-*         [Convert IP address to hostname]
+*         [Convert IP address to hostname without blocking]
 *     + int UtilHostnameToIp(const char *hostname, uchar *ipaddr)
 *         [Convert hostname to IP address]
-*     + char *UtilIpToString(const uchar *ipaddr)
-*         [Convert IP address to readable string]
+*     + char *UtilFormatIp(const uchar *ipaddr, char *str)
+*         [Format IP address into a caller buffer]
+*     + char *UtilFormatMac(const uchar *hwaddr, char *str)
+*         [Format MAC address into a caller buffer]
 */
 
 #include "tour.h"
 
+#include <pthread.h>
+
+#define RESOLVER_PENDING    0   // reverse lookup queued, no answer yet
+#define RESOLVER_POSITIVE   1   // resolved
+#define RESOLVER_NEGATIVE   2   // lookup failed
+
+typedef struct resolver_entry {
+    uchar   ipaddr[IPADDR_BUFFSIZE];    /* IP address               */
+    char    name[RESOLVER_NAMESIZE];    /* Host name                */
+    int     state;                      /* RESOLVER_*               */
+    uint64_t expires;                   /* Monotonic ns, 0 = never  */
+    struct resolver_entry *next;        /* Next in bucket           */
+} resolver_entry;
+
+// resolver cache: reverse (by IP) and forward (by name) tables, plus the
+// queue of reverse lookups served by the worker thread
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  queued;
+    resolver_entry  *byIp[RESOLVER_HASH_SIZE];
+    resolver_entry  *byName[RESOLVER_HASH_SIZE];
+    uchar   queue[RESOLVER_QUEUE_SIZE][IPADDR_BUFFSIZE];
+    uint    head, tail;
+} resolver = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static pthread_once_t resolverOnce = PTHREAD_ONCE_INIT;
+
+static const char hexDigits[] = "0123456789abcdef";
+
 /* --------------------------------------------------------------------------
  *  UtilRandom
  *
@@ -49,8 +94,29 @@ uint UtilRandom(uint min, uint max) {
  */
 void UtilTime(char *timestr) {
     time_t ticks = time(NULL);
+    char buf[26];
+
     bzero(timestr, TIMESTR_BUFFSIZE);
-    snprintf(timestr, TIMESTR_BUFFSIZE, "%.24s", ctime(&ticks));
+    // ctime_r: ping threads log concurrently with the main loop
+    snprintf(timestr, TIMESTR_BUFFSIZE, "%.24s", ctime_r(&ticks, buf));
+}
+
+/* --------------------------------------------------------------------------
+ *  UtilNowNs
+ *
+ *  Monotonic clock in nanoseconds
+ *
+ *  @param  : void
+ *  @return : uint64_t  [CLOCK_MONOTONIC in nanoseconds]
+ *
+ *  Unlike gettimeofday, CLOCK_MONOTONIC never steps, so differences of two
+ *  readings are safe to use as durations
+ * --------------------------------------------------------------------------
+ */
+uint64_t UtilNowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /* --------------------------------------------------------------------------
@@ -70,28 +136,244 @@ void UtilHostname(char *hostname) {
         err_quit("UtilHostname: gethostname error\n");
 }
 
+/* --------------------------------------------------------------------------
+ *  ResolverHashName
+ *
+ *  Hash a host name into a resolver bucket
+ *
+ *  @param  : const char    *name   [host name]
+ *  @return : uint          [bucket index]
+ *
+ *  FNV-1a over the name
+ * --------------------------------------------------------------------------
+ */
+static uint ResolverHashName(const char *name) {
+    uint h = 2166136261U;
+
+    while (*name)
+        h = (h ^ (uchar)*name++) * 16777619U;
+    return h % RESOLVER_HASH_SIZE;
+}
+
+/* --------------------------------------------------------------------------
+ *  ResolverFind
+ *
+ *  Find a resolver cache entry
+ *
+ *  @param  : int           byName  [1: key is a host name, 0: an IP address]
+ *            const void    *key    [host name or IP address]
+ *  @return : resolver_entry *      [entry, NULL if not cached]
+ *
+ *  Must be called with resolver.lock held
+ * --------------------------------------------------------------------------
+ */
+static resolver_entry *ResolverFind(int byName, const void *key) {
+    resolver_entry *e;
+    uint32_t ip;
+
+    if (byName) {
+        for (e = resolver.byName[ResolverHashName(key)]; e != NULL; e = e->next)
+            if (strcmp(e->name, key) == 0)
+                return e;
+    } else {
+        memcpy(&ip, key, IPADDR_BUFFSIZE);
+        for (e = resolver.byIp[(ip * 2654435761U) % RESOLVER_HASH_SIZE]; e != NULL; e = e->next)
+            if (memcmp(e->ipaddr, key, IPADDR_BUFFSIZE) == 0)
+                return e;
+    }
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  ResolverInsert
+ *
+ *  Insert a resolver cache entry
+ *
+ *  @param  : int           byName  [1: forward table, 0: reverse table]
+ *            const uchar   *ipaddr [IP address]
+ *            const char    *name   [host name]
+ *  @return : resolver_entry *      [new entry]
+ *
+ *  The entry is created positive and never expiring, callers adjust it.
+ *  Must be called with resolver.lock held
+ * --------------------------------------------------------------------------
+ */
+static resolver_entry *ResolverInsert(int byName, const uchar *ipaddr, const char *name) {
+    resolver_entry *e = Calloc(1, sizeof(resolver_entry));
+    resolver_entry **bucket;
+    uint32_t ip;
+
+    memcpy(e->ipaddr, ipaddr, IPADDR_BUFFSIZE);
+    snprintf(e->name, RESOLVER_NAMESIZE, "%s", name);
+    e->state = RESOLVER_POSITIVE;
+
+    memcpy(&ip, ipaddr, IPADDR_BUFFSIZE);
+    bucket = byName ? &resolver.byName[ResolverHashName(e->name)]
+                    : &resolver.byIp[(ip * 2654435761U) % RESOLVER_HASH_SIZE];
+    e->next = *bucket;
+    *bucket = e;
+    return e;
+}
+
+/* --------------------------------------------------------------------------
+ *  ResolverLoadHosts
+ *
+ *  Bulk-load the resolver cache from /etc/hosts
+ *
+ *  @param  : void
+ *  @return : void
+ *
+ *  Every IPv4 line adds all its names to the forward table and its first
+ *  name to the reverse table; the first line wins, as in the C library.
+ *  These entries never expire
+ * --------------------------------------------------------------------------
+ */
+static void ResolverLoadHosts() {
+    FILE *fp;
+    char line[512], *p, *token, *save;
+    uchar ipaddr[IPADDR_BUFFSIZE];
+
+    if ((fp = fopen("/etc/hosts", "r")) == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((p = strchr(line, '#')) != NULL)
+            *p = 0;
+        if ((token = strtok_r(line, " \t\r\n", &save)) == NULL)
+            continue;
+        if (inet_pton(AF_INET, token, ipaddr) != 1)
+            continue;
+
+        if ((token = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+            continue;
+        if (ResolverFind(0, ipaddr) == NULL)
+            ResolverInsert(0, ipaddr, token);
+        for (; token != NULL; token = strtok_r(NULL, " \t\r\n", &save))
+            if (ResolverFind(1, token) == NULL)
+                ResolverInsert(1, ipaddr, token);
+    }
+    fclose(fp);
+}
+
+/* --------------------------------------------------------------------------
+ *  ResolverWorker
+ *
+ *  Resolve queued reverse lookups in the background
+ *
+ *  @param  : void  *arg    [unused]
+ *  @return : void  *       [never returns]
+ *
+ *  getnameinfo() may block on DNS for seconds, so it only runs here, with
+ *  the lock released. The answer is cached for RESOLVER_POSITIVE_TTL
+ *  seconds, a failure for RESOLVER_NEGATIVE_TTL seconds
+ * --------------------------------------------------------------------------
+ */
+static void *ResolverWorker(void *arg) {
+    struct sockaddr_in sin;
+    char name[RESOLVER_NAMESIZE];
+    resolver_entry *e;
+    int r;
+
+    Pthread_mutex_lock(&resolver.lock);
+    for ( ; ; ) {
+        while (resolver.head == resolver.tail)
+            pthread_cond_wait(&resolver.queued, &resolver.lock);
+
+        bzero(&sin, sizeof(sin));
+        sin.sin_family = AF_INET;
+        memcpy(&sin.sin_addr, resolver.queue[resolver.head % RESOLVER_QUEUE_SIZE], IPADDR_BUFFSIZE);
+        resolver.head++;
+
+        Pthread_mutex_unlock(&resolver.lock);
+        r = getnameinfo((SA *)&sin, sizeof(sin), name, sizeof(name), NULL, 0, NI_NAMEREQD);
+        Pthread_mutex_lock(&resolver.lock);
+
+        if ((e = ResolverFind(0, &sin.sin_addr)) == NULL)
+            continue;
+        if (r == 0) {
+            snprintf(e->name, RESOLVER_NAMESIZE, "%s", name);
+            e->state = RESOLVER_POSITIVE;
+            e->expires = UtilNowNs() + RESOLVER_POSITIVE_TTL * 1000000000ULL;
+        } else {
+            e->state = RESOLVER_NEGATIVE;
+            e->expires = UtilNowNs() + RESOLVER_NEGATIVE_TTL * 1000000000ULL;
+        }
+    }
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  ResolverInit
+ *
+ *  Initialize the resolver cache once
+ *
+ *  @param  : void
+ *  @return : void
+ *
+ *  Run through pthread_once on the first lookup: load /etc/hosts and start
+ *  the detached worker thread
+ * --------------------------------------------------------------------------
+ */
+static void ResolverInit() {
+    pthread_t tid;
+
+    Pthread_mutex_lock(&resolver.lock);
+    ResolverLoadHosts();
+    Pthread_mutex_unlock(&resolver.lock);
+
+    if (pthread_create(&tid, NULL, ResolverWorker, NULL) == 0)
+        pthread_detach(tid);
+}
+
 /* --------------------------------------------------------------------------
  *  UtilIpToHostname
  *
- *  Convert IP address to hostname
+ *  Convert IP address to hostname without blocking
  *
  *  @param  : const uchar   *ipaddr     [IP address, network style]
- *            char          *hostname   [Hostname]
- *  @return : int           [ -1 if failed ]
+ *            char          *hostname   [Hostname, HOSTNAME_BUFFSIZE bytes]
+ *  @return : int           [ -1 if not resolved (yet) ]
  *
- *  Convert IP address (4-byte network style) to hostname
+ *  Convert IP address (4-byte network style) to hostname from the resolver
+ *  cache. Safe to call on every hop and from ping threads: a miss or an
+ *  expired entry queues a reverse lookup for the worker and returns at
+ *  once; "?" is written until the answer arrives. An expired name is still
+ *  returned while it is being refreshed
  * --------------------------------------------------------------------------
  */
 int UtilIpToHostname(const uchar *ipaddr, char *hostname) {
-    struct hostent *he;
+    resolver_entry *e;
+    uint64_t now = UtilNowNs();
+    int r = -1;
 
-    he = gethostbyaddr((struct in_addr *)ipaddr, sizeof(struct in_addr), AF_INET);
-    if (he == NULL) {
-        printf("UtilIpToHostname error: gethostbyaddr error for \n");
-        return -1;
+    pthread_once(&resolverOnce, ResolverInit);
+
+    Pthread_mutex_lock(&resolver.lock);
+    if ((e = ResolverFind(0, ipaddr)) == NULL) {
+        e = ResolverInsert(0, ipaddr, "");
+        e->state = RESOLVER_PENDING;
+        e->expires = now;
     }
-    memcpy(hostname, he->h_name, HOSTNAME_BUFFSIZE);
-    return 0;
+
+    if (e->expires != 0 && now >= e->expires
+        && resolver.tail - resolver.head < RESOLVER_QUEUE_SIZE) {
+        // queue a lookup; a pending entry is queued again if it is lost
+        memcpy(resolver.queue[resolver.tail % RESOLVER_QUEUE_SIZE], ipaddr, IPADDR_BUFFSIZE);
+        resolver.tail++;
+        e->expires = now + RESOLVER_NEGATIVE_TTL * 1000000000ULL;
+        pthread_cond_signal(&resolver.queued);
+    }
+
+    if (e->name[0] != 0) {
+        // longer names are cut, as before the cache
+        memcpy(hostname, e->name, HOSTNAME_BUFFSIZE - 1);
+        hostname[HOSTNAME_BUFFSIZE - 1] = 0;
+        r = 0;
+    } else {
+        snprintf(hostname, HOSTNAME_BUFFSIZE, "?");
+    }
+    Pthread_mutex_unlock(&resolver.lock);
+    return r;
 }
 
 /* --------------------------------------------------------------------------
@@ -103,32 +385,105 @@ int UtilIpToHostname(const uchar *ipaddr, char *hostname) {
  *            uchar         *ipaddr     [IP address]
  *  @return : int           [ -1 if failed ]
  *
- *  Convert hostname to IP address (4-byte network style)
+ *  Convert hostname to IP address (4-byte network style). Names from
+ *  /etc/hosts and earlier answers come from the cache, so a sequence that
+ *  repeats nodes resolves each name once. A miss blocks on getaddrinfo(),
+ *  which only happens while the tour is being set up
  * --------------------------------------------------------------------------
  */
 int UtilHostnameToIp(const char *hostname, uchar *ipaddr) {
-    struct hostent      *he;
-    he = gethostbyname(hostname);
-    //if (he == NULL || hostname[0] != 'v' || hostname[1] != 'm') {
-    if (he == NULL) {
+    struct addrinfo hints, *res;
+    resolver_entry *e;
+    uint64_t now = UtilNowNs();
+    uchar ip[IPADDR_BUFFSIZE] = {0};
+    int r;
+
+    pthread_once(&resolverOnce, ResolverInit);
+
+    Pthread_mutex_lock(&resolver.lock);
+    e = ResolverFind(1, hostname);
+    if (e != NULL && (e->expires == 0 || now < e->expires)) {
+        if ((r = (e->state == RESOLVER_POSITIVE) ? 0 : -1) == 0)
+            memcpy(ipaddr, e->ipaddr, IPADDR_BUFFSIZE);
+        Pthread_mutex_unlock(&resolver.lock);
+        if (r < 0)
+            printf("UtilHostnameToIp error: gethostbyname error for %s\n", hostname);
+        return r;
+    }
+    Pthread_mutex_unlock(&resolver.lock);
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    if ((r = getaddrinfo(hostname, NULL, &hints, &res)) == 0) {
+        memcpy(ip, &((struct sockaddr_in *)res->ai_addr)->sin_addr, IPADDR_BUFFSIZE);
+        freeaddrinfo(res);
+    }
+
+    Pthread_mutex_lock(&resolver.lock);
+    if ((e = ResolverFind(1, hostname)) == NULL)
+        e = ResolverInsert(1, ip, hostname);
+    memcpy(e->ipaddr, ip, IPADDR_BUFFSIZE);
+    e->state = (r == 0) ? RESOLVER_POSITIVE : RESOLVER_NEGATIVE;
+    e->expires = now + ((r == 0) ? RESOLVER_POSITIVE_TTL : RESOLVER_NEGATIVE_TTL) * 1000000000ULL;
+    Pthread_mutex_unlock(&resolver.lock);
+
+    if (r != 0) {
         printf("UtilHostnameToIp error: gethostbyname error for %s\n", hostname);
         return -1;
     }
-    memcpy(ipaddr, he->h_addr, IPADDR_BUFFSIZE);
+    memcpy(ipaddr, ip, IPADDR_BUFFSIZE);
     return 0;
 }
 
 /* --------------------------------------------------------------------------
- *  UtilIptoString
+ *  UtilFormatIp
  *
- *  Convert IP address to readable string
+ *  Format IP address into a caller buffer
  *
- *  @param  : const uchar   *ipaddr     [IP address]
- *  @return : char *        [Readable IP address string]
+ *  @param  : const uchar   *ipaddr     [IP address, network style]
+ *            char          *str        [IPSTR_BUFFSIZE bytes]
+ *  @return : char *        [str]
  *
- *  Convert IP address (4-byte network style) to readable string
+ *  Dotted decimal without inet_ntoa's static buffer, so concurrent threads
+ *  can format addresses for the same log line
  * --------------------------------------------------------------------------
  */
-char *UtilIpToString(const uchar *ipaddr) {
-    return inet_ntoa(*(struct in_addr*)ipaddr);
+char *UtilFormatIp(const uchar *ipaddr, char *str) {
+    char *p = str;
+    int i;
+
+    for (i = 0; i < IPADDR_BUFFSIZE; i++) {
+        if (ipaddr[i] >= 100)
+            *p++ = '0' + ipaddr[i] / 100;
+        if (ipaddr[i] >= 10)
+            *p++ = '0' + ipaddr[i] / 10 % 10;
+        *p++ = '0' + ipaddr[i] % 10;
+        *p++ = (i < IPADDR_BUFFSIZE - 1) ? '.' : 0;
+    }
+    return str;
+}
+
+/* --------------------------------------------------------------------------
+ *  UtilFormatMac
+ *
+ *  Format MAC address into a caller buffer
+ *
+ *  @param  : const uchar   *hwaddr     [MAC address]
+ *            char          *str        [MACSTR_BUFFSIZE bytes]
+ *  @return : char *        [str, "xx:xx:xx:xx:xx:xx"]
+ *
+ *  Nibbles are looked up in a hex digit table instead of one printf per
+ *  byte
+ * --------------------------------------------------------------------------
+ */
+char *UtilFormatMac(const uchar *hwaddr, char *str) {
+    char *p = str;
+    int i;
+
+    for (i = 0; i < HWADDR_BUFFSIZE; i++) {
+        *p++ = hexDigits[hwaddr[i] >> 4];
+        *p++ = hexDigits[hwaddr[i] & 0x0f];
+        *p++ = (i < HWADDR_BUFFSIZE - 1) ? ':' : 0;
+    }
+    return str;
 }